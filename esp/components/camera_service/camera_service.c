@@ -0,0 +1,432 @@
+/**
+ * @file camera_service.c
+ *
+ * Camera service: the driver runs in grab latest mode and,
+ * while the service is warm, its task keeps taking the frames
+ * as they are completed and holds the newest ones in a small
+ * ring. The frame buffers stay in PSRAM where the driver wrote
+ * them, the recognition is handed the pointer of the newest
+ * one, so nothing is copied and a capture never waits for the
+ * sensor when the vehicle arrived while warm.
+ *
+ * The service is woken by the first weight rise (or by a
+ * capture) and goes back to sleep after CONFIG_CAMERA_WARM_PERIOD
+ * seconds without any: the held frames are given back and the
+ * sensor is powered down through its PWDN pin, which keeps its
+ * registers, so the exposure is still close when it wakes up.
+ * The frames of the first SETTLE_MS after a wake up are dropped
+ * while the exposure settles.
+ *
+ * The capture settings (frame size, JPEG quality, grayscale) and
+ * the exposure can be changed at runtime: the task applies them
+ * through the sensor between two frames, or on the next wake up
+ * while asleep, so the sensor is only ever driven from one task.
+ * The frames held are then dropped, with those of the next
+ * SETTLE_MS (EXPOSURE_SETTLE_MS for the exposure, which the auto
+ * exposure takes a few frames to reach), which may still have
+ * the former settings.
+ *
+ */
+
+#include "camera_service.h"
+
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "driver/gpio.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include <inttypes.h>
+
+#define TAG "CAMERA_SERVICE"
+
+#ifndef CONFIG_CAMERA_WARM_PERIOD
+#define CONFIG_CAMERA_WARM_PERIOD 15
+#endif
+
+// Frames dropped after a wake up, while the exposure settles
+#define SETTLE_MS 150
+
+// Frames dropped after a change of exposure, while the auto exposure converges
+#define EXPOSURE_SETTLE_MS 300
+
+// Special effect of the sensor turning the frames to grayscale
+#define EFFECT_NONE      0
+#define EFFECT_GRAYSCALE 2
+
+// Time the sensor needs to leave the power down
+#define POWER_UP_MS 5
+
+#define WARM_PERIOD_US ((int64_t) CONFIG_CAMERA_WARM_PERIOD * 1000 * 1000)
+
+static int pwdn = -1;
+static TaskHandle_t service_task = NULL;
+static SemaphoreHandle_t frame_ready = NULL;   // given on every new frame of the ring
+
+// Newest frame first, the lock only covers the pointers
+static camera_fb_t *ring[CAMERA_SERVICE_RING_FRAMES];
+static portMUX_TYPE ring_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Settings waiting to be applied by the task, under the ring lock
+static camera_service_format_t pending_format;
+static bool format_pending = false;
+static camera_service_exposure_t pending_exposure;
+static bool exposure_pending = false;
+
+static volatile int64_t warm_until_us = 0;
+static int64_t warm_since_us = 0;
+
+static camera_service_stats_t stats;
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+int64_t camera_service_frame_us(const camera_fb_t *fb)
+{
+    return (int64_t) fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+}
+
+/**
+ * Starts the service, with the sensor powered down
+ * until the first wake up
+ * @param pwdn_pin GPIO of the sensor PWDN pin, -1 if not wired
+ * @return ESP_OK on success
+ */
+esp_err_t camera_service_init(int pwdn_pin)
+{
+    frame_ready = xSemaphoreCreateBinary();
+    if (frame_ready == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    pwdn = pwdn_pin;
+
+    if (pwdn >= 0) {
+        gpio_set_level(pwdn, 1);
+    }
+
+    if (xTaskCreate(camera_service_task, "camera_service", 4096, NULL, tskIDLE_PRIORITY + 2, &service_task) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    ESP_LOGI(TAG, "Camera service started, %d frames held, warm for %d s", CAMERA_SERVICE_RING_FRAMES,
+        CONFIG_CAMERA_WARM_PERIOD);
+    return ESP_OK;
+}
+
+/**
+ * Keeps the service warm for CONFIG_CAMERA_WARM_PERIOD
+ * seconds from now, waking it up if it is asleep
+ */
+void camera_service_wake(void)
+{
+    warm_until_us = esp_timer_get_time() + WARM_PERIOD_US;
+
+    if (service_task != NULL) {
+        xTaskNotifyGive(service_task);
+    }
+}
+
+/**
+ * Hands off the newest frame of the ring, if it was captured
+ * at or after since_us, otherwise waits for a new frame.
+ * The service is kept warm by the call
+ * @param since_us Oldest capture time accepted
+ * @param timeout How long to wait for a frame
+ * @return The frame, to be given back with camera_service_give(), or NULL
+ */
+camera_fb_t *camera_service_take(int64_t since_us, TickType_t timeout)
+{
+    if (service_task == NULL) {
+        return NULL;
+    }
+
+    camera_service_wake();
+
+    TickType_t start = xTaskGetTickCount();
+    bool waited = false;
+
+    while (1) {
+        camera_fb_t *fb = NULL;
+
+        portENTER_CRITICAL(&ring_lock);
+        if (ring[0] != NULL && camera_service_frame_us(ring[0]) >= since_us) {
+            fb = ring[0];
+
+            for (int i = 0; i < CAMERA_SERVICE_RING_FRAMES - 1; i++) {
+                ring[i] = ring[i + 1];
+            }
+            ring[CAMERA_SERVICE_RING_FRAMES - 1] = NULL;
+        }
+        portEXIT_CRITICAL(&ring_lock);
+
+        if (fb != NULL) {
+            uint32_t age_ms = (uint32_t)((esp_timer_get_time() - camera_service_frame_us(fb)) / 1000);
+
+            portENTER_CRITICAL(&stats_lock);
+            stats.frames++;
+            stats.waits += waited;
+            stats.age_ms_sum += age_ms;
+            if (age_ms > stats.age_ms_max) {
+                stats.age_ms_max = age_ms;
+            }
+            portEXIT_CRITICAL(&stats_lock);
+
+            ESP_LOGD(TAG, "Frame handed off, %" PRIu32 " ms old%s", age_ms, waited ? " (waited)" : "");
+            return fb;
+        }
+
+        TickType_t elapsed = xTaskGetTickCount() - start;
+
+        if (elapsed >= timeout || xSemaphoreTake(frame_ready, timeout - elapsed) == pdFALSE) {
+            portENTER_CRITICAL(&stats_lock);
+            stats.timeouts++;
+            portEXIT_CRITICAL(&stats_lock);
+
+            ESP_LOGW(TAG, "No frame captured in time");
+            return NULL;
+        }
+
+        waited = true;
+    }
+}
+
+/**
+ * Changes the capture settings. They are applied by the
+ * service task before its next frame, or when it wakes up
+ * @param format The new settings, copied
+ */
+void camera_service_set_format(const camera_service_format_t *format)
+{
+    portENTER_CRITICAL(&ring_lock);
+    pending_format = *format;
+    format_pending = true;
+    portEXIT_CRITICAL(&ring_lock);
+}
+
+/**
+ * Changes the exposure. It is applied by the service task
+ * before its next frame, or when it wakes up
+ * @param exposure The new settings, copied
+ * @return Capture time from which the frames have the new
+ * exposure, to be passed to camera_service_take()
+ */
+int64_t camera_service_set_exposure(const camera_service_exposure_t *exposure)
+{
+    portENTER_CRITICAL(&ring_lock);
+    pending_exposure = *exposure;
+    exposure_pending = true;
+    portEXIT_CRITICAL(&ring_lock);
+
+    // The task drops the frames until EXPOSURE_SETTLE_MS after applying it, never earlier than this
+    return esp_timer_get_time() + EXPOSURE_SETTLE_MS * 1000;
+}
+
+void camera_service_give(camera_fb_t *fb)
+{
+    if (fb != NULL) {
+        esp_camera_fb_return(fb);
+    }
+}
+
+void camera_service_get_stats(camera_service_stats_t *out)
+{
+    portENTER_CRITICAL(&stats_lock);
+    *out = stats;
+
+    if (out->warm) {
+        out->warm_ms += (uint32_t)((esp_timer_get_time() - warm_since_us) / 1000);
+    }
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+/**
+ * Puts a new frame at the head of the ring
+ * and gives back the oldest one if it is full
+ */
+static void push_frame(camera_fb_t *fb)
+{
+    portENTER_CRITICAL(&ring_lock);
+    camera_fb_t *evicted = ring[CAMERA_SERVICE_RING_FRAMES - 1];
+
+    for (int i = CAMERA_SERVICE_RING_FRAMES - 1; i > 0; i--) {
+        ring[i] = ring[i - 1];
+    }
+    ring[0] = fb;
+    portEXIT_CRITICAL(&ring_lock);
+
+    if (evicted != NULL) {
+        esp_camera_fb_return(evicted);
+    }
+
+    xSemaphoreGive(frame_ready);
+}
+
+// Gives back the held frames
+static void flush_ring(void)
+{
+    for (int i = 0; i < CAMERA_SERVICE_RING_FRAMES; i++) {
+        portENTER_CRITICAL(&ring_lock);
+        camera_fb_t *fb = ring[i];
+        ring[i] = NULL;
+        portEXIT_CRITICAL(&ring_lock);
+
+        if (fb != NULL) {
+            esp_camera_fb_return(fb);
+        }
+    }
+}
+
+/**
+ * Applies the pending capture settings, if any
+ * @return true if they were applied, the held frames are then gone
+ */
+static bool apply_format(void)
+{
+    portENTER_CRITICAL(&ring_lock);
+    camera_service_format_t format = pending_format;
+    bool pending = format_pending;
+    format_pending = false;
+    portEXIT_CRITICAL(&ring_lock);
+
+    sensor_t *s = esp_camera_sensor_get();
+    if (!pending || s == NULL) {
+        return false;
+    }
+
+    s->set_framesize(s, format.frame_size);
+    s->set_quality(s, format.quality);
+    s->set_special_effect(s, format.grayscale ? EFFECT_GRAYSCALE : EFFECT_NONE);
+
+    flush_ring();
+
+    portENTER_CRITICAL(&stats_lock);
+    stats.format_changes++;
+    portEXIT_CRITICAL(&stats_lock);
+
+    ESP_LOGI(TAG, "Capture settings: frame size %d, quality %d%s", format.frame_size, format.quality,
+        format.grayscale ? ", grayscale" : "");
+    return true;
+}
+
+/**
+ * Applies the pending exposure, if any
+ * @return true if it was applied, the held frames are then gone
+ */
+static bool apply_exposure(void)
+{
+    portENTER_CRITICAL(&ring_lock);
+    camera_service_exposure_t exposure = pending_exposure;
+    bool pending = exposure_pending;
+    exposure_pending = false;
+    portEXIT_CRITICAL(&ring_lock);
+
+    sensor_t *s = esp_camera_sensor_get();
+    if (!pending || s == NULL) {
+        return false;
+    }
+
+    s->set_ae_level(s, exposure.ae_level);
+    s->set_brightness(s, exposure.brightness);
+
+    flush_ring();
+
+    portENTER_CRITICAL(&stats_lock);
+    stats.exposure_changes++;
+    portEXIT_CRITICAL(&stats_lock);
+
+    ESP_LOGD(TAG, "Exposure: level %d, brightness %d", exposure.ae_level, exposure.brightness);
+    return true;
+}
+
+/**
+ * Applies the pending settings
+ * @param now Current time
+ * @param settled_us Moved to the end of the settling, if anything was applied
+ */
+static void apply_settings(int64_t now, int64_t *settled_us)
+{
+    if (apply_format()) {
+        *settled_us = now + SETTLE_MS * 1000;
+    }
+
+    if (apply_exposure()) {
+        *settled_us = now + EXPOSURE_SETTLE_MS * 1000;
+    }
+}
+
+// Gives back the held frames and powers the sensor down
+static void sleep_sensor(void)
+{
+    flush_ring();
+
+    if (pwdn >= 0) {
+        gpio_set_level(pwdn, 1);
+    }
+
+    portENTER_CRITICAL(&stats_lock);
+    stats.warm = false;
+    stats.warm_ms += (uint32_t)((esp_timer_get_time() - warm_since_us) / 1000);
+    portEXIT_CRITICAL(&stats_lock);
+
+    ESP_LOGI(TAG, "Camera asleep");
+}
+
+// Powers the sensor up, returns the time from which its frames are kept
+static int64_t wake_sensor(void)
+{
+    if (pwdn >= 0) {
+        gpio_set_level(pwdn, 0);
+        vTaskDelay(pdMS_TO_TICKS(POWER_UP_MS));
+    }
+
+    int64_t now = esp_timer_get_time();
+    int64_t settled_us = now + SETTLE_MS * 1000;
+
+    apply_settings(now, &settled_us);
+
+    portENTER_CRITICAL(&stats_lock);
+    stats.warm = true;
+    stats.wakeups++;
+    warm_since_us = now;
+    portEXIT_CRITICAL(&stats_lock);
+
+    ESP_LOGI(TAG, "Camera awake");
+    return settled_us;
+}
+
+void camera_service_task(void *arg)
+{
+    bool warm = false;
+    int64_t settled_us = 0;
+
+    while (1) {
+        if (!warm) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+            if (esp_timer_get_time() < warm_until_us) {
+                settled_us = wake_sensor();
+                warm = true;
+            }
+            continue;
+        }
+
+        if (esp_timer_get_time() >= warm_until_us) {
+            sleep_sensor();
+            warm = false;
+            continue;
+        }
+
+        apply_settings(esp_timer_get_time(), &settled_us);
+
+        // Blocks until the driver completes the next frame
+        camera_fb_t *fb = esp_camera_fb_get();
+        if (fb == NULL) {
+            continue;
+        }
+
+        if (camera_service_frame_us(fb) < settled_us) {
+            esp_camera_fb_return(fb);
+        } else {
+            push_frame(fb);
+        }
+    }
+}
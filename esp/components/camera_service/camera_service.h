@@ -0,0 +1,81 @@
+/**
+ * @file camera_service.h
+ *
+ * Header file for the camera service: while a vehicle is
+ * likely at the gate the newest frames are kept ready in
+ * PSRAM, so a capture is a pointer handoff, and during idle
+ * the sensor is powered down.
+ *
+ */
+#ifndef CAMERA_SERVICE_H
+#define CAMERA_SERVICE_H
+
+#pragma once
+
+#include "esp_camera.h"
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Frames held by the service, the newest ones
+#define CAMERA_SERVICE_RING_FRAMES 2
+
+// Frame buffers of the driver: the ring, two held by the
+// recognition while it compares them, one being filled
+#define CAMERA_SERVICE_FB_COUNT (CAMERA_SERVICE_RING_FRAMES + 3)
+
+typedef struct {
+    bool warm;                  // the sensor is capturing
+    uint32_t wakeups;           // times the sensor left the power down
+    uint32_t warm_ms;           // time spent capturing, the current period included
+    uint32_t frames;            // frames handed to the recognition
+    uint32_t waits;             // handoffs that waited for a new frame
+    uint32_t timeouts;          // handoffs without a frame
+    uint32_t age_ms_sum;        // age of the handed frames at the handoff
+    uint32_t age_ms_max;
+    uint32_t format_changes;    // capture settings applied
+    uint32_t exposure_changes;  // exposure settings applied
+} camera_service_stats_t;
+
+// Capture settings, see camera_service_set_format()
+typedef struct {
+    framesize_t frame_size;     // not larger than the one the driver was initialized with
+    int quality;                // JPEG quality, 0-63, lower is finer
+    bool grayscale;
+} camera_service_format_t;
+
+// Exposure settings of the sensor, see camera_service_set_exposure()
+typedef struct {
+    int ae_level;               // auto exposure target, -2 to 2
+    int brightness;             // -2 to 2
+} camera_service_exposure_t;
+
+// Starts the service on an initialized camera, asleep; pwdn_pin is -1 if not wired
+esp_err_t camera_service_init(int pwdn_pin);
+
+// A vehicle is likely: keeps the frames refreshed for CONFIG_CAMERA_WARM_PERIOD seconds
+void camera_service_wake(void);
+
+// Hands off the newest frame captured at or after since_us, waiting for one up to timeout
+camera_fb_t *camera_service_take(int64_t since_us, TickType_t timeout);
+
+// Changes the capture settings from the next frame on
+void camera_service_set_format(const camera_service_format_t *format);
+
+// Changes the exposure, returns the capture time from which the frames have it
+int64_t camera_service_set_exposure(const camera_service_exposure_t *exposure);
+
+// Gives a frame back to the driver
+void camera_service_give(camera_fb_t *fb);
+
+// Time a frame was captured at, in esp_timer microseconds
+int64_t camera_service_frame_us(const camera_fb_t *fb);
+
+// Copies the service counters
+void camera_service_get_stats(camera_service_stats_t *stats);
+
+// Camera service task: refreshes the ring while warm
+void camera_service_task(void *arg);
+
+#endif /* CAMERA_SERVICE_H */
@@ -7,26 +7,96 @@
 
 #include "../../main/fsm.h"
 #include "../https/https_task.h"
+#include "../trace/trace.h"
 
 #include "cv.h"
-#include "esp_http_client.h"
-#include "esp_tls.h"
-#include "esp_crt_bundle.h"
+#include "cv_backend.h"
+#include "plate_crop.h"
+#include "frame_score.h"
+#include "plate_cache.h"
+#include "upload_tuner.h"
+#include "esp_event.h"
+#include "esp_netif.h"
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_err.h"
-#include "esp_crt_bundle.h"
-#include "cJSON.h"
+#include "sdkconfig.h"
 #include <string.h>
 #include <stdlib.h>
 #include <inttypes.h>
-#include <sys/param.h>
 #include <stdbool.h>
 
 #ifndef CONFIG_USE_MOCK_CAMERA
-    #include "esp_camera.h"
+    #include "../camera_service/camera_service.h"
+
+// Oldest frame of the camera service ring used for a capture: the
+// newest one is handed off at once while the camera is warm
+#define FRAME_MAX_AGE_US    (200 * 1000)
+
+// Longest wait for a frame, the camera may have to wake up first
+#define CAPTURE_TIMEOUT_MS  1000
+#endif
+
+#if !defined(CONFIG_USE_MOCK_CAMERA) && CONFIG_CV_BURST_FRAMES > 1
+    #define CV_BURST
+    #include "img_converters.h"
+    #include "esp_heap_caps.h"
+#endif
+
+#ifdef CONFIG_PLATE_CROP
+    #include "img_converters.h"
+    #include "esp_heap_caps.h"
+
+// Quality of the re-encoded crop (0-100, higher is better): the crop
+// is a fraction of the frame, so it can afford more than the camera.
+// With CONFIG_UPLOAD_TUNER it is set by the upload level instead
+#define CROP_JPEG_QUALITY 90
+#endif
+
+#if !defined(CONFIG_USE_MOCK_CAMERA) && defined(CONFIG_UPLOAD_TUNER)
+    #define CV_TUNER
+
+// Widest frame the driver was initialized with, see camera_init()
+#ifdef CONFIG_PLATE_CROP
+#define FRAME_MAX_WIDTH 640
+#else
+#define FRAME_MAX_WIDTH 320
+#endif
+
+// Capture settings, only used by the recognition task
+static upload_tuner_t tuner;
+static upload_tuner_stats_t tuner_stats;    // copy of the counters for the status
+#endif
+
+#if !defined(CONFIG_USE_MOCK_CAMERA) && CONFIG_RECAPTURE_DEADLINE > 0
+    #define CV_RECAPTURE
+
+// A plate read with less confidence is recaptured
+#define RECAPTURE_CONFIDENCE_MIN 0.6f
+
+// Exposure set by camera_init(), then the brackets tried in turn
+static const camera_service_exposure_t exposures[] = {
+    { .ae_level = 0,  .brightness = 2 },
+    { .ae_level = 2,  .brightness = 2 },    // brighter: plate in the shade, backlight
+    { .ae_level = -2, .brightness = 0 },    // darker: glare of a reflective plate, headlights
+};
+
+#define EXPOSURES (sizeof(exposures) / sizeof(exposures[0]))
+
+static cv_recapture_stats_t recapture_stats;
+#endif
+
+#ifdef CONFIG_PLATE_CACHE
+// Recent recognitions, only used by the recognition task
+static plate_cache_t cache;
+static plate_cache_stats_t cache_stats;    // copy of the counters for the status
+#endif
+
+#if defined(CONFIG_PLATE_CACHE) || defined(CV_TUNER) || defined(CV_RECAPTURE)
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
 #endif
 
 // Mock image embedded (for Wokwi)
@@ -37,279 +107,871 @@ extern const uint8_t mock_image_end[]   asm("_binary_mock_plate_jpg_end");
 
 #define YIELD() vTaskDelay(pdMS_TO_TICKS(10))
 
-// License plate API
-#define CV_API_URL "https://www.circuitdigest.cloud/api/v1/readnumberplate"
-#define CV_API_KEY CONFIG_API_KEY
-#define MAX_HTTP_OUTPUT_BUFFER 1024
-
 static const char *TAG = "CV Module";
-static char api_response_buffer[MAX_HTTP_OUTPUT_BUFFER];
-static int response_len = 0;
+
 static TaskHandle_t recognition_task_handle = NULL;
 
-// The event handler, which collects and saves 1KB chunks of response data for each HTTPS request
-static esp_err_t http_event_handler(esp_http_client_event_handle_t evt)
+// Notification bits of the recognition task, one pair for each
+// lane, and one to (re)open the connection to the CV API
+#define MAX_LANES           8
+#define COMMIT_BIT(lane)    (1UL << (lane))
+#define SPECULATE_BIT(lane) (1UL << ((lane) + MAX_LANES))
+#define WARM_BIT            (1UL << 31)
+
+#ifndef CONFIG_CV_KEEPALIVE_PERIOD
+#define CONFIG_CV_KEEPALIVE_PERIOD 0
+#endif
+
+// A speculative result older than this is not trusted anymore
+#define SPEC_RESULT_TTL_US  (10 * 1000 * 1000)
+
+// Time given to the backend to decide on an entry, longer than
+// the timeout of the HTTP client so a failure is told from a timeout
+#define ENTRY_TIMEOUT_MS    8000
+
+// Data extracted from a backend response
+typedef struct {
+    char *plate;
+    char *image_link;
+    int64_t captured_us;
+} plate_result_t;
+
+// Speculative recognition, started on the first valid weight
+// sample and committed (or discarded) once detection completes
+typedef enum {
+    SPEC_IDLE,
+    SPEC_RUNNING,   // capture and upload in progress
+    SPEC_DONE,      // result available, waiting for the detection outcome
+} spec_state_t;
+
+static struct {
+    spec_state_t state;
+    uint8_t lane;
+    bool committed;     // the detection was confirmed while running
+    bool cancelled;     // the detection was dropped while running
+    plate_result_t result;
+} speculation;
+
+static portMUX_TYPE spec_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void free_plate_result(plate_result_t *result)
 {
-    if (evt -> event_id == HTTP_EVENT_ON_DATA && evt -> data_len > 0) {
-        size_t copy_len = evt->data_len;
+    free(result->plate);
+    free(result->image_link);
+    result->plate = NULL;
+    result->image_link = NULL;
+}
 
-        if (response_len + copy_len >= MAX_HTTP_OUTPUT_BUFFER) {
-            copy_len = MAX_HTTP_OUTPUT_BUFFER - response_len - 1;
-            ESP_LOGW(TAG, "Response buffer full, truncating");
-        }
+/**
+ * @brief Opens the connection to the backend ahead of the next
+ * vehicle, from the recognition task
+ * @param fresh Drop the current connection first, it may
+ * belong to a previous network link
+ */
+static void warm_connection(bool fresh)
+{
+    const cv_backend_t *backend = cv_backend_get();
+    esp_err_t err = backend->warm(fresh);
+
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "%s backend warm-up failed: %s", backend->name, esp_err_to_name(err));
+    }
+}
+
+/**
+ * Asks the recognition task to open a new connection to the
+ * CV API, so that the next vehicle does not wait for the TLS
+ * handshake. Called at boot and when the network is back
+ */
+void cv_warm_connection(void)
+{
+    if (recognition_task_handle != NULL) {
+        xTaskNotify(recognition_task_handle, WARM_BIT, eSetBits);
+    }
+}
 
-        memcpy(api_response_buffer + response_len, evt -> data, copy_len);
-        response_len += copy_len;
+void cv_get_connection_stats(cv_connection_stats_t *stats)
+{
+    cv_backend_get()->get_stats(stats);
+}
+
+void cv_get_cache_stats(plate_cache_stats_t *stats)
+{
+#ifdef CONFIG_PLATE_CACHE
+    portENTER_CRITICAL(&stats_lock);
+    *stats = cache_stats;
+    portEXIT_CRITICAL(&stats_lock);
+#else
+    *stats = (plate_cache_stats_t){ 0 };
+#endif
+}
+
+void cv_get_recapture_stats(cv_recapture_stats_t *stats)
+{
+#ifdef CV_RECAPTURE
+    portENTER_CRITICAL(&stats_lock);
+    *stats = recapture_stats;
+    portEXIT_CRITICAL(&stats_lock);
+#else
+    *stats = (cv_recapture_stats_t){ 0 };
+#endif
+}
+
+void cv_get_upload_stats(upload_tuner_stats_t *stats)
+{
+#ifdef CV_TUNER
+    portENTER_CRITICAL(&stats_lock);
+    *stats = tuner_stats;
+    portEXIT_CRITICAL(&stats_lock);
+#else
+    *stats = (upload_tuner_stats_t){ 0 };
+#endif
+}
+
+#ifdef CV_TUNER
+static framesize_t frame_size_of(const upload_level_t *level)
+{
+    switch (level->width) {
+        case 640: return FRAMESIZE_VGA;
+        case 480: return FRAMESIZE_HVGA;
+        case 400: return FRAMESIZE_CIF;
+        default:  return FRAMESIZE_QVGA;
     }
+}
 
-    return ESP_OK;
+// Hands the settings of the current level to the camera service
+static void apply_upload_level(void)
+{
+    const upload_level_t *level = upload_tuner_level(&tuner);
+    camera_service_format_t format = {
+        .frame_size = frame_size_of(level),
+        .quality = level->quality,
+        .grayscale = level->grayscale,
+    };
+
+    camera_service_set_format(&format);
 }
 
-// Formats the response buffer as pretty JSON and prints it to console
-void print_api_response_buffer() {
-    printf("\n---------- Response content: -------------\n\n");
+/**
+ * Feeds the outcome of a recognition to the controller of the
+ * capture settings, and applies the level it picks
+ * @param sample The outcome, not taken into account without a request
+ */
+static void tune_upload(const upload_sample_t *sample)
+{
+    if (sample->bytes == 0) {
+        return;
+    }
+
+    uint8_t previous = tuner.level;
 
-    cJSON *root = cJSON_Parse(api_response_buffer);
+    if (upload_tuner_observe(&tuner, sample, esp_timer_get_time())) {
+        const upload_level_t *level = upload_tuner_level(&tuner);
 
-    if (root == NULL) {
-        printf("%s", api_response_buffer); // fallback
-    } else {
-        char *pretty = cJSON_Print(root);
-
-        if (pretty) {
-            // Replaces tabs with 2 spaces for better readability
-            for (char *p = pretty; *p; p++) {
-                if (*p == '\t') {
-                    printf("  ");
-                } else {
-                    putchar(*p);
-                }
-            }
-            
-            free(pretty);
-        }
+        ESP_LOGI(TAG, "Upload level %u -> %u (latency %" PRIu32 " ms, target %d ms): %ux%u, quality %u/%u%s",
+            previous, tuner.level, tuner.stats.latency_ms, CONFIG_UPLOAD_TARGET_LATENCY, level->width,
+            level->height, level->quality, level->crop_quality, level->grayscale ? ", grayscale" : "");
 
-        cJSON_Delete(root);
+        apply_upload_level();
     }
-    
-    printf("\n\n------------------------------------------\n\n");
+
+    portENTER_CRITICAL(&stats_lock);
+    tuner_stats = tuner.stats;
+    portEXIT_CRITICAL(&stats_lock);
 }
+#endif
 
 /**
- * @brief Performs the HTTPS request to the CV API, to send the image data
- * @param payload The payload to send in the request body (image data)
- * @param payload_len Length of the payload in bytes
- * @return ESP_OK on success, error code otherwise
+ * Sends an image to the backend and copies the plate and
+ * the image link read from its response
+ * @param image The JPEG image
+ * @param image_len Length of the image in bytes
+ * @param result Filled with the recognized data (caller must free)
+ * @param sample The size and time of the request are added to it
  */
-esp_err_t perform_cv_api_request(const char *payload, size_t payload_len)
+static void recognize_with_backend(const uint8_t *image, size_t image_len, plate_result_t *result,
+    upload_sample_t *sample)
 {
-    // Reset the response buffer
-    response_len = 0;
-    memset(api_response_buffer, 0, sizeof(api_response_buffer));
-    
-    // HTTP client configuration
-    char content_type[128];
-    snprintf(content_type, sizeof(content_type), "multipart/form-data; boundary=----ESP32Boundary");
-
-    esp_http_client_config_t config = {
-        .url = CV_API_URL,
-        .method = HTTP_METHOD_POST,
-        .event_handler = http_event_handler,
-        .timeout_ms = 30000,
-        .crt_bundle_attach = esp_crt_bundle_attach,
-        .skip_cert_common_name_check = true,
-    };
-    
-    vTaskDelay(pdMS_TO_TICKS(10));
+    cv_response_t fields;
+    int64_t start_us = esp_timer_get_time();
+
+    esp_err_t err = cv_backend_get()->recognize(image, image_len, &fields);
 
-    esp_http_client_handle_t client = esp_http_client_init(&config);
-    esp_http_client_set_header(client, "Content-Type", content_type);
-    esp_http_client_set_header(client, "Authorization", CV_API_KEY);
-    esp_http_client_set_post_field(client, (char*) payload, payload_len);
+    sample->upload_ms += (uint32_t)((esp_timer_get_time() - start_us) / 1000);
+    sample->bytes += image_len;
+
+    if (err != ESP_OK) {
+        return;
+    }
 
-    // Perform the HTTP POST request and prints the response
-    esp_err_t err = esp_http_client_perform(client);
+    // Some responses give the confidence in percent
+    if (fields.has_confidence) {
+        sample->confidence = fields.confidence > 1.0f ? fields.confidence / 100.0f : fields.confidence;
+    }
 
-    vTaskDelay(pdMS_TO_TICKS(10));
-    // Truncate response buffer to a null-terminated string
-    if (response_len < sizeof(api_response_buffer)) {
-        api_response_buffer[response_len] = '\0';
+    if (fields.has_plate) {
+        result->plate = strdup(fields.plate);
     } else {
-        api_response_buffer[sizeof(api_response_buffer) - 1] = '\0';
+        ESP_LOGE(TAG, "number_plate not found in response");
     }
 
-    // Response handling
-    if (err == ESP_OK) {
-        ESP_LOGI(
-            TAG,
-            "Response ESP_OK - Status %d with content_length = %" PRId64,
-            esp_http_client_get_status_code(client),
-            esp_http_client_get_content_length(client)
-        );
+    YIELD();
+
+    if (fields.has_image_link) {
+        result->image_link = strdup(fields.image_link);
     } else {
-        ESP_LOGE(TAG, "request failed: %s", esp_err_to_name(err));
+        ESP_LOGE(TAG, "view_image not found in response");
     }
-    // Cleans up the HTTPS client
-    esp_http_client_cleanup(client);
-    
-    return err;
+}
+
+////////////////////////////////////////////////
+/////////////// CV task ////////////////////////
+////////////////////////////////////////////////
+
+
+// A new IP address means a new network link: the kept-alive connection is gone
+static void ip_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
+{
+    cv_warm_connection();
+}
+
+void cv_task_creator(void) {
+#ifdef CV_TUNER
+    // Applied on the first wake up of the camera
+    upload_tuner_init(&tuner, CONFIG_UPLOAD_TARGET_LATENCY, FRAME_MAX_WIDTH);
+    apply_upload_level();
+#endif
+
+    xTaskCreatePinnedToCore(
+        recognition_task,
+        "recognition_task",
+        12288,
+        NULL,
+        tskIDLE_PRIORITY + 1,
+        &recognition_task_handle,
+        0
+    );
+
+    esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, ip_event_handler, NULL);
+
+    // The WiFi is already connected at this point
+    cv_warm_connection();
 }
 
 /**
- * @brief Prepares the image payload for the CV API request
- * @param image_data Pointer to the image data buffer
- * @param image_len Length of the image data in bytes
- * @return ESP_OK on success, error code otherwise
+ * Wakes the recognition task on behalf of a lane to get the
+ * entry decision. If a speculative recognition was started for
+ * the same vehicle, its result is used instead of a new capture.
+ * Every lane owns one bit of the notification value,
+ * so requests coming from different lanes are not lost
+ * @param lane The lane requesting the recognition
  */
-esp_err_t prepare_image_payload(const uint8_t *image_data, size_t image_len) {
-    if (!image_data || image_len == 0) {
-        ESP_LOGE(TAG, "invalid image data passed to plate_recognition_api()");
+void unblock_recognition_task(uint8_t lane) {
+    if (recognition_task_handle == NULL) {
+        return;
+    }
+
+    portENTER_CRITICAL(&spec_lock);
+    bool in_flight = speculation.state == SPEC_RUNNING && speculation.lane == lane;
+    if (in_flight) {
+        // the task submits the result as soon as the upload completes
+        speculation.committed = true;
+    }
+    portEXIT_CRITICAL(&spec_lock);
+
+    if (!in_flight) {
+        xTaskNotify(recognition_task_handle, COMMIT_BIT(lane), eSetBits);
+    }
+}
+
+/**
+ * Starts capture and upload while the weight detection is still
+ * confirming the vehicle, so the plate is often already known
+ * when the detection completes
+ * @param lane The lane whose scale saw the first valid sample
+ */
+void cv_speculative_begin(uint8_t lane) {
+    if (recognition_task_handle == NULL) {
+        return;
+    }
+
+    plate_result_t stale = { 0 };
+
+    portENTER_CRITICAL(&spec_lock);
+    bool start = speculation.state != SPEC_RUNNING;
+    if (start) {
+        // a result never committed belongs to a previous candidate
+        stale = speculation.result;
+        speculation.result = (plate_result_t){ 0 };
+        speculation.state = SPEC_RUNNING;
+        speculation.lane = lane;
+        speculation.committed = false;
+        speculation.cancelled = false;
+    }
+    portEXIT_CRITICAL(&spec_lock);
+
+    free_plate_result(&stale);
+
+    if (start) {
+        ESP_LOGI(TAG, "Starting speculative recognition for lane %d", lane);
+        xTaskNotify(recognition_task_handle, SPECULATE_BIT(lane), eSetBits);
+    }
+}
+
+/**
+ * Discards the speculative recognition of a lane, called when
+ * the weight detection drops the candidate without confirming it.
+ * An upload already in flight is not aborted, its result is
+ * thrown away when it completes
+ * @param lane The lane whose candidate was dropped
+ */
+void cv_speculative_cancel(uint8_t lane) {
+    plate_result_t stale = { 0 };
+
+    portENTER_CRITICAL(&spec_lock);
+    if (speculation.lane == lane) {
+        if (speculation.state == SPEC_RUNNING) {
+            speculation.cancelled = true;
+        } else if (speculation.state == SPEC_DONE) {
+            stale = speculation.result;
+            speculation.result = (plate_result_t){ 0 };
+            speculation.state = SPEC_IDLE;
+        }
+    }
+    portEXIT_CRITICAL(&spec_lock);
+
+    if (stale.plate || stale.image_link) {
+        ESP_LOGI(TAG, "Discarding speculative recognition of lane %d", lane);
+    }
+    free_plate_result(&stale);
+}
+
+#ifdef CONFIG_PLATE_CROP
+/**
+ * Decodes a frame, locates the plate and encodes a crop around it.
+ * The frame is decoded once into PSRAM, converted to grayscale for
+ * the location, and the crop is moved to the start of the decoded
+ * buffer (the grayscale one if the upload level is grayscale) before
+ * being encoded again
+ * @param image The JPEG frame
+ * @param image_len Length of the frame in bytes
+ * @param crop Set to the JPEG crop, to be freed by the caller
+ * @param crop_len Set to the length of the crop
+ * @param hash Set to the perceptual hash of the plate, false if it could not be computed
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND if no plate was found
+ */
+static esp_err_t crop_plate(const uint8_t *image, size_t image_len, uint8_t **crop, size_t *crop_len,
+    plate_hash_t *hash, bool *hashed)
+{
+    int64_t start_us = esp_timer_get_time();
+    uint16_t width, height;
+
+    if (!plate_crop_jpeg_size(image, image_len, &width, &height)) {
         return ESP_ERR_INVALID_ARG;
     }
-    
-    ESP_LOGI(TAG, "sending image to API (%d bytes)...", image_len);
-    fflush(stdout);
-
-    // Prepare multipart form data (header and footer)
-    char *data_header = NULL;
-    const char *data_footer = "\r\n------ESP32Boundary--\r\n";
-
-    asprintf(
-        &data_header,
-        "------ESP32Boundary\r\n"
-        "Content-Disposition: form-data; name=\"imageFile\"; filename=\"%s.jpeg\"\r\n"
-        "Content-Type: image/jpeg\r\n\r\n",
-        CV_API_KEY
-    );
-    
-    if (!data_header) {
-        ESP_LOGE(TAG, "invalid data_header");
+
+    size_t pixels = (size_t) width * height;
+    uint8_t *rgb = heap_caps_malloc(pixels * 3, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    uint8_t *gray = heap_caps_malloc(pixels, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+
+    if (rgb == NULL || gray == NULL) {
+        ESP_LOGW(TAG, "No memory to decode a %ux%u frame", width, height);
+        heap_caps_free(rgb);
+        heap_caps_free(gray);
         return ESP_ERR_NO_MEM;
     }
-    
-    size_t data_header_len = strlen(data_header);
-    size_t data_footer_len  = strlen(data_footer);
-    
-    // Calculate total length of POST body and checks for overflow
-    size_t total_len = data_header_len + image_len + data_footer_len;
 
-    if (image_len > SIZE_MAX - data_header_len - data_footer_len) {
-        ESP_LOGE(TAG, "total_len overflow in send_image_to_api()");
-        free(data_header);
-        return ESP_ERR_NO_MEM;
+    plate_rect_t rect;
+    esp_err_t err = ESP_OK;
+
+    if (!fmt2rgb888(image, image_len, PIXFORMAT_JPEG, rgb)) {
+        err = ESP_FAIL;
+    } else {
+        plate_crop_rgb_to_gray(rgb, gray, pixels);
+
+        if (!plate_crop_locate(gray, width, height, &rect)) {
+            err = ESP_ERR_NOT_FOUND;
+        } else {
+            *hashed = plate_hash_compute(gray, width, height, &rect, hash);
+        }
     }
-    
-    size_t largest_free_size = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
-    ESP_LOGI(
-        TAG, "payload size = %u, available size = %u", 
-        (unsigned) total_len,
-        (unsigned) largest_free_size
-    );
 
-    uint8_t *post_data = malloc(total_len);
+#ifdef CV_TUNER
+    const upload_level_t *level = upload_tuner_level(&tuner);
+    uint8_t quality = level->crop_quality;
+    bool grayscale = level->grayscale;
+#else
+    uint8_t quality = CROP_JPEG_QUALITY;
+    bool grayscale = false;
+#endif
 
-    if (!post_data) {
-        ESP_LOGE(TAG, "malloc(%u) failed, aborting...", (unsigned) total_len);
-        free(data_header);
-        return ESP_ERR_NO_MEM;
+    if (err == ESP_OK) {
+        uint8_t *pixels_buf = grayscale ? gray : rgb;
+        size_t bpp = grayscale ? 1 : 3;
+
+        // Rows of the crop packed at the start of the buffer, moving forward never overlaps a row not yet moved
+        for (uint16_t y = 0; y < rect.height; y++) {
+            memmove(&pixels_buf[(size_t) y * rect.width * bpp],
+                &pixels_buf[((size_t)(rect.y + y) * width + rect.x) * bpp], (size_t) rect.width * bpp);
+        }
+
+        if (!fmt2jpg(pixels_buf, (size_t) rect.width * rect.height * bpp, rect.width, rect.height,
+                grayscale ? PIXFORMAT_GRAYSCALE : PIXFORMAT_RGB888, quality, crop, crop_len)) {
+            err = ESP_FAIL;
+        }
     }
 
-    vTaskDelay(pdMS_TO_TICKS(10));
+    heap_caps_free(gray);
+    heap_caps_free(rgb);
 
-    // Build payload with header, image data, and footer
-    memcpy(post_data, data_header, data_header_len);
-    memcpy(post_data + data_header_len, image_data, image_len);
-    memcpy(post_data + data_header_len + image_len, data_footer, data_footer_len);
-    
-    // Perform the HTTP POST request and prints the response
-    esp_err_t err = perform_cv_api_request((const char *) post_data, total_len);
-    print_api_response_buffer();
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Plate at %u,%u %ux%u (contrast %.1f): %u -> %u bytes in %lld ms",
+            rect.x, rect.y, rect.width, rect.height, rect.contrast, (unsigned) image_len,
+            (unsigned) *crop_len, (long long)(esp_timer_get_time() - start_us) / 1000);
+    } else {
+        ESP_LOGW(TAG, "No plate crop (%s), uploading the whole frame", esp_err_to_name(err));
+    }
 
-    free(post_data);
-    free(data_header);
-    
     return err;
 }
+#endif
+
+#ifdef CONFIG_PLATE_CACHE
+static void update_cache_stats(void)
+{
+    portENTER_CRITICAL(&stats_lock);
+    cache_stats = cache.stats;
+    portEXIT_CRITICAL(&stats_lock);
+}
 
-char* extract_plate_from_response(void) {
-    char *plate = NULL;
+/**
+ * Resolves a plate seen recently without calling the CV API
+ * @param hash Perceptual hash of the plate
+ * @param result Filled with the cached recognition on a hit (caller must free)
+ * @return true on a hit
+ */
+static bool recognize_from_cache(plate_hash_t hash, plate_result_t *result)
+{
+    int64_t now_us = esp_timer_get_time();
 
-    cJSON *root = cJSON_Parse(api_response_buffer);
-    if (root == NULL) {
-        ESP_LOGE(TAG, "Failed to parse JSON response");
-        return NULL;
+    if (cache.ttl_us == 0) {
+        plate_cache_init(&cache, (int64_t) CONFIG_PLATE_CACHE_TTL * 1000 * 1000);
     }
 
-    cJSON *data = cJSON_GetObjectItem(root, "data");
-    if (data == NULL) {
-        ESP_LOGE(TAG, "\"data\" object not found in response");
-        cJSON_Delete(root);
-        return NULL;
+    const plate_cache_entry_t *entry = plate_cache_lookup(&cache, hash, now_us);
+    update_cache_stats();
+
+    if (entry == NULL) {
+        return false;
     }
 
-    cJSON *plate_item = cJSON_GetObjectItem(data, "number_plate");
+    result->plate = strdup(entry->plate);
+    result->image_link = strdup(entry->image_link);
 
-    if (cJSON_IsString(plate_item) && (plate_item->valuestring != NULL)) {
-        plate = strdup(plate_item->valuestring);
-    } else {
-        ESP_LOGE(TAG, "number_plate not found in response");
+    ESP_LOGI(TAG, "Plate %s from the cache, recognized %lld s ago (%" PRIu32 "/%" PRIu32 " hits)", entry->plate,
+        (long long)(now_us - entry->stored_us) / 1000000, cache_stats.hits, cache_stats.lookups);
+
+    return result->plate != NULL && result->image_link != NULL;
+}
+#endif
+
+/**
+ * Sends an image to the CV API and reads the plate and
+ * the image link from the response. With CONFIG_PLATE_CROP
+ * only a crop around the plate is sent; if nothing is
+ * recognized in it, the whole frame is sent after all
+ * @param image The JPEG frame
+ * @param image_len Length of the frame in bytes
+ * @param result Filled with the recognized data (caller must free)
+ * @param sample Filled with the size and time of the requests, 0 bytes if none was sent
+ */
+static void recognize_image(const uint8_t *image, size_t image_len, plate_result_t *result,
+    upload_sample_t *sample)
+{
+#ifdef CONFIG_PLATE_CROP
+    uint8_t *crop = NULL;
+    size_t crop_len = 0;
+    plate_hash_t hash = 0;
+    bool hashed = false;
+
+    if (crop_plate(image, image_len, &crop, &crop_len, &hash, &hashed) == ESP_OK) {
+#ifdef CONFIG_PLATE_CACHE
+        if (hashed && recognize_from_cache(hash, result)) {
+            free(crop);
+            return;
+        }
+#endif
+
+        recognize_with_backend(crop, crop_len, result, sample);
+        free(crop);
+
+        if (result->plate != NULL && result->image_link != NULL) {
+#ifdef CONFIG_PLATE_CACHE
+            if (hashed) {
+                plate_cache_store(&cache, hash, result->plate, result->image_link, esp_timer_get_time());
+                update_cache_stats();
+            }
+#endif
+            return;
+        }
+
+        // The crop may hold some other text than the plate
+        ESP_LOGW(TAG, "Nothing recognized in the crop, sending the whole frame");
+        free_plate_result(result);
     }
+#endif
 
-    cJSON_Delete(root);
-    return plate;
+    recognize_with_backend(image, image_len, result, sample);
 }
 
-char* extract_image_link_from_response(void) {
-    char *image_link = NULL;
+#ifdef CV_BURST
+/**
+ * Scores a frame of the burst on a half size decode
+ * @param fb The JPEG frame
+ * @param scratch Buffer of at least half width * half height * 2 bytes
+ * @param score Set to the sharpness of the frame
+ * @return false if the frame cannot be decoded
+ */
+static bool score_frame(const camera_fb_t *fb, uint8_t *scratch, uint32_t *score)
+{
+    if (!jpg2rgb565(fb->buf, fb->len, scratch, JPG_SCALE_2X)) {
+        return false;
+    }
+
+    uint16_t width = fb->width / 2, height = fb->height / 2;
+
+    frame_score_rgb565_to_gray(scratch, scratch, (size_t) width * height);
+    *score = frame_score_sharpness(scratch, width, height);
+
+    return true;
+}
 
-    cJSON *root = cJSON_Parse(api_response_buffer);
-    if (root == NULL) {
-        ESP_LOGE(TAG, "Failed to parse JSON response");
+/**
+ * Takes CONFIG_CV_BURST_FRAMES frames from the camera service and
+ * keeps the sharpest. Only the best frame so far is held, the others
+ * are given back to the driver as soon as they are scored, so nothing
+ * is copied. The first frame is the newest of the ring, the following
+ * ones are captured after it
+ * @param since_us Oldest capture time accepted for the first frame
+ * @return The chosen frame, to be given back with camera_service_give(), or NULL
+ */
+static camera_fb_t *capture_best_frame(int64_t since_us)
+{
+    camera_fb_t *best = camera_service_take(since_us, pdMS_TO_TICKS(CAPTURE_TIMEOUT_MS));
+    if (best == NULL) {
         return NULL;
     }
 
-    cJSON *data = cJSON_GetObjectItem(root, "data");
-    if (data == NULL) {
-        ESP_LOGE(TAG, "\"data\" object not found in response");
-        cJSON_Delete(root);
-        return NULL;
+    // The decode at half size is enough to see the blur, in PSRAM it does not take from the heap
+    size_t scratch_len = (size_t)((best->width + 1) / 2) * ((best->height + 1) / 2) * 2;
+    uint8_t *scratch = heap_caps_malloc(scratch_len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+
+    if (scratch == NULL) {
+        ESP_LOGW(TAG, "No memory to score the frames, using the first one");
+        return best;
     }
 
-    cJSON *image_item = cJSON_GetObjectItem(data, "view_image");
+    int64_t start_us = esp_timer_get_time();
+    int64_t last_us = camera_service_frame_us(best);
+    uint32_t best_score = 0;
+    bool best_valid = score_frame(best, scratch, &best_score);
 
-    if (cJSON_IsString(image_item) && (image_item->valuestring != NULL)) {
-        image_link = strdup(image_item->valuestring);
-    } else {
-        ESP_LOGE(TAG, "view_image not found in response");
+    for (int i = 1; i < CONFIG_CV_BURST_FRAMES; i++) {
+        camera_fb_t *fb = camera_service_take(last_us + 1, pdMS_TO_TICKS(CAPTURE_TIMEOUT_MS));
+        if (fb == NULL) {
+            break;
+        }
+
+        uint32_t score;
+        bool valid = score_frame(fb, scratch, &score);
+        last_us = camera_service_frame_us(fb);
+
+        ESP_LOGD(TAG, "Frame %d: %u bytes, sharpness %" PRIu32, i, (unsigned) fb->len, score);
+
+        if (valid && (!best_valid || score > best_score)) {
+            camera_service_give(best);
+            best = fb;
+            best_score = score;
+            best_valid = true;
+        } else {
+            camera_service_give(fb);
+        }
     }
 
-    cJSON_Delete(root);
-    return image_link;
+    heap_caps_free(scratch);
+
+    ESP_LOGI(TAG, "Best of %d frames: sharpness %" PRIu32 ", chosen in %lld ms", CONFIG_CV_BURST_FRAMES,
+        best_score, (long long)(esp_timer_get_time() - start_us) / 1000);
+
+    return best;
 }
+#endif
 
-////////////////////////////////////////////////
-/////////////// CV task ////////////////////////
-////////////////////////////////////////////////
+#ifndef CONFIG_USE_MOCK_CAMERA
+// Takes the frame to upload, the sharpest of a burst or the newest one captured since since_us
+static camera_fb_t *capture_frame(int64_t since_us)
+{
+#ifdef CV_BURST
+    return capture_best_frame(since_us);
+#else
+    return camera_service_take(since_us, pdMS_TO_TICKS(CAPTURE_TIMEOUT_MS));
+#endif
+}
+#endif
+
+#ifdef CV_RECAPTURE
+static bool read_well(const plate_result_t *result, float confidence)
+{
+    return result->plate != NULL && result->image_link != NULL &&
+        (confidence < 0 || confidence >= RECAPTURE_CONFIDENCE_MIN);
+}
 
+// Confidence of a result for the comparison, a plate without one ranks first
+static float rank(const plate_result_t *result, float confidence)
+{
+    if (result->plate == NULL || result->image_link == NULL) {
+        return -2.0f;
+    }
 
-void cv_task_creator(void) {
-    xTaskCreatePinnedToCore(
-        recognition_task,
-        "recognition_task",
-        12288,
-        NULL,
-        tskIDLE_PRIORITY + 1,
-        &recognition_task_handle,
-        0
-    );
+    return confidence < 0 ? 1.0f : confidence;
 }
 
-void unblock_recognition_task(void) {
-    if (recognition_task_handle != NULL) {
-        xTaskNotifyGive(recognition_task_handle);
+/**
+ * Retakes the shot with the bracketed exposures while the plate
+ * is not read with confidence, as long as another attempt fits
+ * before CONFIG_RECAPTURE_DEADLINE ms from the first capture.
+ * The best result is kept, the exposure is restored at the end
+ * @param result The result of the first attempt, replaced by a better one
+ * @param confidence Confidence of the first attempt, negative if unknown
+ */
+static void recapture(plate_result_t *result, float confidence)
+{
+    if (read_well(result, confidence)) {
+        return;
     }
+
+    int64_t start_us = esp_timer_get_time();
+    int64_t deadline_us = result->captured_us + (int64_t) CONFIG_RECAPTURE_DEADLINE * 1000;
+    int64_t attempt_us = start_us - result->captured_us;   // an attempt takes about as long as the first
+    float best = rank(result, confidence);
+    uint32_t attempts = 0;
+
+    for (size_t i = 1; i < EXPOSURES && esp_timer_get_time() + attempt_us <= deadline_us; i++) {
+        int64_t attempt_start_us = esp_timer_get_time();
+        camera_fb_t *fb = capture_frame(camera_service_set_exposure(&exposures[i]));
+
+        if (fb == NULL) {
+            break;
+        }
+
+        plate_result_t retry = { .captured_us = result->captured_us };
+        upload_sample_t sample = { .confidence = -1.0f };
+
+        recognize_image(fb->buf, fb->len, &retry, &sample);
+        camera_service_give(fb);
+
+        attempts++;
+        attempt_us = esp_timer_get_time() - attempt_start_us;
+
+        ESP_LOGI(TAG, "Recapture %u (exposure %d, brightness %d): %s in %lld ms", (unsigned) i, exposures[i].ae_level,
+            exposures[i].brightness, retry.plate ? retry.plate : "no plate", (long long) attempt_us / 1000);
+
+        if (rank(&retry, sample.confidence) > best) {
+            free_plate_result(result);
+            *result = retry;
+            best = rank(&retry, sample.confidence);
+            confidence = sample.confidence;
+        } else {
+            free_plate_result(&retry);
+        }
+
+        if (read_well(result, confidence)) {
+            break;
+        }
+    }
+
+    camera_service_set_exposure(&exposures[0]);
+
+    if (attempts == 0) {
+        return;
+    }
+
+    portENTER_CRITICAL(&stats_lock);
+    recapture_stats.recognitions++;
+    recapture_stats.attempts += attempts;
+    recapture_stats.read += read_well(result, confidence);
+    recapture_stats.time_ms_sum += (uint32_t)((esp_timer_get_time() - start_us) / 1000);
+    portEXIT_CRITICAL(&stats_lock);
 }
+#endif
+
+/**
+ * Captures the image, sends it to the CV API and
+ * extracts the plate and the image link from the response.
+ * With CONFIG_RECAPTURE_DEADLINE, a plate not read with
+ * confidence is recaptured with other exposures
+ * @param lane The lane the image is captured for
+ * @param result Filled with the recognized data (caller must free)
+ */
+static void capture_and_recognize(uint8_t lane, plate_result_t *result)
+{
+    upload_sample_t sample = { .confidence = -1.0f };
+
+    result->captured_us = esp_timer_get_time();
+    
+#ifdef CONFIG_USE_MOCK_CAMERA
+    // MOCK VERSION: Use embedded image
+    size_t image_size = mock_image_end - mock_image_start;
+    ESP_LOGI(TAG, "Using MOCK image (%d bytes)", image_size);
+    recognize_image(mock_image_start, image_size, result, &sample);
+#else
+    // REAL VERSION: Capture from camera
+    camera_fb_t *fb = capture_frame(result->captured_us - FRAME_MAX_AGE_US);
+    if (!fb) {
+        ESP_LOGE(TAG, "Camera capture failed");
+        trace_record(TRACE_CV_DONE, lane, 0);
+        return;
+    }
+    
+    ESP_LOGI(TAG, "Camera captured %d bytes", fb->len);
+    recognize_image(fb->buf, fb->len, result, &sample);
+    camera_service_give(fb);
+#endif
 
+#ifdef CV_TUNER
+    // The level is judged on the first attempt, the recaptures are about the exposure
+    sample.latency_ms = (uint32_t)((esp_timer_get_time() - result->captured_us) / 1000);
+    sample.recognized = result->plate != NULL && result->image_link != NULL;
+    tune_upload(&sample);
+#endif
+
+#ifdef CV_RECAPTURE
+    recapture(result, sample.confidence);
+#endif
+
+    trace_record(TRACE_CV_DONE, lane, result->plate != NULL && result->image_link != NULL);
+}
+
+/**
+ * Asks the backend whether the recognized plate can enter
+ * and posts the outcome to the FSM of the given lane as
+ * soon as the decision arrives, or at its deadline
+ * @param lane The lane the vehicle is waiting on
+ * @param result The recognized data, freed by this function
+ */
+static void submit_entry(uint8_t lane, plate_result_t *result)
+{
+    entry_request_t request;
+    entry_decision_t decision = { .outcome = ENTRY_DECISION_FAILED };
+
+    if (result->plate != NULL && result->image_link != NULL) {
+        ESP_LOGI(TAG, "===== PLATE DETECTED: %s =====", result->plate);
+        ESP_LOGI(TAG, "===== IMAGE LINK: %s =====", result->image_link);
+
+        esp_err_t err = entry_request_post(result->plate, result->image_link, ENTRY_TIMEOUT_MS, &request);
+
+        if (err == ESP_OK) {
+            entry_request_wait(&request, &decision);
+            ESP_LOGI(TAG, "Entry %s by backend in %" PRIu32 " ms", entry_outcome_name(decision.outcome),
+                decision.latency_ms);
+        } else {
+            ESP_LOGE(TAG, "Entry request not sent: %s", esp_err_to_name(err));
+        }
+    } else {
+        ESP_LOGE(TAG, "Plate recognition failed");
+    }
+
+    fsm_post_event(lane, decision.outcome == ENTRY_DECISION_ALLOWED ? PLATE_RECOGNIZED : PLATE_REFUSED);
+    free_plate_result(result);
+}
+
+// A speculative frame was taken at the first weight sample, maybe with
+// the vehicle still moving: a failed read is retried on a fresh capture
+static bool speculation_missed(const plate_result_t *result)
+{
+    return result->plate == NULL || result->image_link == NULL;
+}
+
+/**
+ * Runs a speculative recognition and decides what to do with
+ * its result depending on what happened on the scale meanwhile
+ * @param lane The lane the speculation was started for
+ */
+static void run_speculation(uint8_t lane)
+{
+    plate_result_t result = { 0 };
+    capture_and_recognize(lane, &result);
+
+    portENTER_CRITICAL(&spec_lock);
+    bool committed = speculation.committed;
+    bool cancelled = speculation.cancelled;
+    if (!committed && !cancelled) {
+        // keep the result until the detection is confirmed or dropped
+        speculation.result = result;
+        speculation.state = SPEC_DONE;
+    } else {
+        speculation.state = SPEC_IDLE;
+    }
+    portEXIT_CRITICAL(&spec_lock);
+
+    if (committed && !cancelled) {
+        ESP_LOGI(TAG, "Speculative recognition committed for lane %d", lane);
+
+        if (speculation_missed(&result)) {
+            ESP_LOGI(TAG, "No plate in the speculative frame of lane %d, capturing again", lane);
+            free_plate_result(&result);
+            capture_and_recognize(lane, &result);
+        }
+
+        submit_entry(lane, &result);
+    } else if (cancelled) {
+        ESP_LOGI(TAG, "Speculative recognition of lane %d discarded", lane);
+        free_plate_result(&result);
+
+        // the candidate was dropped and then confirmed: the frame
+        // may not show the vehicle, so take a fresh one
+        if (committed) {
+            capture_and_recognize(lane, &result);
+            submit_entry(lane, &result);
+        }
+    }
+}
+
+/**
+ * Serves an entry decision: uses the result of a completed
+ * speculation when it is recent enough, otherwise captures now
+ * @param lane The lane the vehicle is waiting on
+ */
+static void recognize_plate(uint8_t lane)
+{
+    ESP_LOGI(TAG, "Plate recognition task started for lane %d...", lane);
+
+    plate_result_t result = { 0 };
+    bool speculated = false;
+
+    portENTER_CRITICAL(&spec_lock);
+    if (speculation.state == SPEC_DONE && speculation.lane == lane) {
+        speculated = esp_timer_get_time() - speculation.result.captured_us < SPEC_RESULT_TTL_US;
+        result = speculation.result;
+        speculation.result = (plate_result_t){ 0 };
+        speculation.state = SPEC_IDLE;
+    }
+    portEXIT_CRITICAL(&spec_lock);
+
+    if (speculated && speculation_missed(&result)) {
+        ESP_LOGI(TAG, "No plate in the speculative frame of lane %d, capturing again", lane);
+        speculated = false;
+    }
+
+    if (speculated) {
+        ESP_LOGI(TAG, "Using speculative recognition for lane %d", lane);
+    } else {
+        free_plate_result(&result);
+        capture_and_recognize(lane, &result);
+    }
+
+    submit_entry(lane, &result);
+}
 
 /**
  * Plate recognition task
@@ -325,60 +987,30 @@ void unblock_recognition_task(void) {
 void recognition_task(void *arg)
 {   
     while (1) {
-        // Block until weight detection signals entry
-        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
-
-        ESP_LOGI(TAG, "Plate recognition task started...");
-        
-    #ifdef CONFIG_USE_MOCK_CAMERA
-        // MOCK VERSION: Use embedded image
-        size_t image_size = mock_image_end - mock_image_start;
-        ESP_LOGI(TAG, "Using MOCK image (%d bytes)", image_size);
-        prepare_image_payload(mock_image_start, image_size);
-    #else
-        // REAL VERSION: Capture from camera
-        camera_fb_t *fb = esp_camera_fb_get();
-        if (!fb) {
-            ESP_LOGE(TAG, "Camera capture failed");
-            return;
+        // Block until weight detection signals entry on some lane
+        uint32_t bits = 0;
+        TickType_t timeout = (CONFIG_CV_KEEPALIVE_PERIOD > 0) ?
+            pdMS_TO_TICKS(CONFIG_CV_KEEPALIVE_PERIOD * 1000) : portMAX_DELAY;
+
+        if (xTaskNotifyWait(0, UINT32_MAX, &bits, timeout) == pdFALSE) {
+            // Idle for a whole period: a request keeps the server from closing the connection
+            warm_connection(false);
+            continue;
         }
-        
-        ESP_LOGI(TAG, "Camera captured %d bytes", fb->len);
-        prepare_image_payload(fb->buf, fb->len);
-    #endif
-        YIELD();
-        const char *plate = extract_plate_from_response();
-        YIELD();
-        const char *image_link = extract_image_link_from_response();
-
-        if (plate != NULL && image_link != NULL) {
-            ESP_LOGI(TAG, "===== PLATE DETECTED: %s =====", plate);
-            ESP_LOGI(TAG, "===== IMAGE LINK: %s =====", image_link);
-            set_license_plate_data((char*) plate);
-            set_image_url_data((char*) image_link);
-            
-            xTaskCreate(post_entry_task, "post_entry_task", 8192, NULL, 5, NULL);
-            vTaskDelay(pdMS_TO_TICKS(5000));
-
-            bool entryAllowed = get_entry_allowed();
-
-            if (entryAllowed) {
-                ESP_LOGI(TAG, "Entry allowed by backend");
-                fsm_handle_event(PLATE_RECOGNIZED);
-            } else {
-                ESP_LOGI(TAG, "Entry refused by backend");
-                fsm_handle_event(PLATE_REFUSED);
-            }
-        } else {
-            ESP_LOGE(TAG, "Plate recognition failed");
-            fsm_handle_event(PLATE_REFUSED);
+
+        if (bits & WARM_BIT) {
+            warm_connection(true);
         }
-        
-        free((void*) plate);
-        free((void*) image_link);
 
-    #ifndef CONFIG_USE_MOCK_CAMERA
-        esp_camera_fb_return(fb);
-    #endif
+        // The camera is shared: lanes are served one at a time
+        for (uint8_t lane = 0; lane < MAX_LANES; lane++) {
+            if (bits & SPECULATE_BIT(lane)) {
+                run_speculation(lane);
+            }
+
+            if (bits & COMMIT_BIT(lane)) {
+                recognize_plate(lane);
+            }
+        }
     }
-}
\ No newline at end of file
+}
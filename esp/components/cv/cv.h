@@ -9,27 +9,47 @@
 #define CV_H
 
 #include "esp_err.h"
-#include "esp_http_client.h"
+#include "cv_backend.h"
+#include "plate_cache.h"
+#include "upload_tuner.h"
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
 
-// Performs the HTTPS request to the CV API, to send the image data
-esp_err_t perform_cv_api_request(const char *payload, size_t payload_len);
+// Recaptures with a bracketed exposure after a plate was not read with confidence
+typedef struct {
+    uint32_t recognitions;      // recognitions that were recaptured
+    uint32_t attempts;          // recaptures taken
+    uint32_t read;              // recognitions read with confidence after a recapture
+    uint32_t time_ms_sum;       // time spent recapturing
+} cv_recapture_stats_t;
 
-// Prepares the image payload for the CV API request
-esp_err_t prepare_image_payload(const uint8_t *image_data, size_t image_len);
+void recognition_task(void *arg);
 
-// Extracts recognized plate string from last API response (caller must free)
-char* extract_plate_from_response(void);
+void cv_task_creator(void);
 
-// Extracts view image URL from last API response (caller must free)
-char* extract_image_link_from_response(void);
+// Opens the connection to the CV API ahead of the next vehicle
+void cv_warm_connection(void);
 
-void recognition_task(void *arg);
+// Copies the timing of the requests to the CV API
+void cv_get_connection_stats(cv_connection_stats_t *stats);
 
-void cv_task_creator(void);
+// Copies the counters of the recognition cache, all 0 if it is disabled
+void cv_get_cache_stats(plate_cache_stats_t *stats);
+
+// Copies the counters of the upload size controller, all 0 if it is disabled
+void cv_get_upload_stats(upload_tuner_stats_t *stats);
+
+// Copies the counters of the recaptures, all 0 if they are disabled
+void cv_get_recapture_stats(cv_recapture_stats_t *stats);
+
+// Wakes the recognition task on behalf of a lane
+void unblock_recognition_task(uint8_t lane);
+
+// Starts capture and upload before the weight detection is confirmed
+void cv_speculative_begin(uint8_t lane);
 
-void unblock_recognition_task(void);
+// Discards the speculative recognition of a lane
+void cv_speculative_cancel(uint8_t lane);
 
 #endif /* CV_H */
\ No newline at end of file
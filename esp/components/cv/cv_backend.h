@@ -0,0 +1,61 @@
+/**
+ * @file cv_backend.h
+ *
+ * Plate recognition backends: the recognition task captures
+ * the frame (and crops it) whatever the backend, a backend
+ * sends it, parses the response and returns the fields read.
+ *
+ * Both backends shipped speak the CircuitDigest protocol
+ * (multipart upload, JSON response, see cv_response.h) over
+ * a kept-alive connection:
+ *   cv_backend_circuitdigest   the cloud API, HTTPS with the API key
+ *   cv_backend_local           the stand-in server of web-service/cv-mock,
+ *                              plain HTTP at CONFIG_CV_LOCAL_URL
+ *
+ */
+#ifndef CV_BACKEND_H
+#define CV_BACKEND_H
+
+#pragma once
+
+#include "cv_response.h"
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Timing of the requests to the backend, the handshake apart.
+// The HEAD requests that open or keep the connection are counted
+// apart from the uploads, so that the request time is the upload one
+typedef struct {
+    uint32_t requests;              // image uploads
+    uint32_t handshakes;            // requests, uploads or HEAD, that had to open a new connection
+    uint32_t probes;                // warm-up and keep-alive HEAD requests
+    uint32_t probes_refused;        // probes answered with an error status or a Connection: close
+    uint32_t request_ms_sum;
+    uint32_t handshake_ms_sum;
+    uint32_t probe_ms_sum;
+    uint32_t last_request_ms;
+    uint32_t last_handshake_ms;
+} cv_connection_stats_t;
+
+typedef struct {
+    const char *name;
+
+    // Opens the connection ahead of the next request (or keeps it open), fresh drops the current one first
+    esp_err_t (*warm)(bool fresh);
+
+    // Sends a JPEG image and parses the response into fields
+    esp_err_t (*recognize)(const uint8_t *image, size_t image_len, cv_response_t *fields);
+
+    // Copies the timing of the requests
+    void (*get_stats)(cv_connection_stats_t *stats);
+} cv_backend_t;
+
+extern const cv_backend_t cv_backend_circuitdigest;
+extern const cv_backend_t cv_backend_local;
+
+// Backend selected in the configuration
+const cv_backend_t *cv_backend_get(void);
+
+#endif /* CV_BACKEND_H */
@@ -0,0 +1,464 @@
+/**
+ * @file cv_backend_http.c
+ *
+ * HTTP transport of the recognition backends: the image is
+ * streamed in a multipart body (cv_multipart.h) on a kept-alive
+ * connection and the response is parsed as it arrives. The
+ * CircuitDigest and the local backend only differ in their
+ * URL, their TLS setup and their key.
+ *
+ */
+
+#include "cv_backend.h"
+#include "cv_multipart.h"
+
+#include "esp_http_client.h"
+#include "esp_crt_bundle.h"
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <sys/param.h>
+
+#define TAG "CV_BACKEND"
+
+#define CIRCUITDIGEST_URL "https://www.circuitdigest.cloud/api/v1/readnumberplate"
+
+#ifndef CONFIG_CV_LOCAL_URL
+#define CONFIG_CV_LOCAL_URL "http://192.168.1.100:8080/api/v1/readnumberplate"
+#endif
+
+#ifndef CONFIG_CV_PROBE_PATH
+#define CONFIG_CV_PROBE_PATH "/"
+#endif
+
+#define MAX_HTTP_OUTPUT_BUFFER 1024
+
+typedef struct {
+    const char *name;
+    const char *url;
+    const char *api_key;        // sent as the Authorization header, NULL for none
+    const char *head;           // multipart head, with the key as the file name
+    size_t head_len;
+    bool tls;
+
+    // Persistent connection, only used by the recognition task
+    esp_http_client_handle_t client;
+    bool connected;             // kept up to date by the event handler
+    int64_t request_start_us;
+    int64_t handshake_us;       // handshake of the current request, 0 if the connection was reused
+    bool server_closes;         // the response of the current request has a Connection: close
+    cv_connection_stats_t stats;
+    portMUX_TYPE stats_lock;
+} http_backend_t;
+
+static const char multipart_tail[] = CV_MULTIPART_TAIL;
+
+#define MULTIPART_TAIL_LEN (sizeof(multipart_tail) - 1)
+
+static const char circuitdigest_head[] = CV_MULTIPART_HEAD(CONFIG_API_KEY);
+static const char local_head[] = CV_MULTIPART_HEAD("local");
+
+static http_backend_t circuitdigest = {
+    .name = "CircuitDigest",
+    .url = CIRCUITDIGEST_URL,
+    .api_key = CONFIG_API_KEY,
+    .head = circuitdigest_head,
+    .head_len = sizeof(circuitdigest_head) - 1,
+    .tls = true,
+    .stats_lock = portMUX_INITIALIZER_UNLOCKED,
+};
+
+static http_backend_t local = {
+    .name = "local",
+    .url = CONFIG_CV_LOCAL_URL,
+    .api_key = NULL,
+    .head = local_head,
+    .head_len = sizeof(local_head) - 1,
+    .tls = false,
+    .stats_lock = portMUX_INITIALIZER_UNLOCKED,
+};
+
+// The response is parsed as it arrives, the buffer only keeps
+// its beginning for the console
+static cv_response_parser_t response_parser;
+static char api_response_buffer[MAX_HTTP_OUTPUT_BUFFER];
+static int response_len = 0;
+static size_t response_total = 0;
+
+// The event handler, which feeds every chunk of the response to the
+// parser and keeps the first 1KB of it to be printed
+static esp_err_t http_event_handler(esp_http_client_event_handle_t evt)
+{
+    http_backend_t *backend = evt -> user_data;
+
+    if (evt -> event_id == HTTP_EVENT_ON_CONNECTED) {
+        backend -> connected = true;
+        backend -> handshake_us = esp_timer_get_time() - backend -> request_start_us;
+    } else if (evt -> event_id == HTTP_EVENT_DISCONNECTED) {
+        backend -> connected = false;
+    } else if (evt -> event_id == HTTP_EVENT_ON_HEADER && strcasecmp(evt -> header_key, "Connection") == 0) {
+        backend -> server_closes = strcasecmp(evt -> header_value, "close") == 0;
+    }
+
+    if (evt -> event_id == HTTP_EVENT_ON_DATA && evt -> data_len > 0) {
+        cv_response_feed(&response_parser, evt -> data, evt -> data_len);
+        response_total += evt -> data_len;
+
+        size_t copy_len = MIN((size_t) evt->data_len, MAX_HTTP_OUTPUT_BUFFER - response_len - 1);
+
+        memcpy(api_response_buffer + response_len, evt -> data, copy_len);
+        response_len += copy_len;
+    }
+
+    return ESP_OK;
+}
+
+// Prints the beginning of the response and the fields read from it to console
+static void print_api_response_buffer(void)
+{
+    printf("\n---------- Response content: -------------\n\n");
+
+    printf("%s", api_response_buffer);
+
+    if (response_total > (size_t) response_len) {
+        printf("\n... (%u bytes in total)", (unsigned) response_total);
+    }
+
+    const cv_response_t *fields = &response_parser.fields;
+
+    printf("\n\nplate: %s, image: %s, confidence: ",
+        fields->has_plate ? fields->plate : "-",
+        fields->has_image_link ? fields->image_link : "-");
+
+    if (fields->has_confidence) {
+        printf("%.2f", fields->confidence);
+    } else {
+        printf("-");
+    }
+
+    if (response_parser.error) {
+        printf(" (invalid JSON)");
+    }
+
+    printf("\n\n------------------------------------------\n\n");
+}
+
+/**
+ * @brief Writes a whole buffer to the open connection,
+ * esp_http_client_write() may send less than asked
+ * @return ESP_OK on success, ESP_FAIL if the connection failed
+ */
+static esp_err_t write_all(esp_http_client_handle_t client, const char *data, size_t len)
+{
+    while (len > 0) {
+        int written = esp_http_client_write(client, data, len);
+
+        if (written <= 0) {
+            return ESP_FAIL;
+        }
+
+        data += written;
+        len -= written;
+    }
+
+    return ESP_OK;
+}
+
+/**
+ * @brief Creates the client of a backend once, its
+ * connection is then kept open between two requests
+ */
+static esp_http_client_handle_t get_client(http_backend_t *backend)
+{
+    if (backend->client != NULL) {
+        return backend->client;
+    }
+
+    esp_http_client_config_t config = {
+        .url = backend->url,
+        .method = HTTP_METHOD_POST,
+        .event_handler = http_event_handler,
+        .user_data = backend,
+        .timeout_ms = 30000,
+        .crt_bundle_attach = backend->tls ? esp_crt_bundle_attach : NULL,
+        .skip_cert_common_name_check = true,
+        .keep_alive_enable = true,
+    };
+
+    backend->client = esp_http_client_init(&config);
+
+    if (backend->client != NULL) {
+        esp_http_client_set_header(backend->client, "Content-Type", CV_MULTIPART_CONTENT_TYPE);
+
+        if (backend->api_key != NULL) {
+            esp_http_client_set_header(backend->client, "Authorization", backend->api_key);
+        }
+    }
+
+    return backend->client;
+}
+
+static void reset_response(void)
+{
+    response_len = 0;
+    response_total = 0;
+    memset(api_response_buffer, 0, sizeof(api_response_buffer));
+    cv_response_init(&response_parser);
+}
+
+/**
+ * @brief Sends one request on the connection, opening it
+ * first if it is closed. The multipart body is streamed:
+ * the head, the image straight from its buffer and the
+ * tail, so the image is never copied nor allocated again.
+ * Without an image, a HEAD request on CONFIG_CV_PROBE_PATH
+ * only opens the connection (or keeps it open), its response
+ * has no body to read
+ * @param backend The backend
+ * @param image_data The JPEG image, NULL for a HEAD request
+ * @param image_len Length of the image in bytes
+ * @return ESP_OK on success, error code otherwise
+ */
+static esp_err_t exchange(http_backend_t *backend, const uint8_t *image_data, size_t image_len)
+{
+    esp_http_client_handle_t client = get_client(backend);
+
+    if (client == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    bool head = image_data == NULL;
+    int content_len = head ? 0 : (int)(backend->head_len + image_len + MULTIPART_TAIL_LEN);
+
+    // Same host, so the connection is kept when the path changes
+    esp_http_client_set_url(client, head ? CONFIG_CV_PROBE_PATH : backend->url);
+    esp_http_client_set_method(client, head ? HTTP_METHOD_HEAD : HTTP_METHOD_POST);
+    reset_response();
+
+    backend->request_start_us = esp_timer_get_time();
+    backend->handshake_us = 0;
+    backend->server_closes = false;
+
+    // Connects if needed, then sends the request headers with the Content-Length
+    esp_err_t err = esp_http_client_open(client, content_len);
+
+    if (err == ESP_OK && !head) {
+        err = write_all(client, backend->head, backend->head_len);
+        if (err == ESP_OK) {
+            err = write_all(client, (const char *) image_data, image_len);
+        }
+        if (err == ESP_OK) {
+            err = write_all(client, multipart_tail, MULTIPART_TAIL_LEN);
+        }
+    }
+
+    if (err == ESP_OK && esp_http_client_fetch_headers(client) < 0) {
+        err = ESP_FAIL;
+    }
+
+    // The body is read through the event handler, like esp_http_client_perform() does
+    if (err == ESP_OK && !head) {
+        err = esp_http_client_flush_response(client, NULL);
+    }
+
+    return err;
+}
+
+/**
+ * @brief Sends a request on the kept-alive connection. The
+ * server may have closed it since the previous request, so
+ * a request failing on a reused connection is sent again
+ * once on a new one. A response with an error status or a
+ * Connection: close does not keep the connection: it is
+ * closed here, and a HEAD request answered so fails
+ * @return ESP_OK on success, ESP_ERR_INVALID_RESPONSE for a
+ * HEAD request that did not keep the connection, error code otherwise
+ */
+static esp_err_t request(http_backend_t *backend, const uint8_t *image_data, size_t image_len)
+{
+    bool reused = backend->connected;
+    esp_err_t err = exchange(backend, image_data, image_len);
+
+    if (err != ESP_OK && reused) {
+        ESP_LOGW(TAG, "Kept-alive connection lost (%s), reconnecting", esp_err_to_name(err));
+        esp_http_client_close(backend->client);
+        err = exchange(backend, image_data, image_len);
+    }
+
+    if (err != ESP_OK) {
+        if (backend->client != NULL) {
+            esp_http_client_close(backend->client);
+        }
+        return err;
+    }
+
+    uint32_t handshake_ms = backend->handshake_us / 1000;
+    uint32_t request_ms = (esp_timer_get_time() - backend->request_start_us - backend->handshake_us) / 1000;
+    int status = esp_http_client_get_status_code(backend->client);
+    bool kept_alive = status >= 200 && status < 300 && !backend->server_closes;
+
+    portENTER_CRITICAL(&backend->stats_lock);
+    if (image_data != NULL) {
+        backend->stats.requests++;
+        backend->stats.request_ms_sum += request_ms;
+        backend->stats.last_request_ms = request_ms;
+    } else {
+        backend->stats.probes++;
+        backend->stats.probe_ms_sum += request_ms;
+        if (!kept_alive) {
+            backend->stats.probes_refused++;
+        }
+    }
+    if (backend->handshake_us > 0) {
+        backend->stats.handshakes++;
+        backend->stats.handshake_ms_sum += handshake_ms;
+        backend->stats.last_handshake_ms = handshake_ms;
+    }
+    portEXIT_CRITICAL(&backend->stats_lock);
+
+    if (backend->handshake_us > 0) {
+        ESP_LOGI(TAG, "%s %s: handshake %lu ms, request %lu ms", backend->name, image_data ? "upload" : "warm-up",
+            (unsigned long) handshake_ms, (unsigned long) request_ms);
+    } else {
+        ESP_LOGI(TAG, "%s %s: request %lu ms on the kept-alive connection", backend->name,
+            image_data ? "upload" : "keep-alive", (unsigned long) request_ms);
+    }
+
+    if (kept_alive) {
+        return ESP_OK;
+    }
+
+    ESP_LOGW(TAG, "%s answered %d%s, connection not kept alive", backend->name, status,
+        backend->server_closes ? " with Connection: close" : "");
+    esp_http_client_close(backend->client);
+    backend->connected = false;
+
+    return image_data != NULL ? ESP_OK : ESP_ERR_INVALID_RESPONSE;
+}
+
+/**
+ * @brief Uploads an image to a backend and parses the response
+ * @param backend The backend
+ * @param image The JPEG image (camera frame buffer, crop or mock image)
+ * @param image_len Length of the image in bytes
+ * @param fields Filled with the fields read from the response
+ * @return ESP_OK on success, ESP_ERR_INVALID_RESPONSE if the
+ * response is not complete JSON, error code otherwise
+ */
+static esp_err_t recognize(http_backend_t *backend, const uint8_t *image, size_t image_len, cv_response_t *fields)
+{
+    if (image == NULL || image_len == 0) {
+        ESP_LOGE(TAG, "invalid image data passed to the %s backend", backend->name);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (image_len > INT_MAX - backend->head_len - MULTIPART_TAIL_LEN) {
+        ESP_LOGE(TAG, "image too large (%u bytes)", (unsigned) image_len);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    ESP_LOGI(TAG, "sending image to the %s backend (%u bytes)...", backend->name, (unsigned) image_len);
+
+    esp_err_t err = request(backend, image, image_len);
+
+    // Response handling
+    if (err == ESP_OK) {
+        ESP_LOGI(
+            TAG,
+            "Response ESP_OK - Status %d with content_length = %" PRId64,
+            esp_http_client_get_status_code(backend->client),
+            esp_http_client_get_content_length(backend->client)
+        );
+    } else {
+        ESP_LOGE(TAG, "request failed: %s", esp_err_to_name(err));
+    }
+
+    print_api_response_buffer();
+
+    *fields = response_parser.fields;
+
+    if (err == ESP_OK && !response_parser.complete) {
+        ESP_LOGE(TAG, "Failed to parse JSON response");
+        err = ESP_ERR_INVALID_RESPONSE;
+    }
+
+    return err;
+}
+
+static esp_err_t warm(http_backend_t *backend, bool fresh)
+{
+    if (fresh && backend->client != NULL) {
+        esp_http_client_close(backend->client);
+    }
+
+    return request(backend, NULL, 0);
+}
+
+static void get_stats(http_backend_t *backend, cv_connection_stats_t *stats)
+{
+    portENTER_CRITICAL(&backend->stats_lock);
+    *stats = backend->stats;
+    portEXIT_CRITICAL(&backend->stats_lock);
+}
+
+////    CircuitDigest cloud API
+
+static esp_err_t circuitdigest_warm(bool fresh)
+{
+    return warm(&circuitdigest, fresh);
+}
+
+static esp_err_t circuitdigest_recognize(const uint8_t *image, size_t image_len, cv_response_t *fields)
+{
+    return recognize(&circuitdigest, image, image_len, fields);
+}
+
+static void circuitdigest_get_stats(cv_connection_stats_t *stats)
+{
+    get_stats(&circuitdigest, stats);
+}
+
+const cv_backend_t cv_backend_circuitdigest = {
+    .name = "CircuitDigest",
+    .warm = circuitdigest_warm,
+    .recognize = circuitdigest_recognize,
+    .get_stats = circuitdigest_get_stats,
+};
+
+////    Local stand-in server
+
+static esp_err_t local_warm(bool fresh)
+{
+    return warm(&local, fresh);
+}
+
+static esp_err_t local_recognize(const uint8_t *image, size_t image_len, cv_response_t *fields)
+{
+    return recognize(&local, image, image_len, fields);
+}
+
+static void local_get_stats(cv_connection_stats_t *stats)
+{
+    get_stats(&local, stats);
+}
+
+const cv_backend_t cv_backend_local = {
+    .name = "local",
+    .warm = local_warm,
+    .recognize = local_recognize,
+    .get_stats = local_get_stats,
+};
+
+const cv_backend_t *cv_backend_get(void)
+{
+#ifdef CONFIG_CV_BACKEND_LOCAL
+    return &cv_backend_local;
+#else
+    return &cv_backend_circuitdigest;
+#endif
+}
@@ -0,0 +1,27 @@
+/**
+ * @file cv_multipart.h
+ *
+ * Multipart body of an upload to the CircuitDigest API, shared
+ * by the firmware and the host tools. It is built at compile
+ * time: only the image between the head and the tail changes
+ * from one request to the next.
+ *
+ */
+#ifndef CV_MULTIPART_H
+#define CV_MULTIPART_H
+
+#pragma once
+
+#define CV_MULTIPART_BOUNDARY "----ESP32Boundary"
+
+#define CV_MULTIPART_CONTENT_TYPE "multipart/form-data; boundary=" CV_MULTIPART_BOUNDARY
+
+// The API takes the key as the name of the uploaded file
+#define CV_MULTIPART_HEAD(api_key) \
+    "--" CV_MULTIPART_BOUNDARY "\r\n" \
+    "Content-Disposition: form-data; name=\"imageFile\"; filename=\"" api_key ".jpeg\"\r\n" \
+    "Content-Type: image/jpeg\r\n\r\n"
+
+#define CV_MULTIPART_TAIL "\r\n--" CV_MULTIPART_BOUNDARY "--\r\n"
+
+#endif /* CV_MULTIPART_H */
@@ -0,0 +1,381 @@
+/**
+ * @file cv_response.c
+ *
+ * Single pass JSON scanner extracting the fields of the CV
+ * API response: a character level state machine with a stack
+ * of the open containers and of their current key. Strings
+ * are only stored when they are a key or a wanted field.
+ *
+ */
+
+#include "cv_response.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef enum {
+    MODE_VALUE,         // a value is expected
+    MODE_KEY,           // a key (or the end of the object) is expected
+    MODE_COLON,
+    MODE_STRING,
+    MODE_ESCAPE,        // after a backslash
+    MODE_UNICODE,       // reading the 4 digits of \u
+    MODE_LITERAL,       // number, true, false or null
+    MODE_AFTER,         // after a value: separator or end of the container
+    MODE_DONE,
+} parser_mode_t;
+
+typedef enum {
+    TARGET_NONE,
+    TARGET_PLATE,
+    TARGET_IMAGE_LINK,
+    TARGET_CONFIDENCE,
+} parser_target_t;
+
+void cv_response_init(cv_response_parser_t *parser)
+{
+    memset(parser, 0, sizeof(*parser));
+    parser->mode = MODE_VALUE;
+}
+
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Field written by the value starting now, from the keys on the stack
+static parser_target_t value_target(const cv_response_parser_t *p)
+{
+    if (p->depth < 2) {
+        return TARGET_NONE;
+    }
+
+    uint8_t level = p->depth - 1;
+
+    if (p->containers[level] != '{' || p->containers[level - 1] != '{' ||
+        strcmp(p->keys[level - 1], "data") != 0) {
+        return TARGET_NONE;
+    }
+
+    const char *key = p->keys[level];
+
+    if (strcmp(key, "number_plate") == 0) {
+        return TARGET_PLATE;
+    }
+    if (strcmp(key, "view_image") == 0) {
+        return TARGET_IMAGE_LINK;
+    }
+    if (strstr(key, "confidence") != NULL) {
+        return TARGET_CONFIDENCE;
+    }
+
+    return TARGET_NONE;
+}
+
+static void start_string(cv_response_parser_t *p, bool is_key)
+{
+    p->mode = MODE_STRING;
+    p->string_is_key = is_key;
+    p->overflow = false;
+    p->out_len = 0;
+    p->out = NULL;
+
+    if (is_key) {
+        p->out = p->keys[p->depth - 1];
+        p->out_max = CV_RESPONSE_KEY_MAX;
+    } else if (p->target == TARGET_PLATE) {
+        p->out = p->fields.plate;
+        p->out_max = CV_PLATE_MAX;
+    } else if (p->target == TARGET_IMAGE_LINK) {
+        p->out = p->fields.image_link;
+        p->out_max = CV_IMAGE_LINK_MAX;
+    } else if (p->target == TARGET_CONFIDENCE) {
+        // a confidence sent as a string is converted like a number
+        p->out = p->literal;
+        p->out_max = sizeof(p->literal);
+    }
+
+    if (p->out != NULL) {
+        p->out[0] = '\0';
+    }
+}
+
+static void put_char(cv_response_parser_t *p, char c)
+{
+    if (p->out == NULL) {
+        return;
+    }
+
+    if (p->out_len + 1 < p->out_max) {
+        p->out[p->out_len++] = c;
+        p->out[p->out_len] = '\0';
+    } else {
+        p->overflow = true;
+    }
+}
+
+// Writes a \u escape as UTF-8, surrogate pairs are not joined
+static void put_code_point(cv_response_parser_t *p, uint16_t cp)
+{
+    if (cp < 0x80) {
+        put_char(p, (char) cp);
+    } else if (cp < 0x800) {
+        put_char(p, (char)(0xC0 | (cp >> 6)));
+        put_char(p, (char)(0x80 | (cp & 0x3F)));
+    } else {
+        put_char(p, (char)(0xE0 | (cp >> 12)));
+        put_char(p, (char)(0x80 | ((cp >> 6) & 0x3F)));
+        put_char(p, (char)(0x80 | (cp & 0x3F)));
+    }
+}
+
+static void set_confidence(cv_response_parser_t *p, const char *text)
+{
+    char *end;
+    float value = strtof(text, &end);
+
+    if (end != text && *end == '\0') {
+        p->fields.confidence = value;
+        p->fields.has_confidence = true;
+    }
+}
+
+static void value_done(cv_response_parser_t *p)
+{
+    p->target = TARGET_NONE;
+
+    if (p->depth == 0) {
+        p->mode = MODE_DONE;
+        p->complete = true;
+    } else {
+        p->mode = MODE_AFTER;
+    }
+}
+
+static void end_string(cv_response_parser_t *p)
+{
+    if (p->string_is_key) {
+        // A truncated key must not match a shorter one
+        if (p->overflow) {
+            p->out[0] = '\0';
+        }
+        p->mode = MODE_COLON;
+        return;
+    }
+
+    bool valid = !p->overflow && p->out_len > 0;
+
+    switch (p->target) {
+        case TARGET_PLATE:
+            p->fields.has_plate = valid;
+            break;
+        case TARGET_IMAGE_LINK:
+            p->fields.has_image_link = valid;
+            break;
+        case TARGET_CONFIDENCE:
+            if (valid) {
+                set_confidence(p, p->literal);
+            }
+            break;
+        default:
+            break;
+    }
+
+    value_done(p);
+}
+
+static bool push(cv_response_parser_t *p, char container)
+{
+    if (p->depth == CV_RESPONSE_MAX_DEPTH) {
+        return false;
+    }
+
+    p->containers[p->depth] = container;
+    p->keys[p->depth][0] = '\0';
+    p->depth++;
+    p->mode = (container == '{') ? MODE_KEY : MODE_VALUE;
+    p->target = TARGET_NONE;
+
+    return true;
+}
+
+static bool pop(cv_response_parser_t *p, char closing)
+{
+    if (p->depth == 0 || p->containers[p->depth - 1] != (closing == '}' ? '{' : '[')) {
+        return false;
+    }
+
+    p->depth--;
+    value_done(p);
+
+    return true;
+}
+
+/**
+ * Processes one character
+ * @return 1 if it was consumed, 0 if it must be processed again
+ * in the new mode, -1 if the body is not valid JSON
+ */
+static int step(cv_response_parser_t *p, char c)
+{
+    switch (p->mode) {
+        case MODE_VALUE:
+            if (is_space(c)) {
+                return 1;
+            }
+
+            p->target = value_target(p);
+
+            if (c == '{' || c == '[') {
+                return push(p, c) ? 1 : -1;
+            }
+            if (c == ']') {
+                return pop(p, c) ? 1 : -1;     // empty array
+            }
+            if (c == '"') {
+                start_string(p, false);
+                return 1;
+            }
+            if (c == '-' || (c >= '0' && c <= '9') || c == 't' || c == 'f' || c == 'n') {
+                p->mode = MODE_LITERAL;
+                p->literal_len = 0;
+                return 0;
+            }
+            return -1;
+
+        case MODE_KEY:
+            if (is_space(c)) {
+                return 1;
+            }
+            if (c == '"') {
+                start_string(p, true);
+                return 1;
+            }
+            if (c == '}') {
+                return pop(p, c) ? 1 : -1;     // empty object
+            }
+            return -1;
+
+        case MODE_COLON:
+            if (is_space(c)) {
+                return 1;
+            }
+            if (c == ':') {
+                p->mode = MODE_VALUE;
+                return 1;
+            }
+            return -1;
+
+        case MODE_STRING:
+            if (c == '"') {
+                end_string(p);
+            } else if (c == '\\') {
+                p->mode = MODE_ESCAPE;
+            } else {
+                put_char(p, c);
+            }
+            return 1;
+
+        case MODE_ESCAPE:
+            p->mode = MODE_STRING;
+
+            switch (c) {
+                case 'b': put_char(p, '\b'); break;
+                case 'f': put_char(p, '\f'); break;
+                case 'n': put_char(p, '\n'); break;
+                case 'r': put_char(p, '\r'); break;
+                case 't': put_char(p, '\t'); break;
+                case 'u':
+                    p->mode = MODE_UNICODE;
+                    p->unicode = 0;
+                    p->unicode_digits = 0;
+                    break;
+                default:
+                    put_char(p, c);     // \" \\ \/
+                    break;
+            }
+            return 1;
+
+        case MODE_UNICODE: {
+            int digit;
+
+            if (c >= '0' && c <= '9') {
+                digit = c - '0';
+            } else if (c >= 'a' && c <= 'f') {
+                digit = c - 'a' + 10;
+            } else if (c >= 'A' && c <= 'F') {
+                digit = c - 'A' + 10;
+            } else {
+                return -1;
+            }
+
+            p->unicode = (uint16_t)(p->unicode << 4 | digit);
+
+            if (++p->unicode_digits == 4) {
+                put_code_point(p, p->unicode);
+                p->mode = MODE_STRING;
+            }
+            return 1;
+        }
+
+        case MODE_LITERAL:
+            if (is_space(c) || c == ',' || c == '}' || c == ']') {
+                p->literal[p->literal_len] = '\0';
+
+                if (p->target == TARGET_CONFIDENCE) {
+                    set_confidence(p, p->literal);
+                }
+
+                value_done(p);
+                return 0;
+            }
+
+            if ((size_t) p->literal_len + 1 >= sizeof(p->literal)) {
+                return -1;
+            }
+            p->literal[p->literal_len++] = c;
+            return 1;
+
+        case MODE_AFTER:
+            if (is_space(c)) {
+                return 1;
+            }
+            if (c == ',') {
+                p->mode = (p->containers[p->depth - 1] == '{') ? MODE_KEY : MODE_VALUE;
+                return 1;
+            }
+            if (c == '}' || c == ']') {
+                return pop(p, c) ? 1 : -1;
+            }
+            return -1;
+
+        case MODE_DONE:
+        default:
+            return is_space(c) ? 1 : -1;
+    }
+}
+
+/**
+ * Feeds the next chunk of the response body. The fields are
+ * available in parser->fields as soon as they have been read
+ * @param parser The parser
+ * @param data The chunk
+ * @param len Length of the chunk
+ * @return false if the body is not valid JSON
+ */
+bool cv_response_feed(cv_response_parser_t *parser, const char *data, size_t len)
+{
+    size_t i = 0;
+
+    while (i < len && !parser->error) {
+        int consumed = step(parser, data[i]);
+
+        if (consumed < 0) {
+            parser->error = true;
+        } else {
+            i += consumed;
+        }
+    }
+
+    return !parser->error;
+}
@@ -0,0 +1,71 @@
+/**
+ * @file cv_response.h
+ *
+ * Incremental parser of the CV API response. It is fed the
+ * body chunk by chunk as it arrives and keeps only the fields
+ * the gate uses, so the response is never stored nor parsed
+ * into a tree, whatever its length:
+ *   data.number_plate    the recognized plate
+ *   data.view_image      link to the annotated image
+ *   data.*confidence*    any number whose key contains "confidence"
+ *
+ * It has no hardware dependency, so that it can also be
+ * compiled on the host.
+ *
+ */
+#ifndef CV_RESPONSE_H
+#define CV_RESPONSE_H
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CV_PLATE_MAX        32
+#define CV_IMAGE_LINK_MAX   256
+
+// Deepest nesting accepted, a deeper response is rejected
+#define CV_RESPONSE_MAX_DEPTH 8
+
+// Longest key compared, longer ones never match
+#define CV_RESPONSE_KEY_MAX 24
+
+typedef struct {
+    char plate[CV_PLATE_MAX];
+    char image_link[CV_IMAGE_LINK_MAX];
+    float confidence;
+    bool has_plate;
+    bool has_image_link;
+    bool has_confidence;
+} cv_response_t;
+
+typedef struct {
+    cv_response_t fields;
+    bool complete;          // the top level value has been closed
+    bool error;             // not valid JSON, the rest is ignored
+
+    // Parser state
+    uint8_t mode;
+    uint8_t depth;
+    char containers[CV_RESPONSE_MAX_DEPTH];             // '{' or '['
+    char keys[CV_RESPONSE_MAX_DEPTH][CV_RESPONSE_KEY_MAX];
+    bool string_is_key;
+    bool overflow;          // the string being read did not fit
+    uint8_t target;         // field the current value is written to
+    char *out;              // buffer of the string being read
+    size_t out_len;
+    size_t out_max;
+    uint16_t unicode;       // code point of a \u escape
+    uint8_t unicode_digits;
+    char literal[32];       // number, true, false or null being read
+    uint8_t literal_len;
+} cv_response_parser_t;
+
+// Prepares the parser for a new response
+void cv_response_init(cv_response_parser_t *parser);
+
+// Feeds the next chunk of the body, returns false once the body is known to be invalid
+bool cv_response_feed(cv_response_parser_t *parser, const char *data, size_t len);
+
+#endif /* CV_RESPONSE_H */
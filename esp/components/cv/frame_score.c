@@ -0,0 +1,65 @@
+/**
+ * @file frame_score.c
+ *
+ * Laplacian variance focus score
+ *
+ */
+
+#include "frame_score.h"
+
+/**
+ * Converts big endian RGB565 (as written by the JPEG
+ * decoder of esp32-camera) to grayscale. Each pixel is
+ * written before the next one is read, so the conversion
+ * can be done in place
+ * @param rgb565 The image, two bytes per pixel
+ * @param gray Filled with one byte per pixel
+ * @param pixels Number of pixels
+ */
+void frame_score_rgb565_to_gray(const uint8_t *rgb565, uint8_t *gray, size_t pixels)
+{
+    for (size_t i = 0; i < pixels; i++) {
+        uint16_t c = (uint16_t)(rgb565[2 * i] << 8 | rgb565[2 * i + 1]);
+        uint32_t r = (c >> 11) << 3;
+        uint32_t g = ((c >> 5) & 0x3F) << 2;
+        uint32_t b = (c & 0x1F) << 3;
+
+        gray[i] = (uint8_t)((r + 2 * g + b) >> 2);
+    }
+}
+
+/**
+ * Computes the variance of the Laplacian over the interior
+ * of the image. Only integers are used: the sums fit in 64
+ * bits up to 2^32 pixels
+ * @param gray The image, one byte per pixel, rows not padded
+ * @param width Width of the image
+ * @param height Height of the image
+ * @return The variance, saturated to UINT32_MAX
+ */
+uint32_t frame_score_sharpness(const uint8_t *gray, uint16_t width, uint16_t height)
+{
+    if (width < 3 || height < 3) {
+        return 0;
+    }
+
+    int64_t sum = 0;
+    uint64_t sum_sq = 0;
+
+    for (uint16_t y = 1; y < height - 1; y++) {
+        const uint8_t *row = &gray[(size_t) y * width];
+
+        for (uint16_t x = 1; x < width - 1; x++) {
+            int32_t laplacian = 4 * (int32_t) row[x] - row[x - 1] - row[x + 1] - row[x - width] - row[x + width];
+
+            sum += laplacian;
+            sum_sq += (uint64_t)((int64_t) laplacian * laplacian);
+        }
+    }
+
+    uint64_t n = (uint64_t)(width - 2) * (height - 2);
+    uint64_t mean_sq = (uint64_t)((sum / (int64_t) n) * (sum / (int64_t) n));
+    uint64_t variance = sum_sq / n - mean_sq;
+
+    return variance > UINT32_MAX ? UINT32_MAX : (uint32_t) variance;
+}
@@ -0,0 +1,30 @@
+/**
+ * @file frame_score.h
+ *
+ * Focus score of a camera frame, used to pick the sharpest
+ * frame of a burst before it is uploaded to the CV API.
+ *
+ * The score is the variance of the Laplacian of the grayscale
+ * frame: a motion blurred or out of focus frame has weaker
+ * second derivatives, so a lower variance than a sharp frame
+ * of the same scene.
+ *
+ * It has no hardware dependency, so that it can also be
+ * compiled on the host (tools/plate_crop).
+ *
+ */
+#ifndef FRAME_SCORE_H
+#define FRAME_SCORE_H
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Converts big endian RGB565 to 8 bit grayscale, gray may be the rgb565 buffer itself
+void frame_score_rgb565_to_gray(const uint8_t *rgb565, uint8_t *gray, size_t pixels);
+
+// Variance of the 4 neighbour Laplacian of a grayscale image, 0 if it is too small
+uint32_t frame_score_sharpness(const uint8_t *gray, uint16_t width, uint16_t height);
+
+#endif /* FRAME_SCORE_H */
@@ -0,0 +1,169 @@
+/**
+ * @file plate_cache.c
+ *
+ * Difference hash of the plate region and cache of the
+ * recent recognitions
+ *
+ */
+
+#include "plate_cache.h"
+
+#include <string.h>
+
+/**
+ * Hashes the region centred on a plate: the region is divided
+ * into a grid of cells, each one averaged, and every cell is
+ * compared with its right neighbour
+ * @param gray The image, one byte per pixel, rows not padded
+ * @param width Width of the image
+ * @param height Height of the image
+ * @param plate The plate found in the image
+ * @param hash Set to the hash
+ * @return false if the image is too small
+ */
+bool plate_hash_compute(const uint8_t *gray, uint16_t width, uint16_t height,
+    const plate_rect_t *plate, plate_hash_t *hash)
+{
+    int region_width = width * PLATE_HASH_WIDTH_PERCENT / 100;
+    int region_height = region_width / PLATE_HASH_ASPECT;
+
+    if (region_width < PLATE_HASH_COLUMNS || region_height < PLATE_HASH_ROWS || region_height > height) {
+        return false;
+    }
+
+    // Centred on the plate, moved inside the frame
+    int x = plate->x + plate->width / 2 - region_width / 2;
+    int y = plate->y + plate->height / 2 - region_height / 2;
+
+    x = x < 0 ? 0 : (x + region_width > width ? width - region_width : x);
+    y = y < 0 ? 0 : (y + region_height > height ? height - region_height : y);
+
+    *hash = 0;
+
+    for (int row = 0; row < PLATE_HASH_ROWS; row++) {
+        uint32_t y0 = y + (uint32_t) region_height * row / PLATE_HASH_ROWS;
+        uint32_t y1 = y + (uint32_t) region_height * (row + 1) / PLATE_HASH_ROWS;
+        uint32_t cells[PLATE_HASH_COLUMNS];
+
+        for (int col = 0; col < PLATE_HASH_COLUMNS; col++) {
+            uint32_t x0 = x + (uint32_t) region_width * col / PLATE_HASH_COLUMNS;
+            uint32_t x1 = x + (uint32_t) region_width * (col + 1) / PLATE_HASH_COLUMNS;
+            uint32_t sum = 0;
+
+            for (uint32_t py = y0; py < y1; py++) {
+                const uint8_t *line = &gray[(size_t) py * width];
+
+                for (uint32_t px = x0; px < x1; px++) {
+                    sum += line[px];
+                }
+            }
+
+            // Mean scaled by 256, the cells may differ in size by a pixel
+            cells[col] = (sum << 8) / ((y1 - y0) * (x1 - x0));
+        }
+
+        for (int col = 0; col < PLATE_HASH_COLUMNS - 1; col++) {
+            if (cells[col] > cells[col + 1]) {
+                *hash |= 1ULL << (row * (PLATE_HASH_COLUMNS - 1) + col);
+            }
+        }
+    }
+
+    return true;
+}
+
+uint32_t plate_hash_distance(plate_hash_t a, plate_hash_t b)
+{
+    return (uint32_t) __builtin_popcountll(a ^ b);
+}
+
+void plate_cache_init(plate_cache_t *cache, int64_t ttl_us)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->ttl_us = ttl_us;
+}
+
+// Closest entry within PLATE_CACHE_MAX_DISTANCE, expired ones included
+static plate_cache_entry_t *closest(plate_cache_t *cache, plate_hash_t hash)
+{
+    plate_cache_entry_t *best = NULL;
+    uint32_t best_distance = PLATE_CACHE_MAX_DISTANCE + 1;
+
+    for (int i = 0; i < PLATE_CACHE_ENTRIES; i++) {
+        plate_cache_entry_t *entry = &cache->entries[i];
+
+        if (!entry->used) {
+            continue;
+        }
+
+        uint32_t distance = plate_hash_distance(entry->hash, hash);
+        if (distance < best_distance) {
+            best = entry;
+            best_distance = distance;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * Looks up the recognition of a plate seen recently
+ * @param cache The cache
+ * @param hash Hash of the plate region
+ * @param now_us Current time
+ * @return The closest entry younger than the TTL, NULL on a miss
+ */
+const plate_cache_entry_t *plate_cache_lookup(plate_cache_t *cache, plate_hash_t hash, int64_t now_us)
+{
+    plate_cache_entry_t *entry = closest(cache, hash);
+
+    cache->stats.lookups++;
+
+    if (entry != NULL && now_us - entry->stored_us > cache->ttl_us) {
+        cache->stats.expired++;
+        entry = NULL;
+    }
+
+    if (entry != NULL) {
+        cache->stats.hits++;
+    }
+
+    return entry;
+}
+
+/**
+ * Stores a recognition. An entry of the same plate is
+ * refreshed, otherwise the oldest entry is replaced
+ * @param cache The cache
+ * @param hash Hash of the plate region
+ * @param plate The recognized plate
+ * @param image_link Link to the annotated image
+ * @param now_us Current time
+ */
+void plate_cache_store(plate_cache_t *cache, plate_hash_t hash, const char *plate,
+    const char *image_link, int64_t now_us)
+{
+    plate_cache_entry_t *entry = closest(cache, hash);
+
+    if (entry == NULL) {
+        entry = &cache->entries[0];
+
+        for (int i = 1; i < PLATE_CACHE_ENTRIES && entry->used; i++) {
+            plate_cache_entry_t *other = &cache->entries[i];
+
+            if (!other->used || other->stored_us < entry->stored_us) {
+                entry = other;
+            }
+        }
+    }
+
+    entry->hash = hash;
+    strncpy(entry->plate, plate, CV_PLATE_MAX - 1);
+    entry->plate[CV_PLATE_MAX - 1] = '\0';
+    strncpy(entry->image_link, image_link, CV_IMAGE_LINK_MAX - 1);
+    entry->image_link[CV_IMAGE_LINK_MAX - 1] = '\0';
+    entry->stored_us = now_us;
+    entry->used = true;
+
+    cache->stats.stores++;
+}
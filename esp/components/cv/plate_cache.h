@@ -0,0 +1,90 @@
+/**
+ * @file plate_cache.h
+ *
+ * Cache of the recent recognitions, keyed by a perceptual
+ * hash of the plate region: a vehicle that bounces on the
+ * scale, or backs off and comes back, is resolved locally
+ * instead of with a new call to the CV API.
+ *
+ * The hash is a difference hash of the plate: a region centred
+ * on the located plate is averaged down to a grid of
+ * PLATE_HASH_COLUMNS x PLATE_HASH_ROWS cells and each bit tells
+ * whether a cell is brighter than its right neighbour. The
+ * region has a fixed size, as the extent found for the plate
+ * varies with the blur while its centre does not. Frames of
+ * the same plate differ in a few bits, whatever their exposure,
+ * JPEG noise or small changes of position, while the characters
+ * of another plate change many of them.
+ *
+ * It has no hardware dependency, so that it can also be
+ * compiled on the host (tools/plate_cache).
+ *
+ */
+#ifndef PLATE_CACHE_H
+#define PLATE_CACHE_H
+
+#pragma once
+
+#include "cv_response.h"
+#include "plate_crop.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Grid of the hash: 8 rows of 8 comparisons, 64 bits
+#define PLATE_HASH_ROWS     8
+#define PLATE_HASH_COLUMNS  9
+
+// Region hashed around the centre of the plate: half the
+// frame width, three times as wide as high
+#define PLATE_HASH_WIDTH_PERCENT 50
+#define PLATE_HASH_ASPECT        3
+
+// Most bits two hashes of the same plate differ in
+#define PLATE_CACHE_MAX_DISTANCE 16
+
+// Recognitions remembered, the oldest is replaced
+#define PLATE_CACHE_ENTRIES 8
+
+typedef uint64_t plate_hash_t;
+
+typedef struct {
+    plate_hash_t hash;
+    char plate[CV_PLATE_MAX];
+    char image_link[CV_IMAGE_LINK_MAX];
+    int64_t stored_us;
+    bool used;
+} plate_cache_entry_t;
+
+typedef struct {
+    uint32_t lookups;
+    uint32_t hits;
+    uint32_t expired;           // lookups matching an entry older than the TTL
+    uint32_t stores;
+} plate_cache_stats_t;
+
+typedef struct {
+    plate_cache_entry_t entries[PLATE_CACHE_ENTRIES];
+    int64_t ttl_us;
+    plate_cache_stats_t stats;
+} plate_cache_t;
+
+// Hashes the region around a plate found by plate_crop_locate()
+bool plate_hash_compute(const uint8_t *gray, uint16_t width, uint16_t height,
+    const plate_rect_t *plate, plate_hash_t *hash);
+
+// Number of bits two hashes differ in
+uint32_t plate_hash_distance(plate_hash_t a, plate_hash_t b);
+
+// Empties the cache, entries are kept ttl_us microseconds
+void plate_cache_init(plate_cache_t *cache, int64_t ttl_us);
+
+// Finds the closest recent recognition, NULL on a miss
+const plate_cache_entry_t *plate_cache_lookup(plate_cache_t *cache, plate_hash_t hash, int64_t now_us);
+
+// Remembers a recognition, replacing a close or the oldest entry
+void plate_cache_store(plate_cache_t *cache, plate_hash_t hash, const char *plate,
+    const char *image_link, int64_t now_us);
+
+#endif /* PLATE_CACHE_H */
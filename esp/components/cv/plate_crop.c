@@ -0,0 +1,245 @@
+/**
+ * @file plate_crop.c
+ *
+ * Edge band analysis locating the licence plate
+ *
+ */
+
+#include "plate_crop.h"
+
+#include <stdlib.h>
+
+// A pixel is on a vertical edge when the horizontal gradient
+// is above this many times the mean one (and above the minimum)
+#define EDGE_MEAN_FACTOR    3
+#define EDGE_MIN_THRESHOLD  24
+
+// The band and the plate are extended while the smoothed edge
+// count stays above these fractions of their peak, in percent
+#define ROW_KEEP_PERCENT    45
+#define COLUMN_KEEP_PERCENT 30
+
+// Margins added around the characters: 1/12 of the width
+// on each side, 1/3 of the height above and below
+#define MARGIN_X_DIV 12
+#define MARGIN_Y_DIV 3
+
+// JPEG markers
+#define JPEG_SOI   0xD8
+#define JPEG_SOF0  0xC0
+#define JPEG_SOF2  0xC2
+
+/**
+ * Reads the size of a JPEG image, from the first
+ * baseline or progressive frame header
+ * @return false if the data is not a JPEG image
+ */
+bool plate_crop_jpeg_size(const uint8_t *jpg, size_t len, uint16_t *width, uint16_t *height)
+{
+    if (len < 4 || jpg[0] != 0xFF || jpg[1] != JPEG_SOI) {
+        return false;
+    }
+
+    size_t pos = 2;
+
+    while (pos + 9 <= len) {
+        if (jpg[pos] != 0xFF) {
+            return false;
+        }
+
+        uint8_t marker = jpg[pos + 1];
+        size_t segment_len = (size_t) jpg[pos + 2] << 8 | jpg[pos + 3];
+
+        if (marker >= JPEG_SOF0 && marker <= JPEG_SOF2) {
+            *height = (uint16_t)(jpg[pos + 5] << 8 | jpg[pos + 6]);
+            *width = (uint16_t)(jpg[pos + 7] << 8 | jpg[pos + 8]);
+            return *width > 0 && *height > 0;
+        }
+
+        pos += 2 + segment_len;
+    }
+
+    return false;
+}
+
+void plate_crop_rgb_to_gray(const uint8_t *rgb, uint8_t *gray, size_t pixels)
+{
+    // Symmetric in red and blue, the decoders disagree on their order
+    for (size_t i = 0; i < pixels; i++, rgb += 3) {
+        gray[i] = (uint8_t)((rgb[0] + 2 * rgb[1] + rgb[2]) >> 2);
+    }
+}
+
+static inline uint32_t gradient(const uint8_t *row, uint16_t x)
+{
+    int d = (int) row[x + 1] - (int) row[x - 1];
+    return (uint32_t)(d < 0 ? -d : d);
+}
+
+// Box filter of the given half width, the edges are averaged over the samples available
+static void smooth(const uint32_t *in, uint32_t *out, int n, int half)
+{
+    uint32_t sum = 0;
+    int lo = 0, hi = -1;
+
+    for (int i = 0; i < n; i++) {
+        while (hi < i + half && hi < n - 1) {
+            sum += in[++hi];
+        }
+        while (lo < i - half) {
+            sum -= in[lo++];
+        }
+        out[i] = sum / (uint32_t)(hi - lo + 1);
+    }
+}
+
+// Extends [*lo, *hi] around the peak while the profile stays above keep percent of it
+static void extend(const uint32_t *profile, int n, int peak, uint32_t keep_percent, int *lo, int *hi)
+{
+    uint32_t limit = profile[peak] * keep_percent / 100;
+
+    *lo = *hi = peak;
+    while (*lo > 0 && profile[*lo - 1] >= limit) {
+        (*lo)--;
+    }
+    while (*hi < n - 1 && profile[*hi + 1] >= limit) {
+        (*hi)++;
+    }
+}
+
+static int argmax(const uint32_t *profile, int n)
+{
+    int best = 0;
+
+    for (int i = 1; i < n; i++) {
+        if (profile[i] > profile[best]) {
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+// Finds the plate with the work arrays allocated, see plate_crop_locate()
+static bool locate(const uint8_t *gray, uint16_t width, uint16_t height,
+    uint32_t *rows, uint32_t *cols, uint32_t *profile, plate_rect_t *rect)
+{
+    // Edge threshold from the mean gradient of the frame
+    uint64_t gradient_sum = 0;
+
+    for (uint16_t y = 0; y < height; y++) {
+        const uint8_t *row = &gray[(size_t) y * width];
+
+        for (uint16_t x = 1; x < width - 1; x++) {
+            gradient_sum += gradient(row, x);
+        }
+    }
+
+    uint32_t threshold = (uint32_t)(gradient_sum * EDGE_MEAN_FACTOR / ((uint64_t) height * (width - 2)));
+    if (threshold < EDGE_MIN_THRESHOLD) {
+        threshold = EDGE_MIN_THRESHOLD;
+    }
+
+    // Edges of every row
+    uint64_t edges_total = 0;
+
+    for (uint16_t y = 0; y < height; y++) {
+        const uint8_t *row = &gray[(size_t) y * width];
+
+        for (uint16_t x = 1; x < width - 1; x++) {
+            rows[y] += gradient(row, x) > threshold;
+        }
+        edges_total += rows[y];
+    }
+
+    if (edges_total == 0) {
+        return false;
+    }
+
+    // Band of rows around the densest one
+    int y1, y2;
+
+    smooth(rows, profile, height, height / 48 + 1);
+    extend(profile, height, argmax(profile, height), ROW_KEEP_PERCENT, &y1, &y2);
+
+    int band_height = y2 - y1 + 1;
+    if (band_height < 4) {
+        return false;
+    }
+
+    // Edges of every column of the band, smoothed over about
+    // the spacing of two characters so they merge into one run
+    for (int y = y1; y <= y2; y++) {
+        const uint8_t *row = &gray[(size_t) y * width];
+
+        for (uint16_t x = 1; x < width - 1; x++) {
+            cols[x] += gradient(row, x) > threshold;
+        }
+    }
+
+    int x1, x2;
+
+    smooth(cols, profile, width, band_height / 2 + 1);
+    extend(profile, width, argmax(profile, width), COLUMN_KEEP_PERCENT, &x1, &x2);
+
+    int band_width = x2 - x1 + 1;
+    float aspect = (float) band_width / band_height;
+
+    uint64_t edges_plate = 0;
+    for (int x = x1; x <= x2; x++) {
+        edges_plate += cols[x];
+    }
+
+    float contrast = ((float) edges_plate / ((float) band_width * band_height)) /
+        ((float) edges_total / ((float) width * height));
+
+    if (aspect < PLATE_MIN_ASPECT || aspect > PLATE_MAX_ASPECT || contrast < PLATE_MIN_CONTRAST) {
+        return false;
+    }
+
+    // Margins, clamped to the frame
+    int mx = band_width / MARGIN_X_DIV, my = band_height / MARGIN_Y_DIV;
+
+    x1 = (x1 > mx) ? x1 - mx : 0;
+    y1 = (y1 > my) ? y1 - my : 0;
+    x2 = (x2 + mx < width) ? x2 + mx : width - 1;
+    y2 = (y2 + my < height) ? y2 + my : height - 1;
+
+    rect->x = (uint16_t) x1;
+    rect->y = (uint16_t) y1;
+    rect->width = (uint16_t)(x2 - x1 + 1);
+    rect->height = (uint16_t)(y2 - y1 + 1);
+    rect->contrast = contrast;
+
+    return true;
+}
+
+/**
+ * Finds the plate: the row band with the densest vertical
+ * edges, then the columns of the band with the densest edges,
+ * extended by a margin so the crop holds the whole plate
+ * @param gray The image, one byte per pixel, rows not padded
+ * @param width Width of the image
+ * @param height Height of the image
+ * @param rect Filled with the crop on success
+ * @return false if nothing in the image looks like a plate
+ */
+bool plate_crop_locate(const uint8_t *gray, uint16_t width, uint16_t height, plate_rect_t *rect)
+{
+    if (width < 16 || height < 16) {
+        return false;
+    }
+
+    uint32_t *rows = calloc(height, sizeof(uint32_t));
+    uint32_t *cols = calloc(width, sizeof(uint32_t));
+    uint32_t *profile = calloc(width > height ? width : height, sizeof(uint32_t));
+
+    bool found = rows != NULL && cols != NULL && profile != NULL &&
+        locate(gray, width, height, rows, cols, profile, rect);
+
+    free(rows);
+    free(cols);
+    free(profile);
+
+    return found;
+}
@@ -0,0 +1,49 @@
+/**
+ * @file plate_crop.h
+ *
+ * Location of the licence plate in a grayscale frame, so
+ * that only a crop around it is uploaded to the CV API.
+ *
+ * The characters of a plate are a band of dense, high
+ * contrast vertical edges: the rows of the frame with the
+ * most edges give the band, the columns of the band with
+ * the most edges give the extent of the plate.
+ *
+ * It has no hardware dependency, so that it can also be
+ * compiled on the host (tools/plate_crop).
+ *
+ */
+#ifndef PLATE_CROP_H
+#define PLATE_CROP_H
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Accepted width / height of the edge band, margins excluded
+#define PLATE_MIN_ASPECT 1.5f
+#define PLATE_MAX_ASPECT 10.0f
+
+// Edge density of the band compared to the whole frame
+#define PLATE_MIN_CONTRAST 2.0f
+
+typedef struct {
+    uint16_t x;
+    uint16_t y;
+    uint16_t width;
+    uint16_t height;
+    float contrast;         // edge density of the plate over the frame's
+} plate_rect_t;
+
+// Reads the size of a JPEG image from its frame header
+bool plate_crop_jpeg_size(const uint8_t *jpg, size_t len, uint16_t *width, uint16_t *height);
+
+// Converts RGB888 (either channel order) to 8 bit grayscale
+void plate_crop_rgb_to_gray(const uint8_t *rgb, uint8_t *gray, size_t pixels);
+
+// Finds the plate in a grayscale image, false if no band looks like one
+bool plate_crop_locate(const uint8_t *gray, uint16_t width, uint16_t height, plate_rect_t *rect);
+
+#endif /* PLATE_CROP_H */
@@ -0,0 +1,154 @@
+/**
+ * @file upload_tuner.c
+ *
+ * Latency and recognition driven choice of the capture settings
+ *
+ */
+
+#include "upload_tuner.h"
+
+// The latency may exceed the target by this much, in percent,
+// before a lighter level is taken
+#define LATENCY_MARGIN_PERCENT 15
+
+// Samples in a row predicting a richer level under the
+// target before it is taken, so the level does not flap
+#define RICHER_SAMPLES 3
+
+// A level whose smoothed recognition rate falls below this is
+// too light: two failures in a row from a clean record
+#define SUCCESS_MIN_PERCENT 70
+
+// A plate read with less confidence counts as a failure
+#define CONFIDENCE_MIN 0.6f
+
+// Weight of a new sample in the smoothed values, 1/2^SMOOTH_SHIFT
+#define SMOOTH_SHIFT 2
+
+const upload_level_t upload_levels[UPLOAD_TUNER_LEVELS] = {
+    { .width = 640, .height = 480, .quality = 10, .crop_quality = 90, .grayscale = false, .cost = 100 },
+    { .width = 640, .height = 480, .quality = 12, .crop_quality = 80, .grayscale = false, .cost = 70 },
+    { .width = 640, .height = 480, .quality = 12, .crop_quality = 75, .grayscale = true,  .cost = 55 },
+    { .width = 480, .height = 320, .quality = 12, .crop_quality = 75, .grayscale = true,  .cost = 35 },
+    { .width = 320, .height = 240, .quality = 14, .crop_quality = 70, .grayscale = true,  .cost = 20 },
+    { .width = 320, .height = 240, .quality = 18, .crop_quality = 60, .grayscale = true,  .cost = 14 },
+};
+
+static inline uint32_t smooth(uint32_t average, uint32_t sample)
+{
+    return (uint32_t)(((uint64_t) average * ((1 << SMOOTH_SHIFT) - 1) + sample) >> SMOOTH_SHIFT);
+}
+
+void upload_tuner_init(upload_tuner_t *tuner, uint32_t target_ms, uint16_t max_width)
+{
+    *tuner = (upload_tuner_t){ .target_ms = target_ms, .fresh = true };
+
+    while (tuner->first_level < UPLOAD_TUNER_LEVELS - 1 && upload_levels[tuner->first_level].width > max_width) {
+        tuner->first_level++;
+    }
+
+    tuner->level = tuner->first_level;
+    tuner->last_level = UPLOAD_TUNER_LEVELS - 1;
+
+    for (int i = 0; i < UPLOAD_TUNER_LEVELS; i++) {
+        tuner->success[i] = 100;
+    }
+
+    tuner->stats.level = tuner->level;
+}
+
+const upload_level_t *upload_tuner_level(const upload_tuner_t *tuner)
+{
+    return &upload_levels[tuner->level];
+}
+
+static void set_level(upload_tuner_t *tuner, uint8_t level)
+{
+    if (level > tuner->level) {
+        tuner->stats.lighter++;
+    } else {
+        tuner->stats.richer++;
+    }
+
+    tuner->level = level;
+    tuner->stats.level = level;
+    tuner->fresh = true;
+    tuner->under_target = 0;
+}
+
+/**
+ * Takes the outcome of a request into account and picks
+ * the level of the next capture
+ * @param tuner The controller
+ * @param sample The outcome of the request
+ * @param now_us Current time, for the levels held
+ * @return true if the level changed
+ */
+bool upload_tuner_observe(upload_tuner_t *tuner, const upload_sample_t *sample, int64_t now_us)
+{
+    upload_tuner_stats_t *stats = &tuner->stats;
+    uint8_t level = tuner->level;
+
+    stats->samples++;
+
+    if (sample->upload_ms > 0) {
+        uint32_t bytes_per_s = (uint32_t)((uint64_t) sample->bytes * 1000 / sample->upload_ms);
+        stats->bytes_per_s = stats->bytes_per_s ? smooth(stats->bytes_per_s, bytes_per_s) : bytes_per_s;
+    }
+
+    // The first sample of a level replaces the latencies of the previous one
+    stats->latency_ms = tuner->fresh ? sample->latency_ms : smooth(stats->latency_ms, sample->latency_ms);
+    tuner->upload_ms = tuner->fresh ? sample->upload_ms : smooth(tuner->upload_ms, sample->upload_ms);
+    tuner->fresh = false;
+
+    bool success = sample->recognized && (sample->confidence < 0 || sample->confidence >= CONFIDENCE_MIN);
+    tuner->success[level] = (uint8_t) smooth(tuner->success[level], success ? 100 : 0);
+
+    // The levels held get a new chance once the hold is over
+    if (tuner->last_level < UPLOAD_TUNER_LEVELS - 1 && now_us >= tuner->held_until_us) {
+        tuner->last_level = UPLOAD_TUNER_LEVELS - 1;
+    }
+
+    // Too light to be read: back to the richer level, and stay there for a while
+    if (tuner->success[level] < SUCCESS_MIN_PERCENT) {
+        tuner->success[level] = 100;
+
+        if (level == tuner->first_level) {
+            return false;
+        }
+
+        tuner->last_level = level - 1;
+        tuner->held_until_us = now_us + UPLOAD_TUNER_HOLD_US;
+        stats->held++;
+        set_level(tuner, level - 1);
+        return true;
+    }
+
+    // Too slow: lighter, if that level is not held
+    if (stats->latency_ms > (uint64_t) tuner->target_ms * (100 + LATENCY_MARGIN_PERCENT) / 100) {
+        tuner->under_target = 0;
+
+        if (level < tuner->last_level) {
+            set_level(tuner, level + 1);
+            return true;
+        }
+
+        return false;
+    }
+
+    // Fast enough: richer, if the latency predicted there is still under the target.
+    // Only the upload grows with the cost, the capture and the crop do not
+    if (level > tuner->first_level) {
+        uint32_t predicted_ms = stats->latency_ms + (uint32_t)((uint64_t) tuner->upload_ms *
+            (upload_levels[level - 1].cost - upload_levels[level].cost) / upload_levels[level].cost);
+
+        tuner->under_target = predicted_ms <= tuner->target_ms ? tuner->under_target + 1 : 0;
+
+        if (tuner->under_target >= RICHER_SAMPLES) {
+            set_level(tuner, level - 1);
+            return true;
+        }
+    }
+
+    return false;
+}
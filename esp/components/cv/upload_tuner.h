@@ -0,0 +1,91 @@
+/**
+ * @file upload_tuner.h
+ *
+ * Controller of the size of the uploads to the CV API. The
+ * capture settings are a ladder of levels, from the richest
+ * (VGA, fine JPEG, colour) to the lightest (QVGA, coarse JPEG,
+ * grayscale). After every request the controller is fed the
+ * time from the capture to the result, the bytes sent and
+ * whether the plate was read with enough confidence, and it
+ * moves along the ladder:
+ *   - one level lighter while the smoothed latency is above the
+ *     target, unless that level recently failed the recognition
+ *   - one level richer when the latency predicted there, with the
+ *     request time scaled by the relative cost of the levels, is
+ *     still under the target
+ *   - one level richer at once when the recognition rate of the
+ *     current level drops, and that level is then skipped for
+ *     UPLOAD_TUNER_HOLD_US
+ * So the uploads get lighter when the uplink is slow and richer
+ * again when it recovers, without trading away the plates.
+ *
+ * It has no hardware dependency, so that it can also be
+ * compiled on the host (tools/upload_tuner).
+ *
+ */
+#ifndef UPLOAD_TUNER_H
+#define UPLOAD_TUNER_H
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define UPLOAD_TUNER_LEVELS 6
+
+// How long a level is skipped after its recognition rate dropped
+#define UPLOAD_TUNER_HOLD_US ((int64_t) 30 * 60 * 1000 * 1000)
+
+typedef struct {
+    uint16_t width;             // frame captured by the camera
+    uint16_t height;
+    uint8_t quality;            // JPEG quality of the camera, 0-63, lower is finer
+    uint8_t crop_quality;       // JPEG quality of the uploaded crop, 1-100
+    bool grayscale;
+    uint8_t cost;               // upload size relative to the first level, in percent
+} upload_level_t;
+
+// Outcome of one request to the CV API
+typedef struct {
+    uint32_t latency_ms;        // capture to recognition result
+    uint32_t upload_ms;         // the request alone
+    uint32_t bytes;             // image sent
+    bool recognized;            // a plate was read
+    float confidence;           // 0-1, negative when the response has none
+} upload_sample_t;
+
+typedef struct {
+    uint32_t samples;
+    uint32_t lighter;           // steps to a lighter level
+    uint32_t richer;            // steps to a richer level
+    uint32_t held;              // levels skipped after their recognition rate dropped
+    uint32_t latency_ms;        // smoothed latency at the current level
+    uint32_t bytes_per_s;       // smoothed uplink throughput
+    uint8_t level;
+} upload_tuner_stats_t;
+
+typedef struct {
+    uint32_t target_ms;
+    uint8_t level;
+    uint8_t first_level;        // richest level the camera can capture
+    uint8_t last_level;         // lightest level not held
+    int64_t held_until_us;
+    bool fresh;                 // no sample at the current level yet
+    uint32_t upload_ms;         // smoothed request time at the current level
+    uint8_t under_target;       // consecutive samples allowing a richer level
+    uint8_t success[UPLOAD_TUNER_LEVELS];   // smoothed recognition rate, percent
+    upload_tuner_stats_t stats;
+} upload_tuner_t;
+
+extern const upload_level_t upload_levels[UPLOAD_TUNER_LEVELS];
+
+// Starts on the richest level not wider than max_width
+void upload_tuner_init(upload_tuner_t *tuner, uint32_t target_ms, uint16_t max_width);
+
+// Feeds the outcome of a request, returns true if the level changed
+bool upload_tuner_observe(upload_tuner_t *tuner, const upload_sample_t *sample, int64_t now_us);
+
+// Settings of the current level
+const upload_level_t *upload_tuner_level(const upload_tuner_t *tuner);
+
+#endif /* UPLOAD_TUNER_H */
@@ -21,38 +21,37 @@
 
 // Backend server API
 #define SERVER_URL "https://tinyparkingsystem-api.vercel.app/"
-#define MAX_HTTP_OUTPUT_BUFFER 1024
 
 static const char *TAG = "HTTPS Module";
-static char response_buffer[MAX_HTTP_OUTPUT_BUFFER];
-static int response_len = 0;
 
-// The event handler, which collects and saves 1KB chunks of response data for each HTTPS request
+// The event handler, which collects up to 1KB of response data in the buffer of the request
 static esp_err_t http_event_handler(esp_http_client_event_handle_t evt)
 {
+    https_response_t *response = evt -> user_data;
+
     if (evt -> event_id == HTTP_EVENT_ON_DATA && evt -> data_len > 0) {
         size_t copy_len = evt->data_len;
 
-        if (response_len + copy_len >= MAX_HTTP_OUTPUT_BUFFER) {
-            copy_len = MAX_HTTP_OUTPUT_BUFFER - response_len - 1;
+        if (response->len + copy_len >= MAX_HTTP_OUTPUT_BUFFER) {
+            copy_len = MAX_HTTP_OUTPUT_BUFFER - response->len - 1;
             ESP_LOGW(TAG, "Response buffer full, truncating");
         }
 
-        memcpy(response_buffer + response_len, evt -> data, copy_len);
-        response_len += copy_len;
+        memcpy(response->data + response->len, evt -> data, copy_len);
+        response->len += copy_len;
     }
 
     return ESP_OK;
 }
 
-// Formats the response buffer as pretty JSON and prints it to console
-void print_response_buffer() {
+// Formats the response as pretty JSON and prints it to console
+static void print_response_buffer(const https_response_t *response) {
     printf("\n---------- Response content: -------------\n\n");
 
-    cJSON *root = cJSON_Parse(response_buffer);
+    cJSON *root = cJSON_Parse(response->data);
 
     if (root == NULL) {
-        printf("%s", response_buffer); // fallback
+        printf("%s", response->data); // fallback
     } else {
         char *pretty = cJSON_Print(root);
 
@@ -80,19 +79,21 @@ void print_response_buffer() {
  * @param url The full URL to send the request to
  * @param method The HTTP method to use (GET, POST, PUT, etc.)
  * @param payload The request body payload (for POST/PUT requests), or NULL if none
+ * @param response Filled with the body of the response, as a null-terminated string
  * @return ESP_OK on success, error code otherwise
  */
-esp_err_t perform_https_request(const char *url, esp_http_client_method_t method, const char *payload)
+esp_err_t perform_https_request(const char *url, esp_http_client_method_t method, const char *payload, https_response_t *response)
 {
     // Reset the response buffer
-    response_len = 0;
-    memset(response_buffer, 0, sizeof(response_buffer));
+    response->len = 0;
+    memset(response->data, 0, sizeof(response->data));
 
     // Configures the HTTPS client
     esp_http_client_config_t config = {
         .url = url,
         .method = method,
         .event_handler = http_event_handler,
+        .user_data = response,
         .timeout_ms = 5000,
         .crt_bundle_attach = esp_crt_bundle_attach,
     };
@@ -110,10 +111,10 @@ esp_err_t perform_https_request(const char *url, esp_http_client_method_t method
     esp_err_t err = esp_http_client_perform(client);
 
     // Truncate response buffer to a null-terminated string
-    if (response_len < sizeof(response_buffer)) {
-        response_buffer[response_len] = '\0';
+    if (response->len < sizeof(response->data)) {
+        response->data[response->len] = '\0';
     } else {
-        response_buffer[sizeof(response_buffer) - 1] = '\0';
+        response->data[sizeof(response->data) - 1] = '\0';
     }
 
     // Response handling
@@ -142,14 +143,24 @@ esp_err_t perform_https_request(const char *url, esp_http_client_method_t method
 esp_err_t https_init(void)
 {
     ESP_LOGI(TAG, "called https_init(), performing test GET request...");
-    return https_get_status();
+
+    https_response_t *response = malloc(sizeof(https_response_t));
+    if (response == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_err_t err = https_get_status(response);
+    free(response);
+
+    return err;
 }
 
 /**
  * @brief Performs a GET request to /status
+ * @param response Filled with the body of the response
  * @return ESP_OK on success, error code otherwise
  */
-esp_err_t https_get_status(void)
+esp_err_t https_get_status(https_response_t *response)
 {
     ESP_LOGI(TAG, "performing GET request to /status...");
 
@@ -160,10 +171,11 @@ esp_err_t https_get_status(void)
     esp_err_t err = perform_https_request(
         url,
         HTTP_METHOD_GET,
-        NULL
+        NULL,
+        response
     );
     
-    print_response_buffer();
+    print_response_buffer(response);
 
     return err;
 }
@@ -171,9 +183,10 @@ esp_err_t https_get_status(void)
 /**
  * @brief Performs a PUT request to /status with a JSON payload
  * @param json_payload JSON formatted string to send in the request body
+ * @param response Filled with the body of the response
  * @return ESP_OK on success, error code otherwise
  */
-esp_err_t https_put_status(const char *json_payload) {
+esp_err_t https_put_status(const char *json_payload, https_response_t *response) {
     ESP_LOGI(TAG, "performing PUT request to /status with payload: \n%s", json_payload);
 
     // Defining the URL for the request
@@ -183,20 +196,23 @@ esp_err_t https_put_status(const char *json_payload) {
     esp_err_t err = perform_https_request(
         url,
         HTTP_METHOD_PUT,
-        json_payload
+        json_payload,
+        response
     );
     
-    print_response_buffer();
+    print_response_buffer(response);
 
     return err;
 }
 
 /**
- * @brief Performs a POST to /entry with a JSON payload. On success this returns the entryId
+ * @brief Performs a POST to /entry with a JSON payload and reads the decision of the backend
  * @param json_payload JSON formatted string to send in the request body
- * @return True if the entry was allowed, false otherwise
+ * @param response Filled with the body of the response
+ * @param allowed Set to true if the entry was allowed
+ * @return ESP_OK if the backend answered, ESP_ERR_INVALID_RESPONSE if the answer has no decision, error code otherwise
  */
-bool https_post_entry(const char *json_payload) {
+esp_err_t https_post_entry(const char *json_payload, https_response_t *response, bool *allowed) {
     ESP_LOGI(TAG, "performing POST request to /entry with payload: \n%s", json_payload);
 
     // Defining the URL for the request
@@ -206,41 +222,48 @@ bool https_post_entry(const char *json_payload) {
     esp_err_t err = perform_https_request(
         url,
         HTTP_METHOD_POST,
-        json_payload
+        json_payload,
+        response
     );
     
-    print_response_buffer();
+    print_response_buffer(response);
 
-    bool is_allowed = false;
+    *allowed = false;
 
-    // Response handling
-    if (err == ESP_OK) {
-        cJSON *root = cJSON_Parse(response_buffer);
+    if (err != ESP_OK) {
+        return err;
+    }
 
-        if (root == NULL) {
-            ESP_LOGE(TAG, "Failed to parse JSON response");
-            return false;
-        }
+    // Response handling
+    cJSON *root = cJSON_Parse(response->data);
 
-        // Look for the "allowed" boolean field
-        cJSON *allowed = cJSON_GetObjectItem(root, "allowed");
+    if (root == NULL) {
+        ESP_LOGE(TAG, "Failed to parse JSON response");
+        return ESP_ERR_INVALID_RESPONSE;
+    }
 
-        if (cJSON_IsBool(allowed)) {
-            is_allowed = cJSON_IsTrue(allowed);
-        }
+    // Look for the "allowed" boolean field
+    cJSON *decision = cJSON_GetObjectItem(root, "allowed");
 
-        cJSON_Delete(root); // Always free the memory!
+    if (cJSON_IsBool(decision)) {
+        *allowed = cJSON_IsTrue(decision);
+    } else {
+        ESP_LOGE(TAG, "No entry decision in the response");
+        err = ESP_ERR_INVALID_RESPONSE;
     }
+
+    cJSON_Delete(root); // Always free the memory!
     
-    return is_allowed;
+    return err;
 }
 
 /**
  * @brief Performs a POST to /exit with a JSON payload
  * @param json_payload JSON formatted string to send in the request body
+ * @param response Filled with the body of the response
  * @return ESP_OK on success, error code otherwise
  */
-esp_err_t https_post_exit(const char *json_payload) {
+esp_err_t https_post_exit(const char *json_payload, https_response_t *response) {
     ESP_LOGI(TAG, "performing POST request to /exit with payload: \n%s", json_payload);
 
     // Defining the URL for the request
@@ -250,10 +273,11 @@ esp_err_t https_post_exit(const char *json_payload) {
     esp_err_t err = perform_https_request(
         url,
         HTTP_METHOD_POST,
-        json_payload
+        json_payload,
+        response
     );
     
-    print_response_buffer();
+    print_response_buffer(response);
 
     return err;
 }
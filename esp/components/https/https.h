@@ -14,23 +14,31 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+#define MAX_HTTP_OUTPUT_BUFFER 1024
+
+// Body of the response to a request, each request has its own
+typedef struct {
+    char data[MAX_HTTP_OUTPUT_BUFFER];
+    size_t len;
+} https_response_t;
+
 // Generic method used to perform a REST API request to a specific URL
-esp_err_t perform_https_request(const char *url, esp_http_client_method_t method, const char *payload);
+esp_err_t perform_https_request(const char *url, esp_http_client_method_t method, const char *payload, https_response_t *response);
 
 // Initializes the HTTPS client (by testing a simple GET request)
 esp_err_t https_init(void);
 
 // Performs a GET request to /status
-esp_err_t https_get_status(void);
+esp_err_t https_get_status(https_response_t *response);
 
 // Performs a PUT request to /status with a JSON payload
-esp_err_t https_put_status(const char *json_payload);
+esp_err_t https_put_status(const char *json_payload, https_response_t *response);
 
-// Performs a POST to /entry with a JSON payload and returns if the entry was allowed or not
-bool https_post_entry(const char *json_payload);
+// Performs a POST to /entry with a JSON payload and reads if the entry was allowed or not
+esp_err_t https_post_entry(const char *json_payload, https_response_t *response, bool *allowed);
 
 // Performs a POST to /exit with a JSON payload
-esp_err_t https_post_exit(const char *json_payload);
+esp_err_t https_post_exit(const char *json_payload, https_response_t *response);
 
 // Sends an image to the external API for plate recognition and returns the plate string
 char* plate_recognition_api(const uint8_t *image_data, size_t image_len);
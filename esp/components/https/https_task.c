@@ -2,148 +2,411 @@
  * @file https_task.c
  * 
  * Helpers and wrapper to send https calls
- * to the API
+ * to the API. All the requests are served one
+ * at a time by a single network worker, from
+ * one queue per type of request: an entry
+ * decision is always sent before the exits
+ * and the status waiting, so a burst of
+ * telemetry does not hold up the gate
  */
 
 #include "https_task.h"
 #include "https.h"
+#include "../trace/trace.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
 #include "esp_err.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "cJSON.h"
+#include <string.h>
+#include <inttypes.h>
 
-// Status variables
-static esp_err_t wifi_status;
-static esp_err_t camera_status;
-static esp_err_t ultrasonic_status;
-static esp_err_t weight_status;
-static esp_err_t servo_status;
-static esp_err_t oled_status;
+// Builder of the status, registered by the system initialization
+static status_provider_t status_provider = NULL;
 
 // Entry/exit request variables
 static char * license_plate;
-static char * image_url;
 static float recorded_weight;
-static bool entryAllowed;
+
+// Decisions of the entry requests, the ones of the requests
+// given up on are dropped by the next wait
+#define ENTRY_DECISIONS 4
+
+// Requests waiting for the worker, for each type. The status is
+// built when it is sent, so one waiting stands for any newer one
+#define ENTRY_REQUESTS 4
+#define EXIT_REQUESTS 4
+#define STATUS_REQUESTS 1
+
+#define WORKER_STACK_SIZE 8192
+
+typedef struct https_job https_job_t;
+
+// Called by the worker once the request is answered or failed
+typedef void (*https_done_t)(const https_job_t *job, esp_err_t err);
+
+// A request for the worker, owned by the worker once queued
+struct https_job {
+    https_request_type_t type;
+    uint32_t id;
+    char *payload;              // JSON body, NULL for the status which is built when sent
+    int64_t start_us;
+    int64_t deadline_us;        // entry requests: the decision is not waited for anymore after it
+    https_done_t done;
+    bool allowed;               // decision of an entry request
+    https_response_t response;
+};
+
+static const UBaseType_t queue_lengths[HTTPS_REQUEST_TYPES] = {
+    [HTTPS_REQUEST_ENTRY] = ENTRY_REQUESTS,
+    [HTTPS_REQUEST_EXIT] = EXIT_REQUESTS,
+    [HTTPS_REQUEST_STATUS] = STATUS_REQUESTS,
+};
+
+static QueueHandle_t requests[HTTPS_REQUEST_TYPES];
+static TaskHandle_t worker = NULL;
+
+static QueueHandle_t entry_decisions = NULL;
+static uint32_t last_entry_id = 0;
 
 const char *TAG = "HTTPS Task module";
 
+static esp_err_t submit_job(https_job_t *job);
+
 ////////////////////////////////////////////////////////////////////
 ///////////////////// Status tasks /////////////////////////////////
 ////////////////////////////////////////////////////////////////////
 
-void put_status_task(void *arg) {
-    ESP_LOGI(TAG, "Sending status to backend...");
-    send_system_status_to_api(camera_status, ultrasonic_status, weight_status, servo_status, wifi_status, oled_status);
-    vTaskDelete(NULL);
+void set_status_provider(status_provider_t provider) {
+    status_provider = provider;
 }
 
-void set_status_variables(esp_err_t camera, esp_err_t ultrasonic, esp_err_t weight, esp_err_t servo, esp_err_t wifi, esp_err_t oled) {
-    camera_status = camera;
-    ultrasonic_status = ultrasonic;
-    weight_status = weight;
-    servo_status = servo;
-    wifi_status = wifi;
-    oled_status = oled;
-}
+// Builds the status of the system, to be freed by the caller
+static char *build_system_status(void) {
+    cJSON *board_status = status_provider();
+
+    if (board_status == NULL) {
+        return NULL;
+    }
 
-void send_system_status_to_api() {
-    cJSON *board_status = cJSON_CreateArray();
-    
-    cJSON *item = cJSON_CreateObject();
-    cJSON_AddStringToObject(item, "name", "ESP main module");
-    cJSON_AddStringToObject(item, "status", camera_status == ESP_OK ? "Active" : "Problem");
-    cJSON_AddStringToObject(item, "espStatus", esp_err_to_name(camera_status));
-    cJSON_AddItemToArray(board_status, item);
-    
-    item = cJSON_CreateObject();
-    cJSON_AddStringToObject(item, "name", "Ultrasonic sensor");
-    cJSON_AddStringToObject(item, "status", ultrasonic_status == ESP_OK ? "Active" : "Problem");
-    cJSON_AddStringToObject(item, "espStatus", esp_err_to_name(ultrasonic_status));
-    cJSON_AddItemToArray(board_status, item);
-    
-    item = cJSON_CreateObject();
-    cJSON_AddStringToObject(item, "name", "Weight sensor");
-    cJSON_AddStringToObject(item, "status", weight_status == ESP_OK ? "Active" : "Problem");
-    cJSON_AddStringToObject(item, "espStatus", esp_err_to_name(weight_status));
-    cJSON_AddItemToArray(board_status, item);
-    
-    item = cJSON_CreateObject();
-    cJSON_AddStringToObject(item, "name", "Motor sensor");
-    cJSON_AddStringToObject(item, "status", servo_status == ESP_OK ? "Active" : "Problem");
-    cJSON_AddStringToObject(item, "espStatus", esp_err_to_name(servo_status));
-    cJSON_AddItemToArray(board_status, item);
-    
-    item = cJSON_CreateObject();
-    cJSON_AddStringToObject(item, "name", "Wifi sensor");
-    cJSON_AddStringToObject(item, "status", wifi_status == ESP_OK ? "Active" : "Problem");
-    cJSON_AddStringToObject(item, "espStatus", esp_err_to_name(wifi_status));
-    cJSON_AddItemToArray(board_status, item);
-
-    item = cJSON_CreateObject();
-    cJSON_AddStringToObject(item, "name", "OLED Display");
-    cJSON_AddStringToObject(item, "status", wifi_status == ESP_OK ? "Active" : "Problem");
-    cJSON_AddStringToObject(item, "espStatus", esp_err_to_name(oled_status));
-    cJSON_AddItemToArray(board_status, item);
-    
     char *status_json = cJSON_Print(board_status);
-    https_put_status(status_json);
 
     cJSON_Delete(board_status);
-    free(status_json);
+
+    return status_json;
+}
+
+/**
+ * Queues a PUT of the status to /status, built when it is
+ * sent so that it carries the latest counters. If a status
+ * is already waiting, it stands for this one
+ * @return ESP_OK if the status will be sent
+ */
+esp_err_t status_request_post(void) {
+    https_job_t *job = calloc(1, sizeof(https_job_t));
+    if (job == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    job->type = HTTPS_REQUEST_STATUS;
+
+    esp_err_t err = submit_job(job);
+
+    if (err == ESP_ERR_NO_MEM) {
+        ESP_LOGI(TAG, "Status already waiting to be sent");
+        free(job);
+        return ESP_OK;
+    }
+
+    if (err != ESP_OK) {
+        free(job);
+    }
+
+    return err;
 }
 
 ////////////////////////////////////////////////////////////////////
 /////////////////// Entry/Exit tasks ///////////////////////////////
 ////////////////////////////////////////////////////////////////////
 
-void post_entry_task(void *arg) {
-    ESP_LOGI(TAG, "Sending entry request to backend...");
-    send_entry_to_api();
-    vTaskDelete(NULL);
-}
-
-void send_entry_to_api(void) {
+// Builds the body of an entry request, to be freed by the caller
+static char *build_entry(const char *plate, const char *image_url) {
     cJSON *entry_payload = cJSON_CreateObject();
-    cJSON_AddStringToObject(entry_payload, "licensePlate", license_plate);
+    cJSON_AddStringToObject(entry_payload, "licensePlate", plate);
     cJSON_AddStringToObject(entry_payload, "imageUrl", image_url);
     cJSON_AddNumberToObject(entry_payload, "recordedWeight", recorded_weight);
     
     char *entry_json = cJSON_Print(entry_payload);
-    entryAllowed = https_post_entry(entry_json);
     
     cJSON_Delete(entry_payload);
-    free(entry_json);
+
+    return entry_json;
 }
 
-void post_exit_task(void *arg) {
-    ESP_LOGI(TAG, "Sending exit request to backend...");
-    send_exit_to_api();
-    vTaskDelete(NULL);
+// Hands the decision over to the task waiting for it
+static void entry_done(const https_job_t *job, esp_err_t err) {
+    entry_decision_t decision = {
+        .id = job->id,
+        .err = err,
+        .latency_ms = (uint32_t)((esp_timer_get_time() - job->start_us) / 1000),
+    };
+
+    if (err != ESP_OK) {
+        decision.outcome = ENTRY_DECISION_FAILED;
+    } else {
+        decision.outcome = job->allowed ? ENTRY_DECISION_ALLOWED : ENTRY_DECISION_REFUSED;
+    }
+
+    trace_record(TRACE_ENTRY_DONE, TRACE_NO_LANE, job->allowed);
+
+    // Never blocks: if nobody waits anymore the queue may be full of old decisions
+    if (xQueueSend(entry_decisions, &decision, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "Decision of entry request %" PRIu32 " dropped", job->id);
+    }
 }
 
-void send_exit_to_api(void) {
+/**
+ * Queues a POST to /entry ahead of any other request, the
+ * decision is then waited for with entry_request_wait().
+ * Only called by the recognition task
+ * @param plate The recognized plate
+ * @param image_url The link to the image of the plate
+ * @param timeout_ms Time given to the backend to decide
+ * @param request Filled with the request to wait for
+ * @return ESP_OK if the request was queued
+ */
+esp_err_t entry_request_post(const char *plate, const char *image_url, uint32_t timeout_ms, entry_request_t *request) {
+    https_job_t *job = calloc(1, sizeof(https_job_t));
+    if (job == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    job->type = HTTPS_REQUEST_ENTRY;
+    job->id = ++last_entry_id;
+    job->payload = build_entry(plate, image_url);
+    job->start_us = esp_timer_get_time();
+    job->deadline_us = job->start_us + (int64_t) timeout_ms * 1000;
+    job->done = entry_done;
+
+    esp_err_t err = job->payload != NULL ? submit_job(job) : ESP_ERR_NO_MEM;
+
+    if (err != ESP_OK) {
+        free(job->payload);
+        free(job);
+        return err;
+    }
+
+    request->id = job->id;
+    request->start_us = job->start_us;
+    request->deadline_us = job->deadline_us;
+    return ESP_OK;
+}
+
+/**
+ * Blocks until the decision on the request arrives,
+ * or until its deadline
+ * @param request The request started by entry_request_post()
+ * @param decision Filled with the decision, ENTRY_DECISION_TIMEOUT if it did not arrive in time
+ */
+void entry_request_wait(const entry_request_t *request, entry_decision_t *decision) {
+    while (1) {
+        int64_t left_us = request->deadline_us - esp_timer_get_time();
+        TickType_t left = left_us > 0 ? pdMS_TO_TICKS(left_us / 1000) : 0;
+
+        if (xQueueReceive(entry_decisions, decision, left) != pdTRUE) {
+            ESP_LOGW(TAG, "No decision on entry request %" PRIu32 " before the deadline", request->id);
+
+            *decision = (entry_decision_t){
+                .id = request->id,
+                .outcome = ENTRY_DECISION_TIMEOUT,
+                .err = ESP_ERR_TIMEOUT,
+                .latency_ms = (uint32_t)((esp_timer_get_time() - request->start_us) / 1000),
+            };
+            return;
+        }
+
+        if (decision->id == request->id) {
+            return;
+        }
+
+        // Late answer to a request already given up on
+        ESP_LOGW(TAG, "Late decision on entry request %" PRIu32 " dropped", decision->id);
+    }
+}
+
+const char *entry_outcome_name(entry_outcome_t outcome) {
+    switch (outcome) {
+        case ENTRY_DECISION_ALLOWED: return "allowed";
+        case ENTRY_DECISION_REFUSED: return "refused";
+        case ENTRY_DECISION_FAILED:  return "failed";
+        case ENTRY_DECISION_TIMEOUT: return "timeout";
+        default:            return "unknown";
+    }
+}
+
+/**
+ * Queues a POST to /exit with the plate set by
+ * set_license_plate_data(), sent after the entries
+ * @return ESP_OK if the request was queued
+ */
+esp_err_t exit_request_post(void) {
+    https_job_t *job = calloc(1, sizeof(https_job_t));
+    if (job == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
     cJSON *exit_payload = cJSON_CreateObject();
     cJSON_AddStringToObject(exit_payload, "licensePlate", license_plate);
     
-    char *exit_json = cJSON_Print(exit_payload);
-    https_post_exit(exit_json);
+    job->type = HTTPS_REQUEST_EXIT;
+    job->payload = cJSON_Print(exit_payload);
+    job->start_us = esp_timer_get_time();
     
     cJSON_Delete(exit_payload);
-    free(exit_json);
+
+    esp_err_t err = job->payload != NULL ? submit_job(job) : ESP_ERR_NO_MEM;
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Exit request not sent: %s", esp_err_to_name(err));
+        free(job->payload);
+        free(job);
+    }
+
+    return err;
 }
 
 void set_license_plate_data(char *plate) {
     license_plate = plate;
 }
 
-void set_image_url_data(char *url) {
-    image_url = url;
-}
-
 void set_weight_data(float *weight) {
     recorded_weight = *weight;
 }
 
-bool get_entry_allowed(void) {
-    return entryAllowed;
+
+////////////////////////////////////////////////////////////////////
+/////////////////////// Network worker /////////////////////////////
+////////////////////////////////////////////////////////////////////
+
+/**
+ * Queues a request for the worker, which owns it from then on
+ * @param job The request, allocated on the heap
+ * @return ESP_OK if it was queued, ESP_ERR_NO_MEM if the queue of its type is full
+ */
+static esp_err_t submit_job(https_job_t *job) {
+    if (worker == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (xQueueSend(requests[job->type], &job, 0) != pdTRUE) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    // One notification for each request queued
+    xTaskNotifyGive(worker);
+    return ESP_OK;
+}
+
+// Takes the waiting request of the highest priority, or NULL
+static https_job_t *next_job(void) {
+    https_job_t *job;
+
+    for (int type = 0; type < HTTPS_REQUEST_TYPES; type++) {
+        if (xQueueReceive(requests[type], &job, 0) == pdTRUE) {
+            return job;
+        }
+    }
+
+    return NULL;
+}
+
+static void run_job(https_job_t *job) {
+    esp_err_t err = ESP_ERR_NO_MEM;
+    uint32_t wait_ms = (uint32_t)((esp_timer_get_time() - job->start_us) / 1000);
+
+    switch (job->type) {
+        case HTTPS_REQUEST_ENTRY:
+            // The vehicle was already refused, the backend must not record it
+            if (esp_timer_get_time() > job->deadline_us) {
+                ESP_LOGW(TAG, "Entry request %" PRIu32 " given up on after %" PRIu32 " ms in the queue", job->id, wait_ms);
+                err = ESP_ERR_TIMEOUT;
+                break;
+            }
+
+            ESP_LOGI(TAG, "Sending entry request %" PRIu32 " to backend (queued %" PRIu32 " ms)...", job->id, wait_ms);
+            err = https_post_entry(job->payload, &job->response, &job->allowed);
+            break;
+
+        case HTTPS_REQUEST_EXIT:
+            ESP_LOGI(TAG, "Sending exit request to backend (queued %" PRIu32 " ms)...", wait_ms);
+            err = https_post_exit(job->payload, &job->response);
+            break;
+
+        case HTTPS_REQUEST_STATUS:
+            if (status_provider == NULL) {
+                err = ESP_ERR_INVALID_STATE;
+                break;
+            }
+
+            ESP_LOGI(TAG, "Sending status to backend...");
+            job->payload = build_system_status();
+            if (job->payload != NULL) {
+                err = https_put_status(job->payload, &job->response);
+            }
+            break;
+
+        default:
+            err = ESP_ERR_INVALID_ARG;
+            break;
+    }
+
+    if (job->done != NULL) {
+        job->done(job, err);
+    } else if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Request to backend failed: %s", esp_err_to_name(err));
+    }
+}
+
+static void https_worker_task(void *arg) {
+    while (1) {
+        ulTaskNotifyTake(pdFALSE, portMAX_DELAY);
+
+        https_job_t *job = next_job();
+        if (job == NULL) {
+            continue;
+        }
+
+        run_job(job);
+
+        free(job->payload);
+        free(job);
+    }
+}
+
+/**
+ * Creates the queues and the worker serving the requests to
+ * the backend, before any request is made
+ * @return ESP_OK on success, ESP_ERR_NO_MEM otherwise
+ */
+esp_err_t https_worker_init(void) {
+    entry_decisions = xQueueCreate(ENTRY_DECISIONS, sizeof(entry_decision_t));
+    if (entry_decisions == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (int type = 0; type < HTTPS_REQUEST_TYPES; type++) {
+        requests[type] = xQueueCreate(queue_lengths[type], sizeof(https_job_t *));
+        if (requests[type] == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    if (xTaskCreate(https_worker_task, "https_worker_task", WORKER_STACK_SIZE, NULL, 5, &worker) != pdPASS) {
+        worker = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+
+    return ESP_OK;
 }
@@ -9,28 +9,62 @@
 #define HTTPS_TASK_H
 
 #include "esp_err.h"
+#include "cJSON.h"
 #include <stdbool.h>
+#include <stdint.h>
 
-void put_status_task(void *arg);
+// Outcome of an entry request
+typedef enum {
+    ENTRY_DECISION_ALLOWED,
+    ENTRY_DECISION_REFUSED,     // the backend answered that the vehicle cannot enter
+    ENTRY_DECISION_FAILED,      // the request failed, or its answer has no decision
+    ENTRY_DECISION_TIMEOUT,     // no answer before the deadline
+} entry_outcome_t;
 
-void set_status_variables(esp_err_t camera_status, esp_err_t ultrasonic_status, esp_err_t weight_status, esp_err_t servo_status, esp_err_t wifi_status, esp_err_t oled_status);
+// Entry request in flight, only read by the task waiting for it
+typedef struct {
+    uint32_t id;
+    int64_t start_us;
+    int64_t deadline_us;
+} entry_request_t;
 
-void send_system_status_to_api();
+// Decision on an entry request, handed over by copy
+typedef struct {
+    uint32_t id;
+    entry_outcome_t outcome;
+    esp_err_t err;              // error of the request when it failed
+    uint32_t latency_ms;
+} entry_decision_t;
 
-void post_entry_task(void *arg);
+// Requests served by the network worker, in order of priority
+typedef enum {
+    HTTPS_REQUEST_ENTRY,        // a vehicle waits at the gate for the decision
+    HTTPS_REQUEST_EXIT,
+    HTTPS_REQUEST_STATUS,       // status and telemetry
+    HTTPS_REQUEST_TYPES,
+} https_request_type_t;
 
-void send_entry_to_api(void);
+esp_err_t https_worker_init(void);
 
-void post_exit_task(void *arg);
+// Builds the status of the system as a cJSON array, freed by the
+// network worker. Called from the worker every time a status is sent
+typedef cJSON *(*status_provider_t)(void);
 
-void send_exit_to_api(void);
+// Registers the builder of the status, no status is sent without it
+void set_status_provider(status_provider_t provider);
 
-void set_license_plate_data(char * plate);
+esp_err_t status_request_post(void);
 
-void set_image_url_data(char * url);
+esp_err_t entry_request_post(const char *plate, const char *image_url, uint32_t timeout_ms, entry_request_t *request);
 
-void set_weight_data(float * weight);
+void entry_request_wait(const entry_request_t *request, entry_decision_t *decision);
+
+const char *entry_outcome_name(entry_outcome_t outcome);
+
+esp_err_t exit_request_post(void);
 
-bool get_entry_allowed(void);
+void set_license_plate_data(char * plate);
+
+void set_weight_data(float * weight);
 
 #endif
\ No newline at end of file
@@ -15,6 +15,8 @@
 #include "../wifi/wifi.h"
 #include "../servo_motor/servo_motor.h"
 #include "../oled/oled.h"
+#include "../trace/trace.h"
+#include "../recorder/recorder.h"
 
 #include "esp_log.h"
 #include "esp_err.h"
@@ -30,6 +32,7 @@
 
 #include "esp_camera.h"
 #include "esp_psram.h"
+#include "../camera_service/camera_service.h"
 #define CAM_PWDN GPIO_NUM_38
 #define CAM_RESET -1   //software reset will be performed
 #define CAM_VSYNC GPIO_NUM_6
@@ -51,9 +54,174 @@
 
 // Servo motor pin definition
 #define SERVO_PWM_GPIO   GPIO_NUM_46
+#define SERVO2_PWM_GPIO  GPIO_NUM_1     // barrier of the second lane
 #define SERVO_ANGLE_DOWN 180
 #define SERVO_ANGLE_UP   90
 
+// Outcome of the initialization of each peripheral, reported with the status
+static esp_err_t wifi_status;
+static esp_err_t camera_status;
+static esp_err_t ultrasonic_status;
+static esp_err_t weight_status;
+static esp_err_t servo_status;
+static esp_err_t oled_status;
+
+#if defined(CONFIG_SPECULATIVE_RECOGNITION) || !defined(CONFIG_USE_MOCK_CAMERA)
+/**
+ * @brief Forwards the weight detection candidates to the
+ * camera, so it is warm by the time the plate is wanted,
+ * and to the plate recognition, so capture and upload can
+ * start before the detection is confirmed
+ */
+static void weight_candidate_changed(uint8_t id, bool candidate)
+{
+#ifndef CONFIG_USE_MOCK_CAMERA
+    if (candidate) {
+        camera_service_wake();
+    }
+#endif
+
+#ifdef CONFIG_SPECULATIVE_RECOGNITION
+    if (candidate) {
+        cv_speculative_begin(id);
+    } else {
+        cv_speculative_cancel(id);
+    }
+#endif
+}
+#endif
+
+#if CONFIG_TRACE_REPORT_PERIOD > 0
+/**
+ * @brief Uploads the status, and with it the
+ * timing histograms, on every trace report
+ */
+static void trace_report(void)
+{
+    status_request_post();
+}
+#endif
+
+/**
+ * @brief Builds the status of the system for the backend:
+ * the outcome of the initialization of each peripheral and
+ * the counters of the sensor components. Registered with
+ * the network worker, which calls it when the status is sent
+ * @return The status items, freed by the caller
+ */
+static cJSON *build_system_status(void)
+{
+    cJSON *board_status = cJSON_CreateArray();
+    
+    cJSON *item = cJSON_CreateObject();
+    cJSON_AddStringToObject(item, "name", "ESP main module");
+    cJSON_AddStringToObject(item, "status", camera_status == ESP_OK ? "Active" : "Problem");
+    cJSON_AddStringToObject(item, "espStatus", esp_err_to_name(camera_status));
+
+#ifndef CONFIG_USE_MOCK_CAMERA
+    // Age of the frames at the capture, and the time the sensor was kept on
+    camera_service_stats_t camera_stats;
+    camera_service_get_stats(&camera_stats);
+
+    cJSON_AddBoolToObject(item, "warm", camera_stats.warm);
+    cJSON_AddNumberToObject(item, "wakeups", camera_stats.wakeups);
+    cJSON_AddNumberToObject(item, "warmSeconds", camera_stats.warm_ms / 1000);
+    cJSON_AddNumberToObject(item, "frames", camera_stats.frames);
+    cJSON_AddNumberToObject(item, "framesWaited", camera_stats.waits);
+    cJSON_AddNumberToObject(item, "captureTimeouts", camera_stats.timeouts);
+    cJSON_AddNumberToObject(item, "avgFrameAgeMs", camera_stats.frames ? camera_stats.age_ms_sum / camera_stats.frames : 0);
+    cJSON_AddNumberToObject(item, "maxFrameAgeMs", camera_stats.age_ms_max);
+#endif
+    cJSON_AddItemToArray(board_status, item);
+    
+    item = cJSON_CreateObject();
+    cJSON_AddStringToObject(item, "name", "Ultrasonic sensor");
+    cJSON_AddStringToObject(item, "status", ultrasonic_status == ESP_OK ? "Active" : "Problem");
+    cJSON_AddStringToObject(item, "espStatus", esp_err_to_name(ultrasonic_status));
+    cJSON_AddItemToArray(board_status, item);
+    
+    item = cJSON_CreateObject();
+    cJSON_AddStringToObject(item, "name", "Weight sensor");
+    cJSON_AddStringToObject(item, "status", weight_status == ESP_OK ? "Active" : "Problem");
+    cJSON_AddStringToObject(item, "espStatus", esp_err_to_name(weight_status));
+    cJSON_AddStringToObject(item, "samplingRate", weight_sampling_rate(0));
+    cJSON_AddNumberToObject(item, "samplesPerHour", weight_samples_per_hour(0));
+    cJSON_AddItemToArray(board_status, item);
+    
+    item = cJSON_CreateObject();
+    cJSON_AddStringToObject(item, "name", "Motor sensor");
+    cJSON_AddStringToObject(item, "status", servo_status == ESP_OK ? "Active" : "Problem");
+    cJSON_AddStringToObject(item, "espStatus", esp_err_to_name(servo_status));
+    cJSON_AddItemToArray(board_status, item);
+    
+    item = cJSON_CreateObject();
+    cJSON_AddStringToObject(item, "name", "Wifi sensor");
+    cJSON_AddStringToObject(item, "status", wifi_status == ESP_OK ? "Active" : "Problem");
+    cJSON_AddStringToObject(item, "espStatus", esp_err_to_name(wifi_status));
+    cJSON_AddItemToArray(board_status, item);
+
+    item = cJSON_CreateObject();
+    cJSON_AddStringToObject(item, "name", "OLED Display");
+    cJSON_AddStringToObject(item, "status", wifi_status == ESP_OK ? "Active" : "Problem");
+    cJSON_AddStringToObject(item, "espStatus", esp_err_to_name(oled_status));
+    cJSON_AddItemToArray(board_status, item);
+
+    // Connection to the plate recognition API: handshakes apart from the requests
+    cv_connection_stats_t cv_stats;
+    cv_get_connection_stats(&cv_stats);
+
+    item = cJSON_CreateObject();
+    cJSON_AddStringToObject(item, "name", "Plate recognition API");
+    cJSON_AddStringToObject(item, "status", "Active");
+    cJSON_AddStringToObject(item, "backend", cv_backend_get()->name);
+    cJSON_AddNumberToObject(item, "requests", cv_stats.requests);
+    cJSON_AddNumberToObject(item, "handshakes", cv_stats.handshakes);
+    cJSON_AddNumberToObject(item, "avgRequestMs", cv_stats.requests ? cv_stats.request_ms_sum / cv_stats.requests : 0);
+    cJSON_AddNumberToObject(item, "avgHandshakeMs", cv_stats.handshakes ? cv_stats.handshake_ms_sum / cv_stats.handshakes : 0);
+    cJSON_AddNumberToObject(item, "keepAliveProbes", cv_stats.probes);
+    cJSON_AddNumberToObject(item, "keepAliveRefused", cv_stats.probes_refused);
+    cJSON_AddNumberToObject(item, "avgProbeMs", cv_stats.probes ? cv_stats.probe_ms_sum / cv_stats.probes : 0);
+
+    // Plates resolved by the recognition cache, without a request
+    plate_cache_stats_t cache_stats;
+    cv_get_cache_stats(&cache_stats);
+
+    cJSON_AddNumberToObject(item, "cacheLookups", cache_stats.lookups);
+    cJSON_AddNumberToObject(item, "cacheHits", cache_stats.hits);
+    cJSON_AddNumberToObject(item, "cacheExpired", cache_stats.expired);
+
+    // Capture settings picked for the uplink, see upload_tuner.h
+    upload_tuner_stats_t upload_stats;
+    cv_get_upload_stats(&upload_stats);
+
+    cJSON_AddNumberToObject(item, "uploadLevel", upload_stats.level);
+    cJSON_AddNumberToObject(item, "uploadLatencyMs", upload_stats.latency_ms);
+    cJSON_AddNumberToObject(item, "uplinkBytesPerSecond", upload_stats.bytes_per_s);
+    cJSON_AddNumberToObject(item, "uploadLighter", upload_stats.lighter);
+    cJSON_AddNumberToObject(item, "uploadRicher", upload_stats.richer);
+    cJSON_AddNumberToObject(item, "uploadLevelsHeld", upload_stats.held);
+
+    // Plates recaptured with another exposure after a failed read
+    cv_recapture_stats_t recapture_stats;
+    cv_get_recapture_stats(&recapture_stats);
+
+    cJSON_AddNumberToObject(item, "recaptured", recapture_stats.recognitions);
+    cJSON_AddNumberToObject(item, "recaptureAttempts", recapture_stats.attempts);
+    cJSON_AddNumberToObject(item, "recaptureRead", recapture_stats.read);
+    cJSON_AddNumberToObject(item, "avgRecaptureMs",
+        recapture_stats.recognitions ? recapture_stats.time_ms_sum / recapture_stats.recognitions : 0);
+    cJSON_AddItemToArray(board_status, item);
+
+    // Timing histograms of the gate, see trace.h
+    item = cJSON_CreateObject();
+    cJSON_AddStringToObject(item, "name", "Gate timing");
+    cJSON_AddStringToObject(item, "status", "Active");
+    trace_add_to_json(item);
+    cJSON_AddItemToArray(board_status, item);
+    
+    return board_status;
+}
+
 /**
  * @brief Initializes the overall system components
  * and creates necessary tasks: also sends the various
@@ -62,28 +230,57 @@
 void system_init()
 {
     // Initialize WiFi first (for NVS)
-    esp_err_t wifi_status = wifi_init();
+    wifi_status = wifi_init();
+
+    // Before any request to the backend
+    if (https_worker_init() != ESP_OK) {
+        ESP_LOGE("HTTPS_INIT", "Network worker not started, no request will reach the backend");
+    }
 
-    esp_err_t camera_status = ESP_OK;
+    camera_status = ESP_OK;
 
     #ifndef CONFIG_USE_MOCK_CAMERA
     camera_status = camera_init();
+
+    if (camera_status == ESP_OK) {
+        camera_status = camera_service_init(CAM_PWDN);
+    }
     #endif
 
-    esp_err_t ultrasonic_status = ultrasonic_sensor_init();
-    esp_err_t weight_status = weight_sensor_init();
-    esp_err_t servo_status = servo_init();
-    esp_err_t oled_status = oled_init(I2C_NUM_1);
+#ifdef CONFIG_SENSOR_RECORDER
+    // Before the sensors, so that their first samples are recorded
+    if (recorder_init() == ESP_OK) {
+        xTaskCreate(recorder_task, "recorder_task", 4096, NULL, tskIDLE_PRIORITY + 1, NULL);
+    }
+#endif
+
+    ultrasonic_status = ultrasonic_sensor_init();
+    weight_status = weight_sensor_init();
+    servo_status = servo_init();
+    oled_status = oled_init(I2C_NUM_1);
     
-    set_status_variables(camera_status, ultrasonic_status, weight_status, servo_status, wifi_status, oled_status);
+    set_status_provider(build_system_status);
 
-    xTaskCreate(put_status_task, "put_status_task", 8192, NULL, 5, NULL);
+    status_request_post();
 
     vTaskDelay(pdMS_TO_TICKS(5000));
 
-    xTaskCreatePinnedToCore(weight_task, "weight_task", 8192, NULL, tskIDLE_PRIORITY + 1, NULL, 1);
+    // One weight task for each scale, the sensor id is passed as argument
+    for (uintptr_t id = 0; id < WEIGHT_SENSOR_NUM; id++) {
+        xTaskCreatePinnedToCore(weight_task, "weight_task", 8192, (void *) id, tskIDLE_PRIORITY + 1, NULL, 1);
+    }
 
     cv_task_creator();
+
+    xTaskCreate(trace_task, "trace_task", 4096, NULL, tskIDLE_PRIORITY + 1, NULL);
+
+#if CONFIG_TRACE_REPORT_PERIOD > 0
+    trace_set_report_callback(trace_report);
+#endif
+
+#if defined(CONFIG_SPECULATIVE_RECOGNITION) || !defined(CONFIG_USE_MOCK_CAMERA)
+    weight_set_candidate_callback(weight_candidate_changed);
+#endif
 }
 
 
@@ -117,10 +314,17 @@ esp_err_t camera_init()
         .ledc_channel = LEDC_CHANNEL_0,
 
         .pixel_format = PIXFORMAT_JPEG,
+#ifdef CONFIG_PLATE_CROP
+        // Only a crop around the plate is uploaded, more pixels cost little
+        .frame_size   = FRAMESIZE_VGA,
+#else
         .frame_size   = FRAMESIZE_QVGA,
+#endif
         .jpeg_quality = 12,
-        .fb_count = 2,
-        .fb_location = CAMERA_FB_IN_PSRAM
+        // The camera service holds the newest frames, see camera_service.h
+        .fb_count = CAMERA_SERVICE_FB_COUNT,
+        .fb_location = CAMERA_FB_IN_PSRAM,
+        .grab_mode = CAMERA_GRAB_LATEST
     };
 
     esp_err_t err = esp_camera_init(&config);
@@ -154,11 +358,23 @@ esp_err_t weight_sensor_init()
 
 esp_err_t servo_init(void)
 {
-    return servo_motor_init(&(servo_motor_params_t){
-        .gpio_pwm = SERVO_PWM_GPIO,
-        .angle_up_deg = SERVO_ANGLE_UP,
-        .angle_down_deg = SERVO_ANGLE_DOWN,
-    });
+    // One barrier for each lane, the servo id is the lane id
+    const servo_motor_params_t params[] = {
+        {
+            .gpio_pwm = SERVO_PWM_GPIO,
+            .angle_up_deg = SERVO_ANGLE_UP,
+            .angle_down_deg = SERVO_ANGLE_DOWN,
+        },
+        {
+            .gpio_pwm = SERVO2_PWM_GPIO,
+            .angle_up_deg = SERVO_ANGLE_UP,
+            .angle_down_deg = SERVO_ANGLE_DOWN,
+        },
+    };
+
+    _Static_assert(CONFIG_PARKING_LANES <= sizeof(params) / sizeof(params[0]), "missing servo pins");
+
+    return servo_motor_init(params, CONFIG_PARKING_LANES);
 }
 
 /**
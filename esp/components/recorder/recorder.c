@@ -0,0 +1,296 @@
+/**
+ * @file recorder.c
+ *
+ * Sensor recorder: every raw HX711 conversion and every
+ * ultrasonic measure is queued with its timestamp, and the
+ * recorder task encodes them (recorder_format.h) into pages
+ * written one by one to the "recorder" data partition. The
+ * partition is used as a circular log, the oldest page is
+ * erased when it is reused, and the page sequence numbers
+ * tell the decoder which one is the oldest.
+ *
+ * Queueing never blocks the sensor tasks: like the timing
+ * trace, a producer claims a slot with an atomic increment
+ * and publishes it through the sequence number of the slot.
+ * The flash is only touched by the recorder task, once per
+ * full page (a 4 KB erase and write every few minutes at
+ * the full HX711 rate).
+ *
+ */
+
+#include "recorder.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_timer.h"
+
+#include <stdatomic.h>
+#include <string.h>
+
+#define TAG "RECORDER"
+
+// Size of the ring, must be a power of two: a few seconds of
+// samples of every sensor, in case a page write takes long
+#define RECORDER_RING_SIZE 256
+
+// How often the recorder task drains the ring
+#define RECORDER_DRAIN_MS 200
+
+_Static_assert((RECORDER_RING_SIZE & (RECORDER_RING_SIZE - 1)) == 0, "ring size must be a power of two");
+
+typedef struct {
+    // Sequence number of the sample plus one, 0 while it is being written
+    atomic_uint seq;
+    uint8_t source;
+    uint8_t lane;
+    int32_t value;
+    int64_t time_us;
+} recorder_slot_t;
+
+static recorder_slot_t ring[RECORDER_RING_SIZE];
+static atomic_uint ring_head;   // next sequence number to write
+static uint32_t ring_tail;      // next sequence number to read, recorder task only
+
+static const esp_partition_t *partition = NULL;
+static uint32_t pages_num;
+static uint32_t next_page;      // page of the partition written next
+
+// Page being filled, only used by the recorder task
+static recorder_encoder_t encoder;
+static bool page_open = false;
+
+static atomic_bool flush_requested;
+
+static recorder_stats_t stats;
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+
+//////////////////////////////////////////////////////
+///////////////////// Producer ///////////////////////
+//////////////////////////////////////////////////////
+
+/**
+ * Queues a sample. When the recorder task falls behind,
+ * the oldest samples are overwritten and counted as lost
+ * @param source The sensor type
+ * @param lane The sensor id, below RECORDER_LANES
+ * @param value The raw value
+ * @param time_us When the value was measured, esp_timer time
+ */
+void recorder_add(recorder_source_t source, uint8_t lane, int32_t value, int64_t time_us)
+{
+    if (partition == NULL) {
+        return;
+    }
+
+    uint32_t seq = atomic_fetch_add_explicit(&ring_head, 1, memory_order_relaxed);
+    recorder_slot_t *slot = &ring[seq & (RECORDER_RING_SIZE - 1)];
+
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    slot->source = source;
+    slot->lane = lane;
+    slot->value = value;
+    slot->time_us = time_us;
+
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_release);
+}
+
+void recorder_flush(void)
+{
+    atomic_store(&flush_requested, true);
+}
+
+void recorder_get_stats(recorder_stats_t *out)
+{
+    portENTER_CRITICAL(&stats_lock);
+    *out = stats;
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+
+//////////////////////////////////////////////////////
+////////////////////// Flash /////////////////////////
+//////////////////////////////////////////////////////
+
+/**
+ * Finds the recorder partition and the page following
+ * the most recent one, so that a reboot continues the
+ * log instead of overwriting it from the start
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND if there is no partition
+ */
+esp_err_t recorder_init(void)
+{
+    const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+        ESP_PARTITION_SUBTYPE_ANY, RECORDER_PARTITION_LABEL);
+
+    if (part == NULL) {
+        ESP_LOGE(TAG, "No \"%s\" partition, check the partition table", RECORDER_PARTITION_LABEL);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    pages_num = part->size / RECORDER_PAGE_SIZE;
+    if (pages_num == 0) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    bool found = false;
+    uint32_t last_sequence = 0, last_page = 0;
+
+    for (uint32_t i = 0; i < pages_num; i++) {
+        recorder_page_header_t header;
+
+        if (esp_partition_read(part, i * RECORDER_PAGE_SIZE, &header, sizeof(header)) != ESP_OK ||
+            header.magic != RECORDER_MAGIC || header.version != RECORDER_VERSION) {
+            continue;
+        }
+
+        if (!found || (int32_t)(header.sequence - last_sequence) > 0) {
+            last_sequence = header.sequence;
+            last_page = i;
+            found = true;
+        }
+    }
+
+    next_page = found ? (last_page + 1) % pages_num : 0;
+    stats.sequence = found ? last_sequence + 1 : 0;
+
+    ESP_LOGI(TAG, "%lu pages of %d bytes, continuing at page %lu (sequence %lu)",
+        (unsigned long) pages_num, RECORDER_PAGE_SIZE, (unsigned long) next_page, (unsigned long) stats.sequence);
+
+    partition = part;
+    return ESP_OK;
+}
+
+/**
+ * Completes the page being filled and writes it in place
+ * of the oldest one
+ */
+static void write_page(void)
+{
+    recorder_encoder_finish(&encoder);
+    page_open = false;
+
+    size_t offset = next_page * RECORDER_PAGE_SIZE;
+    esp_err_t err = esp_partition_erase_range(partition, offset, RECORDER_PAGE_SIZE);
+
+    if (err == ESP_OK) {
+        err = esp_partition_write(partition, offset, encoder.page, RECORDER_PAGE_SIZE);
+    }
+
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Page %lu write failed: %s", (unsigned long) next_page, esp_err_to_name(err));
+    }
+
+    // A failed page is skipped, its sequence number is not reused
+    next_page = (next_page + 1) % pages_num;
+
+    portENTER_CRITICAL(&stats_lock);
+    if (err == ESP_OK) {
+        stats.pages_written++;
+    } else {
+        stats.write_errors++;
+    }
+    stats.sequence++;
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+static void encode_sample(const recorder_sample_t *sample)
+{
+    if (!page_open) {
+        recorder_encoder_start(&encoder, stats.sequence, sample->time_us);
+        page_open = true;
+    }
+
+    if (!recorder_encoder_add(&encoder, sample)) {
+        write_page();
+
+        recorder_encoder_start(&encoder, stats.sequence, sample->time_us);
+        page_open = true;
+        recorder_encoder_add(&encoder, sample);
+    }
+}
+
+/**
+ * Encodes the samples published since the last call. A sample
+ * still being written stops the drain, it is read next time
+ */
+static void drain(void)
+{
+    uint32_t head = atomic_load_explicit(&ring_head, memory_order_acquire);
+    uint32_t encoded = 0, lost = 0;
+
+    if (head - ring_tail > RECORDER_RING_SIZE) {
+        lost += head - ring_tail - RECORDER_RING_SIZE;
+        ring_tail = head - RECORDER_RING_SIZE;
+    }
+
+    while (ring_tail != head) {
+        recorder_slot_t *slot = &ring[ring_tail & (RECORDER_RING_SIZE - 1)];
+        uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+        if (seq != ring_tail + 1) {
+            if (seq != 0 && (int32_t)(seq - (ring_tail + 1)) > 0) {
+                // Overwritten by a newer sample
+                lost++;
+                ring_tail++;
+                continue;
+            }
+
+            // Not published yet
+            break;
+        }
+
+        recorder_sample_t sample = {
+            .time_us = slot->time_us,
+            .value = slot->value,
+            .source = slot->source,
+            .lane = slot->lane,
+        };
+
+        atomic_thread_fence(memory_order_acquire);
+
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) {
+            // Overwritten while it was read
+            lost++;
+            ring_tail++;
+            continue;
+        }
+
+        encode_sample(&sample);
+        encoded++;
+        ring_tail++;
+    }
+
+    portENTER_CRITICAL(&stats_lock);
+    stats.samples += encoded;
+    stats.samples_lost += lost;
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+/**
+ * Recorder task
+ * Drains the ring often enough that it never overflows
+ * while a page is written, and writes the page being
+ * filled on recorder_flush()
+ */
+void recorder_task(void *arg)
+{
+    if (partition == NULL) {
+        ESP_LOGW(TAG, "Recorder not initialized, task exiting");
+        vTaskDelete(NULL);
+        return;
+    }
+
+    while (1) {
+        vTaskDelay(pdMS_TO_TICKS(RECORDER_DRAIN_MS));
+        drain();
+
+        if (atomic_exchange(&flush_requested, false) && page_open) {
+            write_page();
+        }
+    }
+}
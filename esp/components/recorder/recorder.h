@@ -0,0 +1,44 @@
+/**
+ * @file recorder.h
+ *
+ * Header file for the sensor recorder: raw samples of the
+ * weight and ultrasonic sensors streamed to a flash partition
+ *
+ */
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#pragma once
+
+#include "recorder_format.h"
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Label of the data partition holding the recording
+#define RECORDER_PARTITION_LABEL "recorder"
+
+typedef struct {
+    uint32_t samples;           // samples encoded so far
+    uint32_t samples_lost;      // overwritten in the ring before being encoded
+    uint32_t pages_written;
+    uint32_t write_errors;
+    uint32_t sequence;          // sequence number of the page being filled
+} recorder_stats_t;
+
+// Finds the partition and the page to continue from
+esp_err_t recorder_init(void);
+
+// Queues a sample, lock-free, a no-op until recorder_init() succeeded
+void recorder_add(recorder_source_t source, uint8_t lane, int32_t value, int64_t time_us);
+
+// Asks the recorder task to write the page being filled, even if it is not full
+void recorder_flush(void);
+
+// Copies the recorder counters
+void recorder_get_stats(recorder_stats_t *stats);
+
+// Recorder task: encodes the queued samples and writes the full pages
+void recorder_task(void *arg);
+
+#endif /* RECORDER_H */
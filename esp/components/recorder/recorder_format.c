@@ -0,0 +1,162 @@
+/**
+ * @file recorder_format.c
+ *
+ * Delta and varint encoding of the recorder pages
+ *
+ */
+
+#include "recorder_format.h"
+
+#include <string.h>
+
+static inline uint64_t zigzag(int64_t v)
+{
+    return ((uint64_t) v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static size_t put_varint(uint8_t *out, uint64_t v)
+{
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        out[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (uint8_t) v;
+
+    return n;
+}
+
+static bool get_varint(recorder_decoder_t *dec, uint64_t *v)
+{
+    uint64_t result = 0;
+
+    for (int shift = 0; shift < 64 && dec->pos < dec->end; shift += 7) {
+        uint8_t byte = dec->page[dec->pos++];
+        result |= (uint64_t)(byte & 0x7f) << shift;
+
+        if ((byte & 0x80) == 0) {
+            *v = result;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void recorder_encoder_start(recorder_encoder_t *enc, uint32_t sequence, int64_t base_us)
+{
+    // Erased flash reads 0xFF, the unused tail of the page is left so
+    memset(enc->page, 0xFF, sizeof(enc->page));
+    memset(enc->last_value, 0, sizeof(enc->last_value));
+
+    recorder_page_header_t header = {
+        .magic = RECORDER_MAGIC,
+        .version = RECORDER_VERSION,
+        .sequence = sequence,
+        .base_us = base_us,
+    };
+    memcpy(enc->page, &header, sizeof(header));
+
+    enc->used = sizeof(header);
+    enc->records = 0;
+    enc->last_us = base_us;
+}
+
+/**
+ * Appends a sample to the page
+ * @param enc The encoder
+ * @param sample The sample, its lane must be below RECORDER_LANES
+ * @return false if the page has no room left for it
+ */
+bool recorder_encoder_add(recorder_encoder_t *enc, const recorder_sample_t *sample)
+{
+    if (sample->source >= RECORDER_SOURCES_NUM || sample->lane >= RECORDER_LANES) {
+        return true;    // cannot be encoded, dropped
+    }
+
+    uint8_t record[RECORDER_RECORD_MAX];
+    int32_t *last_value = &enc->last_value[sample->source][sample->lane];
+    size_t n = 0;
+
+    record[n++] = (uint8_t)(sample->source << 4 | sample->lane);
+    n += put_varint(&record[n], zigzag(sample->time_us - enc->last_us));
+    n += put_varint(&record[n], zigzag((int64_t) sample->value - *last_value));
+
+    if (enc->used + n > RECORDER_PAGE_SIZE) {
+        return false;
+    }
+
+    memcpy(&enc->page[enc->used], record, n);
+    enc->used += n;
+    enc->records++;
+    enc->last_us = sample->time_us;
+    *last_value = sample->value;
+
+    return true;
+}
+
+void recorder_encoder_finish(recorder_encoder_t *enc)
+{
+    recorder_page_header_t header;
+    memcpy(&header, enc->page, sizeof(header));
+
+    header.used = (uint16_t)(enc->used - sizeof(header));
+    header.records = enc->records;
+    memcpy(enc->page, &header, sizeof(header));
+}
+
+bool recorder_decoder_start(recorder_decoder_t *dec, const uint8_t *page, recorder_page_header_t *header)
+{
+    memcpy(header, page, sizeof(*header));
+
+    if (header->magic != RECORDER_MAGIC || header->version != RECORDER_VERSION ||
+        header->used > RECORDER_PAGE_SIZE - sizeof(*header)) {
+        return false;
+    }
+
+    dec->page = page;
+    dec->pos = sizeof(*header);
+    dec->end = sizeof(*header) + header->used;
+    dec->last_us = header->base_us;
+    memset(dec->last_value, 0, sizeof(dec->last_value));
+
+    return true;
+}
+
+bool recorder_decoder_next(recorder_decoder_t *dec, recorder_sample_t *sample)
+{
+    if (dec->pos >= dec->end) {
+        return false;
+    }
+
+    uint8_t tag = dec->page[dec->pos++];
+    uint64_t time_delta, value_delta;
+
+    if (!get_varint(dec, &time_delta) || !get_varint(dec, &value_delta)) {
+        return false;
+    }
+
+    uint8_t source = tag >> 4, lane = tag & 0x0f;
+
+    if (source >= RECORDER_SOURCES_NUM) {
+        return false;
+    }
+
+    int32_t *last_value = &dec->last_value[source][lane];
+
+    dec->last_us += unzigzag(time_delta);
+    *last_value = (int32_t)(*last_value + unzigzag(value_delta));
+
+    sample->time_us = dec->last_us;
+    sample->value = *last_value;
+    sample->source = source;
+    sample->lane = lane;
+
+    return true;
+}
@@ -0,0 +1,93 @@
+/**
+ * @file recorder_format.h
+ *
+ * Binary format of the sensor recorder, shared by the
+ * firmware (recorder.c) and the host decoder
+ * (tools/recorder_decode), so it has no hardware dependency.
+ *
+ * The partition is a circular sequence of flash pages of
+ * RECORDER_PAGE_SIZE bytes, one erase sector each. A page
+ * starts with a header and holds whole records, so it can
+ * be decoded on its own:
+ *   tag       1 byte, source in the high nibble, lane in the low one
+ *   time      zigzag varint, us since the previous record of the page
+ *             (the first one since base_us of the header)
+ *   value     zigzag varint, change since the previous value of the
+ *             same source and lane in the page (the first one since 0)
+ * A raw HX711 sample 100 ms after the previous one and a few
+ * counts away from it takes 5 bytes instead of 16.
+ *
+ */
+#ifndef RECORDER_FORMAT_H
+#define RECORDER_FORMAT_H
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RECORDER_PAGE_SIZE  4096
+#define RECORDER_MAGIC      0x43455253  // "SREC"
+#define RECORDER_VERSION    1
+
+// Lanes per source that can be told apart in the tag
+#define RECORDER_LANES      16
+
+// Longest record: tag and two 64 bit varints
+#define RECORDER_RECORD_MAX (1 + 10 + 10)
+
+typedef enum {
+    RECORDER_WEIGHT,        // raw HX711 conversion
+    RECORDER_ULTRASONIC,    // distance in cm, -1 if the measure failed
+    RECORDER_SOURCES_NUM
+} recorder_source_t;
+
+typedef struct {
+    int64_t time_us;
+    int32_t value;
+    uint8_t source;
+    uint8_t lane;
+} recorder_sample_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t used;          // bytes of records after the header
+    uint32_t sequence;      // page number, grows across the partition wraps
+    uint32_t records;
+    int64_t base_us;        // reference time of the first record
+} recorder_page_header_t;
+
+typedef struct {
+    uint8_t page[RECORDER_PAGE_SIZE];
+    size_t used;            // header included
+    uint32_t records;
+    int64_t last_us;
+    int32_t last_value[RECORDER_SOURCES_NUM][RECORDER_LANES];
+} recorder_encoder_t;
+
+typedef struct {
+    const uint8_t *page;
+    size_t pos;
+    size_t end;
+    int64_t last_us;
+    int32_t last_value[RECORDER_SOURCES_NUM][RECORDER_LANES];
+} recorder_decoder_t;
+
+// Starts an empty page
+void recorder_encoder_start(recorder_encoder_t *enc, uint32_t sequence, int64_t base_us);
+
+// Appends a sample, false if the page is full
+bool recorder_encoder_add(recorder_encoder_t *enc, const recorder_sample_t *sample);
+
+// Completes the header, the page is then ready to be written
+void recorder_encoder_finish(recorder_encoder_t *enc);
+
+// Checks the header of a page and prepares to decode it, false if it is not a recorder page
+bool recorder_decoder_start(recorder_decoder_t *dec, const uint8_t *page, recorder_page_header_t *header);
+
+// Decodes the next sample of the page, false at the end
+bool recorder_decoder_next(recorder_decoder_t *dec, recorder_sample_t *sample);
+
+#endif /* RECORDER_FORMAT_H */
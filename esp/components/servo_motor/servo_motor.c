@@ -5,7 +5,8 @@
 #include "esp_check.h"
 
 static bool s_inited = false;
-static servo_motor_params_t s_p;
+static size_t s_count = 0;
+static servo_motor_params_t s_p[SERVO_MOTOR_MAX];
 
 static servo_config_t s_cfg = {
     .max_angle = 180,
@@ -14,43 +15,58 @@ static servo_config_t s_cfg = {
     .freq = 50,
     .timer_number = LEDC_TIMER_0,
     .channels = {
-        .servo_pin = { -1 },
-        .ch = { LEDC_CHANNEL_0 },
+        .servo_pin = { -1, -1 },
+        .ch = { LEDC_CHANNEL_0, LEDC_CHANNEL_1 },
     },
     .channel_number = 1,
 };
 
-esp_err_t servo_motor_init(const servo_motor_params_t *p)
+esp_err_t servo_motor_init(const servo_motor_params_t *p, size_t count)
 {
     ESP_RETURN_ON_FALSE(p != NULL, ESP_ERR_INVALID_ARG, "servo_motor", "params null");
+    ESP_RETURN_ON_FALSE(count > 0 && count <= SERVO_MOTOR_MAX, ESP_ERR_INVALID_ARG, "servo_motor", "bad servo count");
 
-    s_p = *p;
-    s_cfg.channels.servo_pin[0] = (int)s_p.gpio_pwm;
+    // one LEDC channel for each barrier
+    for (size_t i = 0; i < count; i++) {
+        s_p[i] = p[i];
+        s_cfg.channels.servo_pin[i] = (int)s_p[i].gpio_pwm;
+    }
+    s_cfg.channel_number = count;
+    s_count = count;
 
     esp_err_t err = iot_servo_init(LEDC_LOW_SPEED_MODE, &s_cfg);
     ESP_RETURN_ON_ERROR(err, "servo_motor", "iot_servo_init failed");
 
     s_inited = true;
-    return servo_motor_lower_barrier(); // parti “giu”
+
+    // parti “giu”
+    for (size_t i = 0; i < count; i++) {
+        ESP_RETURN_ON_ERROR(servo_motor_lower_barrier(i), "servo_motor", "lower failed");
+    }
+
+    return ESP_OK;
 }
 
-esp_err_t servo_motor_set_angle(float angle_deg)
+esp_err_t servo_motor_set_angle(uint8_t id, float angle_deg)
 {
     ESP_RETURN_ON_FALSE(s_inited, ESP_ERR_INVALID_STATE, "servo_motor", "not inited");
-    return iot_servo_write_angle(LEDC_LOW_SPEED_MODE, 0, angle_deg);
+    ESP_RETURN_ON_FALSE(id < s_count, ESP_ERR_INVALID_ARG, "servo_motor", "bad servo id");
+    return iot_servo_write_angle(LEDC_LOW_SPEED_MODE, id, angle_deg);
 }
 
-esp_err_t servo_motor_raise_barrier(void)
+esp_err_t servo_motor_raise_barrier(uint8_t id)
 {
-    ESP_LOGI("SERVO", "Servo raised");
-    return servo_motor_set_angle(s_p.angle_up_deg);
+    ESP_RETURN_ON_FALSE(id < s_count, ESP_ERR_INVALID_ARG, "servo_motor", "bad servo id");
+    ESP_LOGI("SERVO", "Servo %d raised", id);
+    return servo_motor_set_angle(id, s_p[id].angle_up_deg);
 }
 
-esp_err_t servo_motor_lower_barrier(void)
+esp_err_t servo_motor_lower_barrier(uint8_t id)
 {
-        ESP_LOGI("SERVO", "Servo lowered");
+    ESP_RETURN_ON_FALSE(id < s_count, ESP_ERR_INVALID_ARG, "servo_motor", "bad servo id");
+    ESP_LOGI("SERVO", "Servo %d lowered", id);
 
-    return servo_motor_set_angle(s_p.angle_down_deg);
+    return servo_motor_set_angle(id, s_p[id].angle_down_deg);
 }
 
 esp_err_t servo_motor_deinit(void)
@@ -1,6 +1,11 @@
 #pragma once
 #include "esp_err.h"
 #include "driver/gpio.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Maximum number of barriers, one for each lane
+#define SERVO_MOTOR_MAX 2
 
 #ifdef __cplusplus
 extern "C" {
@@ -12,10 +17,10 @@ typedef struct {
     float angle_down_deg;      // 0
 } servo_motor_params_t;
 
-esp_err_t servo_motor_init(const servo_motor_params_t *p);
-esp_err_t servo_motor_raise_barrier(void);
-esp_err_t servo_motor_lower_barrier(void);
-esp_err_t servo_motor_set_angle(float angle_deg);
+esp_err_t servo_motor_init(const servo_motor_params_t *p, size_t count);
+esp_err_t servo_motor_raise_barrier(uint8_t id);
+esp_err_t servo_motor_lower_barrier(uint8_t id);
+esp_err_t servo_motor_set_angle(uint8_t id, float angle_deg);
 esp_err_t servo_motor_deinit(void);
 
 #ifdef __cplusplus
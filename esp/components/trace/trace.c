@@ -0,0 +1,421 @@
+/**
+ * @file trace.c
+ *
+ * Timing trace of the gate: the FSM, the sensors and the
+ * network requests append timestamped records to a ring
+ * buffer, and the trace task turns them into per-state
+ * dwell time and weight-to-barrier latency histograms.
+ *
+ * Recording never blocks: a producer claims a slot with an
+ * atomic increment and publishes it through the sequence
+ * number of the slot, so it can be done from any task or ISR.
+ * The histograms are only updated by the consumer side.
+ *
+ */
+
+#include "trace.h"
+#include "../../main/fsm.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+
+#define TAG "TRACE"
+
+// Size of the ring, must be a power of two
+#define TRACE_RING_SIZE 256
+
+// How often the trace task drains the ring
+#define TRACE_COLLECT_MS 500
+
+#ifndef CONFIG_TRACE_REPORT_PERIOD
+#define CONFIG_TRACE_REPORT_PERIOD 0
+#endif
+
+_Static_assert((TRACE_RING_SIZE & (TRACE_RING_SIZE - 1)) == 0, "ring size must be a power of two");
+
+typedef struct {
+    // Sequence number of the record plus one, 0 while it is being written
+    atomic_uint seq;
+    uint8_t event;
+    uint8_t lane;
+    uint16_t arg;
+    int64_t time_us;
+} trace_slot_t;
+
+static trace_slot_t ring[TRACE_RING_SIZE];
+static atomic_uint ring_head;   // next sequence number to write
+
+// Consumer side, protected by hist_lock
+static uint32_t ring_tail;      // next sequence number to read
+static uint32_t records_read;
+static uint32_t records_lost;
+static uint32_t event_counts[TRACE_EVENTS_NUM];
+
+// What the consumer knows about each lane
+static struct {
+    State_t state;
+    int64_t state_since_us;     // -1 until the first transition
+    int64_t trigger_us;         // last weight trigger, -1 if none pending
+} lane_trace[FSM_LANES_NUM];
+
+static trace_hist_t dwell_hist[STATES_NUM];
+static trace_hist_t end_to_end_hist;
+
+static portMUX_TYPE hist_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static trace_report_cb_t report_cb = NULL;
+
+static const char *event_names[TRACE_EVENTS_NUM] = {
+    [TRACE_FSM_TRANSITION]     = "transition",
+    [TRACE_WEIGHT_CANDIDATE]   = "weightCandidate",
+    [TRACE_WEIGHT_TRIGGER]     = "weightTrigger",
+    [TRACE_ULTRASONIC_TRIGGER] = "ultrasonicTrigger",
+    [TRACE_PASSAGE]            = "passage",
+    [TRACE_CV_DONE]            = "cvDone",
+    [TRACE_ENTRY_DONE]         = "entryDone",
+    [TRACE_BARRIER_RAISE]      = "barrierRaise",
+    [TRACE_BARRIER_LOWER]      = "barrierLower",
+};
+
+_Static_assert(sizeof(event_names) / sizeof(event_names[0]) == TRACE_EVENTS_NUM, "missing event name");
+
+
+//////////////////////////////////////////////////////
+///////////////////// Producer ///////////////////////
+//////////////////////////////////////////////////////
+
+/**
+ * Appends a record to the ring. When the consumer falls
+ * behind, the oldest records are overwritten and counted as lost
+ * @param event What happened
+ * @param lane The lane it happened on, TRACE_NO_LANE if none
+ * @param arg Event specific value
+ */
+void IRAM_ATTR trace_record(trace_event_t event, uint8_t lane, uint16_t arg)
+{
+    uint32_t seq = atomic_fetch_add_explicit(&ring_head, 1, memory_order_relaxed);
+    trace_slot_t *slot = &ring[seq & (TRACE_RING_SIZE - 1)];
+
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    slot->event = event;
+    slot->lane = lane;
+    slot->arg = arg;
+    slot->time_us = esp_timer_get_time();
+
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_release);
+}
+
+
+//////////////////////////////////////////////////////
+///////////////////// Histograms /////////////////////
+//////////////////////////////////////////////////////
+
+static void hist_add(trace_hist_t *hist, int64_t duration_us)
+{
+    uint32_t ms = (duration_us > 0) ? (uint32_t)(duration_us / 1000) : 0;
+    uint8_t bucket = 0;
+
+    while (bucket < TRACE_HIST_BUCKETS - 1 && (ms >> (bucket + 1)) != 0) {
+        bucket++;
+    }
+
+    hist->buckets[bucket]++;
+    hist->count++;
+
+    if (ms > hist->max_ms) {
+        hist->max_ms = ms;
+    }
+}
+
+/**
+ * Returns the upper bound of the bucket holding the given
+ * percentile, the maximum if it falls in the last bucket
+ * @param hist The histogram to read
+ * @param percentile Between 1 and 100
+ * @return The bound in ms, 0 if the histogram is empty
+ */
+uint32_t trace_hist_percentile(const trace_hist_t *hist, uint8_t percentile)
+{
+    if (hist->count == 0) {
+        return 0;
+    }
+
+    uint32_t target = (hist->count * percentile + 99) / 100;
+    uint32_t seen = 0;
+
+    for (uint8_t i = 0; i < TRACE_HIST_BUCKETS - 1; i++) {
+        seen += hist->buckets[i];
+
+        if (seen >= target) {
+            uint32_t bound = 2UL << i;
+            return (bound < hist->max_ms) ? bound : hist->max_ms;
+        }
+    }
+
+    return hist->max_ms;
+}
+
+/**
+ * Updates the histograms with a record, called with hist_lock held
+ */
+static void process_record(uint8_t event, uint8_t lane, uint16_t arg, int64_t time_us)
+{
+    if (event < TRACE_EVENTS_NUM) {
+        event_counts[event]++;
+    }
+
+    if (lane >= FSM_LANES_NUM) {
+        return;
+    }
+
+    switch (event) {
+        case TRACE_FSM_TRANSITION:
+            if (lane_trace[lane].state_since_us >= 0 && lane_trace[lane].state < STATES_NUM) {
+                hist_add(&dwell_hist[lane_trace[lane].state], time_us - lane_trace[lane].state_since_us);
+            }
+
+            lane_trace[lane].state = (State_t) arg;
+            lane_trace[lane].state_since_us = time_us;
+
+            // A trigger that did not open the barrier is forgotten
+            if (arg == IDLE) {
+                lane_trace[lane].trigger_us = -1;
+            }
+            break;
+
+        case TRACE_WEIGHT_TRIGGER:
+            lane_trace[lane].trigger_us = time_us;
+            break;
+
+        case TRACE_BARRIER_RAISE:
+            if (lane_trace[lane].trigger_us >= 0) {
+                hist_add(&end_to_end_hist, time_us - lane_trace[lane].trigger_us);
+                lane_trace[lane].trigger_us = -1;
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+/**
+ * Drains the records published since the last call. A record
+ * still being written stops the drain, it is read next time
+ */
+void trace_collect(void)
+{
+    static bool initialized = false;
+
+    portENTER_CRITICAL(&hist_lock);
+
+    if (!initialized) {
+        for (uint8_t i = 0; i < FSM_LANES_NUM; i++) {
+            lane_trace[i].state_since_us = -1;
+            lane_trace[i].trigger_us = -1;
+        }
+        initialized = true;
+    }
+
+    uint32_t head = atomic_load_explicit(&ring_head, memory_order_acquire);
+
+    if (head - ring_tail > TRACE_RING_SIZE) {
+        records_lost += head - ring_tail - TRACE_RING_SIZE;
+        ring_tail = head - TRACE_RING_SIZE;
+    }
+
+    while (ring_tail != head) {
+        trace_slot_t *slot = &ring[ring_tail & (TRACE_RING_SIZE - 1)];
+        uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+        if (seq != ring_tail + 1) {
+            if (seq != 0 && (int32_t)(seq - (ring_tail + 1)) > 0) {
+                // Overwritten by a newer record
+                records_lost++;
+                ring_tail++;
+                continue;
+            }
+
+            // Not published yet
+            break;
+        }
+
+        uint8_t event = slot->event;
+        uint8_t lane = slot->lane;
+        uint16_t arg = slot->arg;
+        int64_t time_us = slot->time_us;
+
+        atomic_thread_fence(memory_order_acquire);
+
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) {
+            // Overwritten while it was read
+            records_lost++;
+            ring_tail++;
+            continue;
+        }
+
+        process_record(event, lane, arg, time_us);
+        records_read++;
+        ring_tail++;
+    }
+
+    portEXIT_CRITICAL(&hist_lock);
+}
+
+
+//////////////////////////////////////////////////////
+////////////////////// Reports ///////////////////////
+//////////////////////////////////////////////////////
+
+static void dump_hist(const char *name, const trace_hist_t *hist)
+{
+    char buckets[TRACE_HIST_BUCKETS * 6 + 1];
+    int len = 0;
+
+    for (uint8_t i = 0; i < TRACE_HIST_BUCKETS && len < (int) sizeof(buckets); i++) {
+        len += snprintf(buckets + len, sizeof(buckets) - len, " %lu", (unsigned long) hist->buckets[i]);
+    }
+
+    ESP_LOGI(TAG, "%-16s n=%-5lu p50<=%lu ms p99<=%lu ms max=%lu ms |%s", name,
+        (unsigned long) hist->count,
+        (unsigned long) trace_hist_percentile(hist, 50),
+        (unsigned long) trace_hist_percentile(hist, 99),
+        (unsigned long) hist->max_ms, buckets);
+}
+
+/**
+ * Prints the histograms to the console: one line
+ * per histogram, followed by the count of every
+ * power of two bucket (1, 2, 4, ... ms)
+ */
+void trace_dump(void)
+{
+    trace_collect();
+
+    trace_hist_t dwell[STATES_NUM];
+    trace_hist_t end_to_end;
+    uint32_t counts[TRACE_EVENTS_NUM];
+    uint32_t read, lost;
+
+    portENTER_CRITICAL(&hist_lock);
+    for (int s = 0; s < STATES_NUM; s++) {
+        dwell[s] = dwell_hist[s];
+    }
+    end_to_end = end_to_end_hist;
+    for (int e = 0; e < TRACE_EVENTS_NUM; e++) {
+        counts[e] = event_counts[e];
+    }
+    read = records_read;
+    lost = records_lost;
+    portEXIT_CRITICAL(&hist_lock);
+
+    ESP_LOGI(TAG, "========== Gate timing (%lu records, %lu lost) ==========",
+        (unsigned long) read, (unsigned long) lost);
+
+    for (int e = 0; e < TRACE_EVENTS_NUM; e++) {
+        ESP_LOGI(TAG, "%-18s %lu", event_names[e], (unsigned long) counts[e]);
+    }
+
+    for (int s = 0; s < STATES_NUM; s++) {
+        if (dwell[s].count > 0) {
+            dump_hist(fsm_state_name((State_t) s), &dwell[s]);
+        }
+    }
+
+    dump_hist("WEIGHT->BARRIER", &end_to_end);
+}
+
+static cJSON *hist_to_json(const trace_hist_t *hist)
+{
+    cJSON *object = cJSON_CreateObject();
+    cJSON *buckets = cJSON_CreateArray();
+
+    for (uint8_t i = 0; i < TRACE_HIST_BUCKETS; i++) {
+        cJSON_AddItemToArray(buckets, cJSON_CreateNumber(hist->buckets[i]));
+    }
+
+    cJSON_AddNumberToObject(object, "count", hist->count);
+    cJSON_AddNumberToObject(object, "p50", trace_hist_percentile(hist, 50));
+    cJSON_AddNumberToObject(object, "p99", trace_hist_percentile(hist, 99));
+    cJSON_AddNumberToObject(object, "max", hist->max_ms);
+    cJSON_AddItemToObject(object, "buckets", buckets);
+
+    return object;
+}
+
+/**
+ * Adds the histograms to a JSON object, as "dwell"
+ * (one entry per state) and "weightToBarrier"
+ * @param object The object to fill
+ */
+void trace_add_to_json(cJSON *object)
+{
+    if (object == NULL) {
+        return;
+    }
+
+    trace_collect();
+
+    trace_hist_t dwell[STATES_NUM];
+    trace_hist_t end_to_end;
+    uint32_t lost;
+
+    portENTER_CRITICAL(&hist_lock);
+    for (int s = 0; s < STATES_NUM; s++) {
+        dwell[s] = dwell_hist[s];
+    }
+    end_to_end = end_to_end_hist;
+    lost = records_lost;
+    portEXIT_CRITICAL(&hist_lock);
+
+    cJSON *dwell_json = cJSON_CreateObject();
+
+    for (int s = 0; s < STATES_NUM; s++) {
+        cJSON_AddItemToObject(dwell_json, fsm_state_name((State_t) s), hist_to_json(&dwell[s]));
+    }
+
+    cJSON_AddItemToObject(object, "dwell", dwell_json);
+    cJSON_AddItemToObject(object, "weightToBarrier", hist_to_json(&end_to_end));
+    cJSON_AddNumberToObject(object, "recordsLost", lost);
+}
+
+void trace_set_report_callback(trace_report_cb_t cb)
+{
+    report_cb = cb;
+}
+
+/**
+ * Trace task
+ * Drains the ring often enough that it never
+ * overflows during a vehicle cycle and, if
+ * CONFIG_TRACE_REPORT_PERIOD is set, periodically
+ * dumps the histograms and calls the report callback.
+ */
+void trace_task(void *arg)
+{
+    int64_t last_report_us = esp_timer_get_time();
+
+    while (1) {
+        vTaskDelay(pdMS_TO_TICKS(TRACE_COLLECT_MS));
+        trace_collect();
+
+        if (CONFIG_TRACE_REPORT_PERIOD > 0 &&
+            esp_timer_get_time() - last_report_us >= (int64_t) CONFIG_TRACE_REPORT_PERIOD * 1000000) {
+            last_report_us = esp_timer_get_time();
+            trace_dump();
+
+            if (report_cb != NULL) {
+                report_cb();
+            }
+        }
+    }
+}
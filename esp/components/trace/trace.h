@@ -0,0 +1,68 @@
+/**
+ * @file trace.h
+ *
+ * Header file for the timing trace: a ring buffer of
+ * timestamped records and the histograms built from it
+ *
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#pragma once
+
+#include "cJSON.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Records that can be traced
+typedef enum {
+    TRACE_FSM_TRANSITION,       // arg: the new state
+    TRACE_WEIGHT_CANDIDATE,     // first sample in the detection window
+    TRACE_WEIGHT_TRIGGER,       // detection confirmed
+    TRACE_ULTRASONIC_TRIGGER,   // exit detected by the ultrasonic sensor
+    TRACE_PASSAGE,              // arg: the new passage state
+    TRACE_CV_DONE,              // arg: 1 if the plate was recognized
+    TRACE_ENTRY_DONE,           // arg: 1 if the entry was allowed
+    TRACE_BARRIER_RAISE,
+    TRACE_BARRIER_LOWER,
+    TRACE_EVENTS_NUM
+} trace_event_t;
+
+// Lane of the records not bound to a lane
+#define TRACE_NO_LANE 0xFF
+
+// Histogram with power of two buckets: bucket i counts the
+// values in [2^i, 2^(i+1)) ms, the last one everything above
+#define TRACE_HIST_BUCKETS 16
+
+typedef struct {
+    uint32_t buckets[TRACE_HIST_BUCKETS];
+    uint32_t count;
+    uint32_t max_ms;
+} trace_hist_t;
+
+// Called by the trace task every CONFIG_TRACE_REPORT_PERIOD seconds
+typedef void (*trace_report_cb_t)(void);
+
+// Appends a record to the ring, lock-free, can be called from any task or ISR
+void trace_record(trace_event_t event, uint8_t lane, uint16_t arg);
+
+// Drains the ring and updates the histograms
+void trace_collect(void);
+
+// Prints the histograms to the console
+void trace_dump(void);
+
+// Adds the histograms to a JSON object
+void trace_add_to_json(cJSON *object);
+
+// Returns the upper bound, in ms, of the bucket holding the given percentile
+uint32_t trace_hist_percentile(const trace_hist_t *hist, uint8_t percentile);
+
+// Registers the function called on every report
+void trace_set_report_callback(trace_report_cb_t cb);
+
+// Trace task: drains the ring periodically and reports the histograms
+void trace_task(void *arg);
+
+#endif /* TRACE_H */
@@ -1,12 +1,15 @@
 /**
  * @file ultrasonic.c
  * 
- * Interface used to manage the ultrasonic sensor
+ * Interface used to manage the ultrasonic sensors,
+ * one for each lane of the gate
  * 
  */
 
 #include "ultrasonic_sensor.h"
 #include "ultrasonic.h"
+#include "../recorder/recorder.h"
+#include "esp_timer.h"
 #include "esp_log.h"
 #include "esp_err.h"
 #include <string.h>
@@ -19,44 +22,66 @@
 #define TRIG_GPIO   GPIO_NUM_3
 #define ECHO_GPIO   GPIO_NUM_20
 
+// Pins of the second lane sensor
+#define TRIG2_GPIO  GPIO_NUM_47
+#define ECHO2_GPIO  GPIO_NUM_48
+
 #define MAX_DISTANCE 50
 #define THRESHOLD_DISTANCE 10
 
 static const char *TAG = "Ultrasonic Module";
-static ultrasonic_sensor_t ultrasonic = {
-    .trigger_pin = TRIG_GPIO,
-    .echo_pin = ECHO_GPIO
+static ultrasonic_sensor_t ultrasonic[ULTRASONIC_SENSOR_NUM] = {
+    {
+        .trigger_pin = TRIG_GPIO,
+        .echo_pin = ECHO_GPIO
+    },
+#if ULTRASONIC_SENSOR_NUM > 1
+    {
+        .trigger_pin = TRIG2_GPIO,
+        .echo_pin = ECHO2_GPIO
+    },
+#endif
 };
-static uint32_t last_distance = -1;
+static uint32_t last_distance[ULTRASONIC_SENSOR_NUM];
 
 esp_err_t ultrasonic_sensor_init()
 {
-    ESP_LOGI(TAG, "Initializing ultrasonic sensor...");
+    ESP_LOGI(TAG, "Initializing %d ultrasonic sensor(s)...", ULTRASONIC_SENSOR_NUM);
 
-    esp_err_t err = ultrasonic_init(&ultrasonic);
+    for (int i = 0; i < ULTRASONIC_SENSOR_NUM; i++) {
+        esp_err_t err = ultrasonic_init(&ultrasonic[i]);
 
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Ultrasonic sensor init failed: %s", esp_err_to_name(err));
-        return err;
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Ultrasonic sensor %d init failed: %s", i, esp_err_to_name(err));
+            return err;
+        }
+
+        last_distance[i] = UINT32_MAX;
     }
 
     ESP_LOGI(TAG, "Ultrasonic sensor initialized successfully");
     return ESP_OK;
 }
 
-bool ultrasonic_sensor_detect()
+bool ultrasonic_sensor_detect(uint8_t id)
 {
+    if (id >= ULTRASONIC_SENSOR_NUM) {
+        return false;
+    }
+
     uint32_t distance = 0;
-    esp_err_t err = ultrasonic_measure_cm(&ultrasonic, MAX_DISTANCE, &distance);
+    esp_err_t err = ultrasonic_measure_cm(&ultrasonic[id], MAX_DISTANCE, &distance);
+
+    recorder_add(RECORDER_ULTRASONIC, id, (err == ESP_OK) ? (int32_t) distance : -1, esp_timer_get_time());
 
     if (err != ESP_OK) {
         return false;
     }
 
-    if (distance != last_distance) {
-        ESP_LOGI(TAG, "detected object from %d cm distance", distance);
-        last_distance = distance;
+    if (distance != last_distance[id]) {
+        ESP_LOGI(TAG, "sensor %d detected object from %d cm distance", id, distance);
+        last_distance[id] = distance;
     }
 
     return (distance > 0 && distance < THRESHOLD_DISTANCE);
-}
\ No newline at end of file
+}
@@ -10,9 +10,14 @@
 
 #include "esp_err.h"
 #include <stdbool.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+
+// One sensor for each lane, the id of a sensor is the id of its lane
+#define ULTRASONIC_SENSOR_NUM CONFIG_PARKING_LANES
 
 esp_err_t ultrasonic_sensor_init();
 
-bool ultrasonic_sensor_detect();
+bool ultrasonic_sensor_detect(uint8_t id);
 
 #endif /* ULTRASONIC_SENSOR_H */
\ No newline at end of file
@@ -8,12 +8,18 @@
 #include "../../main/fsm.h"
 #include "../https/https_task.h"
 #include "../oled/oled.h"
+#include "../trace/trace.h"
 #include "weight.h"
+#include "weight_calibration.h"
+#include "weight_detector.h"
+#include "weight_sampler.h"
 
 #include "hx711.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "driver/temperature_sensor.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "nvs_flash.h"
 #include "nvs.h"
 #include <math.h>
@@ -25,68 +31,141 @@
 #define HX711_DOUT_GPIO  GPIO_NUM_21
 #define HX711_CLK_GPIO   GPIO_NUM_14
 
-// Detection parameters
-#define NOISE_THRESHOLD          5.0f
-#define MIN_CAR_WEIGHT           25.0f
-#define MAX_CAR_WEIGHT           100.0f
-#define DETECT_COUNT_REQUIRED    5
-
-// Variables for HX711
-static hx711_t hx = {
-        .dout = HX711_DOUT_GPIO,
-        .pd_sck = HX711_CLK_GPIO,
-        .gain = HX711_GAIN_A_128
-    };
-static float scale = 1.0f;   // grams per raw unit
-static float offset = 0.0f;  // raw offset
-
-// Detector state
-static float baseline = 0;
-static float filtered = 0;
-static float last_raw_weight = -1;
-static int detect_count = 0;
-
-// Weight detection enabled flag
-static volatile bool weight_enabled = false;
-
+// Empty batches in burst before going back to the idle rate
+#define WEIGHT_QUIET_BATCHES 5
+
+// Background tare refinement: empty scale samples averaged,
+// and temperature change that calls for a new refinement
+#define TARE_REFINE_SAMPLES     25
+#define TARE_REFINE_DELTA_C     1.0f
+#define TEMP_CHECK_PERIOD_US    (60 * 1000000LL)
+
+// State of a single weight sensor
+typedef struct {
+    // Variables for HX711
+    hx711_t hx;
+    int32_t offset;             // raw offset (tare) in use
+    weight_cal_record_t cal;    // calibration record, see weight_calibration.h
+    float temp_c;               // last temperature reading, NAN if unknown
+
+    // Background tare refinement
+    bool refine_tare;
+    int64_t refine_sum;
+    int refine_count;
+    int64_t next_temp_check_us;
+
+    // Detector state, see weight_detector.h
+    weight_detector_t det;
+    int32_t last_raw;   // last sample (or batch mean) fed to the detector
+    int quiet_batches;  // burst batches without load
+
+    // Weight detection enabled flag
+    volatile bool enabled;
+} weight_sensor_t;
+
+static weight_sensor_t sensors[WEIGHT_SENSOR_NUM] = {
+    {
+        .hx = {
+            .dout = HX711_DOUT_GPIO,
+            .pd_sck = HX711_CLK_GPIO,
+            .gain = HX711_GAIN_A_128
+        },
+    },
+};
+
+// Detection parameters, the engine is chosen in menuconfig
+static const weight_detector_config_t detector_config = {
+#if CONFIG_WEIGHT_ENGINE_COUNT
+    .engine = &weight_engine_count,
+#else
+    .engine = &weight_engine_sequential,
+#endif
+    .noise_threshold = WEIGHT_NOISE_THRESHOLD,
+    .min_weight = WEIGHT_MIN_CAR_WEIGHT,
+    .max_weight = WEIGHT_MAX_CAR_WEIGHT,
+    .count_required = WEIGHT_DETECT_COUNT_REQUIRED,
+    .settle_deviation = WEIGHT_SETTLE_DEVIATION,
+};
+
+// Notified when a detection starts or is dropped, see weight.h
+static weight_candidate_cb_t candidate_cb = NULL;
+
+// Die temperature sensor, a proxy of the temperature of the load cell
+static temperature_sensor_handle_t temp_sensor = NULL;
 
 // Prototypes
-static void load_calibration();
+static void load_calibration(uint8_t id);
 
-static void save_calibration();
+static void save_calibration(uint8_t id);
 
 //////////////////////////////////////////////////////
 //////////////// NVS helpers /////////////////////////
 //////////////////////////////////////////////////////
 
 /**
- * @brief Load calibration data from NVS
+ * @brief Builds the NVS key of a sensor: the first sensor keeps
+ * the original key names so existing calibrations stay valid
  */
-static void load_calibration(void)
+static void calibration_key(char *key, size_t len, const char *name, uint8_t id)
 {
+    if (id == 0) {
+        snprintf(key, len, "%s", name);
+    } else {
+        snprintf(key, len, "%s%d", name, id);
+    }
+}
+
+/**
+ * @brief Load calibration data from NVS. A sensor calibrated
+ * before the calibration record existed has its scale blob
+ * converted into a single segment record; its offset is not
+ * kept as a tare, since it was measured at calibration time
+ */
+static void load_calibration(uint8_t id)
+{
+    weight_sensor_t *w = &sensors[id];
+    char cal_key[16], scale_key[16];
+    calibration_key(cal_key, sizeof(cal_key), "cal", id);
+    calibration_key(scale_key, sizeof(scale_key), "scale", id);
+
+    float scale = 1.0f;
     nvs_handle_t nvs;
-    if (nvs_open("weight", NVS_READONLY, &nvs) == ESP_OK) {\
+
+    if (nvs_open("weight", NVS_READONLY, &nvs) == ESP_OK) {
+        size_t cal_size = sizeof(w->cal);
+        esp_err_t err = nvs_get_blob(nvs, cal_key, &w->cal, &cal_size);
+
+        if (err == ESP_OK && cal_size == sizeof(w->cal) && weight_cal_is_valid(&w->cal)) {
+            nvs_close(nvs);
+            ESP_LOGI(TAG, "Loaded calibration %d: %d points, tare=%ld", id, w->cal.points_num, (long) w->cal.tare);
+            return;
+        }
+
         size_t scale_size = sizeof(scale);
-        size_t offset_size = sizeof(offset);
-        nvs_get_blob(nvs, "scale", &scale, &scale_size);
-        nvs_get_blob(nvs, "offset", &offset, &offset_size);
+        nvs_get_blob(nvs, scale_key, &scale, &scale_size);
         nvs_close(nvs);
-        ESP_LOGI(TAG, "Loaded calibration: scale=%.6f offset=%.2f", scale, offset);
+        ESP_LOGI(TAG, "Loaded legacy calibration %d: scale=%.6f", id, scale);
     } else {
         ESP_LOGW(TAG, "No calibration found, using defaults");
     }
+
+    // No tare yet, and the temperature of a legacy calibration is unknown
+    weight_cal_init_linear(&w->cal, scale, 0, NAN);
 }
 
 /**
  * @brief Save calibration data to NVS
  */
-static void save_calibration(void)
+static void save_calibration(uint8_t id)
 {
+    weight_sensor_t *w = &sensors[id];
+    char cal_key[16];
+    calibration_key(cal_key, sizeof(cal_key), "cal", id);
+
     nvs_handle_t nvs;
     esp_err_t err = nvs_open("weight", NVS_READWRITE, &nvs);
     if (err == ESP_OK) {
-        nvs_set_blob(nvs, "scale", &scale, sizeof(scale));
-        nvs_set_blob(nvs, "offset", &offset, sizeof(offset));
+        nvs_set_blob(nvs, cal_key, &w->cal, sizeof(w->cal));
         nvs_commit(nvs);
         nvs_close(nvs);
         ESP_LOGI(TAG, "Calibration saved");
@@ -95,100 +174,362 @@ static void save_calibration(void)
     }
 }
 
+//////////////////////////////////////////////////////
+//////////////// Calibration helpers /////////////////
+//////////////////////////////////////////////////////
+
+/**
+ * @brief Reads the die temperature
+ * @return The temperature in Celsius, NAN if unavailable
+ */
+static float read_temperature(void)
+{
+    if (temp_sensor == NULL) {
+        temperature_sensor_config_t config = TEMPERATURE_SENSOR_CONFIG_DEFAULT(-10, 80);
+
+        if (temperature_sensor_install(&config, &temp_sensor) != ESP_OK ||
+            temperature_sensor_enable(temp_sensor) != ESP_OK) {
+            ESP_LOGW(TAG, "Temperature sensor unavailable, no temperature compensation");
+            temp_sensor = NULL;
+            return NAN;
+        }
+    }
+
+    float celsius;
+    return temperature_sensor_get_celsius(temp_sensor, &celsius) == ESP_OK ? celsius : NAN;
+}
+
+/**
+ * @brief Converts the detection thresholds into raw counts
+ * through the calibration table, at the current temperature,
+ * so the window edges are exact where the table is not linear
+ */
+static void apply_calibration(uint8_t id)
+{
+    weight_sensor_t *w = &sensors[id];
+    const weight_cal_record_t *cal = &w->cal;
+    float sign = weight_cal_counts(cal, 1.0f, w->temp_c) < 0 ? -1.0f : 1.0f;
+
+    weight_detector_counts_t counts = {
+        .offset = w->offset,
+        .sign = (int32_t) sign,
+        .noise = sign * weight_cal_counts(cal, detector_config.noise_threshold, w->temp_c),
+        .min = sign * weight_cal_counts(cal, detector_config.min_weight, w->temp_c),
+        .max = sign * weight_cal_counts(cal, detector_config.max_weight, w->temp_c),
+        .settle = sign * weight_cal_counts(cal, detector_config.settle_deviation, w->temp_c),
+    };
+
+    weight_detector_set_counts(&w->det, &counts);
+}
+
+/**
+ * @brief Converts net raw counts into grams
+ */
+static float net_grams(const weight_sensor_t *w, float counts)
+{
+    return weight_cal_grams(&w->cal, counts, w->temp_c);
+}
+
+/**
+ * Background tare refinement: averages samples of the
+ * empty scale (nothing detected and the reading within the
+ * noise band of the tare) into a new tare, which replaces
+ * the saved one and teaches the record the tare drift.
+ * It runs after a warm start and whenever the temperature
+ * has moved since the last refinement.
+ * @param id The weight sensor
+ * @param raw The last sample fed to the detector
+ */
+static void refine_tare(uint8_t id, int32_t raw)
+{
+    weight_sensor_t *w = &sensors[id];
+
+    if (!w->refine_tare) {
+        int64_t now_us = esp_timer_get_time();
+
+        if (now_us < w->next_temp_check_us) {
+            return;
+        }
+
+        w->next_temp_check_us = now_us + TEMP_CHECK_PERIOD_US;
+        w->temp_c = read_temperature();
+
+        if (!isnan(w->temp_c) && !isnan(w->cal.tare_temp_c) &&
+            fabsf(w->temp_c - w->cal.tare_temp_c) >= TARE_REFINE_DELTA_C) {
+            apply_calibration(id);
+            w->refine_tare = true;
+        }
+        return;
+    }
+
+    int32_t net = w->det.sign * (raw - w->offset) * (1 << WEIGHT_Q_BITS);
+
+    if (w->det.features.active != 0 || net >= w->det.noise_q || net <= -w->det.noise_q) {
+        // Something on the scale: start over
+        w->refine_sum = 0;
+        w->refine_count = 0;
+        return;
+    }
+
+    w->refine_sum += raw;
+
+    if (++w->refine_count < TARE_REFINE_SAMPLES) {
+        return;
+    }
+
+    int32_t tare = (int32_t)(w->refine_sum / w->refine_count);
+    ESP_LOGI(TAG, "Tare %d refined: %ld -> %ld", id, (long) w->offset, (long) tare);
+
+    weight_detector_set_offset(&w->det, tare);
+    w->offset = tare;
+    weight_cal_update_tare(&w->cal, tare, w->temp_c);
+    save_calibration(id);
+
+    w->refine_tare = false;
+    w->refine_sum = 0;
+    w->refine_count = 0;
+}
+
 //////////////////////////////////////////////////////
 //////////////// Weight sensor API ///////////////////
 //////////////////////////////////////////////////////
 
 /**
- * The function initializes the weight sensor,
+ * The function initializes the weight sensors,
  * setting up the HX711 and loading calibration data.
  * If no calibration data is found, default values are used.
+ * When the saved tare is still valid (see weight_cal_tare_valid())
+ * the blocking tare read is skipped and the tare is refined in the
+ * background once the scale is seen empty.
  * @return ESP_OK on success, error code otherwise
  */
 esp_err_t weight_init(void)
 {
-    // try to initialize HX711 
-    esp_err_t ret = hx711_init(&hx);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to initialize HX711: %s", esp_err_to_name(ret));
-        return ret;
-    }
+    for (uint8_t id = 0; id < WEIGHT_SENSOR_NUM; id++) {
+        weight_sensor_t *w = &sensors[id];
+
+        // try to initialize HX711 
+        esp_err_t ret = hx711_init(&w->hx);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to initialize HX711 %d: %s", id, esp_err_to_name(ret));
+            return ret;
+        }
 
-    // Initial raw offset (empty scale)
-    int32_t raw;
-    esp_err_t err = hx711_read_average(&hx, 10, &raw);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to read average from HX711: %s", esp_err_to_name(err));
-    }
-    offset = raw;
+        load_calibration(id);
+        w->temp_c = read_temperature();
+
+        if (weight_cal_tare_valid(&w->cal, w->temp_c)) {
+            // Warm start from the saved tare
+            w->offset = weight_cal_tare_at(&w->cal, w->temp_c);
+            w->cal.tare_boots++;
+            w->refine_tare = true;
+            ESP_LOGI(TAG, "Warm start %d: tare=%ld", id, (long) w->offset);
+        } else {
+            // Initial raw offset (empty scale)
+            int32_t raw = 0;
+            esp_err_t err = hx711_read_average(&w->hx, 10, &raw);
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "Failed to read average from HX711: %s", esp_err_to_name(err));
+            }
+            w->offset = raw;
+            weight_cal_update_tare(&w->cal, raw, w->temp_c);
+        }
 
-    load_calibration();
+        save_calibration(id);
 
-    baseline = 0;
-    filtered = 0;
-    detect_count = 0;
+        // The thresholds are converted to raw counts once here,
+        // through the table rather than the scale of the init
+        weight_detector_init(&w->det, &detector_config, 1.0f, w->offset);
+        apply_calibration(id);
+    }
 
-    ESP_LOGI(TAG, "Weight sensor initialized");
+    ESP_LOGI(TAG, "Weight sensor initialized, %s engine", detector_config.engine->name);
     return ESP_OK;
 }
 
 /**
- * Reads the weight in grams from the sensor,
- * applying calibration parameters.
- * @return Weight in grams
+ * Reads the raw value of the sensor, averaging 5 conversions
+ * @param id The weight sensor to read
+ * @param raw Set to the raw value
+ * @return true on success
  */
-float weight_read_grams(void)
+static bool read_raw_average(uint8_t id, int32_t *raw)
 {
-    int32_t raw;
-    esp_err_t ret = hx711_read_average(&hx, 5, &raw);
+    esp_err_t ret = hx711_read_average(&sensors[id].hx, 5, raw);
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "Failed to read weight %s", esp_err_to_name(ret));
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Reads the weight in grams from the sensor,
+ * applying calibration parameters. While the
+ * interrupt driven acquisition runs, the chip is
+ * not accessed and the last batch is returned.
+ * @param id The weight sensor to read
+ * @return Weight in grams
+ */
+float weight_read_grams(uint8_t id)
+{
+    if (id >= WEIGHT_SENSOR_NUM) {
         return 0;
     }
 
-    float net = (float)(raw - offset);
-    return net * scale;
+    weight_sensor_t *w = &sensors[id];
+    int32_t raw = w->last_raw;
+
+    if (!weight_sampler_running(id) && !read_raw_average(id, &raw)) {
+        return 0;
+    }
+
+    return net_grams(w, (float)(raw - w->offset));
 }
 
 /**
- * Checks if a vehicle is detected based on
- * the weight reading and predefined thresholds.
- * The algorithm uses baseline compensation,
- * EMA filtering, and a detection count mechanism for robustness.
- * @return true if a vehicle is detected, false otherwise
+ * Averages the samples acquired since the last batch
+ * @param id The weight sensor to read
+ * @param raw Set to the mean raw value of the batch
+ * @return false if no sample was acquired
  */
-bool weight_detect_vehicle(void)
+static bool read_batch_raw(uint8_t id, int32_t *raw)
 {
-    float raw_weight = weight_read_grams();
+    weight_sample_t samples[4 * WEIGHT_BATCH_SAMPLES];
+    size_t count = weight_sampler_read(id, samples, sizeof(samples) / sizeof(samples[0]));
 
-    if (raw_weight != last_raw_weight) {
-        ESP_LOGI(TAG, "Raw weight: %.1f g", raw_weight);
+    if (count == 0) {
+        return false;
     }
 
-    // Baseline drift compensation
-    baseline = baseline * 0.99f + raw_weight * 0.01f;
+    int64_t sum = 0;
+    for (size_t i = 0; i < count; i++) {
+        sum += samples[i].raw;
+    }
+
+    *raw = (int32_t)(sum / (int64_t) count);
+    return true;
+}
+
+/**
+ * Registers the callback notified when the first sample
+ * falls in the detection window and when the detection is
+ * dropped before being confirmed
+ * @param cb The callback, NULL to remove it
+ */
+void weight_set_candidate_callback(weight_candidate_cb_t cb)
+{
+    candidate_cb = cb;
+}
 
-    float net = raw_weight - baseline;
+/**
+ * Adaptive sampling: idle rate while the scale is empty,
+ * burst from the sample where the filtered weight leaves
+ * the noise band, and back to idle once the engine has
+ * decided or the scale has been empty for a while
+ * @param id The weight sensor
+ * @param result The outcome of the last sample
+ */
+static void schedule_sampling(uint8_t id, weight_sample_result_t result)
+{
+#if CONFIG_WEIGHT_IDLE_PERIOD > 0
+    weight_sensor_t *w = &sensors[id];
+    const weight_features_t *f = &w->det.features;
+
+    if (weight_sampler_rate(id) == WEIGHT_RATE_IDLE) {
+        // Rising edge: first sample of a new load
+        if (f->active == 1 && f->level_q > 0) {
+            w->quiet_batches = 0;
+            weight_sampler_set_rate(id, WEIGHT_RATE_BURST);
+        }
+        return;
+    }
 
-    // EMA filter
-    filtered = filtered * 0.05f + net * 0.95f;
+    switch (result) {
+        case WEIGHT_SAMPLE_CONFIRMED:
+        case WEIGHT_SAMPLE_REJECTED:
+        case WEIGHT_SAMPLE_TOO_HEAVY:
+            weight_sampler_set_rate(id, WEIGHT_RATE_IDLE);
+            break;
+
+        default:
+            w->quiet_batches = (f->active == 0) ? w->quiet_batches + 1 : 0;
+            if (w->quiet_batches >= WEIGHT_QUIET_BATCHES) {
+                weight_sampler_set_rate(id, WEIGHT_RATE_IDLE);
+            }
+            break;
+    }
+#endif
+}
 
-    if (raw_weight != last_raw_weight) {
-        ESP_LOGI(TAG, "Filtered weight: %.1f g", filtered);
-        last_raw_weight = raw_weight;
+/**
+ * Checks if a vehicle is detected based on
+ * the weight reading and predefined thresholds,
+ * see weight_detector_step() for the algorithm.
+ * @param id The weight sensor to check
+ * @return true if a vehicle is detected, false otherwise
+ */
+bool weight_detect_vehicle(uint8_t id)
+{
+    if (id >= WEIGHT_SENSOR_NUM) {
+        return false;
     }
 
-    // Noise rejection
-    if (fabsf(filtered) < NOISE_THRESHOLD) {
-        detect_count = 0;
+    weight_sensor_t *w = &sensors[id];
+    int32_t raw;
+
+    // One detector step per batch, the batch mean replaces
+    // the busy waiting average of the polled reads
+    bool read = weight_sampler_running(id) ? read_batch_raw(id, &raw) : read_raw_average(id, &raw);
+
+    if (!read) {
         return false;
     }
 
-    // Threshold window
-    if (filtered > MIN_CAR_WEIGHT && filtered < MAX_CAR_WEIGHT) {
-        detect_count++;
+    weight_sample_result_t result = weight_detector_step(&w->det, raw);
 
-        if (detect_count >= DETECT_COUNT_REQUIRED) {
+    if (weight_sampler_running(id)) {
+        schedule_sampling(id, result);
+    }
+
+    refine_tare(id, raw);
+
+    if (raw != w->last_raw) {
+        ESP_LOGD(TAG, "Raw weight: %.1f g", net_grams(w, (float)(raw - w->offset)));
+        ESP_LOGD(TAG, "Filtered weight: %.1f g", net_grams(w, weight_detector_filtered_counts(&w->det)));
+        w->last_raw = raw;
+    }
+
+    switch (result) {
+        case WEIGHT_SAMPLE_CANDIDATE:
+            // First sample in the window: a vehicle may be arriving
+            trace_record(TRACE_WEIGHT_CANDIDATE, id, 0);
+
+            if (candidate_cb != NULL) {
+                candidate_cb(id, true);
+            }
+            return false;
+
+        case WEIGHT_SAMPLE_REJECTED:
+        case WEIGHT_SAMPLE_TOO_HEAVY:
+            ESP_LOGI(TAG, "Load rejected: %s (%.1f g)",
+                result == WEIGHT_SAMPLE_TOO_HEAVY ? "too heavy" : "not a vehicle",
+                net_grams(w, weight_detector_filtered_counts(&w->det)));
+            // A candidate may be open, cancelling without one is harmless
+            // fall through
+
+        case WEIGHT_SAMPLE_DROPPED:
+            if (candidate_cb != NULL) {
+                candidate_cb(id, false);
+            }
+            return false;
+
+        case WEIGHT_SAMPLE_CONFIRMED: {
+            trace_record(TRACE_WEIGHT_TRIGGER, id, 0);
+
+            // Grams are only computed here, to be displayed and sent
+            float filtered = net_grams(w, weight_detector_filtered_counts(&w->det));
             ESP_LOGI(TAG, "Vehicle detected: %.1f g", filtered);
             char weight_str[32];
             snprintf(weight_str, sizeof(weight_str), "Valid weight: %.1f g", filtered);
@@ -197,15 +538,13 @@ bool weight_detect_vehicle(void)
             // Update data to send to the backed
             float rounded = roundf(filtered * 10.0f) / 10.0f;
             set_weight_data(&rounded);
-            detect_count = 0;
 
             return true;
         }
-    } else {
-        detect_count = 0;
-    }
 
-    return false;
+        default:
+            return false;
+    }
 }
 
 /**
@@ -213,37 +552,80 @@ bool weight_detect_vehicle(void)
  * The user is prompted to remove all weight, then place
  * the known weight on the scale. Calibration parameters
  * are computed and saved to NVS.
+ * @param id The weight sensor to calibrate
  * @param known_weight_g The known weight in grams used for calibration
  */
-void weight_calibrate(float known_weight_g)
+void weight_calibrate(uint8_t id, float known_weight_g)
 {
-    esp_err_t ret = hx711_init(&hx);
+    weight_calibrate_points(id, &known_weight_g, 1);
+}
+
+/**
+ * Calibrates the weight sensor on several known weights,
+ * giving a piecewise linear table: readings near the
+ * edges of the detection window are accurate even if the
+ * load cell is not linear. The user is prompted to remove
+ * all weight, then to place each known weight in turn.
+ * The temperature drift learned so far is kept.
+ * @param id The weight sensor to calibrate
+ * @param weights_g The known weights in grams
+ * @param num The number of known weights
+ */
+void weight_calibrate_points(uint8_t id, const float *weights_g, size_t num)
+{
+    if (id >= WEIGHT_SENSOR_NUM) {
+        ESP_LOGE(TAG, "Invalid weight sensor %d", id);
+        return;
+    }
+
+    weight_sensor_t *w = &sensors[id];
+    esp_err_t ret = hx711_init(&w->hx);
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "Failed to initialize HX711: %s", esp_err_to_name(ret));
     }
 
+    load_calibration(id);
+
     int32_t raw_empty, raw_loaded;
 
     ESP_LOGI(TAG, "Calibrating... remove all weight");
     vTaskDelay(pdMS_TO_TICKS(2000));
 
-    hx711_read_average(&hx, 15, &raw_empty);
-    offset = raw_empty;
+    hx711_read_average(&w->hx, 15, &raw_empty);
+    float temp_c = read_temperature();
 
-    ESP_LOGI(TAG, "Raw empty reading: %d", raw_empty);
+    ESP_LOGI(TAG, "Raw empty reading: %ld", (long) raw_empty);
 
-    ESP_LOGI(TAG, "Place %.1f g on the scale", known_weight_g);
-    vTaskDelay(pdMS_TO_TICKS(5000));
+    // New table, same load cell: the drift coefficients stay
+    weight_cal_record_t cal = w->cal;
+    cal.points_num = 1;
+    cal.points[0] = (weight_cal_point_t) { 0 };
+    cal.ref_temp_c = temp_c;
+    cal.tare = 0;
+    weight_cal_update_tare(&cal, raw_empty, temp_c);
 
-    hx711_read_average(&hx, 15, &raw_loaded);
+    for (size_t i = 0; i < num; i++) {
+        ESP_LOGI(TAG, "Place %.1f g on the scale", weights_g[i]);
+        vTaskDelay(pdMS_TO_TICKS(5000));
 
-    ESP_LOGI(TAG, "Raw loaded reading: %d", raw_loaded);
+        hx711_read_average(&w->hx, 15, &raw_loaded);
 
-    scale = known_weight_g / ((float)(raw_loaded - raw_empty) ? : known_weight_g);
+        ESP_LOGI(TAG, "Raw loaded reading: %ld", (long) raw_loaded);
 
-    save_calibration();
+        if (!weight_cal_add_point(&cal, (float)(raw_loaded - raw_empty), weights_g[i])) {
+            ESP_LOGE(TAG, "Point %.1f g refused: the readings must grow with the weight", weights_g[i]);
+        }
+    }
 
-    ESP_LOGI(TAG, "Calibration complete: scale=%.6f", scale);
+    if (!weight_cal_is_valid(&cal)) {
+        ESP_LOGE(TAG, "Calibration failed, the previous one is kept");
+        return;
+    }
+
+    w->cal = cal;
+    save_calibration(id);
+
+    ESP_LOGI(TAG, "Calibration complete: %d points", cal.points_num);
     ESP_LOGI(TAG, "Restart the device to apply new calibration");
 }
 
@@ -252,36 +634,93 @@ void weight_calibrate(float known_weight_g)
 //////////////// Weight detection task ///////////////
 //////////////////////////////////////////////////////
 
-void enable_weight_detection(bool enable) {
-    weight_enabled = enable;
+void enable_weight_detection(uint8_t id, bool enable) {
+    if (id < WEIGHT_SENSOR_NUM) {
+        sensors[id].enabled = enable;
+    }
 }
 
 /**
  * Weight detection task
- * Continuously monitors the weight sensor (since
- * it can't generate an interrupt directly).
+ * Sleeps until the acquisition (driven by the
+ * DOUT ready interrupt of the HX711) has a new
+ * batch of samples, then runs the detection on it.
+ * The acquisition idles, with the chip powered
+ * down, while detection is disabled and while the
+ * scale is empty; it bursts when detection is
+ * enabled again and when a load appears.
+ * If the interrupt cannot be set up, the sensor
+ * is polled every 300 ms instead.
  * When a valid weight is detected, it triggers
- * the appropriate FSM event.
+ * the appropriate FSM event on the lane the
+ * sensor belongs to (the sensor id is the lane id).
+ * @param arg The id of the weight sensor, cast to a pointer
  */
 void weight_task(void *arg) {
-    ESP_LOGI(TAG, "Starting weight detection task...");
+    uint8_t id = (uint8_t)(uintptr_t) arg;
+    ESP_LOGI(TAG, "Starting weight detection task %d...", id);
+
+    esp_err_t err = weight_sampler_start(id, &sensors[id].hx, xTaskGetCurrentTaskHandle());
+    bool interrupt_driven = err == ESP_OK;
+    bool was_enabled = false;
+
+    if (!interrupt_driven) {
+        ESP_LOGW(TAG, "Interrupt driven acquisition unavailable (%s), polling", esp_err_to_name(err));
+    }
 
     while (1) {
+        if (interrupt_driven) {
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1000));
+        }
+
         // Check if weight detection is enabled
-        if (!weight_enabled) {
-            vTaskDelay(pdMS_TO_TICKS(500));
+        if (!sensors[id].enabled) {
+            if (interrupt_driven) {
+#if CONFIG_WEIGHT_IDLE_PERIOD > 0
+                weight_sampler_set_rate(id, WEIGHT_RATE_IDLE);
+#endif
+                // Samples acquired while disabled are thrown away
+                weight_sample_t discard[8];
+                while (weight_sampler_read(id, discard, 8) > 0) {}
+            } else {
+                vTaskDelay(pdMS_TO_TICKS(500));
+            }
+            was_enabled = false;
             continue;
         }
+
+        // Back in IDLE: a vehicle may already be waiting on the scale
+        if (!was_enabled && interrupt_driven) {
+            sensors[id].quiet_batches = 0;
+            weight_sampler_set_rate(id, WEIGHT_RATE_BURST);
+        }
+        was_enabled = true;
         
-        if (weight_detect_vehicle()) {
+        if (weight_detect_vehicle(id)) {
             ESP_LOGI(TAG, "Valid weight detected!");
-            fsm_handle_event(VALID_WEIGHT_DETECTED);
+            fsm_post_event(id, VALID_WEIGHT_DETECTED);
         }
         
-        // Sleep for 300 ms before next reading
-        vTaskDelay(pdMS_TO_TICKS(300));
+        if (!interrupt_driven) {
+            // Sleep for 300 ms before next reading
+            vTaskDelay(pdMS_TO_TICKS(300));
+        }
     }
 }
 
+/**
+ * @return The acquisition rate of a sensor, "polled" without interrupt
+ */
+const char *weight_sampling_rate(uint8_t id)
+{
+    if (!weight_sampler_running(id)) {
+        return "polled";
+    }
 
+    return weight_sampler_rate(id) == WEIGHT_RATE_BURST ? "burst" : "idle";
+}
 
+uint32_t weight_samples_per_hour(uint8_t id)
+{
+    return weight_sampler_samples_per_hour(id);
+}
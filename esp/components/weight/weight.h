@@ -11,24 +11,45 @@
 
 #include "esp_err.h"
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
-// Initialize the weight sensor
+// Number of weight sensors: only the first lane, the
+// entry one, has a scale. The id of a sensor is the id of its lane
+#define WEIGHT_SENSOR_NUM 1
+
+// Initialize the weight sensors
 esp_err_t weight_init(void);
 
 // Read the weight in grams
-float weight_read_grams(void);
+float weight_read_grams(uint8_t id);
 
 // Check if a vehicle is detected based on weight threshold
-bool weight_detect_vehicle(void);
+bool weight_detect_vehicle(uint8_t id);
 
 // Calibrate the weight sensor with a known weight in grams
-void weight_calibrate(float known_weight_g);
+void weight_calibrate(uint8_t id, float known_weight_g);
+
+// Calibrate the weight sensor with several known weights in grams
+void weight_calibrate_points(uint8_t id, const float *weights_g, size_t num);
 
 // Allows other modules to enable/disable weight detection
-void enable_weight_detection(bool enable);
+void enable_weight_detection(uint8_t id, bool enable);
+
+// Called with candidate = true on the first sample in the detection
+// window, and with candidate = false if the detection is then dropped
+typedef void (*weight_candidate_cb_t)(uint8_t id, bool candidate);
+
+// Registers the callback notified about detection candidates
+void weight_set_candidate_callback(weight_candidate_cb_t cb);
+
+// Current acquisition rate of a sensor: "burst", "idle" or "polled"
+const char *weight_sampling_rate(uint8_t id);
+
+// HX711 conversions read per hour
+uint32_t weight_samples_per_hour(uint8_t id);
 
-// Weight detection task
+// Weight detection task, the argument is the sensor id
 void weight_task(void *arg);
 
 #endif /* WEIGHT_H */
\ No newline at end of file
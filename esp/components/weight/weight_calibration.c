@@ -0,0 +1,215 @@
+/**
+ * @file weight_calibration.c
+ *
+ * Piecewise linear calibration table with temperature
+ * compensation and the saved tare of a weight sensor
+ *
+ */
+
+#include "weight_calibration.h"
+
+#include <math.h>
+#include <string.h>
+
+void weight_cal_init_linear(weight_cal_record_t *rec, float scale, float tare, float temp_c)
+{
+    memset(rec, 0, sizeof(*rec));
+    rec->version = WEIGHT_CAL_VERSION;
+    rec->points_num = 1;
+    rec->ref_temp_c = temp_c;
+    rec->tare = (int32_t) lroundf(tare);
+    rec->tare_temp_c = temp_c;
+
+    // The second point only fixes the slope of the single segment
+    if (fabsf(scale) > 1e-9f) {
+        weight_cal_add_point(rec, 100.0f / scale, 100.0f);
+    }
+}
+
+bool weight_cal_is_valid(const weight_cal_record_t *rec)
+{
+    if (rec->version != WEIGHT_CAL_VERSION || rec->points_num < 2 || rec->points_num > WEIGHT_CAL_MAX_POINTS) {
+        return false;
+    }
+
+    if (rec->points[0].grams != 0 || rec->points[0].counts != 0) {
+        return false;
+    }
+
+    // Strictly monotonic in both grams and counts, in the same direction
+    float direction = rec->points[1].counts;
+
+    for (int i = 1; i < rec->points_num; i++) {
+        const weight_cal_point_t *a = &rec->points[i - 1], *b = &rec->points[i];
+
+        if (b->grams <= a->grams || (b->counts - a->counts) * direction <= 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Adds a point to the table, keeping it sorted by weight.
+ * The table must stay monotonic: more weight, more counts
+ * (or fewer, for a load cell mounted the other way round)
+ * @param rec The record
+ * @param counts Net raw counts of the point
+ * @param grams Weight of the point
+ * @return false if the point was refused
+ */
+bool weight_cal_add_point(weight_cal_record_t *rec, float counts, float grams)
+{
+    if (rec->points_num >= WEIGHT_CAL_MAX_POINTS || grams <= 0 || counts == 0) {
+        return false;
+    }
+
+    weight_cal_record_t candidate = *rec;
+    int i = candidate.points_num;
+
+    while (i > 1 && candidate.points[i - 1].grams > grams) {
+        candidate.points[i] = candidate.points[i - 1];
+        i--;
+    }
+
+    candidate.points[i] = (weight_cal_point_t) { .counts = counts, .grams = grams };
+    candidate.points_num++;
+
+    if (!weight_cal_is_valid(&candidate)) {
+        return false;
+    }
+
+    *rec = candidate;
+    return true;
+}
+
+static float temp_delta(float temp_c, float ref_c)
+{
+    return (isnan(temp_c) || isnan(ref_c)) ? 0 : temp_c - ref_c;
+}
+
+// Index of the segment used for the value, the end segments are extrapolated
+static int segment(const weight_cal_record_t *rec, float value, bool by_grams)
+{
+    int i = 1;
+
+    while (i < rec->points_num - 1) {
+        const weight_cal_point_t *p = &rec->points[i];
+        float bound = by_grams ? p->grams : fabsf(p->counts);
+
+        if (value < bound) {
+            break;
+        }
+        i++;
+    }
+
+    return i;
+}
+
+/**
+ * Converts net raw counts into grams: linear interpolation
+ * in the table, then span correction for the temperature
+ * @param rec The record
+ * @param counts Net raw counts
+ * @param temp_c Current temperature, NAN if unknown
+ * @return The weight in grams
+ */
+float weight_cal_grams(const weight_cal_record_t *rec, float counts, float temp_c)
+{
+    float sign = rec->points[1].counts < 0 ? -1.0f : 1.0f;
+    float magnitude = counts * sign;
+    int i = segment(rec, fabsf(magnitude), false);
+
+    const weight_cal_point_t *a = &rec->points[i - 1], *b = &rec->points[i];
+    float slope = (b->grams - a->grams) / fabsf(b->counts - a->counts);
+    float grams;
+
+    if (magnitude < 0) {
+        // Below the empty scale, keep the slope of the first segment
+        grams = magnitude * (rec->points[1].grams / fabsf(rec->points[1].counts));
+    } else {
+        grams = a->grams + (magnitude - fabsf(a->counts)) * slope;
+    }
+
+    return grams / (1.0f + rec->span_drift * temp_delta(temp_c, rec->ref_temp_c));
+}
+
+/**
+ * Inverse of weight_cal_grams()
+ * @param rec The record
+ * @param grams Weight
+ * @param temp_c Current temperature, NAN if unknown
+ * @return Net raw counts, with the sign of the load cell
+ */
+float weight_cal_counts(const weight_cal_record_t *rec, float grams, float temp_c)
+{
+    float sign = rec->points[1].counts < 0 ? -1.0f : 1.0f;
+    float table_grams = grams * (1.0f + rec->span_drift * temp_delta(temp_c, rec->ref_temp_c));
+    float magnitude;
+
+    if (table_grams < 0) {
+        magnitude = table_grams * fabsf(rec->points[1].counts) / rec->points[1].grams;
+    } else {
+        int i = segment(rec, table_grams, true);
+        const weight_cal_point_t *a = &rec->points[i - 1], *b = &rec->points[i];
+        float slope = fabsf(b->counts - a->counts) / (b->grams - a->grams);
+
+        magnitude = fabsf(a->counts) + (table_grams - a->grams) * slope;
+    }
+
+    return magnitude * sign;
+}
+
+int32_t weight_cal_tare_at(const weight_cal_record_t *rec, float temp_c)
+{
+    return rec->tare + (int32_t) lroundf(rec->tare_drift * temp_delta(temp_c, rec->tare_temp_c));
+}
+
+/**
+ * The saved tare is used at boot if it was refined not too
+ * many boots ago and the temperature did not move much since;
+ * without a temperature reading only the boots are checked
+ * @param rec The record
+ * @param temp_c Current temperature, NAN if unknown
+ * @return true if the tare does not need to be measured
+ */
+bool weight_cal_tare_valid(const weight_cal_record_t *rec, float temp_c)
+{
+    if (rec->tare == 0 || rec->tare_boots >= WEIGHT_TARE_VALID_BOOTS) {
+        return false;
+    }
+
+    return fabsf(temp_delta(temp_c, rec->tare_temp_c)) <= WEIGHT_TARE_VALID_C;
+}
+
+/**
+ * Saves a measured tare. When the temperature moved enough
+ * since the previous one, the slope between the two is
+ * averaged into the tare drift coefficient
+ * @param rec The record
+ * @param tare Measured tare, raw counts
+ * @param temp_c Temperature of the measure, NAN if unknown
+ */
+void weight_cal_update_tare(weight_cal_record_t *rec, int32_t tare, float temp_c)
+{
+    float delta = temp_delta(temp_c, rec->tare_temp_c);
+
+    if (rec->tare != 0 && fabsf(delta) >= WEIGHT_DRIFT_MIN_DELTA_C) {
+        float slope = (float)(tare - rec->tare) / delta;
+
+        rec->tare_drift = rec->drift_updates == 0 ? slope : rec->tare_drift * 0.75f + slope * 0.25f;
+        if (rec->drift_updates < UINT16_MAX) {
+            rec->drift_updates++;
+        }
+    }
+
+    // The drift is learned between measures far enough apart
+    // in temperature, so the reference only moves with them
+    if (rec->tare == 0 || isnan(rec->tare_temp_c) || fabsf(delta) >= WEIGHT_DRIFT_MIN_DELTA_C || isnan(temp_c)) {
+        rec->tare_temp_c = temp_c;
+    }
+
+    rec->tare = tare - (int32_t) lroundf(rec->tare_drift * temp_delta(temp_c, rec->tare_temp_c));
+    rec->tare_boots = 0;
+}
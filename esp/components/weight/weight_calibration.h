@@ -0,0 +1,81 @@
+/**
+ * @file weight_calibration.h
+ *
+ * Calibration record of a weight sensor, stored as a single
+ * versioned blob in NVS: a piecewise linear table from net
+ * raw counts to grams, the temperature drift of the tare and
+ * of the span, and the last known tare.
+ *
+ * Like weight_detector.h it has no hardware dependency, so
+ * that it can also be compiled on the host.
+ *
+ */
+#ifndef WEIGHT_CALIBRATION_H
+#define WEIGHT_CALIBRATION_H
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Bump when the layout of weight_cal_record_t changes
+#define WEIGHT_CAL_VERSION 1
+
+// Points of the table, the empty scale included
+#define WEIGHT_CAL_MAX_POINTS 8
+
+// Validity window of the saved tare: boots started from it
+// without a refinement, and temperature change since it was measured
+#define WEIGHT_TARE_VALID_BOOTS 16
+#define WEIGHT_TARE_VALID_C     3.0f
+
+// Smallest temperature change used to learn the tare drift
+#define WEIGHT_DRIFT_MIN_DELTA_C 2.0f
+
+typedef struct {
+    float counts;           // net raw counts (reading - tare)
+    float grams;
+} weight_cal_point_t;
+
+typedef struct {
+    uint16_t version;
+    uint16_t points_num;
+    weight_cal_point_t points[WEIGHT_CAL_MAX_POINTS];   // sorted by grams, points[0] is 0 g
+
+    // Temperature compensation, NAN temperatures when unknown
+    float ref_temp_c;       // temperature of the table
+    float tare_drift;       // tare change, raw counts per degree
+    float span_drift;       // relative span change per degree
+
+    // Last known tare
+    int32_t tare;           // raw counts
+    float tare_temp_c;      // temperature of the tare
+    uint16_t tare_boots;    // boots started from the saved tare since it was measured
+    uint16_t drift_updates; // tare drift estimates so far
+} weight_cal_record_t;
+
+// Builds a single segment record from a scale factor and a tare
+void weight_cal_init_linear(weight_cal_record_t *rec, float scale, float tare, float temp_c);
+
+// Checks the version and the table of a record read from NVS
+bool weight_cal_is_valid(const weight_cal_record_t *rec);
+
+// Adds a point to the table, false if it is not monotonic or the table is full
+bool weight_cal_add_point(weight_cal_record_t *rec, float counts, float grams);
+
+// Converts net raw counts into grams at the given temperature
+float weight_cal_grams(const weight_cal_record_t *rec, float counts, float temp_c);
+
+// Converts grams into net raw counts at the given temperature
+float weight_cal_counts(const weight_cal_record_t *rec, float grams, float temp_c);
+
+// Returns the saved tare corrected for the given temperature
+int32_t weight_cal_tare_at(const weight_cal_record_t *rec, float temp_c);
+
+// Returns true if the saved tare can be used without measuring it again
+bool weight_cal_tare_valid(const weight_cal_record_t *rec, float temp_c);
+
+// Stores a measured tare and learns the tare drift from the previous one
+void weight_cal_update_tare(weight_cal_record_t *rec, int32_t tare, float temp_c);
+
+#endif /* WEIGHT_CALIBRATION_H */
@@ -0,0 +1,424 @@
+/**
+ * @file weight_detector.c
+ *
+ * Vehicle detection on the weight samples: baseline
+ * compensation, EMA filtering and feature extraction,
+ * followed by the decision engines, computed in fixed
+ * point on the raw counts
+ *
+ */
+
+#include "weight_detector.h"
+
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+const weight_detector_config_t weight_detector_default_config = {
+    .engine = &weight_engine_sequential,
+    .noise_threshold = WEIGHT_NOISE_THRESHOLD,
+    .min_weight = WEIGHT_MIN_CAR_WEIGHT,
+    .max_weight = WEIGHT_MAX_CAR_WEIGHT,
+    .count_required = WEIGHT_DETECT_COUNT_REQUIRED,
+    .settle_deviation = WEIGHT_SETTLE_DEVIATION,
+};
+
+static const weight_engine_t *const engines[] = {
+    &weight_engine_count,
+    &weight_engine_sequential,
+};
+
+static void reset_features(weight_detector_t *det)
+{
+    memset(&det->features, 0, sizeof(det->features));
+    det->peak_q = 0;
+}
+
+void weight_detector_init(weight_detector_t *det, const weight_detector_config_t *config, float scale, float offset)
+{
+    det->config = config ? config : &weight_detector_default_config;
+    det->baseline_acc = 0;
+    det->baseline_q = 0;
+    det->filtered_q = 0;
+    reset_features(det);
+    det->config->engine->reset(det);
+
+    weight_detector_set_calibration(det, scale, offset);
+}
+
+static int32_t counts_to_q(float counts)
+{
+    return (int32_t) lroundf(counts * (1 << WEIGHT_Q_BITS));
+}
+
+/**
+ * Converts the thresholds from grams to raw counts. A
+ * negative scale (load cell mounted the other way round)
+ * is handled by flipping the sign of the samples, so the
+ * comparisons keep the same direction.
+ * @param det The detector
+ * @param scale Grams per raw count
+ * @param offset Raw count of the empty scale
+ */
+void weight_detector_set_calibration(weight_detector_t *det, float scale, float offset)
+{
+    const weight_detector_config_t *cfg = det->config;
+    float abs_scale = fabsf(scale);
+
+    if (abs_scale < 1e-9f) {
+        abs_scale = 1.0f;
+    }
+
+    weight_detector_counts_t counts = {
+        .offset = (int32_t) lroundf(offset),
+        .sign = (scale < 0) ? -1 : 1,
+        .noise = cfg->noise_threshold / abs_scale,
+        .min = cfg->min_weight / abs_scale,
+        .max = cfg->max_weight / abs_scale,
+        .settle = cfg->settle_deviation / abs_scale,
+    };
+
+    weight_detector_set_counts(det, &counts);
+    det->scale = scale;
+}
+
+/**
+ * Sets the thresholds already converted into net raw counts,
+ * for calibrations that are not a single scale factor (the
+ * grams are then computed by the caller, det->scale is 0)
+ * @param det The detector
+ * @param counts Tare, direction and thresholds in raw counts
+ */
+void weight_detector_set_counts(weight_detector_t *det, const weight_detector_counts_t *counts)
+{
+    det->offset = counts->offset;
+    det->sign = counts->sign < 0 ? -1 : 1;
+    det->scale = 0;
+
+    det->noise_q = counts_to_q(counts->noise);
+    det->min_q = counts_to_q(counts->min);
+    det->max_q = counts_to_q(counts->max);
+    det->settle_q = counts_to_q(counts->settle);
+    det->settle_var_q = (int64_t) det->settle_q * det->settle_q;
+}
+
+/**
+ * Moves the tare: the baseline is moved by the same amount,
+ * so the net weight, and with it the detection, does not jump
+ * @param det The detector
+ * @param offset New raw count of the empty scale
+ */
+void weight_detector_set_offset(weight_detector_t *det, int32_t offset)
+{
+    int32_t shift_q = det->sign * (det->offset - offset) * (1 << WEIGHT_Q_BITS);
+
+    det->baseline_acc += (int64_t) shift_q << WEIGHT_BASELINE_FRAC_BITS;
+    det->baseline_q += shift_q;
+    det->offset = offset;
+}
+
+// state += (target - state) * alpha, alpha in Q15, rounded
+static inline int32_t smooth(int32_t state, int32_t target, int32_t alpha)
+{
+    int64_t delta = (int64_t)(target - state) * alpha;
+    return state + (int32_t)((delta + (1 << (WEIGHT_COEF_BITS - 1))) >> WEIGHT_COEF_BITS);
+}
+
+/**
+ * Updates the features with the new filtered value.
+ * Outside the noise band the samples are collected in
+ * a small window, the episode restarts from scratch
+ * every time the weight gets back into the noise band.
+ * @param det The detector
+ */
+static void extract_features(weight_detector_t *det)
+{
+    weight_features_t *f = &det->features;
+    int32_t level = det->filtered_q;
+    int32_t magnitude = level < 0 ? -level : level;
+
+    if (magnitude < det->noise_q) {
+        reset_features(det);
+        f->level_q = level;
+        return;
+    }
+
+    f->slope_q = f->active ? level - f->level_q : level;
+    f->level_q = level;
+
+    if (f->slope_q > f->rise_q) {
+        f->rise_q = f->slope_q;
+    }
+
+    if (level > det->peak_q) {
+        det->peak_q = level;
+    }
+
+    if (f->active < UINT16_MAX) {
+        f->active++;
+    }
+
+    // A step of the load starts a new plateau: the window
+    // only holds the samples since the last step
+    int32_t step = f->slope_q < 0 ? -f->slope_q : f->slope_q;
+    if (step > 2 * det->settle_q) {
+        f->count = 0;
+        f->entry_q = f->slope_q;
+    }
+
+    // Sliding window of the last samples of the plateau
+    memmove(&det->window_q[1], &det->window_q[0], (WEIGHT_FEATURE_WINDOW - 1) * sizeof(int32_t));
+    det->window_q[0] = level;
+
+    if (f->count < WEIGHT_FEATURE_WINDOW) {
+        f->count++;
+    }
+
+    int64_t sum = 0;
+    for (int i = 0; i < f->count; i++) {
+        sum += det->window_q[i];
+    }
+    f->mean_q = (int32_t)(sum / f->count);
+
+    int64_t squares = 0;
+    for (int i = 0; i < f->count; i++) {
+        int64_t d = det->window_q[i] - f->mean_q;
+        squares += d * d;
+    }
+    f->variance_q = squares / f->count;
+
+    f->overshoot_q = det->peak_q - level;
+}
+
+/**
+ * Front end of the detector: tare, baseline drift
+ * compensation and EMA filtering of a sample
+ * @param det The detector
+ * @param raw The raw reading of the HX711
+ * @return The filtered weight, net raw counts in Q4
+ */
+int32_t weight_detector_filter(weight_detector_t *det, int32_t raw)
+{
+    // Tare, the scale factor is folded into the thresholds
+    int32_t x = det->sign * (raw - det->offset) * (1 << WEIGHT_Q_BITS);
+
+    // Baseline drift compensation, accumulated with extra
+    // fractional bits so that a slow drift is tracked too
+    int64_t delta = (((int64_t) x << WEIGHT_BASELINE_FRAC_BITS) - det->baseline_acc) * WEIGHT_BASELINE_ALPHA;
+    det->baseline_acc += (delta + (1 << (WEIGHT_BASELINE_COEF_BITS - 1))) >> WEIGHT_BASELINE_COEF_BITS;
+    det->baseline_q = (int32_t)((det->baseline_acc + (1 << (WEIGHT_BASELINE_FRAC_BITS - 1))) >> WEIGHT_BASELINE_FRAC_BITS);
+
+    int32_t net = x - det->baseline_q;
+
+    // EMA filter
+    det->filtered_q = smooth(det->filtered_q, net, WEIGHT_EMA_ALPHA);
+
+    return det->filtered_q;
+}
+
+/**
+ * Feeds a sample to the detector. The front end applies
+ * baseline compensation and EMA filtering, extracts the
+ * features and hands them to the engine of the config.
+ * @param det The detector
+ * @param raw The raw reading of the HX711
+ * @return What the sample changed in the detection
+ */
+weight_sample_result_t weight_detector_step(weight_detector_t *det, int32_t raw)
+{
+    weight_detector_filter(det, raw);
+
+    extract_features(det);
+
+    return det->config->engine->decide(det, &det->features);
+}
+
+//////////////////////////////////////////////////////
+//////////////// Count engine ////////////////////////
+//////////////////////////////////////////////////////
+
+static void count_reset(weight_detector_t *det)
+{
+    det->detect_count = 0;
+}
+
+static weight_sample_result_t reset_count(weight_detector_t *det)
+{
+    bool dropped = det->detect_count > 0;
+    det->detect_count = 0;
+
+    return dropped ? WEIGHT_SAMPLE_DROPPED : WEIGHT_SAMPLE_NONE;
+}
+
+/**
+ * Confirms a vehicle after count_required consecutive
+ * filtered samples inside the detection window.
+ * @param det The detector
+ * @param f The features of the sample
+ * @return What the sample changed in the detection
+ */
+static weight_sample_result_t count_decide(weight_detector_t *det, const weight_features_t *f)
+{
+    // Noise rejection
+    if (f->active == 0) {
+        return reset_count(det);
+    }
+
+    // Threshold window
+    if (f->level_q <= det->min_q || f->level_q >= det->max_q) {
+        return reset_count(det);
+    }
+
+    det->detect_count++;
+
+    if (det->detect_count >= det->config->count_required) {
+        det->detect_count = 0;
+        return WEIGHT_SAMPLE_CONFIRMED;
+    }
+
+    return (det->detect_count == 1) ? WEIGHT_SAMPLE_CANDIDATE : WEIGHT_SAMPLE_NONE;
+}
+
+const weight_engine_t weight_engine_count = {
+    .name = "count",
+    .reset = count_reset,
+    .decide = count_decide,
+};
+
+//////////////////////////////////////////////////////
+//////////////// Sequential engine ///////////////////
+//////////////////////////////////////////////////////
+
+static void sequential_reset(weight_detector_t *det)
+{
+    det->score = 0;
+    det->heavy_score = 0;
+    det->decided = false;
+    det->detect_count = 0;
+}
+
+/**
+ * Sequential test: every sample adds evidence for or
+ * against a vehicle, and the decision is taken as soon
+ * as the evidence crosses a bound instead of after a
+ * fixed number of samples.
+ * - a settled load (low variance, flat slope, no
+ *   overshoot) in the window is evidence of a vehicle,
+ *   below it of debris, above it of a heavy object
+ * - a fluctuating load is evidence of a hand
+ * - a load still rising adds nothing
+ * A vehicle rolls on at a constant speed, so its last step
+ * is as steep as the rest of the ramp and one settled sample
+ * confirms it. A hand slows down into the press: a plateau
+ * entered with less than 2/3 of the steepest slope needs a
+ * second settled sample.
+ * One decision is taken per episode: after it the engine
+ * waits for the weight to get back into the noise band.
+ * detect_count is 1 while a candidate is open.
+ * @param det The detector
+ * @param f The features of the sample
+ * @return What the sample changed in the detection
+ */
+static weight_sample_result_t sequential_decide(weight_detector_t *det, const weight_features_t *f)
+{
+    if (f->active == 0) {
+        bool dropped = det->detect_count > 0;
+        sequential_reset(det);
+        return dropped ? WEIGHT_SAMPLE_DROPPED : WEIGHT_SAMPLE_NONE;
+    }
+
+    // Nothing to decide on a load being removed, the
+    // baseline undershoots when a vehicle leaves
+    if (det->decided || f->level_q <= 0) {
+        return WEIGHT_SAMPLE_NONE;
+    }
+
+    // A vehicle does not come back down from its peak, apart
+    // from the noise, a small bounce and the baseline tracking
+    int32_t overshoot_max = 2 * det->settle_q + det->peak_q / 16;
+    int32_t slope = f->slope_q < 0 ? -f->slope_q : f->slope_q;
+
+    // The first sample of a plateau still carries the tail of
+    // the filtered step: its slope is allowed twice the settle
+    // deviation, as long as the window is already quiet
+    int32_t slope_max = f->count == 2 ? 2 * det->settle_q : det->settle_q;
+    bool settled = f->count >= 2 && f->variance_q <= det->settle_var_q &&
+                   slope <= slope_max && f->overshoot_q <= overshoot_max;
+
+    // A vehicle does not move again once settled: a new step
+    // after some evidence drops it, the hand shifted its press
+    if (f->count == 1 && det->score > 0) {
+        det->score = 0;
+    }
+
+    if (settled) {
+        int weight = 3 * f->entry_q >= 2 * f->rise_q ? WEIGHT_SEQ_SETTLED : WEIGHT_SEQ_SLOWED;
+
+        if (f->mean_q >= det->max_q) {
+            det->heavy_score += weight;
+        } else if (f->mean_q <= det->min_q) {
+            det->score -= weight;
+        } else {
+            det->score += weight;
+        }
+    } else if (f->overshoot_q > overshoot_max) {
+        // Went up and came back down: pressed by a hand
+        det->score -= 1;
+    }
+
+    weight_sample_result_t result = WEIGHT_SAMPLE_NONE;
+
+    if (det->score >= WEIGHT_SEQ_ACCEPT) {
+        result = WEIGHT_SAMPLE_CONFIRMED;
+    } else if (det->heavy_score >= WEIGHT_SEQ_ACCEPT) {
+        result = WEIGHT_SAMPLE_TOO_HEAVY;
+    } else if (det->score <= WEIGHT_SEQ_REJECT) {
+        result = WEIGHT_SAMPLE_REJECTED;
+    }
+
+    if (result != WEIGHT_SAMPLE_NONE) {
+        det->decided = true;
+        det->detect_count = 0;
+        return result;
+    }
+
+    // First sample in the window opens the candidate
+    if (det->detect_count == 0 && f->level_q > det->min_q && f->level_q < det->max_q) {
+        det->detect_count = 1;
+        return WEIGHT_SAMPLE_CANDIDATE;
+    }
+
+    return WEIGHT_SAMPLE_NONE;
+}
+
+const weight_engine_t weight_engine_sequential = {
+    .name = "sequential",
+    .reset = sequential_reset,
+    .decide = sequential_decide,
+};
+
+float weight_detector_grams(const weight_detector_t *det, int32_t raw)
+{
+    return (float)(raw - det->offset) * det->scale;
+}
+
+float weight_detector_filtered_grams(const weight_detector_t *det)
+{
+    return (float) det->sign * det->filtered_q * det->scale / (1 << WEIGHT_Q_BITS);
+}
+
+float weight_detector_filtered_counts(const weight_detector_t *det)
+{
+    return (float) det->sign * det->filtered_q / (1 << WEIGHT_Q_BITS);
+}
+
+const weight_engine_t *weight_detector_find_engine(const char *name)
+{
+    for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+        if (strcmp(engines[i]->name, name) == 0) {
+            return engines[i];
+        }
+    }
+
+    return NULL;
+}
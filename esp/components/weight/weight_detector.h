@@ -0,0 +1,184 @@
+/**
+ * @file weight_detector.h
+ *
+ * Vehicle detection algorithm run on the weight samples,
+ * without any hardware dependency so that it can also be
+ * compiled on the host (see tools/replay and tools/weight_bench)
+ *
+ * The whole chain works on raw HX711 counts in fixed point:
+ * the thresholds are converted once from grams into counts
+ * with the calibration, so a sample costs a few integer
+ * operations and no float.
+ *
+ * The filtering front end is shared; the decision is taken
+ * by a pluggable engine (weight_engine_t) working on the
+ * features the front end extracts from the filtered stream.
+ *
+ */
+#ifndef WEIGHT_DETECTOR_H
+#define WEIGHT_DETECTOR_H
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Default detection parameters
+#define WEIGHT_NOISE_THRESHOLD          5.0f
+#define WEIGHT_MIN_CAR_WEIGHT           25.0f
+#define WEIGHT_MAX_CAR_WEIGHT           100.0f
+#define WEIGHT_DETECT_COUNT_REQUIRED    5
+#define WEIGHT_SETTLE_DEVIATION         1.5f
+
+// Samples over which the mean and the variance are computed,
+// the window restarts on every step of the load
+#define WEIGHT_FEATURE_WINDOW 3
+
+// Bounds of the sequential test, in evidence units: a settled
+// sample weighs WEIGHT_SEQ_SETTLED, or WEIGHT_SEQ_SLOWED when the
+// load slowed down into the plateau, and a fluctuating one 1
+#define WEIGHT_SEQ_ACCEPT   3
+#define WEIGHT_SEQ_REJECT   (-4)
+#define WEIGHT_SEQ_SETTLED  3
+#define WEIGHT_SEQ_SLOWED   2
+
+// Fractional bits of the filter state (raw counts in Q4)
+#define WEIGHT_Q_BITS 4
+
+// Extra fractional bits of the baseline: with an alpha of 0.01 a
+// Q4 state rounds any drift under about 3 counts to no update
+#define WEIGHT_BASELINE_FRAC_BITS 12
+
+// Filter coefficients in Q15
+#define WEIGHT_COEF_BITS        15
+#define WEIGHT_EMA_ALPHA        31130   // 0.95, EMA filter
+
+// The baseline coefficient in Q24: in Q15, 0.01 is off by 0.1%,
+// enough to move the baseline by 0.03 g under a 90 g vehicle
+#define WEIGHT_BASELINE_COEF_BITS   24
+#define WEIGHT_BASELINE_ALPHA       167772  // 0.01, baseline drift compensation
+
+typedef struct weight_engine weight_engine_t;
+
+typedef struct {
+    const weight_engine_t *engine;  // decision engine
+    float noise_threshold;  // filtered values below this are noise (g)
+    float min_weight;       // detection window (g)
+    float max_weight;
+    int count_required;     // consecutive samples in the window to confirm (count engine)
+    float settle_deviation; // standard deviation of a settled load (g, sequential engine)
+} weight_detector_config_t;
+
+// Calibration expressed directly in raw counts, see weight_detector_set_counts()
+typedef struct {
+    int32_t offset;         // tare, raw counts
+    int32_t sign;           // -1 if the counts decrease with the weight
+    float noise;            // thresholds of the config, in net raw counts
+    float min;
+    float max;
+    float settle;
+} weight_detector_counts_t;
+
+// Features of the filtered stream, in raw counts Q4, updated
+// on every sample. An episode starts when the filtered weight
+// leaves the noise band and ends when it gets back into it
+typedef struct {
+    int32_t level_q;        // filtered weight
+    int32_t slope_q;        // change since the previous sample
+    int32_t rise_q;         // steepest slope of the episode
+    int32_t entry_q;        // slope of the step into the current plateau
+    int32_t mean_q;         // mean of the window
+    int64_t variance_q;     // variance of the window, Q8
+    int32_t overshoot_q;    // peak of the episode above the current level
+    uint16_t active;        // samples in the episode, 0 in the noise band
+    uint8_t count;          // samples in the window
+} weight_features_t;
+
+typedef struct {
+    const weight_detector_config_t *config;
+
+    // Calibration
+    int32_t offset;         // tare, raw counts
+    int32_t sign;           // -1 if the scale factor is negative
+    float scale;            // grams per count, only used to report grams
+
+    // Thresholds in raw counts, Q4
+    int32_t noise_q;
+    int32_t min_q;
+    int32_t max_q;
+    int32_t settle_q;
+    int64_t settle_var_q;   // Q8
+
+    // Filter state in raw counts, Q4
+    int64_t baseline_acc;   // baseline with WEIGHT_BASELINE_FRAC_BITS more fractional bits
+    int32_t baseline_q;
+    int32_t filtered_q;
+
+    // Feature extraction
+    weight_features_t features;
+    int32_t window_q[WEIGHT_FEATURE_WINDOW];
+    int32_t peak_q;
+
+    // Engine state
+    int detect_count;       // count engine
+    int score;              // sequential engine, vehicle evidence
+    int heavy_score;        // sequential engine, too heavy evidence
+    bool decided;           // sequential engine, decision taken for this episode
+} weight_detector_t;
+
+// Outcome of a sample
+typedef enum {
+    WEIGHT_SAMPLE_NONE,         // nothing changed
+    WEIGHT_SAMPLE_CANDIDATE,    // first sample in the detection window
+    WEIGHT_SAMPLE_DROPPED,      // a started detection was dropped
+    WEIGHT_SAMPLE_CONFIRMED,    // vehicle detected
+    WEIGHT_SAMPLE_REJECTED,     // the load is not a vehicle (hand, debris)
+    WEIGHT_SAMPLE_TOO_HEAVY,    // the load is settled above the window
+} weight_sample_result_t;
+
+// Decision engine, given the features of every sample
+struct weight_engine {
+    const char *name;
+    void (*reset)(weight_detector_t *det);
+    weight_sample_result_t (*decide)(weight_detector_t *det, const weight_features_t *f);
+};
+
+// Consecutive samples in the detection window
+extern const weight_engine_t weight_engine_count;
+
+// Sequential test on the settled mean, variance and overshoot
+extern const weight_engine_t weight_engine_sequential;
+
+extern const weight_detector_config_t weight_detector_default_config;
+
+// Resets the detector state, config NULL selects the default parameters
+void weight_detector_init(weight_detector_t *det, const weight_detector_config_t *config, float scale, float offset);
+
+// Converts the thresholds to raw counts for a new calibration
+void weight_detector_set_calibration(weight_detector_t *det, float scale, float offset);
+
+// Feeds a raw sample to the detector
+weight_sample_result_t weight_detector_step(weight_detector_t *det, int32_t raw);
+
+// Runs the filter alone on a raw sample, returns the filtered weight in counts Q4
+int32_t weight_detector_filter(weight_detector_t *det, int32_t raw);
+
+// Converts a raw sample to grams
+float weight_detector_grams(const weight_detector_t *det, int32_t raw);
+
+// Returns the filtered weight in grams
+float weight_detector_filtered_grams(const weight_detector_t *det);
+
+// Sets the thresholds from a calibration that is not a single scale factor
+void weight_detector_set_counts(weight_detector_t *det, const weight_detector_counts_t *counts);
+
+// Moves the tare, keeping the filter state continuous
+void weight_detector_set_offset(weight_detector_t *det, int32_t offset);
+
+// Returns the filtered weight in net raw counts, with the sign of the load cell
+float weight_detector_filtered_counts(const weight_detector_t *det);
+
+// Returns the engine with the given name, NULL if unknown
+const weight_engine_t *weight_detector_find_engine(const char *name);
+
+#endif /* WEIGHT_DETECTOR_H */
@@ -0,0 +1,335 @@
+/**
+ * @file weight_sampler.c
+ *
+ * Interrupt driven HX711 acquisition.
+ *
+ * DOUT goes low when a conversion is ready: a low level
+ * interrupt on it wakes the acquisition task, which clocks
+ * the conversion out and pushes it into the ring buffer of
+ * the sensor. The interrupt stays disabled while the bits
+ * are clocked out, since DOUT toggles with the data, and is
+ * enabled again once DOUT is back high. Nothing polls the
+ * chip, so the CPU is free between two conversions.
+ *
+ * At the idle rate the chip is powered down between two
+ * conversions: it is powered up again a settling time before
+ * the next one is due, and goes back down as soon as it is
+ * read, so it draws current for about WEIGHT_SETTLING_MS of
+ * every idle period.
+ *
+ * The ring has a single producer (the acquisition task) and
+ * a single consumer (the weight task), so it needs no lock.
+ *
+ */
+
+#include "weight_sampler.h"
+#include "weight.h"
+#include "../recorder/recorder.h"
+
+#include "driver/gpio.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#include <stdatomic.h>
+
+#define TAG "WEIGHT_SAMPLER"
+
+// Size of the ring of each sensor, must be a power of two
+#define SAMPLER_RING_SIZE 32
+
+// The acquisition task reads a conversion before the next one
+// is ready (100 ms at 10 SPS), it must not wait behind the others
+#define SAMPLER_TASK_PRIORITY 10
+
+// Wake up even without interrupt, in case an edge was missed
+#define SAMPLER_WATCHDOG_MS 500
+
+// Time left to the consumer to look at an idle sample
+// before the chip is powered down
+#define SAMPLER_VERDICT_MS 20
+
+#define US_PER_HOUR 3600000000LL
+
+_Static_assert((SAMPLER_RING_SIZE & (SAMPLER_RING_SIZE - 1)) == 0, "ring size must be a power of two");
+
+typedef struct {
+    hx711_t *hx;
+    TaskHandle_t task;
+    TaskHandle_t consumer;
+    volatile int64_t ready_us;      // set by the ISR
+
+    weight_sample_t ring[SAMPLER_RING_SIZE];
+    atomic_uint head;               // written by the acquisition task
+    atomic_uint tail;               // written by the consumer
+    uint32_t dropped;
+
+    // Rate, set by the consumer
+    volatile weight_rate_t rate;
+
+    // Samples of the current and of the last hour
+    int64_t hour_start_us;
+    uint32_t hour_samples;
+    uint32_t last_hour_samples;
+} weight_sampler_t;
+
+static weight_sampler_t samplers[WEIGHT_SENSOR_NUM];
+
+/**
+ * DOUT low: a conversion is ready. The interrupt is
+ * disabled until the acquisition task has read it
+ */
+static void dout_ready_isr(void *arg)
+{
+    weight_sampler_t *s = arg;
+    BaseType_t woken = pdFALSE;
+
+    gpio_intr_disable(s->hx->dout);
+    s->ready_us = esp_timer_get_time();
+
+    vTaskNotifyGiveFromISR(s->task, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+static void push_sample(weight_sampler_t *s, int32_t raw, int64_t time_us)
+{
+    uint32_t head = atomic_load_explicit(&s->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&s->tail, memory_order_acquire);
+
+    if (head - tail == SAMPLER_RING_SIZE) {
+        // Consumer behind: the tail belongs to the consumer,
+        // so the new sample is dropped instead of overwriting
+        // the oldest one
+        s->dropped++;
+        return;
+    }
+
+    s->ring[head & (SAMPLER_RING_SIZE - 1)] = (weight_sample_t) {
+        .raw = raw,
+        .time_us = time_us,
+    };
+
+    atomic_store_explicit(&s->head, head + 1, memory_order_release);
+}
+
+static void count_sample(weight_sampler_t *s, int64_t now_us)
+{
+    if (now_us - s->hour_start_us >= US_PER_HOUR) {
+        s->last_hour_samples = s->hour_samples;
+        s->hour_samples = 0;
+        s->hour_start_us = now_us;
+    }
+
+    s->hour_samples++;
+}
+
+/**
+ * Idle rate: powers the chip down until a settling time
+ * before the next conversion is due. The consumer gets a
+ * moment to ask for a burst first, so that a rising edge
+ * does not pay the settling time of a power up. A rate
+ * change wakes the task up early.
+ */
+static void idle_power_down(weight_sampler_t *s)
+{
+    int32_t off_ms = CONFIG_WEIGHT_IDLE_PERIOD - WEIGHT_SETTLING_MS - SAMPLER_VERDICT_MS;
+
+    if (off_ms <= 0) {
+        return;
+    }
+
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(SAMPLER_VERDICT_MS));
+    if (s->rate != WEIGHT_RATE_IDLE) {
+        return;
+    }
+
+    hx711_power_down(s->hx, true);
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(off_ms));
+    hx711_power_down(s->hx, false);
+}
+
+/**
+ * Acquisition task
+ * Sleeps until the DOUT interrupt fires, reads the
+ * conversion and notifies the consumer every batch,
+ * or every sample at the idle rate.
+ */
+static void sampler_task(void *arg)
+{
+    weight_sampler_t *s = arg;
+    uint32_t in_batch = 0;
+
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(SAMPLER_WATCHDOG_MS));
+
+        int64_t ready_us = s->ready_us;
+        bool idle = s->rate == WEIGHT_RATE_IDLE;
+
+        if (gpio_get_level(s->hx->dout) == 0) {
+            int32_t raw;
+
+            if (hx711_read_data(s->hx, &raw) == ESP_OK) {
+                int64_t now_us = esp_timer_get_time();
+                int64_t sample_us = ready_us ? ready_us : now_us;
+
+                push_sample(s, raw, sample_us);
+                recorder_add(RECORDER_WEIGHT, (uint8_t)(s - samplers), raw, sample_us);
+                count_sample(s, now_us);
+
+                if (idle || ++in_batch >= WEIGHT_BATCH_SAMPLES) {
+                    in_batch = 0;
+                    xTaskNotifyGive(s->consumer);
+                }
+
+                // Down until the next idle conversion, the interrupt
+                // stays disabled since DOUT is undefined meanwhile
+                if (idle) {
+                    idle_power_down(s);
+                }
+            }
+        }
+
+        s->ready_us = 0;
+        gpio_intr_enable(s->hx->dout);
+    }
+}
+
+/**
+ * Starts the interrupt driven acquisition of a sensor.
+ * The HX711 must already be initialized
+ * @param id The weight sensor
+ * @param hx The HX711 of the sensor
+ * @param consumer The task notified every WEIGHT_BATCH_SAMPLES samples
+ * @return ESP_OK on success, error code otherwise
+ */
+esp_err_t weight_sampler_start(uint8_t id, hx711_t *hx, TaskHandle_t consumer)
+{
+    if (id >= WEIGHT_SENSOR_NUM || hx == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    weight_sampler_t *s = &samplers[id];
+
+    if (s->task != NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    s->hx = hx;
+    s->consumer = consumer;
+    s->rate = WEIGHT_RATE_BURST;
+    s->hour_start_us = esp_timer_get_time();
+    atomic_store(&s->head, 0);
+    atomic_store(&s->tail, 0);
+
+    // The service may already be installed by another component
+    esp_err_t err = gpio_install_isr_service(0);
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+        ESP_LOGE(TAG, "Failed to install the GPIO ISR service: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    // The interrupt stays disabled until the task it notifies exists
+    gpio_intr_disable(hx->dout);
+    gpio_set_intr_type(hx->dout, GPIO_INTR_LOW_LEVEL);
+
+    err = gpio_isr_handler_add(hx->dout, dout_ready_isr, s);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to add the DOUT handler: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    // Created last, so that s->task is only set for a sensor with its interrupt
+    if (xTaskCreatePinnedToCore(sampler_task, "weight_sampler", 4096, s,
+            SAMPLER_TASK_PRIORITY, &s->task, 1) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create the acquisition task %d", id);
+        gpio_isr_handler_remove(hx->dout);
+        s->task = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+
+    gpio_intr_enable(hx->dout);
+
+    ESP_LOGI(TAG, "Interrupt driven acquisition started on sensor %d", id);
+    return ESP_OK;
+}
+
+bool weight_sampler_running(uint8_t id)
+{
+    return id < WEIGHT_SENSOR_NUM && samplers[id].task != NULL;
+}
+
+/**
+ * Copies the oldest samples out of the ring of a sensor,
+ * only to be called from the consumer task
+ * @param id The weight sensor
+ * @param samples Destination of the samples
+ * @param max Maximum number of samples to copy
+ * @return The number of samples copied
+ */
+size_t weight_sampler_read(uint8_t id, weight_sample_t *samples, size_t max)
+{
+    if (!weight_sampler_running(id)) {
+        return 0;
+    }
+
+    weight_sampler_t *s = &samplers[id];
+    uint32_t tail = atomic_load_explicit(&s->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&s->head, memory_order_acquire);
+    size_t count = 0;
+
+    while (tail != head && count < max) {
+        samples[count++] = s->ring[tail & (SAMPLER_RING_SIZE - 1)];
+        tail++;
+    }
+
+    atomic_store_explicit(&s->tail, tail, memory_order_release);
+    return count;
+}
+
+uint32_t weight_sampler_dropped(uint8_t id)
+{
+    return (id < WEIGHT_SENSOR_NUM) ? samplers[id].dropped : 0;
+}
+
+/**
+ * Switches the acquisition rate of a sensor. A task
+ * powered down for the idle rate is woken up, so that
+ * a burst starts with the next conversion
+ * @param id The weight sensor
+ * @param rate The new rate
+ */
+void weight_sampler_set_rate(uint8_t id, weight_rate_t rate)
+{
+    if (!weight_sampler_running(id) || samplers[id].rate == rate) {
+        return;
+    }
+
+    samplers[id].rate = rate;
+
+    if (rate == WEIGHT_RATE_BURST) {
+        xTaskNotifyGive(samplers[id].task);
+    }
+
+    ESP_LOGD(TAG, "Sensor %d rate: %s", id, rate == WEIGHT_RATE_BURST ? "burst" : "idle");
+}
+
+weight_rate_t weight_sampler_rate(uint8_t id)
+{
+    return (id < WEIGHT_SENSOR_NUM) ? samplers[id].rate : WEIGHT_RATE_BURST;
+}
+
+uint32_t weight_sampler_samples_per_hour(uint8_t id)
+{
+    if (!weight_sampler_running(id)) {
+        return 0;
+    }
+
+    weight_sampler_t *s = &samplers[id];
+
+    if (s->last_hour_samples > 0) {
+        return s->last_hour_samples;
+    }
+
+    int64_t elapsed_us = esp_timer_get_time() - s->hour_start_us;
+    return elapsed_us > 0 ? (uint32_t)((int64_t) s->hour_samples * US_PER_HOUR / elapsed_us) : 0;
+}
@@ -0,0 +1,63 @@
+/**
+ * @file weight_sampler.h
+ *
+ * Interrupt driven HX711 acquisition: every conversion
+ * is read as soon as DOUT signals it is ready and stored,
+ * with its timestamp, in a ring buffer drained in batches.
+ *
+ * The acquisition has two rates: burst, every conversion of
+ * the chip, and idle, one conversion per idle period with the
+ * chip powered down in between. The consumer picks the rate.
+ *
+ */
+#ifndef WEIGHT_SAMPLER_H
+#define WEIGHT_SAMPLER_H
+
+#pragma once
+
+#include "hx711.h"
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Samples the consumer is woken up for: at the 10 SPS
+// of the HX711 a batch covers 200 ms
+#define WEIGHT_BATCH_SAMPLES 2
+
+// The HX711 needs 400 ms at 10 SPS to settle after a power up
+#define WEIGHT_SETTLING_MS 400
+
+typedef enum {
+    WEIGHT_RATE_IDLE,       // one conversion per idle period, powered down in between
+    WEIGHT_RATE_BURST,      // every conversion, batched
+} weight_rate_t;
+
+typedef struct {
+    int32_t raw;        // raw conversion
+    int64_t time_us;    // when DOUT signalled the conversion
+} weight_sample_t;
+
+// Starts the acquisition of a sensor, consumer is notified for every batch
+esp_err_t weight_sampler_start(uint8_t id, hx711_t *hx, TaskHandle_t consumer);
+
+// Returns true if the acquisition of a sensor is running
+bool weight_sampler_running(uint8_t id);
+
+// Copies up to max samples out of the ring, returns how many were copied
+size_t weight_sampler_read(uint8_t id, weight_sample_t *samples, size_t max);
+
+// Samples lost because the consumer did not keep up
+uint32_t weight_sampler_dropped(uint8_t id);
+
+// Switches the acquisition rate, the consumer is then notified for every sample in idle
+void weight_sampler_set_rate(uint8_t id, weight_rate_t rate);
+
+// Returns the current acquisition rate
+weight_rate_t weight_sampler_rate(uint8_t id);
+
+// Samples acquired over the last hour (extrapolated during the first hour)
+uint32_t weight_sampler_samples_per_hour(uint8_t id);
+
+#endif /* WEIGHT_SAMPLER_H */
@@ -6,8 +6,11 @@
  */
 
 #include "fsm.h"
+#include "fsm_timing.h"
+#include "passage.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
 #include "freertos/event_groups.h"
 #include "driver/gpio.h"
 #include "ultrasonic.h"
@@ -16,6 +19,7 @@
 #include "esp_log.h"
 #include "esp_system.h"
 #include "esp_sleep.h"
+#include "esp_timer.h"
 
 #include <stdbool.h>
 
@@ -27,112 +31,466 @@
 #include "../components/init/init.h"
 #include "../components/servo_motor/servo_motor.h"
 #include "../components/oled/oled.h"
-
-// Idle delay function for low power mode
-#ifdef CONFIG_USE_MOCK_CAMERA
-    #define IDLE_DELAY() vTaskDelay(pdMS_TO_TICKS(200))
+#include "../components/trace/trace.h"
+
+// Idle delay function for low power mode: in simulation the
+// FSM simply blocks on the event queue for the idle period.
+// Light sleep stops the whole chip, so it is only used when
+// a single lane is configured
+#if defined(CONFIG_USE_MOCK_CAMERA) || FSM_LANES_NUM > 1
+    #define IDLE_DELAY()
+    #define IDLE_WAIT_MS IDLE_POLL_MS
 #else
     #define IDLE_DELAY() do { \
-        esp_sleep_enable_timer_wakeup(200000); \
+        esp_sleep_enable_timer_wakeup(IDLE_POLL_MS * 1000); \
         esp_light_sleep_start(); \
     } while(0)
+    #define IDLE_WAIT_MS 0
 #endif
 
 #define TOTAL_PARKING_SPOTS 10
 
-// Current state of the FSM
-static State_t curr_state = INIT;
+#define FSM_QUEUE_LENGTH 8
+#define FSM_WAIT_FOREVER UINT32_MAX
+
+#define SYSTEM_READY_BIT BIT0
+
+#define TAG "FSM"
+
+// What a lane is used for
+typedef enum {
+    LANE_ENTRY_EXIT,    // single lane shared by entering and exiting vehicles
+    LANE_ENTRY_ONLY,
+    LANE_EXIT_ONLY,
+} lane_role_t;
+
+// Static configuration of a lane. The weight sensor, the ultrasonic
+// sensor and the servo bound to a lane have the same id as the lane
+typedef struct {
+    const char *name;
+    lane_role_t role;
+    bool owns_display;  // the OLED is shared, only one lane drives it
+} fsm_lane_config_t;
+
+// Message stored in the event queue
+typedef struct {
+    Event_t event;
+    int64_t posted_us;  // esp_timer timestamp taken when the event was posted
+} fsm_event_msg_t;
+
+// Runtime context of a lane: every lane runs its own FSM instance
+typedef struct {
+    uint8_t id;
+    const fsm_lane_config_t *config;
+
+    // Current state of the FSM
+    State_t curr_state;
+
+    // Flag that avoids multiple concurrent recognitions
+    bool recognition_busy;
+
+    // Vehicle passage under the open barrier
+    passage_t passage;
+
+    // The entry or exit that opened the barrier changed the parking
+    // counter, which is then undone if no vehicle goes through
+    bool spot_changed;
+
+    // End of the refusal message, the FSM task keeps
+    // serving its event queue until then
+    int64_t refuse_until_us;
+
+    // First idle iteration that found the ultrasonic
+    // sensor occupied, 0 while the lane is clear
+    int64_t occupied_since_us;
 
-// Flag that avoids multiple concurrent recognitions
-static bool recognition_busy = false;
+    // Queue that serializes all the events handled by the lane task
+    QueueHandle_t event_queue;
 
-// Parking spot counter
+    // Dispatcher statistics, protected by a spinlock since
+    // they are updated from tasks and ISRs alike
+    fsm_stats_t stats;
+    portMUX_TYPE stats_lock;
+} fsm_lane_t;
+
+static const fsm_lane_config_t lane_configs[FSM_LANES_NUM] = {
+#if FSM_LANES_NUM == 1
+    { .name = "GATE",  .role = LANE_ENTRY_EXIT, .owns_display = true },
+#else
+    { .name = "ENTRY", .role = LANE_ENTRY_ONLY, .owns_display = true },
+    { .name = "EXIT",  .role = LANE_EXIT_ONLY,  .owns_display = false },
+#endif
+};
+
+static fsm_lane_t lanes[FSM_LANES_NUM];
+
+// Parking spot counter, shared by all the lanes
 static int parking_spots_available = TOTAL_PARKING_SPOTS;
+static portMUX_TYPE spots_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Set by the first lane once the hardware is initialized
+static EventGroupHandle_t system_events = NULL;
 
 // Prototypes of state functions
-static void init_fn();
+static void init_fn(fsm_lane_t *lane);
+
+static void idle_entry_fn(fsm_lane_t *lane);
+
+static void idle_fn(fsm_lane_t *lane);
+
+static void entry_fn(fsm_lane_t *lane);
+
+static void refuse_fn(fsm_lane_t *lane);
+
+static void refuse_hold_fn(fsm_lane_t *lane);
+
+static void allow_fn(fsm_lane_t *lane);
 
-static void idle_fn();
+static void exit_fn(fsm_lane_t *lane);
 
-static void entry_fn();
+static void passage_fn(fsm_lane_t *lane);
 
-static void refuse_fn();
+static void lane_clear(fsm_lane_t *lane);
 
-static void allow_fn();
+// Actions bound to each state of the transition table
+typedef struct {
+    void (*on_entry)(fsm_lane_t *lane);     // executed once when the state is entered
+    void (*run)(fsm_lane_t *lane);          // executed at every iteration of the FSM task
+    void (*on_exit)(fsm_lane_t *lane);      // executed once when the state is left
+    uint32_t wait_ms;                       // how long the FSM task waits for an event after run
+} fsm_state_actions_t;
 
-static void exit_fn();
+static const fsm_state_actions_t state_actions[STATES_NUM] = {
+    [INIT]          = {                            .run = init_fn,                               .wait_ms = FSM_WAIT_FOREVER },
+    [IDLE]          = { .on_entry = idle_entry_fn, .run = idle_fn,                               .wait_ms = IDLE_WAIT_MS },
+    [VEHICLE_ENTRY] = { .on_entry = entry_fn,                                                    .wait_ms = FSM_WAIT_FOREVER },
+    [ENTRY_REFUSED] = { .on_entry = refuse_fn,     .run = refuse_hold_fn, .on_exit = lane_clear, .wait_ms = REFUSE_HOLD_MS },
+    [ENTRY_ALLOWED] = { .on_entry = allow_fn,      .run = passage_fn,     .on_exit = lane_clear, .wait_ms = PASSAGE_SAMPLE_MS },
+    [VEHICLE_EXIT]  = { .on_entry = exit_fn,       .run = passage_fn,     .on_exit = lane_clear, .wait_ms = PASSAGE_SAMPLE_MS },
+};
 
 
 ////////////////////////////////////////////////////////////////
 //////////////// FSM Logic /////////////////////////////////////
 ////////////////////////////////////////////////////////////////
 
-void fsm_handle_event(Event_t event) {
-    switch (curr_state) {
-        case IDLE:
-            if (event == VALID_WEIGHT_DETECTED) {
-                curr_state = VEHICLE_ENTRY;
-            } else if (event == EXIT_DETECTED) {
-                curr_state = VEHICLE_EXIT;
-            } else if (event == REMOTE_OPEN) {
-                curr_state = ENTRY_ALLOWED;
-            }
-            break;
-        case VEHICLE_ENTRY:
-            if (event == PLATE_RECOGNIZED) {
-                curr_state = ENTRY_ALLOWED;
-            } else if (event == PLATE_REFUSED) {
-                curr_state = ENTRY_REFUSED;
-            }
-            break;
-        default:
-            // Handle invalid state
-        break;
+/**
+ * Creates the context and the event queue of every lane.
+ * Events posted before this call are dropped.
+ */
+void fsm_init(void) {
+    if (system_events == NULL) {
+        system_events = xEventGroupCreate();
+    }
+
+    for (uint8_t i = 0; i < FSM_LANES_NUM; i++) {
+        fsm_lane_t *lane = &lanes[i];
+
+        if (lane->event_queue != NULL) {
+            continue;
+        }
+
+        lane->id = i;
+        lane->config = &lane_configs[i];
+        lane->curr_state = INIT;
+        lane->recognition_busy = false;
+        portMUX_INITIALIZE(&lane->stats_lock);
+        lane->event_queue = xQueueCreate(FSM_QUEUE_LENGTH, sizeof(fsm_event_msg_t));
+
+        if (lane->event_queue == NULL) {
+            ESP_LOGE(TAG, "Failed to create the event queue of lane %s", lane->config->name);
+        }
+    }
+
+    char error[64];
+    int problems = fsm_verify_table(error, sizeof(error));
+
+    if (problems > 0) {
+        ESP_LOGE(TAG, "Transition table has %d problem(s), first: %s", problems, error);
     }
+}
 
+/**
+ * Returns the name of a lane, used by the tasks
+ * created for it
+ */
+const char *fsm_lane_name(uint8_t lane) {
+    return (lane < FSM_LANES_NUM) ? lane_configs[lane].name : "UNKNOWN";
 }
 
-void fsm_run_state_function() {
-    switch (curr_state) {
-        case INIT:
-            init_fn();
-            break;
-        case IDLE:
-            idle_fn();
-            break;
-        case VEHICLE_ENTRY:
-            entry_fn();
-            break;
-        case ENTRY_REFUSED:
-            refuse_fn();
-            break;
-        case ENTRY_ALLOWED:
-            allow_fn();
-            break;
-        case VEHICLE_EXIT:
-            exit_fn();
-            break;
-        default:
-            // Handle invalid state
-            break;
+/**
+ * Updates the posting counters and the queue depth high watermark
+ */
+static void update_post_stats(fsm_lane_t *lane, bool queued, UBaseType_t depth) {
+    if (queued) {
+        lane->stats.events_posted++;
+    } else {
+        lane->stats.events_dropped++;
+    }
+
+    if (depth > lane->stats.queue_depth_max) {
+        lane->stats.queue_depth_max = depth;
     }
 }
 
+/**
+ * Posts an event to the FSM task of a lane. Never blocks:
+ * if the queue is full the event is dropped and counted.
+ * @param lane_id The lane the event belongs to
+ * @param event The event to post
+ * @return true if the event was queued, false otherwise
+ */
+bool fsm_post_event(uint8_t lane_id, Event_t event) {
+    if (lane_id >= FSM_LANES_NUM || lanes[lane_id].event_queue == NULL) {
+        return false;
+    }
+
+    fsm_lane_t *lane = &lanes[lane_id];
+    fsm_event_msg_t msg = {
+        .event = event,
+        .posted_us = esp_timer_get_time(),
+    };
+
+    bool queued = xQueueSend(lane->event_queue, &msg, 0) == pdTRUE;
+    UBaseType_t depth = uxQueueMessagesWaiting(lane->event_queue);
+
+    portENTER_CRITICAL(&lane->stats_lock);
+    update_post_stats(lane, queued, depth);
+    portEXIT_CRITICAL(&lane->stats_lock);
+
+    if (!queued) {
+        ESP_LOGW(TAG, "[%s] Event queue full, %s dropped", lane->config->name, fsm_event_name(event));
+    }
+
+    return queued;
+}
+
+/**
+ * ISR-safe variant of fsm_post_event()
+ * @param lane_id The lane the event belongs to
+ * @param event The event to post
+ * @param higher_priority_task_woken Set to pdTRUE if a context switch is required
+ * @return true if the event was queued, false otherwise
+ */
+bool fsm_post_event_from_isr(uint8_t lane_id, Event_t event, BaseType_t *higher_priority_task_woken) {
+    if (lane_id >= FSM_LANES_NUM || lanes[lane_id].event_queue == NULL) {
+        return false;
+    }
+
+    fsm_lane_t *lane = &lanes[lane_id];
+    fsm_event_msg_t msg = {
+        .event = event,
+        .posted_us = esp_timer_get_time(),
+    };
+
+    bool queued = xQueueSendFromISR(lane->event_queue, &msg, higher_priority_task_woken) == pdTRUE;
+    UBaseType_t depth = uxQueueMessagesWaitingFromISR(lane->event_queue);
+
+    portENTER_CRITICAL_ISR(&lane->stats_lock);
+    update_post_stats(lane, queued, depth);
+    portEXIT_CRITICAL_ISR(&lane->stats_lock);
+
+    return queued;
+}
+
+/**
+ * Applies the transition triggered by an event, running the
+ * exit action of the current state and the entry action of the
+ * next one. Only called from the task of the lane, so transitions
+ * are always serialized.
+ * @return true if the event caused a transition
+ */
+static bool fsm_handle_event(fsm_lane_t *lane, Event_t event) {
+    State_t next;
+
+    if (!fsm_next_state(lane->curr_state, event, &next)) {
+        return false;
+    }
+
+    trace_record(TRACE_FSM_TRANSITION, lane->id, next);
+
+    ESP_LOGI(TAG, "[%s] %s -> %s on %s", lane->config->name,
+        fsm_state_name(lane->curr_state), fsm_state_name(next), fsm_event_name(event));
+
+    if (state_actions[lane->curr_state].on_exit) {
+        state_actions[lane->curr_state].on_exit(lane);
+    }
+
+    lane->curr_state = next;
+
+    if (state_actions[lane->curr_state].on_entry) {
+        state_actions[lane->curr_state].on_entry(lane);
+    }
+
+    return true;
+}
+
+/**
+ * Blocks until an event is available for the lane (or the wait
+ * time of the current state expires) and applies its transition.
+ * The wait is what wakes the FSM as soon as an event is posted,
+ * instead of polling the state function at a fixed rate.
+ * @param lane_id The lane served by the calling task
+ */
+void fsm_dispatch_events(uint8_t lane_id) {
+    if (lane_id >= FSM_LANES_NUM || lanes[lane_id].event_queue == NULL) {
+        vTaskDelay(pdMS_TO_TICKS(50));
+        return;
+    }
+
+    fsm_lane_t *lane = &lanes[lane_id];
+    uint32_t wait_ms = state_actions[lane->curr_state].wait_ms;
+    TickType_t wait_ticks = (wait_ms == FSM_WAIT_FOREVER) ? portMAX_DELAY : pdMS_TO_TICKS(wait_ms);
+
+    fsm_event_msg_t msg;
+
+    if (xQueueReceive(lane->event_queue, &msg, wait_ticks) != pdTRUE) {
+        // Let lower priority tasks run between two polling iterations
+        if (wait_ticks == 0) {
+            vTaskDelay(1);
+        }
+        return;
+    }
+
+    int64_t latency = esp_timer_get_time() - msg.posted_us;
+    bool changed = fsm_handle_event(lane, msg.event);
+    UBaseType_t depth = uxQueueMessagesWaiting(lane->event_queue);
+
+    portENTER_CRITICAL(&lane->stats_lock);
+    lane->stats.queue_depth = depth;
+    if (changed) {
+        lane->stats.transitions++;
+        lane->stats.latency_last_us = latency;
+        lane->stats.latency_total_us += latency;
+        if (latency > lane->stats.latency_max_us) {
+            lane->stats.latency_max_us = latency;
+        }
+    } else {
+        lane->stats.events_ignored++;
+    }
+    portEXIT_CRITICAL(&lane->stats_lock);
+
+    if (changed) {
+        ESP_LOGI(TAG, "[%s] %s handled after %lld us (queue depth %u)",
+            lane->config->name, fsm_event_name(msg.event), latency, (unsigned) depth);
+    } else {
+        ESP_LOGW(TAG, "[%s] %s ignored in state %s",
+            lane->config->name, fsm_event_name(msg.event), fsm_state_name(lane->curr_state));
+    }
+}
+
+/**
+ * Copies the dispatcher statistics of a lane
+ * @param lane_id The lane to read
+ * @param stats Destination of the copy
+ */
+void fsm_get_stats(uint8_t lane_id, fsm_stats_t *stats) {
+    if (stats == NULL || lane_id >= FSM_LANES_NUM) {
+        return;
+    }
+
+    fsm_lane_t *lane = &lanes[lane_id];
+    UBaseType_t depth = lane->event_queue ? uxQueueMessagesWaiting(lane->event_queue) : 0;
+
+    portENTER_CRITICAL(&lane->stats_lock);
+    lane->stats.queue_depth = depth;
+    *stats = lane->stats;
+    portEXIT_CRITICAL(&lane->stats_lock);
+}
+
+/**
+ * Runs the periodic action of the current state of a lane, if any
+ * @param lane_id The lane served by the calling task
+ */
+void fsm_run_state_function(uint8_t lane_id) {
+    if (lane_id >= FSM_LANES_NUM) {
+        return;
+    }
+
+    fsm_lane_t *lane = &lanes[lane_id];
+
+    if (lane->curr_state < STATES_NUM && state_actions[lane->curr_state].run) {
+        state_actions[lane->curr_state].run(lane);
+    }
+}
+
+////////////////////////////////////////////////////////////////
+//////////////// Lane helpers //////////////////////////////////
+////////////////////////////////////////////////////////////////
+
+static bool lane_handles_entries(const fsm_lane_t *lane) {
+    return lane->config->role != LANE_EXIT_ONLY;
+}
+
+static bool lane_handles_exits(const fsm_lane_t *lane) {
+    return lane->config->role != LANE_ENTRY_ONLY;
+}
+
+/**
+ * Display wrappers: only the lane owning the OLED writes on it
+ */
+static void lane_print(fsm_lane_t *lane, uint8_t row, const char *text) {
+    if (lane->config->owns_display) {
+        oled_print(row, text);
+    }
+}
+
+static void lane_clear(fsm_lane_t *lane) {
+    if (lane->config->owns_display) {
+        oled_clear();
+    }
+}
+
+/**
+ * Parking spot counter helpers, the counter
+ * is shared by the tasks of all the lanes
+ */
+static int get_parking_spots(void) {
+    portENTER_CRITICAL(&spots_lock);
+    int spots = parking_spots_available;
+    portEXIT_CRITICAL(&spots_lock);
+    return spots;
+}
+
+// Both return false when the counter is already at its limit
+static bool take_parking_spot(void) {
+    portENTER_CRITICAL(&spots_lock);
+    bool changed = parking_spots_available > 1;
+    parking_spots_available -= changed ? 1 : 0;
+    portEXIT_CRITICAL(&spots_lock);
+    return changed;
+}
+
+static bool release_parking_spot(void) {
+    portENTER_CRITICAL(&spots_lock);
+    bool changed = parking_spots_available < TOTAL_PARKING_SPOTS;
+    parking_spots_available += changed ? 1 : 0;
+    portEXIT_CRITICAL(&spots_lock);
+    return changed;
+}
+
 ////////////////////////////////////////////////////////////////
 //////////////// FSM State Functions ///////////////////////////
 ////////////////////////////////////////////////////////////////
 
 /**
- * Initializes the whole system
+ * Initializes the whole system: the first lane
+ * brings up the hardware, the others wait for it
  */
-void init_fn() {
+void init_fn(fsm_lane_t *lane) {
+    if (lane->id != 0) {
+        xEventGroupWaitBits(system_events, SYSTEM_READY_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+        fsm_post_event(lane->id, STATE_COMPLETED);
+        return;
+    }
+
     system_init();
 
     #ifdef CONFIG_USE_MOCK_CAMERA
     ESP_LOGI("IDLE", "Running in MOCK CAMERA mode (Wokwi simulation)");
     #endif
 
-    ESP_LOGI("INIT", "System ready. Waiting for detection...");
+    ESP_LOGI("INIT", "System ready with %d lane(s). Waiting for detection...", FSM_LANES_NUM);
 
     vTaskDelay(pdMS_TO_TICKS(2000));
 
@@ -147,38 +505,68 @@ void init_fn() {
 
     oled_clear();
 
-    curr_state = IDLE;
+    xEventGroupSetBits(system_events, SYSTEM_READY_BIT);
+    fsm_post_event(lane->id, STATE_COMPLETED);
 }
 
 /**
- * When in idle state, the system enters low
- * power mode and waits for interrupts
+ * Shows the number of available spots and
+ * enables the weight detection if there is room
  */
-void idle_fn() {
-    // System waiting for an event
-    oled_clear();
+void idle_entry_fn(fsm_lane_t *lane) {
+    lane_clear(lane);
+    lane->occupied_since_us = 0;
+
+    int spots = get_parking_spots();
+    bool has_room = spots > 0;
 
-    if (parking_spots_available <= 0) {
-        enable_weight_detection(false);
-        oled_print(2, "The parking lot");
-        oled_print(4, "is full!");
+    if (lane_handles_entries(lane)) {
+        enable_weight_detection(lane->id, has_room);
+        lane->recognition_busy = false;
+    }
+
+    if (!has_room) {
+        lane_print(lane, 2, "The parking lot");
+        lane_print(lane, 4, "is full!");
     } else {
-        enable_weight_detection(true);
-        recognition_busy = false;
         char spots_str[20];
-        snprintf(spots_str, sizeof(spots_str), "%d parking spots", parking_spots_available);
-        oled_print(2, spots_str);
-        oled_print(4, "available");
+        snprintf(spots_str, sizeof(spots_str), "%d parking spots", spots);
+        lane_print(lane, 2, spots_str);
+        lane_print(lane, 4, "available");
     }
+}
 
+/**
+ * When in idle state, the system enters low
+ * power mode and waits for interrupts
+ */
+void idle_fn(fsm_lane_t *lane) {
     // Enter low power mode
     IDLE_DELAY();
 
+    if (!lane_handles_exits(lane)) {
+        return;
+    }
+
     // wait for the ultrasonic sensor to detect vehicle passage
-    if (ultrasonic_sensor_detect()) {
-        ESP_LOGI("IDLE", "Detected vehicle exiting...");
-        vTaskDelay(pdMS_TO_TICKS(500)); // Debounce delay
-        fsm_handle_event(EXIT_DETECTED);
+    if (!ultrasonic_sensor_detect(lane->id)) {
+        lane->occupied_since_us = 0;
+        return;
+    }
+
+    int64_t now = esp_timer_get_time();
+
+    if (lane->occupied_since_us == 0) {
+        ESP_LOGI("IDLE", "[%s] Detected vehicle exiting...", lane->config->name);
+        trace_record(TRACE_ULTRASONIC_TRIGGER, lane->id, 0);
+        lane->occupied_since_us = now;
+        return;
+    }
+
+    // Debounce: the sensor must stay occupied across the iterations
+    if (now - lane->occupied_since_us >= (int64_t) EXIT_DEBOUNCE_MS * 1000) {
+        lane->occupied_since_us = 0;
+        fsm_post_event(lane->id, EXIT_DETECTED);
     }
 }
 
@@ -186,121 +574,146 @@ void idle_fn() {
  * Detects weight and runs the CV algorithm.
  * Decide whether to allow or refuse entrance
  */
-void entry_fn() {
-    enable_weight_detection(false);
+void entry_fn(fsm_lane_t *lane) {
+    enable_weight_detection(lane->id, false);
 
-    oled_clear();
+    lane_clear(lane);
 
-    oled_print(2, "Verifying license");
-    oled_print(4, "plate...");
+    lane_print(lane, 2, "Verifying license");
+    lane_print(lane, 4, "plate...");
 
-    if (!recognition_busy) {
-        unblock_recognition_task();
-        recognition_busy = true;
+    // The FSM then blocks on the event queue until the
+    // recognition task posts its outcome
+    if (!lane->recognition_busy) {
+        unblock_recognition_task(lane->id);
+        lane->recognition_busy = true;
     }
+}
 
-    vTaskDelay(pdMS_TO_TICKS(2000));
+/**
+ * Shows a negative message on the display,
+ * refuse_hold_fn() leaves it there for REFUSE_HOLD_MS
+ */
+void refuse_fn(fsm_lane_t *lane) {
+    lane_clear(lane);
+    ESP_LOGI("REFUSE", "[%s] Entry refused. Access denied.", lane->config->name);
 
-    oled_clear();
+    lane_print(lane, 2, "Your vehicle");
+    lane_print(lane, 4, "is not allowed!");
+
+    lane->refuse_until_us = esp_timer_get_time() + (int64_t) REFUSE_HOLD_MS * 1000;
 }
 
 /**
- * Shows a negative message
- * on the display
+ * Goes back to idle once the refusal has been shown
+ * for REFUSE_HOLD_MS. The FSM task waits for the hold
+ * on the event queue, an event handled meanwhile only
+ * runs this check earlier.
  */
-void refuse_fn() {
-    oled_clear();
-    ESP_LOGI("REFUSE", "Entry refused. Access denied.");
-
-    oled_print(2, "Your vehicle");
-    oled_print(4, "is not allowed!");
+void refuse_hold_fn(fsm_lane_t *lane) {
+    if (esp_timer_get_time() >= lane->refuse_until_us) {
+        fsm_post_event(lane->id, STATE_COMPLETED);
+    }
+}
 
-    vTaskDelay(pdMS_TO_TICKS(5000));
+/**
+ * Opens the barrier of the lane and starts
+ * following the vehicle through it
+ */
+static void open_gate(fsm_lane_t *lane) {
+    servo_motor_raise_barrier(lane->id);
+    trace_record(TRACE_BARRIER_RAISE, lane->id, 0);
 
-    oled_clear();
-    curr_state = IDLE;
+    passage_start(&lane->passage, esp_timer_get_time(),
+        (int64_t) PASSAGE_WAIT_TIMEOUT_MS * 1000, (int64_t) PASSAGE_CLEAR_HOLD_MS * 1000);
 }
 
 /**
  * Shows a positive message on the
- * display, opens the gate bar and waits a signal
- * from the ultrasonic sensor to close it again
+ * display and opens the gate bar: the
+ * passage is then followed by passage_fn()
  */
-void allow_fn() {
-    oled_clear();
-    ESP_LOGI("ALLOW", "Entry allowed. Opening gate...");
+void allow_fn(fsm_lane_t *lane) {
+    lane_clear(lane);
+    ESP_LOGI("ALLOW", "[%s] Entry allowed. Opening gate...", lane->config->name);
 
-    oled_print(3, "Entrance allowed!");
+    lane_print(lane, 3, "Entrance allowed!");
 
     // Update counter
-    parking_spots_available -= (parking_spots_available > 1) ? 1 : 0;
+    lane->spot_changed = take_parking_spot();
 
     // raise the barrier when entry is allowed
-    servo_motor_raise_barrier();
-
-    // wait for the ultrasonic sensor to detect vehicle passage
-    bool is_still_detecting = false;
+    open_gate(lane);
+}
 
-    // Await vehicle passage
-    while (!is_still_detecting) {
-        is_still_detecting = ultrasonic_sensor_detect();
-        vTaskDelay(pdMS_TO_TICKS(200));
+/**
+ * Opens the gate bar for exit,
+ * passage_fn() closes it once the vehicle left
+ */
+void exit_fn(fsm_lane_t *lane) {
+    lane_clear(lane);
+    if (lane_handles_entries(lane)) {
+        enable_weight_detection(lane->id, false);
     }
+    ESP_LOGI("EXIT", "[%s] Exit allowed. Opening gate...", lane->config->name);
 
-    ESP_LOGI("ALLOW", "Vehicle passing the gate...");
-
-    // Await vehicle clearance
-    while (is_still_detecting) {
-        is_still_detecting = ultrasonic_sensor_detect();
-        vTaskDelay(pdMS_TO_TICKS(200));
-    }
+    lane_print(lane, 3, "Vehicle exiting");
 
-    ESP_LOGI("ALLOW", "Vehicle passed. Closing gate...");
+    // Update counter
+    lane->spot_changed = release_parking_spot();
 
-    oled_clear();
+    // Raise the barrier when vehicle exit is detected
+    open_gate(lane);
 
-    oled_print(3, "Closing gate...");
-    
-    // close the barrier after ultrasonic read
-    servo_motor_lower_barrier();
-    vTaskDelay(pdMS_TO_TICKS(3000));
-    
-    oled_clear();
-    curr_state = IDLE;
+    // Send exit notification to backend, the request
+    // is queued for the network worker while the vehicle drives out
+    set_license_plate_data("invalid_plate");
+    exit_request_post();
 }
 
 /**
- * Opens the gate bar for exit
- * and waits for the vehicle to leave
+ * Samples the ultrasonic sensor while the barrier is open
+ * and closes it as soon as the lane is clear. The FSM task
+ * keeps serving its event queue between two samples.
  */
-void exit_fn() {
-    oled_clear();
-    enable_weight_detection(false);
-    ESP_LOGI("EXIT", "Exit allowed. Opening gate...");
+void passage_fn(fsm_lane_t *lane) {
+    passage_state_t before = lane->passage.state;
 
-    oled_print(3, "Vehicle exiting");
+    if (passage_done(&lane->passage)) {
+        return;
+    }
 
-    // Update counter
-    parking_spots_available += (parking_spots_available < TOTAL_PARKING_SPOTS) ? 1 : 0;
+    bool occupied = ultrasonic_sensor_detect(lane->id);
+    passage_state_t now = passage_update(&lane->passage, occupied, esp_timer_get_time());
 
-    // Raise the barrier when vehicle exit is detected
-    servo_motor_raise_barrier();
+    if (now != before) {
+        trace_record(TRACE_PASSAGE, lane->id, now);
+        ESP_LOGI("PASSAGE", "[%s] %s -> %s", lane->config->name,
+            passage_state_name(before), passage_state_name(now));
+    }
 
-    // Wait for some time to allow vehicle to exit
-    vTaskDelay(pdMS_TO_TICKS(5000));
+    if (!passage_done(&lane->passage)) {
+        return;
+    }
 
-    // Close the barrier after delay
-    servo_motor_lower_barrier();
-    
-    ESP_LOGI("EXIT", "Vehicle passed. Closing gate...");
+    if (now == PASSAGE_TIMEOUT) {
+        // Nobody went through: undo the counter update, if there was one
+        ESP_LOGW("PASSAGE", "[%s] No vehicle passed. Closing gate...", lane->config->name);
 
-    // Send exit notification to backend
-    set_license_plate_data("invalid_plate");
-    xTaskCreate(post_exit_task, "post_exit_task", 8192, NULL, 5, NULL);
-    vTaskDelay(pdMS_TO_TICKS(5000));
+        if (lane->spot_changed && lane->curr_state == ENTRY_ALLOWED) {
+            release_parking_spot();
+        } else if (lane->spot_changed) {
+            take_parking_spot();
+        }
+    } else {
+        ESP_LOGI("PASSAGE", "[%s] Vehicle passed. Closing gate...", lane->config->name);
+    }
 
-    oled_clear();
-    
-    curr_state = IDLE;
-}
+    lane_clear(lane);
+    lane_print(lane, 3, "Closing gate...");
+
+    servo_motor_lower_barrier(lane->id);
+    trace_record(TRACE_BARRIER_LOWER, lane->id, 0);
 
+    fsm_post_event(lane->id, STATE_COMPLETED);
+}
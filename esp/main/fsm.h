@@ -13,29 +13,48 @@
 #ifndef FSM_H_
 #define FSM_H_
 
-typedef enum {
-    VALID_WEIGHT_DETECTED,
-    EXIT_DETECTED,
-    REMOTE_OPEN,
-    PLATE_RECOGNIZED,
-    PLATE_REFUSED,
-    NONE
-} Event_t;
-
-typedef enum {
-    INIT,
-    IDLE,
-    VEHICLE_ENTRY,
-    ENTRY_REFUSED,
-    ENTRY_ALLOWED,
-    VEHICLE_EXIT,
-    STATES_NUM
-} State_t;
-
-
-void fsm_handle_event(Event_t event);
-
-void fsm_run_state_function();
+#include "freertos/FreeRTOS.h"
+#include "sdkconfig.h"
+#include "fsm_table.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Statistics collected by the FSM event dispatcher
+typedef struct {
+    uint32_t events_posted;     // events accepted by the queue
+    uint32_t events_dropped;    // events lost because the queue was full
+    uint32_t events_ignored;    // events with no transition from the current state
+    uint32_t transitions;       // state changes caused by events
+    uint32_t queue_depth;       // events currently waiting in the queue
+    uint32_t queue_depth_max;   // highest queue depth observed
+    int64_t latency_last_us;    // event-to-transition latency of the last transition
+    int64_t latency_max_us;     // worst event-to-transition latency
+    int64_t latency_total_us;   // sum of all latencies (average = total / transitions)
+} fsm_stats_t;
+
+// Number of lanes, each one running its own FSM instance
+#define FSM_LANES_NUM CONFIG_PARKING_LANES
+
+// Creates the lanes and their event queues, must be called before posting any event
+void fsm_init(void);
+
+const char *fsm_lane_name(uint8_t lane);
+
+// Posts an event to the FSM of a lane from a task context
+bool fsm_post_event(uint8_t lane, Event_t event);
+
+// Posts an event to the FSM of a lane from an interrupt service routine
+bool fsm_post_event_from_isr(uint8_t lane, Event_t event, BaseType_t *higher_priority_task_woken);
+
+// Waits for the next event of a lane and applies the resulting transition
+void fsm_dispatch_events(uint8_t lane);
+
+// Runs the periodic action of the current state of a lane
+void fsm_run_state_function(uint8_t lane);
+
+// Copies the dispatcher statistics of a lane
+void fsm_get_stats(uint8_t lane, fsm_stats_t *stats);
 
 
 #endif /* FSM_H_ */
@@ -0,0 +1,157 @@
+/*
+ * fsm_table.c
+ *
+ * Transition table of the finite state machine,
+ * expanded from FSM_TRANSITIONS() in fsm_table.h, and the
+ * checks run on it. This file has no hardware
+ * dependency, so it can also be compiled on the host.
+ *
+ */
+
+#include "fsm_table.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#define FSM_TABLE_ENTRY(state, event, next_state) \
+    [state][event] = { .valid = true, .next = next_state },
+
+const fsm_transition_t fsm_transition_table[STATES_NUM][EVENTS_NUM] = {
+    FSM_TRANSITIONS(FSM_TABLE_ENTRY)
+};
+
+/*
+ * Never called: a (state, event) pair listed twice in
+ * FSM_TRANSITIONS() expands into a duplicated case label,
+ * which makes the build fail instead of silently overriding
+ * the first transition.
+ */
+#define FSM_CASE_ENTRY(state, event, next_state) \
+    case (state) * EVENTS_NUM + (event): return next_state;
+
+__attribute__((unused))
+static State_t fsm_table_duplicate_check(int key) {
+    switch (key) {
+        FSM_TRANSITIONS(FSM_CASE_ENTRY)
+        default: return STATES_NUM;
+    }
+}
+
+static const char *state_names[STATES_NUM] = {
+    [INIT]          = "INIT",
+    [IDLE]          = "IDLE",
+    [VEHICLE_ENTRY] = "VEHICLE_ENTRY",
+    [ENTRY_REFUSED] = "ENTRY_REFUSED",
+    [ENTRY_ALLOWED] = "ENTRY_ALLOWED",
+    [VEHICLE_EXIT]  = "VEHICLE_EXIT",
+};
+
+static const char *event_names[EVENTS_NUM] = {
+    [VALID_WEIGHT_DETECTED] = "VALID_WEIGHT_DETECTED",
+    [EXIT_DETECTED]         = "EXIT_DETECTED",
+    [REMOTE_OPEN]           = "REMOTE_OPEN",
+    [PLATE_RECOGNIZED]      = "PLATE_RECOGNIZED",
+    [PLATE_REFUSED]         = "PLATE_REFUSED",
+    [STATE_COMPLETED]       = "STATE_COMPLETED",
+    [NONE]                  = "NONE",
+};
+
+_Static_assert(sizeof(state_names) / sizeof(state_names[0]) == STATES_NUM, "missing state name");
+_Static_assert(sizeof(event_names) / sizeof(event_names[0]) == EVENTS_NUM, "missing event name");
+
+const char *fsm_state_name(State_t state) {
+    return (state < STATES_NUM && state_names[state]) ? state_names[state] : "UNKNOWN";
+}
+
+const char *fsm_event_name(Event_t event) {
+    return (event < EVENTS_NUM && event_names[event]) ? event_names[event] : "UNKNOWN";
+}
+
+/**
+ * Looks up the transition for a (state, event) pair
+ * @param state The current state
+ * @param event The event to handle
+ * @param next Set to the next state when the event is handled
+ * @return true if the event causes a transition, false if it is ignored
+ */
+bool fsm_next_state(State_t state, Event_t event, State_t *next) {
+    if (state >= STATES_NUM || event >= EVENTS_NUM) {
+        return false;
+    }
+
+    const fsm_transition_t *t = &fsm_transition_table[state][event];
+
+    if (t->valid && next != NULL) {
+        *next = t->next;
+    }
+
+    return t->valid;
+}
+
+/**
+ * Walks every (state, event) pair of the table and checks that:
+ * - every state is reachable from INIT
+ * - every state has at least one outgoing transition
+ * - IDLE can be reached again from every state (no dead ends)
+ * @param error Buffer that receives the first problem found, can be NULL
+ * @param error_len Size of the error buffer
+ * @return The number of problems found, 0 if the table is sound
+ */
+int fsm_verify_table(char *error, size_t error_len) {
+    int problems = 0;
+    bool reachable[STATES_NUM] = { [INIT] = true };
+    bool reaches_idle[STATES_NUM] = { [IDLE] = true };
+    bool changed = true;
+
+    // Forward closure from INIT and backward closure towards IDLE
+    while (changed) {
+        changed = false;
+
+        for (int s = 0; s < STATES_NUM; s++) {
+            for (int e = 0; e < EVENTS_NUM; e++) {
+                const fsm_transition_t *t = &fsm_transition_table[s][e];
+
+                if (!t->valid) {
+                    continue;
+                }
+
+                if (reachable[s] && !reachable[t->next]) {
+                    reachable[t->next] = true;
+                    changed = true;
+                }
+
+                if (reaches_idle[t->next] && !reaches_idle[s]) {
+                    reaches_idle[s] = true;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    for (int s = 0; s < STATES_NUM; s++) {
+        bool has_exit = false;
+
+        for (int e = 0; e < EVENTS_NUM; e++) {
+            has_exit |= fsm_transition_table[s][e].valid;
+        }
+
+        const char *problem = NULL;
+
+        if (!reachable[s]) {
+            problem = "unreachable from INIT";
+        } else if (!has_exit) {
+            problem = "has no outgoing transition";
+        } else if (!reaches_idle[s]) {
+            problem = "cannot get back to IDLE";
+        }
+
+        if (problem != NULL) {
+            if (problems == 0 && error != NULL && error_len > 0) {
+                snprintf(error, error_len, "state %s %s", state_names[s], problem);
+            }
+            problems++;
+        }
+    }
+
+    return problems;
+}
@@ -0,0 +1,75 @@
+/*
+ * fsm_table.h
+ *
+ * States, events and transition table of the
+ * finite state machine. Kept free of any ESP-IDF
+ * include so that the table can be compiled on the
+ * host as well, see tools/replay.
+ *
+ */
+
+#ifndef FSM_TABLE_H_
+#define FSM_TABLE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum {
+    VALID_WEIGHT_DETECTED,
+    EXIT_DETECTED,
+    REMOTE_OPEN,
+    PLATE_RECOGNIZED,
+    PLATE_REFUSED,
+    STATE_COMPLETED,    // posted by a state when its work is over
+    NONE,
+    EVENTS_NUM
+} Event_t;
+
+typedef enum {
+    INIT,
+    IDLE,
+    VEHICLE_ENTRY,
+    ENTRY_REFUSED,
+    ENTRY_ALLOWED,
+    VEHICLE_EXIT,
+    STATES_NUM
+} State_t;
+
+/*
+ * Transition table of the FSM: X(current state, event, next state).
+ * Every (state, event) pair not listed here is ignored by the FSM.
+ * The table is expanded at compile time into a lookup array by
+ * fsm_table.c, where duplicated pairs are rejected by the compiler.
+ */
+#define FSM_TRANSITIONS(X) \
+    X(INIT,          STATE_COMPLETED,       IDLE)           \
+    X(IDLE,          VALID_WEIGHT_DETECTED, VEHICLE_ENTRY)  \
+    X(IDLE,          EXIT_DETECTED,         VEHICLE_EXIT)   \
+    X(IDLE,          REMOTE_OPEN,           ENTRY_ALLOWED)  \
+    X(VEHICLE_ENTRY, PLATE_RECOGNIZED,      ENTRY_ALLOWED)  \
+    X(VEHICLE_ENTRY, PLATE_REFUSED,         ENTRY_REFUSED)  \
+    X(ENTRY_REFUSED, STATE_COMPLETED,       IDLE)           \
+    X(ENTRY_ALLOWED, STATE_COMPLETED,       IDLE)           \
+    X(VEHICLE_EXIT,  STATE_COMPLETED,       IDLE)
+
+// Entry of the expanded transition table
+typedef struct {
+    bool valid;     // false if the event is ignored in the state
+    State_t next;
+} fsm_transition_t;
+
+extern const fsm_transition_t fsm_transition_table[STATES_NUM][EVENTS_NUM];
+
+// Looks up the next state, returns false if the event is ignored in the state
+bool fsm_next_state(State_t state, Event_t event, State_t *next);
+
+// Checks that every state is reachable from INIT and can get back to IDLE
+int fsm_verify_table(char *error, size_t error_len);
+
+const char *fsm_state_name(State_t state);
+
+const char *fsm_event_name(Event_t event);
+
+
+#endif /* FSM_TABLE_H_ */
@@ -0,0 +1,30 @@
+/*
+ * fsm_timing.h
+ *
+ * Delays of the state actions of fsm.c. Kept free
+ * of any ESP-IDF include so that tools/replay models
+ * the lanes with the same values as the firmware.
+ *
+ */
+
+#ifndef FSM_TIMING_H_
+#define FSM_TIMING_H_
+
+// Polling period of idle_fn(), by light sleep or on the event queue
+#define IDLE_POLL_MS 200
+
+// How long the ultrasonic sensor must stay occupied in idle
+// before a vehicle is taken as exiting
+#define EXIT_DEBOUNCE_MS 500
+
+// How long the refusal stays on the display before going back to idle
+#define REFUSE_HOLD_MS 5000
+
+// Passage tracking: the sensor is sampled every PASSAGE_SAMPLE_MS
+// while the barrier is open, the lane must stay free for
+// PASSAGE_CLEAR_HOLD_MS before the barrier is closed
+#define PASSAGE_SAMPLE_MS       100
+#define PASSAGE_CLEAR_HOLD_MS   600
+#define PASSAGE_WAIT_TIMEOUT_MS 30000
+
+#endif /* FSM_TIMING_H_ */
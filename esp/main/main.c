@@ -20,14 +20,18 @@
 
 /**
  * FSM Task
- * This task runs the finite state machine, executing state functions
- * in a loop with a small delay to allow other tasks to run.
+ * This task runs the finite state machine of a lane: it executes
+ * the state function and then blocks on the event queue of the lane,
+ * so that it wakes up as soon as another task (or an ISR) posts an event.
+ * @param arg The id of the lane, cast to a pointer
  */
 void fsm_task(void *arg)
 {
+    uint8_t lane = (uint8_t)(uintptr_t) arg;
+
     while (1) {
-        fsm_run_state_function();   // executes one state iteration
-        vTaskDelay(pdMS_TO_TICKS(50));
+        fsm_run_state_function(lane);   // executes one state iteration
+        fsm_dispatch_events(lane);      // waits for the next event
     }
 }
 
@@ -48,7 +52,7 @@ void calibration_task(void *arg)
     ESP_ERROR_CHECK(ret);
 
     // Perform weight calibration with a known weight of 1000 grams
-    weight_calibrate(35.0f);
+    weight_calibrate(0, 35.0f);
     vTaskDelete(NULL); // Delete this task after calibration
 }
 #endif
@@ -60,6 +64,11 @@ void app_main(void) {
     xTaskCreate(calibration_task, "calibration_task", 8192, NULL, 5, NULL);
     #else
 
-    xTaskCreate(fsm_task, "fsm_task", 8192, NULL, 5, NULL);
+    fsm_init();
+
+    // One FSM task for each lane of the gate
+    for (uintptr_t lane = 0; lane < FSM_LANES_NUM; lane++) {
+        xTaskCreate(fsm_task, fsm_lane_name(lane), 8192, (void *) lane, 5, NULL);
+    }
     #endif
 }
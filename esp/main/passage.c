@@ -0,0 +1,80 @@
+/*
+ * passage.c
+ *
+ * Passage sub-machine: follows a vehicle from the
+ * moment the barrier opens until the lane is clear.
+ *
+ *   WAITING --occupied--> PASSING --free for clear_hold--> CLEARED
+ *      |                     ^  |
+ *      |                     +--+ occupied again (trailer, gap)
+ *      +--wait_timeout--> TIMEOUT
+ *
+ * A vehicle under the barrier never times out: the
+ * barrier is only closed on a free lane.
+ *
+ */
+
+#include "passage.h"
+
+#include <stddef.h>
+
+void passage_start(passage_t *p, int64_t now_us, int64_t wait_timeout_us, int64_t clear_hold_us) {
+    p->state = PASSAGE_WAITING;
+    p->started_us = now_us;
+    p->free_since_us = -1;
+    p->wait_timeout_us = wait_timeout_us;
+    p->clear_hold_us = clear_hold_us;
+}
+
+/**
+ * Advances the sub-machine with a new sample
+ * @param p The passage to update
+ * @param occupied true if the sensor sees a vehicle
+ * @param now_us Time of the sample
+ * @return The state after the sample
+ */
+passage_state_t passage_update(passage_t *p, bool occupied, int64_t now_us) {
+    switch (p->state) {
+        case PASSAGE_WAITING:
+            if (occupied) {
+                p->state = PASSAGE_PASSING;
+                p->free_since_us = -1;
+            } else if (now_us - p->started_us >= p->wait_timeout_us) {
+                p->state = PASSAGE_TIMEOUT;
+            }
+            break;
+
+        case PASSAGE_PASSING:
+            if (occupied) {
+                p->free_since_us = -1;
+            } else if (p->free_since_us < 0) {
+                p->free_since_us = now_us;
+            }
+
+            if (p->free_since_us >= 0 && now_us - p->free_since_us >= p->clear_hold_us) {
+                p->state = PASSAGE_CLEARED;
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    return p->state;
+}
+
+bool passage_done(const passage_t *p) {
+    return p->state == PASSAGE_CLEARED || p->state == PASSAGE_TIMEOUT;
+}
+
+const char *passage_state_name(passage_state_t state) {
+    static const char *names[] = {
+        [PASSAGE_IDLE]    = "IDLE",
+        [PASSAGE_WAITING] = "WAITING",
+        [PASSAGE_PASSING] = "PASSING",
+        [PASSAGE_CLEARED] = "CLEARED",
+        [PASSAGE_TIMEOUT] = "TIMEOUT",
+    };
+
+    return (state <= PASSAGE_TIMEOUT) ? names[state] : "UNKNOWN";
+}
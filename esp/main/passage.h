@@ -0,0 +1,45 @@
+/*
+ * passage.h
+ *
+ * Sub-machine that follows a vehicle through an
+ * open gate: it is fed with the ultrasonic samples
+ * and the current time, and tells the lane when the
+ * barrier can be closed. It has no hardware
+ * dependency, so it can also be compiled on the host.
+ *
+ */
+
+#ifndef PASSAGE_H_
+#define PASSAGE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum {
+    PASSAGE_IDLE,       // no passage in progress
+    PASSAGE_WAITING,    // barrier open, vehicle not seen yet
+    PASSAGE_PASSING,    // vehicle under the barrier
+    PASSAGE_CLEARED,    // vehicle gone, the barrier can be closed
+    PASSAGE_TIMEOUT,    // no vehicle showed up, the barrier can be closed
+} passage_state_t;
+
+typedef struct {
+    passage_state_t state;
+    int64_t started_us;         // when the barrier was opened
+    int64_t free_since_us;      // first free sample after the vehicle, -1 if occupied
+    int64_t wait_timeout_us;    // how long to wait for the vehicle
+    int64_t clear_hold_us;      // how long the lane must stay free to be cleared
+} passage_t;
+
+// Starts following a passage, the barrier has just been opened
+void passage_start(passage_t *p, int64_t now_us, int64_t wait_timeout_us, int64_t clear_hold_us);
+
+// Feeds a sensor sample, returns the updated state
+passage_state_t passage_update(passage_t *p, bool occupied, int64_t now_us);
+
+// Returns true once the passage reached CLEARED or TIMEOUT
+bool passage_done(const passage_t *p);
+
+const char *passage_state_name(passage_state_t state);
+
+#endif /* PASSAGE_H_ */
@@ -0,0 +1,388 @@
+/*
+ * cv_bench.c
+ *
+ * Host tool that uploads a directory of JPEG images to a plate
+ * recognition server the way the firmware does (same multipart
+ * body, from components/cv/cv_multipart.h, on one kept-alive
+ * connection) and parses the responses with the parser of the
+ * firmware (components/cv/cv_response.c). It reports the
+ * latency percentiles, the errors and the plate read in every
+ * image, and checks them against a list of expected plates.
+ *
+ * Meant to be run against the local stand-in server
+ * (web-service/cv-mock), which answers the same plate for the
+ * same image. Build and run, from the esp/ directory:
+ *   gcc -O2 -Icomponents/cv -o cv_bench tools/cv_bench/cv_bench.c components/cv/cv_response.c
+ *   ./cv_bench http://localhost:8080/api/v1/readnumberplate components/cv 20 expected.txt
+ *
+ * The expected plates file has one "<image name> <plate>" per
+ * line. The tool exits with 1 if a plate differs from the
+ * expected one or from the one of a previous round.
+ *
+ */
+
+#include "cv_multipart.h"
+#include "cv_response.h"
+
+#include <dirent.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_IMAGES 64
+#define MAX_REQUESTS 10000
+
+static const char multipart_head[] = CV_MULTIPART_HEAD("bench");
+static const char multipart_tail[] = CV_MULTIPART_TAIL;
+
+typedef struct {
+    char name[256];
+    uint8_t *jpg;
+    size_t len;
+    char expected[CV_PLATE_MAX];
+    char plate[CV_PLATE_MAX];
+    bool read;                  // a plate was read in a previous round
+    bool mismatch;
+} image_t;
+
+static image_t images[MAX_IMAGES];
+static int image_count = 0;
+
+static char host[256], port[8] = "80", path[512] = "/";
+static int sock = -1;
+
+// Counters of the run
+static double latencies_ms[MAX_REQUESTS];
+static int requests = 0, errors = 0, connections = 0;
+
+static double now_ms(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+// Splits an http:// URL into host, port and path
+static bool parse_url(const char *url) {
+    if (strncmp(url, "http://", 7) != 0) {
+        return false;
+    }
+
+    url += 7;
+    const char *slash = strchr(url, '/');
+    size_t authority_len = slash ? (size_t)(slash - url) : strlen(url);
+    const char *colon = memchr(url, ':', authority_len);
+    size_t host_len = colon ? (size_t)(colon - url) : authority_len;
+
+    if (host_len == 0 || host_len >= sizeof(host)) {
+        return false;
+    }
+
+    memcpy(host, url, host_len);
+    host[host_len] = '\0';
+
+    if (colon != NULL) {
+        snprintf(port, sizeof(port), "%.*s", (int)(authority_len - host_len - 1), colon + 1);
+    }
+    if (slash != NULL) {
+        snprintf(path, sizeof(path), "%s", slash);
+    }
+
+    return true;
+}
+
+static bool connect_server(void) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *res;
+
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        return false;
+    }
+
+    for (struct addrinfo *ai = res; ai != NULL && sock < 0; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sock >= 0 && connect(sock, ai->ai_addr, ai->ai_addrlen) != 0) {
+            close(sock);
+            sock = -1;
+        }
+    }
+
+    freeaddrinfo(res);
+    connections += sock >= 0;
+    return sock >= 0;
+}
+
+static void disconnect_server(void) {
+    if (sock >= 0) {
+        close(sock);
+        sock = -1;
+    }
+}
+
+static bool send_all(const void *data, size_t len) {
+    const uint8_t *p = data;
+
+    while (len > 0) {
+        ssize_t sent = send(sock, p, len, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return false;
+        }
+        p += sent;
+        len -= (size_t) sent;
+    }
+
+    return true;
+}
+
+/**
+ * Uploads an image and parses the response on the kept-alive
+ * connection, which is closed if anything goes wrong
+ * @return The HTTP status, -1 if the connection failed
+ */
+static int upload(const image_t *image, cv_response_parser_t *parser) {
+    char headers[1024];
+    size_t body_len = sizeof(multipart_head) - 1 + image->len + sizeof(multipart_tail) - 1;
+
+    int headers_len = snprintf(headers, sizeof(headers),
+        "POST %s HTTP/1.1\r\nHost: %s:%s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: keep-alive\r\n\r\n",
+        path, host, port, CV_MULTIPART_CONTENT_TYPE, body_len);
+
+    if ((sock < 0 && !connect_server()) || !send_all(headers, (size_t) headers_len) ||
+        !send_all(multipart_head, sizeof(multipart_head) - 1) || !send_all(image->jpg, image->len) ||
+        !send_all(multipart_tail, sizeof(multipart_tail) - 1)) {
+        disconnect_server();
+        return -1;
+    }
+
+    // Reads until the end of the headers, the rest of the buffer is body
+    char buffer[4096];
+    size_t len = 0;
+    char *body = NULL;
+
+    while (body == NULL) {
+        ssize_t received = len < sizeof(buffer) - 1 ? recv(sock, buffer + len, sizeof(buffer) - 1 - len, 0) : 0;
+        if (received <= 0) {
+            disconnect_server();
+            return -1;
+        }
+
+        len += (size_t) received;
+        buffer[len] = '\0';
+        body = strstr(buffer, "\r\n\r\n");
+    }
+
+    *body = '\0';
+    body += 4;
+
+    int status = 0;
+    sscanf(buffer, "HTTP/1.%*d %d", &status);
+
+    // Without a length the body ends with the connection
+    long content_len = -1;
+    bool keep_alive = true;
+
+    for (char *line = strchr(buffer, '\n'); line != NULL; line = strchr(line + 1, '\n')) {
+        if (strncasecmp(line + 1, "Content-Length:", 15) == 0) {
+            content_len = strtol(line + 16, NULL, 10);
+        } else if (strncasecmp(line + 1, "Connection: close", 17) == 0) {
+            keep_alive = false;
+        }
+    }
+
+    size_t body_received = len - (size_t)(body - buffer);
+    cv_response_init(parser);
+    cv_response_feed(parser, body, body_received);
+
+    while (content_len < 0 || body_received < (size_t) content_len) {
+        ssize_t received = recv(sock, buffer, sizeof(buffer), 0);
+        if (received <= 0) {
+            keep_alive = false;
+            break;
+        }
+
+        cv_response_feed(parser, buffer, (size_t) received);
+        body_received += (size_t) received;
+    }
+
+    if (!keep_alive || content_len < 0) {
+        disconnect_server();
+    }
+
+    return status;
+}
+
+static uint8_t *read_file(const char *file_path, size_t *len) {
+    FILE *file = fopen(file_path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    uint8_t *data = size > 0 ? malloc(size) : NULL;
+    if (data != NULL && fread(data, 1, size, file) != (size_t) size) {
+        free(data);
+        data = NULL;
+    }
+
+    fclose(file);
+    *len = (size_t) size;
+    return data;
+}
+
+static bool is_jpeg(const char *name) {
+    const char *dot = strrchr(name, '.');
+    return dot != NULL && (strcasecmp(dot, ".jpg") == 0 || strcasecmp(dot, ".jpeg") == 0);
+}
+
+static int load_images(const char *dir_path) {
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        perror(dir_path);
+        return 0;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && image_count < MAX_IMAGES) {
+        if (!is_jpeg(entry->d_name)) {
+            continue;
+        }
+
+        char file_path[1024];
+        image_t *image = &images[image_count];
+
+        snprintf(file_path, sizeof(file_path), "%s/%s", dir_path, entry->d_name);
+        snprintf(image->name, sizeof(image->name), "%s", entry->d_name);
+        image->jpg = read_file(file_path, &image->len);
+
+        image_count += image->jpg != NULL;
+    }
+
+    closedir(dir);
+    return image_count;
+}
+
+static bool load_expected(const char *file_path) {
+    FILE *file = fopen(file_path, "r");
+    if (file == NULL) {
+        perror(file_path);
+        return false;
+    }
+
+    char name[256], plate[CV_PLATE_MAX];
+    while (fscanf(file, "%255s %31s", name, plate) == 2) {
+        for (int i = 0; i < image_count; i++) {
+            if (strcmp(images[i].name, name) == 0) {
+                snprintf(images[i].expected, sizeof(images[i].expected), "%s", plate);
+            }
+        }
+    }
+
+    fclose(file);
+    return true;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(int percent) {
+    if (requests == 0) {
+        return 0;
+    }
+
+    int index = (requests * percent + 99) / 100 - 1;
+    return latencies_ms[index < 0 ? 0 : index];
+}
+
+// Uploads one image and checks its plate against the expected and the previous ones
+static void bench_image(image_t *image, int round) {
+    cv_response_parser_t parser;
+
+    double start = now_ms();
+    int status = upload(image, &parser);
+    double elapsed = now_ms() - start;
+
+    latencies_ms[requests++] = elapsed;
+
+    if (status != 200 || !parser.complete || parser.error || !parser.fields.has_plate) {
+        errors++;
+        printf("round %-3d %-28s error (HTTP %d%s)  %7.1f ms\n", round, image->name, status,
+            status == 200 ? ", incomplete response" : "", elapsed);
+        return;
+    }
+
+    const char *plate = parser.fields.plate;
+
+    if ((image->expected[0] != '\0' && strcmp(plate, image->expected) != 0) ||
+        (image->read && strcmp(plate, image->plate) != 0)) {
+        image->mismatch = true;
+    }
+
+    snprintf(image->plate, sizeof(image->plate), "%s", plate);
+    image->read = true;
+
+    printf("round %-3d %-28s %-10s %5.2f  %7.1f ms%s\n", round, image->name, plate,
+        parser.fields.has_confidence ? parser.fields.confidence : 0.0f, elapsed,
+        image->mismatch ? "  MISMATCH" : "");
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3 || argc > 5) {
+        fprintf(stderr, "Usage: %s <http URL> <directory of JPEG images> [rounds] [expected plates file]\n", argv[0]);
+        return 1;
+    }
+
+    int rounds = argc >= 4 ? atoi(argv[3]) : 1;
+
+    if (!parse_url(argv[1])) {
+        fprintf(stderr, "Only http:// URLs are supported: %s\n", argv[1]);
+        return 1;
+    }
+
+    if (load_images(argv[2]) == 0) {
+        fprintf(stderr, "No JPEG image in %s\n", argv[2]);
+        return 1;
+    }
+
+    if (argc == 5 && !load_expected(argv[4])) {
+        return 1;
+    }
+
+    if (rounds < 1 || rounds * image_count > MAX_REQUESTS) {
+        rounds = rounds < 1 ? 1 : MAX_REQUESTS / image_count;
+    }
+
+    double start = now_ms();
+
+    for (int round = 1; round <= rounds; round++) {
+        for (int i = 0; i < image_count; i++) {
+            bench_image(&images[i], round);
+        }
+    }
+
+    double total = now_ms() - start;
+    disconnect_server();
+
+    int mismatches = 0;
+    for (int i = 0; i < image_count; i++) {
+        mismatches += images[i].mismatch;
+        free(images[i].jpg);
+    }
+
+    qsort(latencies_ms, (size_t) requests, sizeof(double), compare_double);
+
+    printf("\n%d requests in %.1f s on %d connections, %d errors (%.1f %%)\n", requests, total / 1e3,
+        connections, errors, 100.0 * errors / requests);
+    printf("latency p50 %.1f ms  p90 %.1f ms  p99 %.1f ms  max %.1f ms\n", percentile(50), percentile(90),
+        percentile(99), latencies_ms[requests - 1]);
+    printf("%d of %d images with an unexpected plate\n", mismatches, image_count);
+
+    return mismatches > 0 ? 1 : 0;
+}
@@ -0,0 +1,288 @@
+/*
+ * detector_eval.c
+ *
+ * Host tool that runs labelled weight sequences through
+ * every detection engine of weight_detector.c and compares
+ * how many vehicles they accept, how fast, and how many
+ * other loads (hands, debris, heavy objects, knocks) they
+ * wrongly accept.
+ *
+ * Build and run, from the esp/ directory:
+ *   gcc -O2 -Icomponents/weight -o detector_eval tools/detector_eval/detector_eval.c \
+ *       components/weight/weight_detector.c -lm
+ *   ./detector_eval [options] tools/detector_eval/sequences.csv
+ *
+ * Options, checked on the engine given with --engine (the default
+ * engine of the firmware if not given):
+ *   --engine <name>          engine the limits apply to
+ *   --max-latency <ms>       slowest vehicle confirmation (default 1000)
+ *   --max-mean-latency <ms>  mean vehicle confirmation (default 800)
+ *   --max-false <n>          other loads accepted (default 2)
+ * Every vehicle must be accepted. The exit status is 1 if a limit
+ * is exceeded, so a change of the engine that makes it slower or
+ * less selective on the sequences is caught.
+ *
+ * Sequence format (CSV, lines starting with # are ignored):
+ *   <label>,<grams>,<grams>,...    net weight every 200 ms (one batch)
+ * Only the sequences labelled "vehicle" are to be accepted.
+ *
+ * The latency is measured from the first sample above the
+ * noise threshold to the confirmation.
+ *
+ */
+
+#include "weight_detector.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Period of the detector steps, one batch of the sampler
+#define SAMPLE_MS 200
+
+// The sequences are in grams, the detector works on raw counts
+#define EVAL_SCALE 0.01f
+
+// Empty scale samples fed before each sequence, so the baseline settles
+#define LEAD_SAMPLES 50
+
+#define MAX_SAMPLES 512
+#define MAX_LABELS  8
+
+// Goals of the checked engine on the bundled sequences: a vehicle
+// confirmed one batch after it stops rising (its ramp takes up to
+// 800 ms), at most one hand in six accepted
+#define DEFAULT_MAX_LATENCY_MS      1000
+#define DEFAULT_MAX_MEAN_LATENCY_MS 800
+#define DEFAULT_MAX_FALSE_TRIGGERS  2
+
+static const char *const engine_names[] = { "count", "sequential" };
+#define ENGINES_NUM (sizeof(engine_names) / sizeof(engine_names[0]))
+
+typedef struct {
+    char label[16];
+    int sequences;
+    int accepted;
+    long latency_sum_ms;
+    int latency_max_ms;
+} label_stats_t;
+
+typedef struct {
+    label_stats_t labels[MAX_LABELS];
+    int labels_num;
+} engine_stats_t;
+
+static label_stats_t *find_label(engine_stats_t *stats, const char *label) {
+    for (int i = 0; i < stats->labels_num; i++) {
+        if (strcmp(stats->labels[i].label, label) == 0) {
+            return &stats->labels[i];
+        }
+    }
+
+    if (stats->labels_num == MAX_LABELS) {
+        return NULL;
+    }
+
+    label_stats_t *l = &stats->labels[stats->labels_num++];
+    memset(l, 0, sizeof(*l));
+    snprintf(l->label, sizeof(l->label), "%s", label);
+    return l;
+}
+
+/**
+ * Runs a sequence through a fresh detector
+ * @return The latency of the confirmation in ms, -1 if not confirmed
+ */
+static int run_sequence(const weight_detector_config_t *cfg, const float *grams, int num) {
+    weight_detector_t det;
+    weight_detector_init(&det, cfg, EVAL_SCALE, 0);
+
+    for (int i = 0; i < LEAD_SAMPLES; i++) {
+        weight_detector_step(&det, 0);
+    }
+
+    int start = -1;
+
+    for (int i = 0; i < num; i++) {
+        if (start < 0 && fabsf(grams[i]) >= cfg->noise_threshold) {
+            start = i;
+        }
+
+        if (weight_detector_step(&det, (int32_t) lroundf(grams[i] / EVAL_SCALE)) == WEIGHT_SAMPLE_CONFIRMED) {
+            return (i - (start < 0 ? i : start) + 1) * SAMPLE_MS;
+        }
+    }
+
+    return -1;
+}
+
+static int parse_line(char *line, char *label, size_t label_len, float *grams) {
+    char *save = NULL;
+    char *field = strtok_r(line, ",\r\n", &save);
+
+    if (field == NULL) {
+        return -1;
+    }
+
+    snprintf(label, label_len, "%s", field);
+
+    int num = 0;
+    while ((field = strtok_r(NULL, ",\r\n", &save)) != NULL && num < MAX_SAMPLES) {
+        grams[num++] = strtof(field, NULL);
+    }
+
+    return num;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [--engine name] [--max-latency ms] [--max-mean-latency ms] "
+        "[--max-false n] sequences.csv\n", name);
+}
+
+int main(int argc, char **argv) {
+    const char *checked = weight_detector_default_config.engine->name;
+    int max_latency_ms = DEFAULT_MAX_LATENCY_MS;
+    int max_mean_latency_ms = DEFAULT_MAX_MEAN_LATENCY_MS;
+    int max_false = DEFAULT_MAX_FALSE_TRIGGERS;
+    const char *path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            checked = argv[++i];
+        } else if (strcmp(argv[i], "--max-latency") == 0 && i + 1 < argc) {
+            max_latency_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-mean-latency") == 0 && i + 1 < argc) {
+            max_mean_latency_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-false") == 0 && i + 1 < argc) {
+            max_false = atoi(argv[++i]);
+        } else if (argv[i][0] != '-' && path == NULL) {
+            path = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (path == NULL) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (weight_detector_find_engine(checked) == NULL) {
+        fprintf(stderr, "Unknown engine %s\n", checked);
+        return 1;
+    }
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return 1;
+    }
+
+    weight_detector_config_t configs[ENGINES_NUM];
+    engine_stats_t stats[ENGINES_NUM];
+
+    for (size_t e = 0; e < ENGINES_NUM; e++) {
+        configs[e] = weight_detector_default_config;
+        configs[e].engine = weight_detector_find_engine(engine_names[e]);
+        stats[e].labels_num = 0;
+    }
+
+    static float grams[MAX_SAMPLES];
+    char line[8192], label[16];
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+
+        int num = parse_line(line, label, sizeof(label), grams);
+        if (num <= 0) {
+            continue;
+        }
+
+        for (size_t e = 0; e < ENGINES_NUM; e++) {
+            label_stats_t *l = find_label(&stats[e], label);
+            if (l == NULL) {
+                continue;
+            }
+
+            int latency = run_sequence(&configs[e], grams, num);
+
+            l->sequences++;
+            if (latency >= 0) {
+                l->accepted++;
+                l->latency_sum_ms += latency;
+                if (latency > l->latency_max_ms) {
+                    l->latency_max_ms = latency;
+                }
+            }
+        }
+    }
+
+    fclose(file);
+
+    int failures = 0;
+
+    for (size_t e = 0; e < ENGINES_NUM; e++) {
+        int vehicles = 0, accepted = 0, false_triggers = 0;
+        long latency_sum_ms = 0;
+        int latency_max_ms = 0;
+
+        printf("%s engine\n", engine_names[e]);
+        printf("  %-10s %9s %9s %12s %12s\n", "label", "sequences", "accepted", "mean ms", "max ms");
+
+        for (int i = 0; i < stats[e].labels_num; i++) {
+            const label_stats_t *l = &stats[e].labels[i];
+
+            printf("  %-10s %9d %9d %12.0f %12d\n", l->label, l->sequences, l->accepted,
+                l->accepted ? (double) l->latency_sum_ms / l->accepted : 0.0, l->latency_max_ms);
+
+            if (strcmp(l->label, "vehicle") == 0) {
+                vehicles += l->sequences;
+                accepted += l->accepted;
+                latency_sum_ms += l->latency_sum_ms;
+                latency_max_ms = l->latency_max_ms > latency_max_ms ? l->latency_max_ms : latency_max_ms;
+            } else {
+                false_triggers += l->accepted;
+            }
+        }
+
+        printf("  vehicles accepted %d/%d, false triggers %d\n", accepted, vehicles, false_triggers);
+
+        if (strcmp(engine_names[e], checked) != 0) {
+            printf("\n");
+            continue;
+        }
+
+        // Limits of the checked engine
+        int mean_ms = accepted ? (int)(latency_sum_ms / accepted) : 0;
+
+        if (vehicles == 0) {
+            printf("  FAIL: no vehicle sequence\n");
+            failures++;
+        }
+        if (accepted < vehicles) {
+            printf("  FAIL: %d vehicle(s) not accepted\n", vehicles - accepted);
+            failures++;
+        }
+        if (latency_max_ms > max_latency_ms) {
+            printf("  FAIL: slowest vehicle %d ms, limit %d ms\n", latency_max_ms, max_latency_ms);
+            failures++;
+        }
+        if (mean_ms > max_mean_latency_ms) {
+            printf("  FAIL: mean vehicle latency %d ms, limit %d ms\n", mean_ms, max_mean_latency_ms);
+            failures++;
+        }
+        if (false_triggers > max_false) {
+            printf("  FAIL: %d false trigger(s), limit %d\n", false_triggers, max_false);
+            failures++;
+        }
+
+        printf("  limits (max %d ms, mean %d ms, %d false): %s\n\n", max_latency_ms, max_mean_latency_ms,
+            max_false, failures ? "FAIL" : "PASS");
+    }
+
+    return failures ? 1 : 0;
+}
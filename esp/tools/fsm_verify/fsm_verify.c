@@ -0,0 +1,136 @@
+/*
+ * fsm_verify.c
+ *
+ * Host test of the FSM transition table (main/fsm_table.c):
+ * runs fsm_verify_table(), then walks every (state, event)
+ * pair through fsm_next_state() and checks that:
+ * - the lookup agrees with the expanded table
+ * - every transition goes to a known state
+ * - NONE is never handled, it only marks the absence of an event
+ * - the lookups out of range are ignored
+ * - every state and event has a name
+ * The table is printed, so that a change of the transitions
+ * can be reviewed without flashing the board.
+ *
+ * Build and run, from the esp/ directory:
+ *   gcc -O2 -Wall -Imain -o fsm_verify tools/fsm_verify/fsm_verify.c main/fsm_table.c
+ *   ./fsm_verify
+ *
+ * Exits with 1 if any check fails.
+ *
+ */
+
+#include "fsm_table.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static int failures = 0;
+
+static void fail(const char *what, State_t state, Event_t event)
+{
+    printf("FAIL: %s (%s, %s)\n", what, fsm_state_name(state), fsm_event_name(event));
+    failures++;
+}
+
+// Prints the table, one row for each state, "-" for an ignored event
+static void print_table(void)
+{
+    printf("%-14s", "");
+    for (int e = 0; e < EVENTS_NUM; e++) {
+        printf(" %-22s", fsm_event_name(e));
+    }
+    printf("\n");
+
+    for (int s = 0; s < STATES_NUM; s++) {
+        printf("%-14s", fsm_state_name(s));
+
+        for (int e = 0; e < EVENTS_NUM; e++) {
+            State_t next;
+            printf(" %-22s", fsm_next_state(s, e, &next) ? fsm_state_name(next) : "-");
+        }
+        printf("\n");
+    }
+    printf("\n");
+}
+
+static void check_pairs(void)
+{
+    int transitions = 0;
+
+    for (int s = 0; s < STATES_NUM; s++) {
+        if (strcmp(fsm_state_name(s), "UNKNOWN") == 0) {
+            fail("state without a name", s, NONE);
+        }
+
+        for (int e = 0; e < EVENTS_NUM; e++) {
+            const fsm_transition_t *t = &fsm_transition_table[s][e];
+            State_t next = STATES_NUM;
+            bool handled = fsm_next_state(s, e, &next);
+
+            if (handled != t->valid) {
+                fail("lookup disagrees with the table", s, e);
+                continue;
+            }
+
+            if (!handled) {
+                continue;
+            }
+
+            transitions++;
+
+            if (next != t->next) {
+                fail("lookup returns another next state", s, e);
+            }
+
+            if (next >= STATES_NUM) {
+                fail("transition to an unknown state", s, e);
+            }
+
+            if (e == NONE) {
+                fail("NONE is handled", s, e);
+            }
+        }
+    }
+
+    for (int e = 0; e < EVENTS_NUM; e++) {
+        if (strcmp(fsm_event_name(e), "UNKNOWN") == 0) {
+            fail("event without a name", INIT, e);
+        }
+    }
+
+    printf("%d states x %d events, %d transitions\n", STATES_NUM, EVENTS_NUM, transitions);
+}
+
+static void check_out_of_range(void)
+{
+    State_t next = IDLE;
+
+    if (fsm_next_state(STATES_NUM, STATE_COMPLETED, &next) || next != IDLE) {
+        fail("state out of range handled", STATES_NUM, STATE_COMPLETED);
+    }
+
+    if (fsm_next_state(IDLE, EVENTS_NUM, &next) || next != IDLE) {
+        fail("event out of range handled", IDLE, EVENTS_NUM);
+    }
+}
+
+int main(void)
+{
+    char error[128] = "";
+
+    print_table();
+
+    int problems = fsm_verify_table(error, sizeof(error));
+
+    if (problems > 0) {
+        printf("FAIL: fsm_verify_table() found %d problem(s), first: %s\n", problems, error);
+        failures++;
+    }
+
+    check_pairs();
+    check_out_of_range();
+
+    printf("%s\n", failures ? "FAILED" : "PASS");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,387 @@
+/*
+ * plate_cache.c
+ *
+ * Host test of the recognition cache (components/cv/plate_cache.c):
+ * the plate of a JPEG image is located and hashed like on the
+ * gate, then variants of the image are run through the cache.
+ * Variants of the same plate (other exposure, JPEG quality,
+ * noise, blur, position, scale) must hit the entry of the
+ * original, variants with other characters (the segments of
+ * the plate swapped, mirrored) and the other images given must
+ * miss it. The TTL and the replacement of the oldest entry are
+ * checked too.
+ *
+ * Needs libjpeg (libjpeg-dev or libjpeg-turbo8-dev).
+ * Build and run, from the esp/ directory:
+ *   gcc -O2 -Icomponents/cv -o plate_cache tools/plate_cache/plate_cache.c \
+ *       components/cv/plate_cache.c components/cv/plate_crop.c -ljpeg
+ *   ./plate_cache components/cv/mock_plate.jpg [other plates.jpg ...]
+ *
+ * Exits with 1 if any check fails.
+ *
+ */
+
+#include "plate_cache.h"
+#include "plate_crop.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// jpeglib.h needs stdio.h first
+#include <jpeglib.h>
+
+// Quality of the camera frames, about jpeg_quality 12 of the driver
+#define FRAME_JPEG_QUALITY 80
+
+#define TTL_US (120LL * 1000 * 1000)
+
+typedef struct {
+    uint8_t *rgb;
+    uint16_t width;
+    uint16_t height;
+} image_t;
+
+typedef enum {
+    SAME,
+    OTHER,
+} expect_t;
+
+static int failures = 0;
+
+static bool decode(const uint8_t *jpg, size_t len, image_t *image) {
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, jpg, len);
+
+    if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+
+    image->width = cinfo.output_width;
+    image->height = cinfo.output_height;
+    image->rgb = malloc((size_t) image->width * image->height * 3);
+
+    while (image->rgb != NULL && cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = &image->rgb[(size_t) cinfo.output_scanline * image->width * 3];
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+
+    return image->rgb != NULL;
+}
+
+static bool decode_file(const char *path, image_t *image) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return false;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    uint8_t *data = size > 0 ? malloc(size) : NULL;
+    bool ok = data != NULL && fread(data, 1, size, file) == (size_t) size && decode(data, size, image);
+
+    free(data);
+    fclose(file);
+    return ok;
+}
+
+// Encodes and decodes the image again, as the camera frames are JPEG
+static void recompress(image_t *image, int quality) {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    unsigned char *out = NULL;
+    unsigned long out_len = 0;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &out, &out_len);
+
+    cinfo.image_width = image->width;
+    cinfo.image_height = image->height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = &image->rgb[(size_t) cinfo.next_scanline * image->width * 3];
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    free(image->rgb);
+    decode(out, out_len, image);
+    free(out);
+}
+
+static image_t copy(const image_t *image) {
+    image_t out = *image;
+    size_t len = (size_t) image->width * image->height * 3;
+
+    out.rgb = malloc(len);
+    memcpy(out.rgb, image->rgb, len);
+    return out;
+}
+
+static uint8_t clamp(int value) {
+    return value < 0 ? 0 : value > 255 ? 255 : (uint8_t) value;
+}
+
+////    Variants of the same plate
+
+static void brighten(image_t *image, int delta) {
+    for (size_t i = 0; i < (size_t) image->width * image->height * 3; i++) {
+        image->rgb[i] = clamp(image->rgb[i] + delta);
+    }
+}
+
+static void add_noise(image_t *image, int amplitude) {
+    srand(1);
+    for (size_t i = 0; i < (size_t) image->width * image->height * 3; i++) {
+        image->rgb[i] = clamp(image->rgb[i] + rand() % (2 * amplitude + 1) - amplitude);
+    }
+}
+
+static void blur(image_t *image, int radius) {
+    image_t src = copy(image);
+
+    for (int y = 0; y < image->height; y++) {
+        for (int x = 0; x < image->width; x++) {
+            for (int c = 0; c < 3; c++) {
+                int sum = 0, n = 0;
+
+                for (int k = -radius; k <= radius; k++) {
+                    int xx = x + k < 0 ? 0 : x + k >= image->width ? image->width - 1 : x + k;
+                    sum += src.rgb[((size_t) y * image->width + xx) * 3 + c];
+                    n++;
+                }
+                image->rgb[((size_t) y * image->width + x) * 3 + c] = (uint8_t)(sum / n);
+            }
+        }
+    }
+
+    free(src.rgb);
+}
+
+// Moves the content by dx, dy pixels, the border is repeated
+static void shift(image_t *image, int dx, int dy) {
+    image_t src = copy(image);
+
+    for (int y = 0; y < image->height; y++) {
+        for (int x = 0; x < image->width; x++) {
+            int sx = x - dx < 0 ? 0 : x - dx >= image->width ? image->width - 1 : x - dx;
+            int sy = y - dy < 0 ? 0 : y - dy >= image->height ? image->height - 1 : y - dy;
+            memcpy(&image->rgb[((size_t) y * image->width + x) * 3], &src.rgb[((size_t) sy * image->width + sx) * 3], 3);
+        }
+    }
+
+    free(src.rgb);
+}
+
+// Scales the content around the centre, nearest neighbour
+static void zoom(image_t *image, int percent) {
+    image_t src = copy(image);
+    int cx = image->width / 2, cy = image->height / 2;
+
+    for (int y = 0; y < image->height; y++) {
+        for (int x = 0; x < image->width; x++) {
+            int sx = cx + (x - cx) * 100 / percent, sy = cy + (y - cy) * 100 / percent;
+            sx = sx < 0 ? 0 : sx >= image->width ? image->width - 1 : sx;
+            sy = sy < 0 ? 0 : sy >= image->height ? image->height - 1 : sy;
+            memcpy(&image->rgb[((size_t) y * image->width + x) * 3], &src.rgb[((size_t) sy * image->width + sx) * 3], 3);
+        }
+    }
+
+    free(src.rgb);
+}
+
+////    Variants with other characters
+
+// Swaps the left and right parts of the plate, split at percent of its width
+static void swap_halves(image_t *image, const plate_rect_t *rect, int percent) {
+    image_t src = copy(image);
+    int split = rect->width * percent / 100;
+
+    for (int y = rect->y; y < rect->y + rect->height; y++) {
+        for (int x = 0; x < rect->width; x++) {
+            int sx = rect->x + (x + split) % rect->width;
+            memcpy(&image->rgb[((size_t) y * image->width + rect->x + x) * 3], &src.rgb[((size_t) y * image->width + sx) * 3], 3);
+        }
+    }
+
+    free(src.rgb);
+}
+
+static void mirror(image_t *image, const plate_rect_t *rect) {
+    image_t src = copy(image);
+
+    for (int y = rect->y; y < rect->y + rect->height; y++) {
+        for (int x = 0; x < rect->width; x++) {
+            int sx = rect->x + rect->width - 1 - x;
+            memcpy(&image->rgb[((size_t) y * image->width + rect->x + x) * 3], &src.rgb[((size_t) y * image->width + sx) * 3], 3);
+        }
+    }
+
+    free(src.rgb);
+}
+
+////    Checks
+
+/**
+ * Locates the plate and hashes it, like the gate does
+ * @return false if no plate was found
+ */
+static bool hash_image(const image_t *image, plate_rect_t *rect, plate_hash_t *hash) {
+    size_t pixels = (size_t) image->width * image->height;
+    uint8_t *gray = malloc(pixels);
+
+    plate_crop_rgb_to_gray(image->rgb, gray, pixels);
+
+    bool found = plate_crop_locate(gray, image->width, image->height, rect) &&
+        plate_hash_compute(gray, image->width, image->height, rect, hash);
+
+    free(gray);
+    return found;
+}
+
+static void check(const char *name, const image_t *image, plate_cache_t *cache, plate_hash_t original, expect_t expect) {
+    plate_rect_t rect;
+    plate_hash_t hash;
+
+    if (!hash_image(image, &rect, &hash)) {
+        // No plate means a full frame upload, never a wrong plate
+        printf("%-26s no plate found, uploaded%s\n", name, expect == SAME ? "" : "  ok");
+        failures += expect == SAME;
+        return;
+    }
+
+    const plate_cache_entry_t *entry = plate_cache_lookup(cache, hash, 0);
+    bool hit = entry != NULL;
+    bool ok = hit == (expect == SAME);
+
+    printf("%-26s distance %3u  %s  %s\n", name, plate_hash_distance(hash, original),
+        hit ? "hit " : "miss", ok ? "ok" : "FAILED");
+
+    failures += !ok;
+}
+
+typedef void (*variant_fn)(image_t *image, const plate_rect_t *rect);
+
+static void v_recompress(image_t *i, const plate_rect_t *r) { (void) r; recompress(i, 50); }
+static void v_brighter(image_t *i, const plate_rect_t *r)   { (void) r; brighten(i, 40); }
+static void v_darker(image_t *i, const plate_rect_t *r)     { (void) r; brighten(i, -40); }
+static void v_noise(image_t *i, const plate_rect_t *r)      { (void) r; add_noise(i, 12); }
+static void v_blur(image_t *i, const plate_rect_t *r)       { (void) r; blur(i, 2); }
+static void v_shift(image_t *i, const plate_rect_t *r)      { (void) r; shift(i, 9, 4); }
+static void v_zoom_in(image_t *i, const plate_rect_t *r)    { (void) r; zoom(i, 108); }
+static void v_zoom_out(image_t *i, const plate_rect_t *r)   { (void) r; zoom(i, 93); }
+static void v_swap_third(image_t *i, const plate_rect_t *r) { swap_halves(i, r, 33); }
+static void v_swap_half(image_t *i, const plate_rect_t *r)  { swap_halves(i, r, 50); }
+static void v_mirror(image_t *i, const plate_rect_t *r)     { mirror(i, r); }
+
+static const struct {
+    const char *name;
+    variant_fn fn;
+    expect_t expect;
+} variants[] = {
+    { "jpeg quality 50",   v_recompress, SAME },
+    { "brighter",          v_brighter,   SAME },
+    { "darker",            v_darker,     SAME },
+    { "noise",             v_noise,      SAME },
+    { "motion blur",       v_blur,       SAME },
+    { "moved 9,4 px",      v_shift,      SAME },
+    { "closer 8 %",        v_zoom_in,    SAME },
+    { "farther 7 %",       v_zoom_out,   SAME },
+    { "characters rotated", v_swap_third, OTHER },
+    { "halves swapped",    v_swap_half,  OTHER },
+    { "plate mirrored",    v_mirror,     OTHER },
+};
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <plate image.jpg> [other plate images.jpg ...]\n", argv[0]);
+        return 1;
+    }
+
+    image_t original;
+    if (!decode_file(argv[1], &original)) {
+        fprintf(stderr, "Cannot decode %s\n", argv[1]);
+        return 1;
+    }
+
+    plate_rect_t rect;
+    plate_hash_t hash;
+
+    if (!hash_image(&original, &rect, &hash)) {
+        fprintf(stderr, "No plate found in %s\n", argv[1]);
+        return 1;
+    }
+
+    printf("%s: plate at %u,%u %ux%u\n\n", argv[1], rect.x, rect.y, rect.width, rect.height);
+
+    plate_cache_t cache;
+    plate_cache_init(&cache, TTL_US);
+    plate_cache_store(&cache, hash, "AB123CD", "https://example.com/original.jpg", 0);
+
+    for (size_t i = 0; i < sizeof(variants) / sizeof(variants[0]); i++) {
+        image_t image = copy(&original);
+
+        variants[i].fn(&image, &rect);
+        recompress(&image, FRAME_JPEG_QUALITY);
+        check(variants[i].name, &image, &cache, hash, variants[i].expect);
+        free(image.rgb);
+    }
+
+    for (int i = 2; i < argc; i++) {
+        image_t image;
+
+        if (!decode_file(argv[i], &image)) {
+            fprintf(stderr, "Cannot decode %s\n", argv[i]);
+            return 1;
+        }
+
+        check(argv[i], &image, &cache, hash, OTHER);
+        free(image.rgb);
+    }
+
+    // After the TTL the same plate is recognized again
+    bool expired = plate_cache_lookup(&cache, hash, TTL_US + 1) == NULL;
+    printf("%-26s %s\n", "after the TTL", expired ? "miss  ok" : "hit   FAILED");
+    failures += !expired;
+
+    // A full cache replaces its oldest entry: 8 hashes at least
+    // 32 bits apart from each other and from the original
+    for (int i = 0; i < PLATE_CACHE_ENTRIES; i++) {
+        static const plate_hash_t masks[] = {
+            0xFFFFFFFF00000000ULL, 0x00000000FFFFFFFFULL, 0xFFFF0000FFFF0000ULL, 0x0000FFFF0000FFFFULL,
+            0xFF00FF00FF00FF00ULL, 0x00FF00FF00FF00FFULL, 0xF0F0F0F0F0F0F0F0ULL, 0x0F0F0F0F0F0F0F0FULL,
+        };
+        plate_cache_store(&cache, hash ^ masks[i], "XX000XX", "", 1 + i);
+    }
+
+    bool replaced = plate_cache_lookup(&cache, hash, PLATE_CACHE_ENTRIES + 1) == NULL;
+    printf("%-26s %s\n", "oldest entry replaced", replaced ? "miss  ok" : "hit   FAILED");
+    failures += !replaced;
+
+    printf("\n%u lookups, %u hits, %u expired, %u stores: %s\n", cache.stats.lookups, cache.stats.hits,
+        cache.stats.expired, cache.stats.stores, failures ? "FAILED" : "passed");
+
+    free(original.rgb);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,246 @@
+/*
+ * plate_crop.c
+ *
+ * Host tool that runs the plate location of the firmware
+ * (components/cv/plate_crop.c) over a directory of JPEG
+ * images, writes the crops that would be uploaded and
+ * reports where the plate was found and how many bytes
+ * the crop saves. It also prints the focus score used to
+ * pick the sharpest frame of a burst (components/cv/frame_score.c),
+ * computed on a half size image like on the camera.
+ *
+ * Needs libjpeg (libjpeg-dev or libjpeg-turbo8-dev).
+ * Build and run, from the esp/ directory:
+ *   gcc -O2 -Icomponents/cv -o plate_crop tools/plate_crop/plate_crop.c \
+ *       components/cv/plate_crop.c components/cv/frame_score.c -ljpeg
+ *   ./plate_crop components/cv crops/
+ *
+ * The crops are encoded with the quality used by the
+ * firmware, so their size is close to the uploaded one.
+ *
+ */
+
+#include "plate_crop.h"
+#include "frame_score.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// jpeglib.h needs stdio.h first
+#include <jpeglib.h>
+
+// Same quality as CROP_JPEG_QUALITY in cv.c
+#define CROP_JPEG_QUALITY 90
+
+typedef struct {
+    uint8_t *rgb;
+    uint16_t width;
+    uint16_t height;
+} image_t;
+
+static uint8_t *read_file(const char *path, size_t *len) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    uint8_t *data = size > 0 ? malloc(size) : NULL;
+    if (data != NULL && fread(data, 1, size, file) != (size_t) size) {
+        free(data);
+        data = NULL;
+    }
+
+    fclose(file);
+    *len = (size_t) size;
+    return data;
+}
+
+static bool decode(const uint8_t *jpg, size_t len, image_t *image) {
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, jpg, len);
+
+    if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+
+    image->width = cinfo.output_width;
+    image->height = cinfo.output_height;
+    image->rgb = malloc((size_t) image->width * image->height * 3);
+
+    while (image->rgb != NULL && cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = &image->rgb[(size_t) cinfo.output_scanline * image->width * 3];
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+
+    return image->rgb != NULL;
+}
+
+static size_t encode_crop(const image_t *image, const plate_rect_t *rect, const char *path) {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    unsigned char *out = NULL;
+    unsigned long out_len = 0;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &out, &out_len);
+
+    cinfo.image_width = rect->width;
+    cinfo.image_height = rect->height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, CROP_JPEG_QUALITY, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = &image->rgb[((size_t)(rect->y + cinfo.next_scanline) * image->width + rect->x) * 3];
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    if (path != NULL) {
+        FILE *file = fopen(path, "wb");
+        if (file != NULL) {
+            fwrite(out, 1, out_len, file);
+            fclose(file);
+        }
+    }
+
+    free(out);
+    return out_len;
+}
+
+// Sharpness of the image at half size, as scored before the upload
+static uint32_t sharpness(const uint8_t *gray, uint16_t width, uint16_t height) {
+    uint16_t half_width = width / 2, half_height = height / 2;
+    uint8_t *half = malloc((size_t) half_width * half_height);
+
+    if (half == NULL) {
+        return 0;
+    }
+
+    for (uint16_t y = 0; y < half_height; y++) {
+        for (uint16_t x = 0; x < half_width; x++) {
+            const uint8_t *p = &gray[(size_t) 2 * y * width + 2 * x];
+            half[(size_t) y * half_width + x] = (uint8_t)((p[0] + p[1] + p[width] + p[width + 1]) / 4);
+        }
+    }
+
+    uint32_t score = frame_score_sharpness(half, half_width, half_height);
+    free(half);
+    return score;
+}
+
+static bool is_jpeg(const char *name) {
+    const char *dot = strrchr(name, '.');
+    return dot != NULL && (strcasecmp(dot, ".jpg") == 0 || strcasecmp(dot, ".jpeg") == 0);
+}
+
+/**
+ * Locates the plate in an image and writes its crop
+ * @return true if a plate was found
+ */
+static bool process(const char *dir, const char *name, const char *out_dir) {
+    char path[1024], out_path[1024];
+    size_t len;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    uint8_t *jpg = read_file(path, &len);
+    image_t image = { 0 };
+
+    if (jpg == NULL || !decode(jpg, len, &image)) {
+        printf("%-28s cannot decode\n", name);
+        free(jpg);
+        return false;
+    }
+
+    uint16_t width, height;
+    if (!plate_crop_jpeg_size(jpg, len, &width, &height) || width != image.width || height != image.height) {
+        printf("%-28s frame header size mismatch\n", name);
+    }
+
+    uint8_t *gray = malloc((size_t) image.width * image.height);
+    plate_rect_t rect;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    plate_crop_rgb_to_gray(image.rgb, gray, (size_t) image.width * image.height);
+    bool found = plate_crop_locate(gray, image.width, image.height, &rect);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double us = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3;
+    uint32_t score = sharpness(gray, image.width, image.height);
+
+    if (found) {
+        snprintf(out_path, sizeof(out_path), "%s/crop_%s", out_dir, name);
+        size_t crop_len = encode_crop(&image, &rect, out_dir ? out_path : NULL);
+
+        printf("%-28s %4ux%-4u sharpness %6u  plate %4u,%-4u %4ux%-4u contrast %5.1f  %7zu -> %6zu bytes (%3.0f %%)  %6.0f us\n",
+            name, image.width, image.height, score, rect.x, rect.y, rect.width, rect.height, rect.contrast,
+            len, crop_len, 100.0 * crop_len / len, us);
+    } else {
+        printf("%-28s %4ux%-4u sharpness %6u  no plate, full frame uploaded                                    %6.0f us\n",
+            name, image.width, image.height, score, us);
+    }
+
+    free(gray);
+    free(image.rgb);
+    free(jpg);
+    return found;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s <directory of JPEG images> [crop output directory]\n", argv[0]);
+        return 1;
+    }
+
+    const char *out_dir = argc == 3 ? argv[2] : NULL;
+    if (out_dir != NULL) {
+        mkdir(out_dir, 0755);
+    }
+
+    DIR *dir = opendir(argv[1]);
+    if (dir == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    int images = 0, found = 0;
+    struct dirent *entry;
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (is_jpeg(entry->d_name)) {
+            images++;
+            found += process(argv[1], entry->d_name, out_dir);
+        }
+    }
+
+    closedir(dir);
+
+    printf("\n%d images, plate found in %d\n", images, found);
+    return 0;
+}
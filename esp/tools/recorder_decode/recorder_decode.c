@@ -0,0 +1,247 @@
+/*
+ * recorder_decode.c
+ *
+ * Host tool that decodes a dump of the "recorder" partition
+ * written by the sensor recorder (CONFIG_SENSOR_RECORDER)
+ * into CSV, oldest sample first.
+ *
+ * Build, from the esp/ directory:
+ *   gcc -O2 -Icomponents/recorder -o recorder_decode tools/recorder_decode/recorder_decode.c \
+ *       components/recorder/recorder_format.c
+ *
+ * Read the partition back and decode it:
+ *   parttool.py read_partition --partition-name recorder --output recorder.bin
+ *   ./recorder_decode recorder.bin > samples.csv
+ *
+ * Output format:
+ *   boot,time_us,source,lane,value
+ * time_us is the esp_timer time of the sample, which starts
+ * over at every reboot: boot counts the restarts seen so far.
+ * source is "weight" (raw HX711 counts) or "ultrasonic"
+ * (distance in cm, -1 if the measure failed).
+ *
+ * With --replay the samples of one lane are written in the
+ * trace format of tools/replay instead, the weight converted
+ * to grams with --scale and --offset (by default the mean of
+ * the first samples) and the ultrasonic distance turned into
+ * the 0/1 detection of the firmware:
+ *   ./recorder_decode --replay --scale 0.0021 recorder.bin > trace.csv
+ *
+ */
+
+#include "recorder_format.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Same threshold as ultrasonic_sensor_detect()
+#define DEFAULT_THRESHOLD_CM 10
+
+// Samples of different sensors can be queued slightly out of
+// order, a clock going back further than this is a reboot
+#define REBOOT_MARGIN_US 1000000
+
+// Weight samples averaged for the automatic offset
+#define OFFSET_SAMPLES 10
+
+typedef struct {
+    uint32_t sequence;
+    const uint8_t *data;
+} page_ref_t;
+
+typedef struct {
+    bool replay;
+    int lane;
+    float scale;
+    bool offset_set;
+    double offset;
+    int threshold_cm;
+} options_t;
+
+// Replay conversion state
+typedef struct {
+    int64_t origin_us;          // time 0 of the trace, -1 until the first sample
+    int64_t boot_shift_us;      // added to the samples of the current boot
+    int64_t last_us;
+    int boot;                   // boot of the last sample
+    int offset_samples;
+    double offset_sum;
+    int ultrasonic;             // last detection written, -1 if none
+} replay_state_t;
+
+static const char *source_names[RECORDER_SOURCES_NUM] = {
+    [RECORDER_WEIGHT]     = "weight",
+    [RECORDER_ULTRASONIC] = "ultrasonic",
+};
+
+static int compare_pages(const void *a, const void *b) {
+    const page_ref_t *pa = a, *pb = b;
+    int32_t diff = (int32_t)(pa->sequence - pb->sequence);
+
+    return (diff > 0) - (diff < 0);
+}
+
+static void replay_sample(const options_t *opt, replay_state_t *st, const recorder_sample_t *s, int boot) {
+    if (s->lane != opt->lane) {
+        return;
+    }
+
+    if (st->origin_us < 0) {
+        st->origin_us = s->time_us;
+        st->last_us = s->time_us;
+    }
+
+    // The clock starts over at every reboot: continue from the last sample
+    if (boot != st->boot) {
+        st->boot_shift_us += st->last_us - s->time_us;
+        st->boot = boot;
+    }
+    st->last_us = s->time_us;
+
+    long long time_ms = (s->time_us + st->boot_shift_us - st->origin_us) / 1000;
+
+    if (s->source == RECORDER_WEIGHT) {
+        if (!opt->offset_set && st->offset_samples < OFFSET_SAMPLES) {
+            st->offset_sum += s->value;
+            st->offset_samples++;
+        }
+
+        double offset = opt->offset_set ? opt->offset : st->offset_sum / st->offset_samples;
+
+        printf("%lld,weight,%.1f\n", time_ms, (s->value - offset) * opt->scale);
+    } else if (s->source == RECORDER_ULTRASONIC) {
+        if (s->value < 0) {
+            return;     // failed measure, the firmware keeps its state
+        }
+
+        int detected = s->value > 0 && s->value < opt->threshold_cm;
+
+        if (detected != st->ultrasonic) {
+            printf("%lld,ultrasonic,%d\n", time_ms, detected);
+            st->ultrasonic = detected;
+        }
+    }
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [options] recorder.bin\n"
+        "  --replay          write the trace format of tools/replay\n"
+        "  --lane N          lane written with --replay (0)\n"
+        "  --scale G         grams per raw count (1.0)\n"
+        "  --offset C        raw counts of the empty scale (mean of the first samples)\n"
+        "  --threshold CM    ultrasonic detection distance (%d)\n",
+        name, DEFAULT_THRESHOLD_CM);
+}
+
+int main(int argc, char **argv) {
+    options_t opt = {
+        .lane = 0,
+        .scale = 1.0f,
+        .threshold_cm = DEFAULT_THRESHOLD_CM,
+    };
+
+    static const struct option long_options[] = {
+        { "replay",    no_argument,       NULL, 'r' },
+        { "lane",      required_argument, NULL, 'l' },
+        { "scale",     required_argument, NULL, 's' },
+        { "offset",    required_argument, NULL, 'o' },
+        { "threshold", required_argument, NULL, 't' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (c) {
+            case 'r': opt.replay = true; break;
+            case 'l': opt.lane = atoi(optarg); break;
+            case 's': opt.scale = strtof(optarg, NULL); break;
+            case 'o': opt.offset = strtod(optarg, NULL); opt.offset_set = true; break;
+            case 't': opt.threshold_cm = atoi(optarg); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE *file = fopen(argv[optind], "rb");
+    if (file == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    size_t pages_num = size > 0 ? (size_t) size / RECORDER_PAGE_SIZE : 0;
+    uint8_t *data = malloc(pages_num * RECORDER_PAGE_SIZE + 1);
+    page_ref_t *pages = malloc((pages_num + 1) * sizeof(page_ref_t));
+
+    if (data == NULL || pages == NULL || fread(data, RECORDER_PAGE_SIZE, pages_num, file) != pages_num) {
+        fprintf(stderr, "Cannot read %s\n", argv[optind]);
+        return 1;
+    }
+
+    fclose(file);
+
+    // Keep the recorder pages, erased and torn ones are skipped
+    size_t valid = 0;
+    for (size_t i = 0; i < pages_num; i++) {
+        recorder_decoder_t dec;
+        recorder_page_header_t header;
+
+        if (recorder_decoder_start(&dec, &data[i * RECORDER_PAGE_SIZE], &header)) {
+            pages[valid].sequence = header.sequence;
+            pages[valid].data = &data[i * RECORDER_PAGE_SIZE];
+            valid++;
+        }
+    }
+
+    qsort(pages, valid, sizeof(page_ref_t), compare_pages);
+
+    if (!opt.replay) {
+        printf("boot,time_us,source,lane,value\n");
+    }
+
+    replay_state_t st = { .origin_us = -1, .ultrasonic = -1 };
+    unsigned long samples = 0;
+    int64_t last_us = INT64_MIN;
+    int boot = 0;
+
+    for (size_t i = 0; i < valid; i++) {
+        recorder_decoder_t dec;
+        recorder_page_header_t header;
+        recorder_sample_t s;
+
+        recorder_decoder_start(&dec, pages[i].data, &header);
+
+        // A page starting before the end of the previous one was recorded after a reboot
+        if (last_us != INT64_MIN && header.base_us + REBOOT_MARGIN_US < last_us) {
+            boot++;
+        }
+
+        while (recorder_decoder_next(&dec, &s)) {
+            last_us = s.time_us;
+            samples++;
+
+            if (opt.replay) {
+                replay_sample(&opt, &st, &s, boot);
+            } else {
+                printf("%d,%lld,%s,%u,%ld\n", boot, (long long) s.time_us,
+                    source_names[s.source], s.lane, (long) s.value);
+            }
+        }
+    }
+
+    fprintf(stderr, "%zu pages, %zu recorded, %lu samples, %d reboots\n", pages_num, valid, samples, boot);
+
+    free(pages);
+    free(data);
+    return 0;
+}
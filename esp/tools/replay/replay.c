@@ -0,0 +1,780 @@
+/*
+ * replay.c
+ *
+ * Host tool that replays a recorded sensor trace through
+ * the gate logic under a virtual clock, to evaluate
+ * threshold and timing changes without the physical gate.
+ *
+ * The hardware independent parts of the firmware are
+ * compiled as they are: the transition table (fsm_table.c),
+ * the passage sub-machine (passage.c) and the weight
+ * detector (weight_detector.c). The state actions of fsm.c
+ * are modelled by their timing, taken from fsm_timing.h,
+ * which can be changed from the command line.
+ *
+ * Before the replay, fsm.c itself is checked against the
+ * model: every state must wait on its event queue for the
+ * delay modelled here, and no state action may block (the
+ * virtual clock would not see it). The tool exits with 1
+ * if fsm.c differs.
+ *
+ * Build and run, from the esp/ directory:
+ *   gcc -O2 -Imain -Icomponents/weight -o replay tools/replay/replay.c \
+ *       main/fsm_table.c main/passage.c components/weight/weight_detector.c -lm
+ *   ./replay [options] tools/replay/sample_trace.csv
+ *
+ * Trace format (CSV, lines starting with # are ignored):
+ *   <time_ms>,weight,<grams>             scale reading, held until the next one
+ *   <time_ms>,ultrasonic,<0|1>           1 while a vehicle is in front of the sensor
+ *   <time_ms>,cv,<latency_ms>,<0|1>      recognition of the vehicle arrived at time_ms:
+ *                                        CV + /entry latency, entry allowed
+ *
+ * A recognition uses the last cv record not later than its
+ * start, so it stays bound to the same vehicle when the
+ * timing under test moves the recognition.
+ *
+ */
+
+#include "fsm_table.h"
+#include "fsm_timing.h"
+#include "passage.h"
+#include "weight_detector.h"
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Resolution of the virtual clock
+#define TICK_MS 10
+
+// Source checked against the model, relative to esp/
+#define FSM_SOURCE "main/fsm.c"
+
+// Time simulated after the last record of the trace
+#define TAIL_MS 60000
+
+// The trace is in grams, the detector works on raw counts:
+// a calibration of 0.01 g per count keeps the trace resolution
+#define REPLAY_SCALE 0.01f
+
+typedef enum {
+    SRC_WEIGHT,
+    SRC_ULTRASONIC,
+    SRC_CV,
+} source_t;
+
+typedef struct {
+    int64_t time_ms;
+    source_t source;
+    float value;
+    int outcome;
+} record_t;
+
+// Timing of the state actions, defaults match fsm.c and cv.c
+typedef struct {
+    int weight_period_ms;       // weight_task() detection period (one batch)
+    int entry_wait_ms;          // fixed wait after the /entry answer, none in cv.c
+    int refuse_hold_ms;         // refuse_fn() message time
+    int passage_sample_ms;      // PASSAGE_SAMPLE_MS
+    int clear_hold_ms;          // PASSAGE_CLEAR_HOLD_MS
+    int wait_timeout_ms;        // PASSAGE_WAIT_TIMEOUT_MS
+    int default_cv_ms;          // latency used before the first cv record
+    int speculative;            // CONFIG_SPECULATIVE_RECOGNITION
+} sim_config_t;
+
+// A timed FSM event, the replay equivalent of fsm_post_event()
+typedef struct {
+    int64_t due_ms;
+    Event_t event;
+} pending_event_t;
+
+#define MAX_PENDING 8
+
+typedef struct {
+    const sim_config_t *cfg;
+    int64_t now_ms;
+
+    // Inputs
+    const record_t *records;
+    size_t records_num;
+    size_t next_record;
+    const record_t *last_cv;    // last cv record reached by the clock
+    float weight_g;
+    int occupied;
+
+    // FSM
+    State_t state;
+    pending_event_t pending[MAX_PENDING];
+    int pending_num;
+    int64_t state_time_ms[STATES_NUM];
+
+    // Weight task and recognition
+    weight_detector_t det;
+    int64_t next_weight_ms;
+    int64_t next_idle_poll_ms;
+    int64_t occupied_since_ms;  // idle_fn() debounce, -1 while clear
+    int64_t next_passage_ms;
+    int spec_active;
+    int64_t spec_ready_ms;
+    int spec_outcome;
+
+    // Passage
+    passage_t passage;
+
+    // Results
+    int64_t trigger_ms;         // -1 when no trigger is waiting for the barrier
+    int64_t *latencies;
+    size_t latencies_num;
+    size_t latencies_cap;
+    int entries;
+    int exits;
+    int refused;
+    int timeouts;
+    int recognitions;
+    int wasted_recognitions;
+} sim_t;
+
+
+////////////////////////////////////////////////////////////////
+//////////////// Trace loading /////////////////////////////////
+////////////////////////////////////////////////////////////////
+
+static int compare_records(const void *a, const void *b) {
+    const record_t *ra = a, *rb = b;
+    return (ra->time_ms > rb->time_ms) - (ra->time_ms < rb->time_ms);
+}
+
+static record_t *load_trace(const char *path, size_t *count) {
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL) {
+        perror(path);
+        return NULL;
+    }
+
+    size_t cap = 256, num = 0;
+    record_t *records = malloc(cap * sizeof(record_t));
+    char line[256];
+    int line_no = 0;
+
+    while (records != NULL && fgets(line, sizeof(line), f)) {
+        line_no++;
+
+        if (line[0] == '#' || line[0] == '\n' || line[0] == '\r') {
+            continue;
+        }
+
+        long long time_ms;
+        char source[16];
+        float value;
+        int outcome = 0;
+        int fields = sscanf(line, "%lld,%15[^,],%f,%d", &time_ms, source, &value, &outcome);
+
+        if (fields < 3) {
+            fprintf(stderr, "%s:%d: malformed record, skipped\n", path, line_no);
+            continue;
+        }
+
+        record_t r = { .time_ms = time_ms, .value = value, .outcome = outcome };
+
+        if (strcmp(source, "weight") == 0) {
+            r.source = SRC_WEIGHT;
+        } else if (strcmp(source, "ultrasonic") == 0) {
+            r.source = SRC_ULTRASONIC;
+        } else if (strcmp(source, "cv") == 0) {
+            r.source = SRC_CV;
+        } else {
+            fprintf(stderr, "%s:%d: unknown source '%s', skipped\n", path, line_no, source);
+            continue;
+        }
+
+        if (num == cap) {
+            cap *= 2;
+            record_t *grown = realloc(records, cap * sizeof(record_t));
+            if (grown == NULL) {
+                free(records);
+                records = NULL;
+                break;
+            }
+            records = grown;
+        }
+
+        records[num++] = r;
+    }
+
+    fclose(f);
+
+    if (records == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return NULL;
+    }
+
+    qsort(records, num, sizeof(record_t), compare_records);
+    *count = num;
+    return records;
+}
+
+
+////////////////////////////////////////////////////////////////
+//////////////// Simulation ////////////////////////////////////
+////////////////////////////////////////////////////////////////
+
+static void post_event(sim_t *sim, Event_t event, int64_t delay_ms) {
+    if (sim->pending_num == MAX_PENDING) {
+        fprintf(stderr, "%lld ms: event queue full, %s dropped\n",
+            (long long) sim->now_ms, fsm_event_name(event));
+        return;
+    }
+
+    sim->pending[sim->pending_num++] = (pending_event_t) {
+        .due_ms = sim->now_ms + delay_ms,
+        .event = event,
+    };
+}
+
+static void add_latency(sim_t *sim, int64_t latency_ms) {
+    if (sim->latencies_num == sim->latencies_cap) {
+        size_t cap = sim->latencies_cap ? sim->latencies_cap * 2 : 64;
+        int64_t *grown = realloc(sim->latencies, cap * sizeof(int64_t));
+        if (grown == NULL) {
+            return;
+        }
+        sim->latencies = grown;
+        sim->latencies_cap = cap;
+    }
+
+    sim->latencies[sim->latencies_num++] = latency_ms;
+}
+
+/**
+ * Looks up the recognition result of the vehicle on the scale
+ * @param outcome Set to 1 if the entry is allowed
+ * @return The latency of the recognition in ms
+ */
+static int64_t next_recognition(sim_t *sim, int *outcome) {
+    sim->recognitions++;
+
+    if (sim->last_cv == NULL) {
+        *outcome = 1;
+        return sim->cfg->default_cv_ms;
+    }
+
+    *outcome = sim->last_cv->outcome;
+    return (int64_t) sim->last_cv->value;
+}
+
+static void open_gate(sim_t *sim) {
+    passage_start(&sim->passage, sim->now_ms * 1000,
+        (int64_t) sim->cfg->wait_timeout_ms * 1000, (int64_t) sim->cfg->clear_hold_ms * 1000);
+    sim->next_passage_ms = sim->now_ms + sim->cfg->passage_sample_ms;
+
+    if (sim->trigger_ms >= 0) {
+        add_latency(sim, sim->now_ms - sim->trigger_ms);
+        sim->trigger_ms = -1;
+    }
+}
+
+// Entry actions of the states, as in fsm.c
+static void on_entry(sim_t *sim) {
+    switch (sim->state) {
+        case INIT:
+            break;
+
+        case IDLE:
+            sim->trigger_ms = -1;
+            sim->next_idle_poll_ms = sim->now_ms + IDLE_POLL_MS;
+            sim->occupied_since_ms = -1;
+            sim->next_weight_ms = sim->now_ms + sim->cfg->weight_period_ms;
+            break;
+
+        case VEHICLE_ENTRY: {
+            int outcome;
+            int64_t ready_ms;
+
+            if (sim->spec_active) {
+                outcome = sim->spec_outcome;
+                ready_ms = (sim->spec_ready_ms > sim->now_ms) ? sim->spec_ready_ms : sim->now_ms;
+                sim->spec_active = 0;
+            } else {
+                ready_ms = sim->now_ms + next_recognition(sim, &outcome);
+            }
+
+            post_event(sim, outcome ? PLATE_RECOGNIZED : PLATE_REFUSED,
+                ready_ms - sim->now_ms + sim->cfg->entry_wait_ms);
+            break;
+        }
+
+        case ENTRY_REFUSED:
+            sim->refused++;
+            post_event(sim, STATE_COMPLETED, sim->cfg->refuse_hold_ms);
+            break;
+
+        case ENTRY_ALLOWED:
+        case VEHICLE_EXIT:
+            open_gate(sim);
+            break;
+
+        default:
+            break;
+    }
+}
+
+static void handle_event(sim_t *sim, Event_t event) {
+    State_t next;
+
+    if (!fsm_next_state(sim->state, event, &next)) {
+        return;
+    }
+
+    sim->state = next;
+    on_entry(sim);
+}
+
+// Periodic actions: weight task, idle_fn() and passage_fn()
+static void run_periodic(sim_t *sim) {
+    const sim_config_t *cfg = sim->cfg;
+
+    if (sim->state != IDLE) {
+        return;
+    }
+
+    if (sim->now_ms >= sim->next_weight_ms) {
+        sim->next_weight_ms += cfg->weight_period_ms;
+
+        switch (weight_detector_step(&sim->det, (int32_t) lroundf(sim->weight_g / REPLAY_SCALE))) {
+            case WEIGHT_SAMPLE_CANDIDATE:
+                if (cfg->speculative && !sim->spec_active) {
+                    sim->spec_ready_ms = sim->now_ms + next_recognition(sim, &sim->spec_outcome);
+                    sim->spec_active = 1;
+                }
+                break;
+
+            case WEIGHT_SAMPLE_DROPPED:
+            case WEIGHT_SAMPLE_REJECTED:
+            case WEIGHT_SAMPLE_TOO_HEAVY:
+                if (sim->spec_active) {
+                    sim->spec_active = 0;
+                    sim->wasted_recognitions++;
+                }
+                break;
+
+            case WEIGHT_SAMPLE_CONFIRMED:
+                sim->trigger_ms = sim->now_ms;
+                post_event(sim, VALID_WEIGHT_DETECTED, 0);
+                return;
+
+            default:
+                break;
+        }
+    }
+
+    // idle_fn() posts once the sensor stayed occupied for the debounce delay
+    if (sim->now_ms >= sim->next_idle_poll_ms) {
+        sim->next_idle_poll_ms += IDLE_POLL_MS;
+
+        if (!sim->occupied) {
+            sim->occupied_since_ms = -1;
+        } else if (sim->occupied_since_ms < 0) {
+            sim->trigger_ms = sim->now_ms;
+            sim->occupied_since_ms = sim->now_ms;
+        } else if (sim->now_ms - sim->occupied_since_ms >= EXIT_DEBOUNCE_MS) {
+            sim->occupied_since_ms = -1;
+            post_event(sim, EXIT_DETECTED, 0);
+        }
+    }
+}
+
+static void run_passage(sim_t *sim) {
+    if ((sim->state != ENTRY_ALLOWED && sim->state != VEHICLE_EXIT) ||
+        passage_done(&sim->passage) || sim->now_ms < sim->next_passage_ms) {
+        return;
+    }
+
+    sim->next_passage_ms += sim->cfg->passage_sample_ms;
+
+    passage_state_t p = passage_update(&sim->passage, sim->occupied, sim->now_ms * 1000);
+
+    if (p == PASSAGE_CLEARED) {
+        if (sim->state == ENTRY_ALLOWED) {
+            sim->entries++;
+        } else {
+            sim->exits++;
+        }
+    } else if (p == PASSAGE_TIMEOUT) {
+        sim->timeouts++;
+    }
+
+    if (passage_done(&sim->passage)) {
+        post_event(sim, STATE_COMPLETED, 0);
+    }
+}
+
+static void apply_inputs(sim_t *sim) {
+    while (sim->next_record < sim->records_num &&
+           sim->records[sim->next_record].time_ms <= sim->now_ms) {
+        const record_t *r = &sim->records[sim->next_record++];
+
+        if (r->source == SRC_WEIGHT) {
+            sim->weight_g = r->value;
+        } else if (r->source == SRC_ULTRASONIC) {
+            sim->occupied = r->value != 0;
+        } else {
+            sim->last_cv = r;
+        }
+    }
+}
+
+static void dispatch_events(sim_t *sim) {
+    for (int i = 0; i < sim->pending_num; ) {
+        if (sim->pending[i].due_ms > sim->now_ms) {
+            i++;
+            continue;
+        }
+
+        Event_t event = sim->pending[i].event;
+        memmove(&sim->pending[i], &sim->pending[i + 1], (sim->pending_num - i - 1) * sizeof(pending_event_t));
+        sim->pending_num--;
+
+        handle_event(sim, event);
+        i = 0;
+    }
+}
+
+static void simulate(sim_t *sim, int64_t end_ms) {
+    for (sim->now_ms = 0; sim->now_ms < end_ms; sim->now_ms += TICK_MS) {
+        apply_inputs(sim);
+        dispatch_events(sim);
+        run_periodic(sim);
+        run_passage(sim);
+        dispatch_events(sim);
+
+        sim->state_time_ms[sim->state] += TICK_MS;
+    }
+}
+
+
+////////////////////////////////////////////////////////////////
+//////////////// Report ////////////////////////////////////////
+////////////////////////////////////////////////////////////////
+
+static int compare_latencies(const void *a, const void *b) {
+    int64_t la = *(const int64_t *) a, lb = *(const int64_t *) b;
+    return (la > lb) - (la < lb);
+}
+
+static int64_t percentile(const int64_t *sorted, size_t num, int p) {
+    if (num == 0) {
+        return 0;
+    }
+
+    size_t rank = (num * p + 99) / 100;
+    return sorted[rank ? rank - 1 : 0];
+}
+
+static void report(sim_t *sim, int64_t end_ms, double wall_s) {
+    double hours = end_ms / 3600000.0;
+    int vehicles = sim->entries + sim->exits;
+
+    qsort(sim->latencies, sim->latencies_num, sizeof(int64_t), compare_latencies);
+
+    printf("Simulated time:   %.2f h (%.0fx real time)\n", hours,
+        wall_s > 0 ? end_ms / 1000.0 / wall_s : 0);
+    printf("Vehicles:         %d (%d entries, %d exits), %.1f vehicles/hour\n",
+        vehicles, sim->entries, sim->exits, hours > 0 ? vehicles / hours : 0);
+    printf("Refused entries:  %d\n", sim->refused);
+    printf("Passage timeouts: %d\n", sim->timeouts);
+    printf("Recognitions:     %d (%d discarded speculations)\n",
+        sim->recognitions, sim->wasted_recognitions);
+    printf("Gate latency:     n=%zu p50=%lld ms p99=%lld ms (trigger -> barrier raise)\n",
+        sim->latencies_num,
+        (long long) percentile(sim->latencies, sim->latencies_num, 50),
+        (long long) percentile(sim->latencies, sim->latencies_num, 99));
+    printf("State occupancy:\n");
+
+    for (int s = 0; s < STATES_NUM; s++) {
+        printf("  %-14s %6.2f %%\n", fsm_state_name((State_t) s),
+            end_ms > 0 ? 100.0 * sim->state_time_ms[s] / end_ms : 0);
+    }
+}
+
+// Wait of each state on its event queue, as modelled by on_entry()
+// and run_periodic(): IDLE_WAIT_MS is IDLE_POLL_MS, or 0 when
+// idle_fn() sleeps IDLE_POLL_MS itself
+static const char *const modelled_waits[STATES_NUM] = {
+    [INIT]          = "FSM_WAIT_FOREVER",
+    [IDLE]          = "IDLE_WAIT_MS",
+    [VEHICLE_ENTRY] = "FSM_WAIT_FOREVER",
+    [ENTRY_REFUSED] = "REFUSE_HOLD_MS",
+    [ENTRY_ALLOWED] = "PASSAGE_SAMPLE_MS",
+    [VEHICLE_EXIT]  = "PASSAGE_SAMPLE_MS",
+};
+
+// Calls that would block a state action behind the virtual clock
+static const char *const blocking_calls[] = {
+    "vTaskDelay", "esp_rom_delay_us", "xQueueReceive", "xEventGroupWaitBits", "ulTaskNotifyTake",
+};
+
+static char *read_file(const char *path) {
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL) {
+        perror(path);
+        return NULL;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    char *text = len >= 0 ? malloc(len + 1) : NULL;
+    if (text != NULL) {
+        text[fread(text, 1, len, f)] = '\0';
+    }
+
+    fclose(f);
+    return text;
+}
+
+/**
+ * Checks that a state action of fsm.c has no blocking call
+ * @return The number of blocking calls found
+ */
+static int check_action(const char *path, const char *text, const char *name) {
+    char signature[96];
+    snprintf(signature, sizeof(signature), "void %s(fsm_lane_t *lane) {", name);
+
+    const char *body = strstr(text, signature);
+    const char *end = body ? strstr(body, "\n}\n") : NULL;
+
+    if (end == NULL) {
+        fprintf(stderr, "%s: state action %s() not found\n", path, name);
+        return 1;
+    }
+
+    int found = 0;
+
+    for (size_t i = 0; i < sizeof(blocking_calls) / sizeof(blocking_calls[0]); i++) {
+        const char *call = body;
+
+        while ((call = strstr(call, blocking_calls[i])) != NULL && call < end) {
+            fprintf(stderr, "%s: %s() calls %s, not modelled by the replay\n", path, name, blocking_calls[i]);
+            found++;
+            call++;
+        }
+    }
+
+    return found;
+}
+
+/**
+ * Checks fsm.c against the timing model: the wait of every
+ * state in state_actions[] and the absence of blocking calls
+ * in the actions. The boot sequence (INIT) is not replayed.
+ * @param path The fsm.c source
+ * @return 0 if fsm.c matches the model, 1 otherwise
+ */
+static int check_fsm_source(const char *path) {
+    char *text = read_file(path);
+
+    if (text == NULL) {
+        fprintf(stderr, "Cannot check fsm.c against the model, see --fsm-source\n");
+        return 1;
+    }
+
+    const char *table = strstr(text, "state_actions[STATES_NUM] = {");
+    const char *table_end = table ? strstr(table, "\n};") : NULL;
+    int differences = 0;
+    bool seen[STATES_NUM] = { false };
+
+    if (table_end == NULL) {
+        fprintf(stderr, "%s: state_actions[] not found\n", path);
+        free(text);
+        return 1;
+    }
+
+    for (const char *line = strchr(table, '\n'); line != NULL && line < table_end; line = strchr(line + 1, '\n')) {
+        char state_name[32], wait[32];
+
+        if (sscanf(line, " [%31[A-Z_]]", state_name) != 1) {
+            continue;
+        }
+
+        State_t state = STATES_NUM;
+        for (int i = 0; i < STATES_NUM; i++) {
+            if (strcmp(fsm_state_name(i), state_name) == 0) {
+                state = i;
+            }
+        }
+
+        const char *wait_field = strstr(line, ".wait_ms = ");
+        const char *line_end = strchr(line + 1, '\n');
+
+        if (state == STATES_NUM || wait_field == NULL || wait_field > line_end ||
+            sscanf(wait_field, ".wait_ms = %31[A-Za-z0-9_]", wait) != 1) {
+            fprintf(stderr, "%s: unexpected state_actions[] entry for %s\n", path, state_name);
+            differences++;
+            continue;
+        }
+
+        seen[state] = true;
+
+        if (strcmp(wait, modelled_waits[state]) != 0) {
+            fprintf(stderr, "%s: %s waits %s, modelled as %s\n", path, state_name, wait, modelled_waits[state]);
+            differences++;
+        }
+
+        if (state == INIT) {
+            continue;
+        }
+
+        static const char *const fields[] = { ".on_entry = ", ".run = ", ".on_exit = " };
+
+        for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+            const char *field = strstr(line, fields[i]);
+            char name[48];
+
+            if (field != NULL && field < line_end &&
+                sscanf(field + strlen(fields[i]), "%47[a-z0-9_]", name) == 1) {
+                differences += check_action(path, text, name);
+            }
+        }
+    }
+
+    for (int i = 0; i < STATES_NUM; i++) {
+        if (!seen[i]) {
+            fprintf(stderr, "%s: no state_actions[] entry for %s\n", path, fsm_state_name(i));
+            differences++;
+        }
+    }
+
+    free(text);
+    return differences ? 1 : 0;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [options] trace.csv\n"
+        "  --weight-period MS     weight detection period (200)\n"
+        "  --entry-wait MS        fixed wait after the /entry answer (0)\n"
+        "  --refuse-hold MS       refused message time (%d)\n"
+        "  --passage-sample MS    passage sampling period (%d)\n"
+        "  --clear-hold MS        free time before closing the barrier (%d)\n"
+        "  --wait-timeout MS      passage wait timeout (%d)\n"
+        "  --cv-latency MS        latency used before the first cv record (3000)\n"
+        "  --min-weight G         detection window (%.1f)\n"
+        "  --max-weight G\n"
+        "  --noise G              noise threshold (%.1f)\n"
+        "  --engine NAME          detection engine, count or sequential (sequential)\n"
+        "  --count N              samples required to confirm, count engine (%d)\n"
+        "  --no-speculative       start the recognition on confirmation only\n"
+        "  --fsm-source FILE      fsm.c checked against the model (" FSM_SOURCE ")\n",
+        name, REFUSE_HOLD_MS, PASSAGE_SAMPLE_MS, PASSAGE_CLEAR_HOLD_MS, PASSAGE_WAIT_TIMEOUT_MS,
+        WEIGHT_MIN_CAR_WEIGHT, WEIGHT_NOISE_THRESHOLD, WEIGHT_DETECT_COUNT_REQUIRED);
+}
+
+int main(int argc, char **argv) {
+    sim_config_t cfg = {
+        .weight_period_ms = 200,
+        .entry_wait_ms = 0,
+        .refuse_hold_ms = REFUSE_HOLD_MS,
+        .passage_sample_ms = PASSAGE_SAMPLE_MS,
+        .clear_hold_ms = PASSAGE_CLEAR_HOLD_MS,
+        .wait_timeout_ms = PASSAGE_WAIT_TIMEOUT_MS,
+        .default_cv_ms = 3000,
+        .speculative = 1,
+    };
+    weight_detector_config_t det_cfg = weight_detector_default_config;
+    const char *fsm_source = FSM_SOURCE;
+
+    static const struct option options[] = {
+        { "weight-period",  required_argument, NULL, 'w' },
+        { "entry-wait",     required_argument, NULL, 'e' },
+        { "refuse-hold",    required_argument, NULL, 'r' },
+        { "passage-sample", required_argument, NULL, 'p' },
+        { "clear-hold",     required_argument, NULL, 'c' },
+        { "wait-timeout",   required_argument, NULL, 't' },
+        { "cv-latency",     required_argument, NULL, 'l' },
+        { "min-weight",     required_argument, NULL, 'm' },
+        { "max-weight",     required_argument, NULL, 'M' },
+        { "noise",          required_argument, NULL, 'n' },
+        { "engine",         required_argument, NULL, 'E' },
+        { "count",          required_argument, NULL, 'k' },
+        { "no-speculative", no_argument,       NULL, 's' },
+        { "fsm-source",     required_argument, NULL, 'f' },
+        { "help",           no_argument,       NULL, 'h' },
+        { 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+        switch (opt) {
+            case 'w': cfg.weight_period_ms = atoi(optarg); break;
+            case 'e': cfg.entry_wait_ms = atoi(optarg); break;
+            case 'r': cfg.refuse_hold_ms = atoi(optarg); break;
+            case 'p': cfg.passage_sample_ms = atoi(optarg); break;
+            case 'c': cfg.clear_hold_ms = atoi(optarg); break;
+            case 't': cfg.wait_timeout_ms = atoi(optarg); break;
+            case 'l': cfg.default_cv_ms = atoi(optarg); break;
+            case 'm': det_cfg.min_weight = atof(optarg); break;
+            case 'M': det_cfg.max_weight = atof(optarg); break;
+            case 'n': det_cfg.noise_threshold = atof(optarg); break;
+            case 'E': det_cfg.engine = weight_detector_find_engine(optarg); break;
+            case 'k': det_cfg.count_required = atoi(optarg); break;
+            case 's': cfg.speculative = 0; break;
+            case 'f': fsm_source = optarg; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+
+    if (optind != argc - 1 || cfg.weight_period_ms <= 0 || cfg.passage_sample_ms <= 0 ||
+        det_cfg.engine == NULL) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    char error[64];
+    if (fsm_verify_table(error, sizeof(error)) > 0) {
+        fprintf(stderr, "Transition table: %s\n", error);
+        return 1;
+    }
+
+    if (check_fsm_source(fsm_source) != 0) {
+        return 1;
+    }
+
+    size_t records_num = 0;
+    record_t *records = load_trace(argv[optind], &records_num);
+
+    if (records == NULL) {
+        return 1;
+    }
+
+    sim_t sim = {
+        .cfg = &cfg,
+        .records = records,
+        .records_num = records_num,
+        .state = INIT,
+        .trigger_ms = -1,
+    };
+    weight_detector_init(&sim.det, &det_cfg, REPLAY_SCALE, 0);
+
+    int64_t end_ms = (records_num ? records[records_num - 1].time_ms : 0) + TAIL_MS;
+
+    // The boot sequence is not replayed
+    post_event(&sim, STATE_COMPLETED, 0);
+
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    simulate(&sim, end_ms);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+
+    double wall_s = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+    report(&sim, end_ms, wall_s);
+
+    free(sim.latencies);
+    free(records);
+    return 0;
+}
@@ -0,0 +1,336 @@
+/*
+ * upload_tuner.c
+ *
+ * Host simulation of the upload size controller of the firmware
+ * (components/cv/upload_tuner.c). A day of traffic is run over
+ * an uplink whose throughput follows the hour (slow at the rush
+ * hours, fast at night) and a recognition whose success drops
+ * on the small and grayscale levels, more at night. Every fixed
+ * level is compared with the controller on the same vehicles:
+ * latency percentiles, share of the recognitions within the
+ * target, recognition rate and bytes uploaded.
+ *
+ * With a JPEG image, the upload sizes of the levels are measured
+ * on it first: the image is scaled to the frame of each level,
+ * its plate located (components/cv/plate_crop.c) and the crop
+ * encoded like on the gate. Otherwise the nominal cost of the
+ * levels is used.
+ *
+ * Needs libjpeg (libjpeg-dev or libjpeg-turbo8-dev).
+ * Build and run, from the esp/ directory:
+ *   gcc -O2 -Icomponents/cv -o upload_tuner tools/upload_tuner/upload_tuner.c \
+ *       components/cv/upload_tuner.c components/cv/plate_crop.c -ljpeg
+ *   ./upload_tuner [--target MS] [--seed N] [components/cv/mock_plate.jpg]
+ *
+ */
+
+#include "upload_tuner.h"
+#include "plate_crop.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// jpeglib.h needs stdio.h first
+#include <jpeglib.h>
+
+#define DAY_MS (24LL * 3600 * 1000)
+
+// Bytes of the crop of the first level when no image is measured
+#define NOMINAL_CROP_BYTES 14000
+
+// Fixed parts of the latency: capture and crop, round trip, recognition on the server
+#define CAPTURE_MS 150
+#define ROUND_TRIP_MS 250
+#define SERVER_MS 600
+
+// Uplink throughput by hour of the day, in bytes per second
+static const uint32_t uplink_by_hour[24] = {
+    150000, 150000, 150000, 150000, 150000, 120000,  // night
+     60000,  25000,  18000,  30000,  60000,  50000,  // morning rush
+     35000,  40000,  60000,  60000,  40000,  20000,  // afternoon
+     12000,  12000,  20000,  60000, 100000, 150000,  // evening peak
+};
+
+// Probability of reading the plate at each level, in percent
+static const uint8_t read_day[UPLOAD_TUNER_LEVELS]   = { 98, 98, 97, 95, 90, 75 };
+static const uint8_t read_night[UPLOAD_TUNER_LEVELS] = { 96, 94, 90, 75, 55, 35 };
+
+typedef struct {
+    uint8_t *rgb;
+    uint16_t width;
+    uint16_t height;
+} image_t;
+
+typedef struct {
+    uint32_t latencies[4096];
+    int count;
+    int within_target;
+    int recognized;
+    uint64_t bytes;
+    int levels[UPLOAD_TUNER_LEVELS];
+} result_t;
+
+static uint32_t level_bytes[UPLOAD_TUNER_LEVELS];
+
+static uint64_t rng_state;
+
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t)(rng_state >> 32);
+}
+
+// Uniform in [lo, hi]
+static uint32_t rng_range(uint32_t lo, uint32_t hi) {
+    return lo + rng() % (hi - lo + 1);
+}
+
+static bool decode_file(const char *path, image_t *image) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return false;
+    }
+
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, file);
+
+    if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK) {
+        jpeg_destroy_decompress(&cinfo);
+        fclose(file);
+        return false;
+    }
+
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+
+    image->width = cinfo.output_width;
+    image->height = cinfo.output_height;
+    image->rgb = malloc((size_t) image->width * image->height * 3);
+
+    while (image->rgb != NULL && cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = &image->rgb[(size_t) cinfo.output_scanline * image->width * 3];
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    fclose(file);
+
+    return image->rgb != NULL;
+}
+
+// Nearest neighbour scaling to the frame of a level
+static image_t scale(const image_t *image, uint16_t width, uint16_t height) {
+    image_t out = { .rgb = malloc((size_t) width * height * 3), .width = width, .height = height };
+
+    for (uint16_t y = 0; out.rgb != NULL && y < height; y++) {
+        for (uint16_t x = 0; x < width; x++) {
+            const uint8_t *p = &image->rgb[((size_t)(y * image->height / height) * image->width +
+                x * image->width / width) * 3];
+            memcpy(&out.rgb[((size_t) y * width + x) * 3], p, 3);
+        }
+    }
+
+    return out;
+}
+
+// Encodes the crop like crop_plate() in cv.c, returns its size
+static size_t encode_crop(const image_t *image, const uint8_t *gray, const plate_rect_t *rect, const upload_level_t *level) {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    unsigned char *out = NULL;
+    unsigned long out_len = 0;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &out, &out_len);
+
+    cinfo.image_width = rect->width;
+    cinfo.image_height = rect->height;
+    cinfo.input_components = level->grayscale ? 1 : 3;
+    cinfo.in_color_space = level->grayscale ? JCS_GRAYSCALE : JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, level->crop_quality, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+
+    while (cinfo.next_scanline < cinfo.image_height) {
+        size_t offset = (size_t)(rect->y + cinfo.next_scanline) * image->width + rect->x;
+        JSAMPROW row = level->grayscale ? (JSAMPROW) &gray[offset] : &image->rgb[offset * 3];
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    free(out);
+    return out_len;
+}
+
+// Measures the upload of every level on the image, the nominal cost where no plate is found
+static void measure_levels(const image_t *image) {
+    printf("level  frame     quality  crop bytes  cost (nominal)\n");
+
+    for (int i = 0; i < UPLOAD_TUNER_LEVELS; i++) {
+        const upload_level_t *level = &upload_levels[i];
+        image_t frame = scale(image, level->width, level->height);
+        uint8_t *gray = malloc((size_t) frame.width * frame.height);
+        plate_rect_t rect;
+
+        level_bytes[i] = 0;
+
+        if (frame.rgb != NULL && gray != NULL) {
+            plate_crop_rgb_to_gray(frame.rgb, gray, (size_t) frame.width * frame.height);
+
+            if (plate_crop_locate(gray, frame.width, frame.height, &rect)) {
+                level_bytes[i] = (uint32_t) encode_crop(&frame, gray, &rect, level);
+            }
+        }
+
+        if (level_bytes[i] == 0) {
+            level_bytes[i] = NOMINAL_CROP_BYTES * level->cost / 100;
+            printf("%5d  %3ux%-3u   %2u/%-3u  no plate, nominal %u\n", i, level->width, level->height,
+                level->quality, level->crop_quality, level_bytes[i]);
+        } else {
+            printf("%5d  %3ux%-3u   %2u/%-3u  %10u  %3u %% (%u %%)\n", i, level->width, level->height,
+                level->quality, level->crop_quality, level_bytes[i], level_bytes[i] * 100 / level_bytes[0],
+                level->cost);
+        }
+
+        free(gray);
+        free(frame.rgb);
+    }
+
+    printf("\n");
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Runs a day of traffic, at a fixed level or with the controller
+ * @param fixed_level The level used, -1 for the controller
+ */
+static void simulate(int fixed_level, uint32_t target_ms, uint64_t seed, result_t *result) {
+    upload_tuner_t tuner;
+    upload_tuner_init(&tuner, target_ms, upload_levels[0].width);
+
+    memset(result, 0, sizeof(*result));
+    rng_state = seed;
+
+    for (int64_t now_ms = 0; result->count < (int)(sizeof(result->latencies) / sizeof(uint32_t)); ) {
+        // Next vehicle in 2 to 6 minutes
+        now_ms += rng_range(120, 360) * 1000;
+        if (now_ms >= DAY_MS) {
+            break;
+        }
+
+        int hour = (int)(now_ms / 3600000);
+        int level = fixed_level >= 0 ? fixed_level : tuner.level;
+        bool night = hour < 6 || hour >= 20;
+
+        // The uplink varies around the throughput of the hour, the bytes around the measured ones
+        uint32_t uplink = uplink_by_hour[hour] * rng_range(60, 140) / 100;
+        uint32_t bytes = level_bytes[level] * rng_range(80, 120) / 100;
+        uint32_t upload_ms = ROUND_TRIP_MS + SERVER_MS + (uint32_t)((uint64_t) bytes * 1000 / uplink);
+        bool recognized = rng_range(1, 100) <= (night ? read_night : read_day)[level];
+
+        upload_sample_t sample = {
+            .latency_ms = CAPTURE_MS + upload_ms,
+            .upload_ms = upload_ms,
+            .bytes = bytes,
+            .recognized = recognized,
+            .confidence = recognized ? 0.9f : -1.0f,
+        };
+
+        result->latencies[result->count++] = sample.latency_ms;
+        result->within_target += sample.latency_ms <= target_ms;
+        result->recognized += recognized;
+        result->bytes += bytes;
+        result->levels[level]++;
+
+        if (fixed_level < 0) {
+            upload_tuner_observe(&tuner, &sample, now_ms * 1000);
+        }
+    }
+
+    qsort(result->latencies, (size_t) result->count, sizeof(uint32_t), compare_u32);
+}
+
+static void print_result(const char *name, const result_t *result) {
+    printf("%-10s %5u %6u %6u   %5.1f %%  %5.1f %%  %7.1f   ", name,
+        result->latencies[result->count / 2], result->latencies[result->count * 9 / 10],
+        result->latencies[result->count * 99 / 100], 100.0 * result->within_target / result->count,
+        100.0 * result->recognized / result->count, result->bytes / 1024.0 / result->count);
+
+    for (int i = 0; i < UPLOAD_TUNER_LEVELS; i++) {
+        printf(" %3d", result->levels[i]);
+    }
+    printf("\n");
+}
+
+int main(int argc, char **argv) {
+    uint32_t target_ms = 1500;
+    uint64_t seed = 1;
+
+    static const struct option options[] = {
+        { "target", required_argument, NULL, 't' },
+        { "seed",   required_argument, NULL, 's' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+            case 't': target_ms = (uint32_t) atoi(optarg); break;
+            case 's': seed = strtoull(optarg, NULL, 10); break;
+            default:
+                fprintf(stderr, "Usage: %s [--target MS] [--seed N] [image.jpg]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    for (int i = 0; i < UPLOAD_TUNER_LEVELS; i++) {
+        level_bytes[i] = NOMINAL_CROP_BYTES * upload_levels[i].cost / 100;
+    }
+
+    if (optind < argc) {
+        image_t image;
+
+        if (!decode_file(argv[optind], &image)) {
+            fprintf(stderr, "Cannot decode %s\n", argv[optind]);
+            return 1;
+        }
+
+        measure_levels(&image);
+        free(image.rgb);
+    }
+
+    // 0 is not a valid xorshift state
+    seed = seed * 0x9E3779B97F4A7C15ULL + 1;
+
+    printf("Target %u ms\n", target_ms);
+    printf("level        p50    p90    p99   in target  read     KB/upload   vehicles per level\n");
+
+    result_t result;
+
+    for (int i = 0; i < UPLOAD_TUNER_LEVELS; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "fixed %d", i);
+        simulate(i, target_ms, seed, &result);
+        print_result(name, &result);
+    }
+
+    simulate(-1, target_ms, seed, &result);
+    print_result("adaptive", &result);
+
+    return 0;
+}
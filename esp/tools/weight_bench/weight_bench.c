@@ -0,0 +1,345 @@
+/*
+ * weight_bench.c
+ *
+ * Host check and micro-benchmark of the fixed point
+ * weight detector (weight_detector.c) against the float
+ * implementation it replaced. The count engine is used,
+ * it takes the same decisions as the float implementation.
+ *
+ * On a deterministic synthetic HX711 stream (noise, drift
+ * and vehicles) the tool:
+ * - compares the fixed point filter with the float reference
+ *   on every sample: the filtered weights may not differ by
+ *   more than MAX_FILTERED_DIFF, and a decision may only differ
+ *   on a sample whose float value is within that distance of a
+ *   threshold, where the rounding decides
+ * - checks that the baseline follows a drift of a couple of counts
+ * - hashes every state of the fixed point filter and compares
+ *   it with the expected value, so any change in the integer
+ *   arithmetic is noticed (a regression check, it says nothing
+ *   about the accuracy)
+ * - times the same work on both sides: the filter alone, then
+ *   the whole detector (filter, features, count engine)
+ *
+ * Build and run, from the esp/ directory:
+ *   gcc -O2 -Icomponents/weight -o weight_bench tools/weight_bench/weight_bench.c \
+ *       components/weight/weight_detector.c -lm
+ *   ./weight_bench
+ *
+ * The exit status is not 0 if the fixed point filter drifts
+ * from the float reference beyond the bound, if a decision
+ * differs away from a threshold, or if the hash changed.
+ *
+ */
+
+#include "weight_detector.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Synthetic scale: 0.002 g per count, tare around 84000 counts
+#define BENCH_SCALE     0.002f
+#define BENCH_OFFSET    84000.0f
+#define BENCH_SAMPLES   200000
+#define BENCH_RUNS      50
+
+// FNV-1a of the fixed point states over the synthetic stream,
+// update it only when the arithmetic is changed on purpose
+#define EXPECTED_HASH   0x4b009ee59d4f1b57ULL
+
+// Largest difference allowed between the filtered weights of both
+// implementations, in grams: the Q4 state rounds to 1/16 count
+// (0.000125 g) and the thresholds to the same step
+#define MAX_FILTERED_DIFF 0.002f
+
+// Float implementation replaced by the fixed point one, with the
+// same feature extraction so that the timings compare the same work
+typedef struct {
+    float baseline;
+    float filtered;
+    int detect_count;
+
+    // Features, unused by the count decision
+    float level;
+    float slope;
+    float rise;
+    float peak;
+    float mean;
+    float variance;
+    float overshoot;
+    float window[WEIGHT_FEATURE_WINDOW];
+    int active;
+    int count;
+} float_detector_t;
+
+static float float_filter(float_detector_t *det, float grams) {
+    det->baseline = det->baseline * 0.99f + grams * 0.01f;
+
+    float net = grams - det->baseline;
+
+    det->filtered = det->filtered * 0.05f + net * 0.95f;
+
+    return det->filtered;
+}
+
+// Same steps as extract_features() in weight_detector.c
+static void float_features(float_detector_t *det) {
+    float level = det->filtered;
+
+    if (fabsf(level) < WEIGHT_NOISE_THRESHOLD) {
+        det->active = det->count = 0;
+        det->rise = det->peak = 0;
+        det->level = level;
+        return;
+    }
+
+    det->slope = det->active ? level - det->level : level;
+    det->level = level;
+    det->rise = fmaxf(det->rise, det->slope);
+    det->peak = fmaxf(det->peak, level);
+    det->active++;
+
+    if (fabsf(det->slope) > 2 * WEIGHT_SETTLE_DEVIATION) {
+        det->count = 0;
+    }
+
+    for (int i = WEIGHT_FEATURE_WINDOW - 1; i > 0; i--) {
+        det->window[i] = det->window[i - 1];
+    }
+    det->window[0] = level;
+
+    if (det->count < WEIGHT_FEATURE_WINDOW) {
+        det->count++;
+    }
+
+    float sum = 0;
+    for (int i = 0; i < det->count; i++) {
+        sum += det->window[i];
+    }
+    det->mean = sum / det->count;
+
+    float squares = 0;
+    for (int i = 0; i < det->count; i++) {
+        float d = det->window[i] - det->mean;
+        squares += d * d;
+    }
+    det->variance = squares / det->count;
+
+    det->overshoot = det->peak - level;
+}
+
+static weight_sample_result_t float_step(float_detector_t *det, float grams) {
+    float_filter(det, grams);
+    float_features(det);
+
+    bool dropped = det->detect_count > 0;
+
+    if (fabsf(det->filtered) < WEIGHT_NOISE_THRESHOLD ||
+        det->filtered <= WEIGHT_MIN_CAR_WEIGHT || det->filtered >= WEIGHT_MAX_CAR_WEIGHT) {
+        det->detect_count = 0;
+        return dropped ? WEIGHT_SAMPLE_DROPPED : WEIGHT_SAMPLE_NONE;
+    }
+
+    if (++det->detect_count >= WEIGHT_DETECT_COUNT_REQUIRED) {
+        det->detect_count = 0;
+        return WEIGHT_SAMPLE_CONFIRMED;
+    }
+
+    return (det->detect_count == 1) ? WEIGHT_SAMPLE_CANDIDATE : WEIGHT_SAMPLE_NONE;
+}
+
+static weight_detector_config_t count_config;
+
+static uint32_t rng_state = 0x12345678;
+
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+// Raw HX711 stream at 10 SPS: vehicles of 30-90 g staying
+// 2-6 s on the scale, a slow drift of +-3 g and +-0.4 g of noise.
+// Integer only, so the stream is the same on every host
+static void generate(int32_t *raw, size_t num) {
+    const int32_t counts_per_gram = (int32_t) lroundf(1.0f / BENCH_SCALE);
+    size_t next_vehicle = 50, vehicle_end = 0;
+    int32_t vehicle = 0;
+
+    for (size_t i = 0; i < num; i++) {
+        if (i == next_vehicle) {
+            vehicle = (int32_t)(30 + rng() % 60) * counts_per_gram;
+            vehicle_end = i + 20 + rng() % 40;
+            next_vehicle = vehicle_end + 50 + rng() % 300;
+        }
+
+        if (i == vehicle_end) {
+            vehicle = 0;
+        }
+
+        // Triangle wave with a period of 12000 samples
+        int32_t phase = (int32_t)(i % 12000);
+        int32_t drift = (phase < 6000 ? phase : 12000 - phase) - 3000;
+        int32_t noise = (int32_t)(rng() % 401) - 200;
+
+        raw[i] = (int32_t) BENCH_OFFSET + vehicle + drift / 2 + noise;
+    }
+}
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *stop) {
+    return (stop->tv_sec - start->tv_sec) * 1e9 + (stop->tv_nsec - start->tv_nsec);
+}
+
+// Distance of a float filtered value to the nearest threshold of the count engine
+static float threshold_distance(float filtered) {
+    float d = fabsf(fabsf(filtered) - WEIGHT_NOISE_THRESHOLD);
+
+    d = fminf(d, fabsf(filtered - WEIGHT_MIN_CAR_WEIGHT));
+    d = fminf(d, fabsf(filtered - WEIGHT_MAX_CAR_WEIGHT));
+
+    return d;
+}
+
+// The baseline must follow a drift smaller than the rounding step of
+// a Q4 state: after a 2 count step it has to settle on the new level
+static bool drift_tracked(void) {
+    weight_detector_t det;
+    weight_detector_init(&det, &count_config, BENCH_SCALE, BENCH_OFFSET);
+
+    for (int i = 0; i < 2000; i++) {
+        weight_detector_step(&det, (int32_t) BENCH_OFFSET + 2);
+    }
+
+    return det.baseline_q == 2 * (1 << WEIGHT_Q_BITS);
+}
+
+int main(void) {
+    int32_t *raw = malloc(BENCH_SAMPLES * sizeof(int32_t));
+
+    if (raw == NULL) {
+        return 1;
+    }
+
+    generate(raw, BENCH_SAMPLES);
+
+    count_config = weight_detector_default_config;
+    count_config.engine = &weight_engine_count;
+
+    // Accuracy against the float reference, and regression hash
+    weight_detector_t fixed;
+    float_detector_t ref = { 0 };
+    weight_detector_init(&fixed, &count_config, BENCH_SCALE, BENCH_OFFSET);
+
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t mismatches = 0, unexplained = 0, confirmed = 0, confirmed_float = 0;
+    size_t last_near = (size_t) -WEIGHT_DETECT_COUNT_REQUIRED;
+    float max_diff = 0;
+
+    for (size_t i = 0; i < BENCH_SAMPLES; i++) {
+        weight_sample_result_t r_fixed = weight_detector_step(&fixed, raw[i]);
+        weight_sample_result_t r_float = float_step(&ref, (raw[i] - BENCH_OFFSET) * BENCH_SCALE);
+
+        uint32_t words[3] = { (uint32_t) fixed.baseline_q, (uint32_t) fixed.filtered_q, (uint32_t) r_fixed };
+        for (int w = 0; w < 3; w++) {
+            for (int b = 0; b < 4; b++) {
+                hash ^= (words[w] >> (8 * b)) & 0xff;
+                hash *= 0x100000001b3ULL;
+            }
+        }
+
+        confirmed += r_fixed == WEIGHT_SAMPLE_CONFIRMED;
+        confirmed_float += r_float == WEIGHT_SAMPLE_CONFIRMED;
+
+        if (threshold_distance(ref.filtered) <= MAX_FILTERED_DIFF) {
+            last_near = i;
+        }
+
+        if (r_fixed != r_float) {
+            mismatches++;
+
+            // The count engine decides on a run of samples, a mismatch
+            // is explained if one of the samples of the run was within
+            // rounding distance of a threshold
+            if (i - last_near >= WEIGHT_DETECT_COUNT_REQUIRED) {
+                printf("Decision mismatch away from a threshold at sample %zu: fixed %d, float %d (%.4f g)\n",
+                    i, r_fixed, r_float, ref.filtered);
+                unexplained++;
+            }
+        }
+
+        float diff = fabsf(weight_detector_filtered_grams(&fixed) - ref.filtered);
+        if (diff > max_diff) {
+            max_diff = diff;
+        }
+    }
+
+    bool accurate = max_diff <= MAX_FILTERED_DIFF && unexplained == 0;
+    bool exact = hash == EXPECTED_HASH;
+    bool drift = drift_tracked();
+
+    printf("Samples:             %d\n", BENCH_SAMPLES);
+    printf("Vehicles confirmed:  %zu fixed, %zu float\n", confirmed, confirmed_float);
+    printf("Max filtered diff:   %.5f g (bound %.5f g)\n", max_diff, MAX_FILTERED_DIFF);
+    printf("Decision mismatches: %zu, %zu away from a threshold\n", mismatches, unexplained);
+    printf("Against float:       %s\n", accurate ? "PASS" : "FAIL");
+    printf("Slow drift tracked:  %s\n", drift ? "PASS" : "FAIL");
+    printf("Regression hash:     %s (%016llx)\n", exact ? "PASS" : "FAIL", (unsigned long long) hash);
+
+    // Timing, the same work on both sides
+    struct timespec start, stop;
+    volatile float fsink = 0;
+    volatile int sink = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        float_detector_t det = { 0 };
+        for (size_t i = 0; i < BENCH_SAMPLES; i++) {
+            fsink += float_filter(&det, (raw[i] - BENCH_OFFSET) * BENCH_SCALE);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    double float_filter_ns = elapsed_ns(&start, &stop) / ((double) BENCH_RUNS * BENCH_SAMPLES);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        weight_detector_t det;
+        weight_detector_init(&det, &count_config, BENCH_SCALE, BENCH_OFFSET);
+        for (size_t i = 0; i < BENCH_SAMPLES; i++) {
+            sink += weight_detector_filter(&det, raw[i]);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    double fixed_filter_ns = elapsed_ns(&start, &stop) / ((double) BENCH_RUNS * BENCH_SAMPLES);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        float_detector_t det = { 0 };
+        for (size_t i = 0; i < BENCH_SAMPLES; i++) {
+            sink += float_step(&det, (raw[i] - BENCH_OFFSET) * BENCH_SCALE);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    double float_ns = elapsed_ns(&start, &stop) / ((double) BENCH_RUNS * BENCH_SAMPLES);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        weight_detector_t det;
+        weight_detector_init(&det, &count_config, BENCH_SCALE, BENCH_OFFSET);
+        for (size_t i = 0; i < BENCH_SAMPLES; i++) {
+            sink += weight_detector_step(&det, raw[i]);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    double fixed_ns = elapsed_ns(&start, &stop) / ((double) BENCH_RUNS * BENCH_SAMPLES);
+
+    printf("Filter, float:       %.2f ns/sample\n", float_filter_ns);
+    printf("Filter, fixed:       %.2f ns/sample\n", fixed_filter_ns);
+    printf("Detector, float:     %.2f ns/sample\n", float_ns);
+    printf("Detector, fixed:     %.2f ns/sample\n", fixed_ns);
+
+    free(raw);
+    return accurate && drift && exact ? 0 : 1;
+}
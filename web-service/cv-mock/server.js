@@ -0,0 +1,171 @@
+// Local stand-in for the CircuitDigest plate recognition API.
+//
+// It speaks the same protocol as the cloud API (multipart upload of
+// a JPEG in the "imageFile" field, JSON response with the plate in
+// data.number_plate and a link to the image in data.view_image), so
+// the firmware built with the "Local stand-in server" backend, or
+// esp/tools/cv_bench on a Linux box, exercises the whole recognition
+// path without using the API quota nor the internet.
+//
+// The plate answered for an image is picked from the canned plates by
+// the hash of the image, so the same image always gets the same plate.
+//
+// Usage: node server.js [--port 8080] [--latency 800] [--jitter 200]
+//                       [--error-rate 0.05] [--plates AB123CD,EF456GH]
+// The options can also be given as environment variables (PORT,
+// LATENCY, JITTER, ERROR_RATE, PLATES).
+
+const http = require('http');
+const crypto = require('crypto');
+
+const ENDPOINT = '/api/v1/readnumberplate';
+
+// Uploaded images kept for their view_image link
+const MAX_IMAGES = 50;
+
+function option(name, fallback) {
+	const index = process.argv.indexOf(`--${name}`);
+
+	if (index > 0 && index + 1 < process.argv.length) {
+		return process.argv[index + 1];
+	}
+
+	return process.env[name.toUpperCase().replace('-', '_')] || fallback;
+}
+
+const port = parseInt(option('port', '8080'), 10);
+const latency = parseInt(option('latency', '800'), 10);
+const jitter = parseInt(option('jitter', '200'), 10);
+const errorRate = parseFloat(option('error-rate', '0'));
+const plates = option('plates', 'AB123CD,EF456GH,IJ789KL,MN012OP').split(',');
+
+const images = new Map();
+const stats = { requests: 0, recognized: 0, errors: 0, dropped: 0, invalid: 0 };
+
+function sendJson(res, status, body) {
+	const json = JSON.stringify(body);
+
+	res.writeHead(status, { 'Content-Type': 'application/json', 'Content-Length': Buffer.byteLength(json) });
+	res.end(json);
+}
+
+// Returns the JPEG of the "imageFile" part of a multipart body, or null
+function extractImage(body, contentType) {
+	const match = /boundary=(?:"([^"]+)"|([^;]+))/.exec(contentType || '');
+
+	if (!match) {
+		return null;
+	}
+
+	const delimiter = Buffer.from(`--${match[1] || match[2]}`);
+	let start = body.indexOf(delimiter);
+
+	while (start >= 0) {
+		const headersEnd = body.indexOf('\r\n\r\n', start);
+		const next = body.indexOf(delimiter, start + delimiter.length);
+
+		if (headersEnd < 0 || next < 0) {
+			return null;
+		}
+
+		const headers = body.subarray(start, headersEnd).toString();
+
+		if (/name="imageFile"/.test(headers)) {
+			// The part ends with the CRLF before the next delimiter
+			return body.subarray(headersEnd + 4, next - 2);
+		}
+
+		start = next;
+	}
+
+	return null;
+}
+
+function recognize(req, res, body) {
+	const image = extractImage(body, req.headers['content-type']);
+
+	if (!image || image.length < 2 || image[0] !== 0xff || image[1] !== 0xd8) {
+		stats.invalid++;
+		return sendJson(res, 400, { status: 'error', message: 'No JPEG image in the imageFile field' });
+	}
+
+	const hash = crypto.createHash('sha1').update(image).digest('hex');
+	const plate = plates[parseInt(hash.slice(0, 8), 16) % plates.length];
+	const id = hash.slice(0, 16);
+
+	images.set(id, image);
+	if (images.size > MAX_IMAGES) {
+		images.delete(images.keys().next().value);
+	}
+
+	stats.recognized++;
+	console.log(`${new Date().toISOString()} ${image.length} bytes -> ${plate}`);
+
+	sendJson(res, 200, {
+		status: 'success',
+		message: 'Number plate detected',
+		data: {
+			number_plate: plate,
+			confidence: 0.9 + (parseInt(hash.slice(8, 10), 16) % 10) / 100,
+			view_image: `http://${req.headers.host}/images/${id}.jpg`
+		}
+	});
+}
+
+const server = http.createServer((req, res) => {
+	const chunks = [];
+
+	req.on('data', chunk => chunks.push(chunk));
+	req.on('end', () => {
+		// Warm-up of the kept-alive connection by the firmware
+		if (req.method === 'HEAD') {
+			res.writeHead(200);
+			return res.end();
+		}
+
+		if (req.method === 'GET' && req.url === '/stats') {
+			return sendJson(res, 200, stats);
+		}
+
+		if (req.method === 'GET' && req.url.startsWith('/images/')) {
+			const image = images.get(req.url.slice('/images/'.length).replace('.jpg', ''));
+
+			if (!image) {
+				return sendJson(res, 404, { status: 'error', message: 'Unknown image' });
+			}
+
+			res.writeHead(200, { 'Content-Type': 'image/jpeg', 'Content-Length': image.length });
+			return res.end(image);
+		}
+
+		if (req.method !== 'POST' || req.url !== ENDPOINT) {
+			return sendJson(res, 404, { status: 'error', message: 'Not found' });
+		}
+
+		stats.requests++;
+
+		setTimeout(() => {
+			if (Math.random() < errorRate) {
+				// Half of the failures are server errors, half are connections dropped
+				if (Math.random() < 0.5) {
+					stats.errors++;
+					return sendJson(res, 500, { status: 'error', message: 'Simulated server error' });
+				}
+
+				stats.dropped++;
+				return req.socket.destroy();
+			}
+
+			recognize(req, res, Buffer.concat(chunks));
+		}, Math.max(0, latency + (Math.random() * 2 - 1) * jitter));
+	});
+});
+
+// Longer than the keep-alive period of the firmware, so the connection stays open
+server.keepAliveTimeout = 120 * 1000;
+
+server.listen(port, () => {
+	console.log(`Plate recognition stand-in: listening on port ${port}`);
+	console.log(`http://localhost:${port}${ENDPOINT} (latency ${latency} ± ${jitter} ms, error rate ${errorRate})`);
+	console.log(`Canned plates: ${plates.join(', ')}`);
+});